@@ -345,6 +345,40 @@ public:
 		}
 	}
 
+	// Like DoVoid, but when loading, only consumes the data if it matches.
+	bool ExpectVoid(void *data, int size)
+	{
+		switch (mode) {
+		case MODE_READ:	if (memcmp(data, *ptr, size) != 0) return false; break;
+		case MODE_WRITE: memcpy(*ptr, data, size); break;
+		case MODE_MEASURE: break;  // MODE_MEASURE - don't need to do anything
+		case MODE_VERIFY: for(int i = 0; i < size; i++) _dbg_assert_msg_(COMMON, ((u8*)data)[i] == (*ptr)[i], "Savestate verification failure: %d (0x%X) (at %p) != %d (0x%X) (at %p).\n", ((u8*)data)[i], ((u8*)data)[i], &((u8*)data)[i], (*ptr)[i], (*ptr)[i], &(*ptr)[i]); break;
+		default: break;  // throw an error?
+		}
+		(*ptr) += size;
+		return true;
+	}
+
+	// Starts a versioned part of the state. Returns the version to load, ver when
+	// saving, or 0 for states from before the section was added.
+	int Section(const char *title, int minVer, int ver)
+	{
+		char marker[16] = {0};
+		strncpy(marker, title, sizeof(marker));
+		if (!ExpectVoid(marker, sizeof(marker)))
+			return 0;
+
+		int foundVersion = ver;
+		Do(foundVersion);
+		if (foundVersion < minVer || foundVersion > ver)
+		{
+			PanicAlertT("Error: Found version %d of \"%s\", can only load %d to %d. Aborting savestate load...", foundVersion, title, minVer, ver);
+			mode = PointerWrap::MODE_MEASURE;
+			return 0;
+		}
+		return foundVersion;
+	}
+
 	void DoMarker(const char* prevName, u32 arbitraryNumber=0x42)
 	{
 		u32 cookie = arbitraryNumber;
@@ -53,6 +53,9 @@ void CConfig::Load(const char *iniFileName)
 	general->Get("IgnoreBadMemAccess", &bIgnoreBadMemAccess, true);
 	general->Get("CurrentDirectory", &currentDirectory, "");
 	general->Get("ShowDebuggerOnLoad", &bShowDebuggerOnLoad, false);
+	general->Get("CSOCacheBlocks", &iCSOCacheBlocks, 1024);
+	general->Get("ReadAheadBlocks", &iReadAheadBlocks, 64);
+	general->Get("StagedSaveWrites", &bStagedSaveWrites, false);
 
 	IniFile::Section *cpu = iniFile.GetOrCreateSection("CPU");
 	cpu->Get("Core", &iCpuCore, 0);
@@ -69,6 +72,7 @@ void CConfig::Load(const char *iniFileName)
 	graphics->Get("VBO", &bUseVBO, false);
 	graphics->Get("DisableG3DLog", &bDisableG3DLog, false);
 	graphics->Get("VertexCache", &bVertexCache, false);
+	graphics->Get("AutoFrameSkip", &bAutoFrameSkip, false);
 
 	IniFile::Section *sound = iniFile.GetOrCreateSection("Sound");
 	sound->Get("Enable", &bEnableSound, true);
@@ -106,6 +110,9 @@ void CConfig::Save()
 		general->Set("IgnoreBadMemAccess", bIgnoreBadMemAccess);
 		general->Set("CurrentDirectory", currentDirectory);
 		general->Set("ShowDebuggerOnLoad", bShowDebuggerOnLoad);
+		general->Set("CSOCacheBlocks", iCSOCacheBlocks);
+		general->Set("ReadAheadBlocks", iReadAheadBlocks);
+		general->Set("StagedSaveWrites", bStagedSaveWrites);
 		IniFile::Section *cpu = iniFile.GetOrCreateSection("CPU");
 		cpu->Set("Core", iCpuCore);
 		cpu->Set("FastMemory", bFastMemory);
@@ -121,6 +128,7 @@ void CConfig::Save()
 		graphics->Set("VBO", bUseVBO);
 		graphics->Set("DisableG3DLog", bDisableG3DLog);
 		graphics->Set("VertexCache", bVertexCache);
+		graphics->Set("AutoFrameSkip", bAutoFrameSkip);
 
 		IniFile::Section *sound = iniFile.GetOrCreateSection("Sound");
 		sound->Set("Enable", bEnableSound);
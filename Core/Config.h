@@ -46,6 +46,9 @@ public:
 	bool bIgnoreBadMemAccess;
 	bool bFastMemory;
 	int iCpuCore;
+	int iCSOCacheBlocks;  // Decompressed CSO sectors kept in memory, 2KB each
+	int iReadAheadBlocks;  // Sectors to read ahead on sequential disc reads, 0 to disable
+	bool bStagedSaveWrites;  // Write memstick files to a temp file, renamed into place on close
 
 	// GFX
 	bool bDisplayFramebuffer;
@@ -58,6 +61,7 @@ public:
 	bool SSAntiAlaising; //for Windows, too
 	bool bDisableG3DLog;
 	bool bVertexCache;
+	bool bAutoFrameSkip;  // Skip drawing frames when the host can't keep up
 
 	// Sound
 	bool bEnableSound;
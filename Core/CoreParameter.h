@@ -51,6 +51,9 @@ struct CoreParameter
 	bool headLess;   // Try to avoid messageboxes etc
 	bool useMediaEngine;
 
+	// If non-empty, the software GPU writes every displayed frame here as a BMP.
+	std::string frameDumpDirectory;
+
 	// Internal PSP resolution
 	int renderWidth;
 	int renderHeight;
@@ -15,12 +15,74 @@
 // Official git repository and contact information can be found at
 // https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
 
+#include "base/timeutil.h"
+
 #include "../MemMap.h"
 #include "../MIPS/MIPSTables.h"
 #include "ElfReader.h"
 #include "../Debugger/SymbolMap.h"
 #include "../HLE/sceKernelMemory.h"
 
+ElfReader::ElfReader(ElfSource *src) :
+	source(src),
+	base(0),
+	base32(0),
+	header(0),
+	segments(0),
+	sections(0),
+	sectionOffsets(0),
+	sectionAddrs(0),
+	bRelocate(false),
+	entryPoint(0),
+	vaddr(0),
+	segmentTime(0.0),
+	relocateTime(0.0)
+{
+	Elf32_Ehdr ehdr;
+	if (!source->ReadAt(0, &ehdr, sizeof(ehdr)))
+	{
+		ERROR_LOG(LOADER, "ElfReader: Could not read ELF header");
+		return;
+	}
+
+	// Kept together, header, segments and sections point into it.
+	u32 phSize = ehdr.e_phnum * sizeof(Elf32_Phdr);
+	u32 shSize = ehdr.e_shnum * sizeof(Elf32_Shdr);
+	headerData.resize(sizeof(ehdr) + phSize + shSize);
+	memcpy(&headerData[0], &ehdr, sizeof(ehdr));
+	u8 *phdrs = &headerData[0] + sizeof(ehdr);
+	u8 *shdrs = phdrs + phSize;
+	if ((phSize != 0 && !source->ReadAt(ehdr.e_phoff, phdrs, phSize)) ||
+		(shSize != 0 && !source->ReadAt(ehdr.e_shoff, shdrs, shSize)))
+	{
+		ERROR_LOG(LOADER, "ElfReader: Could not read ELF program or section headers");
+		return;
+	}
+
+	header = (Elf32_Ehdr *)&headerData[0];
+	segments = (Elf32_Phdr *)phdrs;
+	sections = (Elf32_Shdr *)shdrs;
+}
+
+u8 *ElfReader::GetData(u32 offset, u32 size)
+{
+	if (!source)
+		return GetPtr(offset);
+
+	std::map<u32, std::vector<u8> >::iterator iter = sourceData.find(offset);
+	if (iter != sourceData.end() && iter->second.size() > size)
+		return &iter->second[0];
+
+	// One extra zero, so a string table without a terminator still ends.
+	std::vector<u8> &data = sourceData[offset];
+	data.assign(size + 1, 0);
+	if (size != 0 && !source->ReadAt(offset, &data[0], size))
+	{
+		ERROR_LOG(LOADER, "ElfReader: Could not read %08x bytes at %08x", size, offset);
+		memset(&data[0], 0, size);
+	}
+	return &data[0];
+}
 
 const char *ElfReader::GetSectionName(int section)
 {
@@ -50,81 +112,87 @@ void addrToHiLo(u32 addr, u16 &hi, s16 &lo)
 	}
 }
 
+#define R_MIPS32 2
+#define R_MIPS26 4
+#define R_MIPS16_HI 5
+#define R_MIPS16_LO 6
+
 void ElfReader::LoadRelocations(Elf32_Rel *rels, int numRelocs)
 {
+	// Each HI16 pairs with the first LO16 after it. One sweep from the back finds them
+	// all, instead of a search forward per HI16.
+	std::vector<int> nextLo(numRelocs);
+	int lo = -1;
+	for (int r = numRelocs - 1; r >= 0; r--)
+	{
+		nextLo[r] = lo;
+		if ((rels[r].r_info & 0xF) == R_MIPS16_LO)
+			lo = r;
+	}
+
+	// Then the target addresses in one batch, so the patching loop below can skip the checks.
+	std::vector<u32> addrs(numRelocs);
+	const int maxSegments = (int)(sizeof(segmentVAddr) / sizeof(segmentVAddr[0]));
 	for (int r = 0; r < numRelocs; r++)
 	{
 		u32 info = rels[r].r_info;
-		u32 addr = rels[r].r_offset;
+		int readwrite = (info>>8) & 0xff;
+		int relative  = (info>>16) & 0xff;
+		if (readwrite >= maxSegments || relative >= maxSegments)
+		{
+			ERROR_LOG(LOADER, "Relocation %i refers to a bad segment: %08x", r, info);
+			addrs[r] = 0;
+			continue;
+		}
+		addrs[r] = rels[r].r_offset + segmentVAddr[readwrite];
+		if (!Memory::IsValidAddress(addrs[r]) || !Memory::IsValidAddress(addrs[r] + 3))
+		{
+			ERROR_LOG(LOADER, "Relocation %i outside of memory: %08x", r, addrs[r]);
+			addrs[r] = 0;
+		}
+	}
 
-		int type = info & 0xf;
+	for (int r = 0; r < numRelocs; r++)
+	{
+		u32 addr = addrs[r];
+		if (addr == 0)
+			continue;
 
-		int readwrite = (info>>8) & 0xff; 
+		u32 info = rels[r].r_info;
+		int type = info & 0xf;
 		int relative  = (info>>16) & 0xff;
 
 		//0 = code
 		//1 = data
 
-		addr += segmentVAddr[readwrite];
-
 		u32 op = Memory::ReadUnchecked_U32(addr);
-
-		const bool log = false;
-		//log=true;
-		if (log)
-		{
-			DEBUG_LOG(LOADER,"rel at: %08x  type: %08x",addr,info);
-		}
 		u32 relocateTo = segmentVAddr[relative];
 
-#define R_MIPS32 2
-#define R_MIPS26 4
-#define R_MIPS16_HI 5
-#define R_MIPS16_LO 6
-
 		switch (type) 
 		{
 		case R_MIPS32:
-			if (log)
-				DEBUG_LOG(LOADER,"Full address reloc %08x", addr);
 			//full address, no problemo
 			op += relocateTo;
 			break;
 
 		case R_MIPS26: //j, jal
 			//add on to put in correct address space
-			if (log)
-				DEBUG_LOG(LOADER,"j/jal reloc %08x", addr);
 			op = (op & 0xFC000000) | (((op&0x03FFFFFF)+(relocateTo>>2))&0x03FFFFFFF);
 			break;
 
 		case R_MIPS16_HI: //lui part of lui-addiu pairs
 			{
-				if (log)
-					DEBUG_LOG(LOADER,"HI reloc %08x", addr);
-
 				u32 cur = (op & 0xFFFF) << 16;
 				u16 hi = 0;
-				bool found = false;
-				for (int t = r + 1; t<numRelocs; t++)
+				int t = nextLo[r];
+				if (t != -1 && addrs[t] != 0)
 				{
-					if ((rels[t].r_info & 0xF) == R_MIPS16_LO) 
-					{
-						u32 corrLoAddr = rels[t].r_offset + segmentVAddr[readwrite];
-						if (log)
-						{
-							DEBUG_LOG(LOADER,"Corresponding lo found at %08x", corrLoAddr);
-						}
-
-						s16 lo = (s32)(s16)(u16)(Memory::ReadUnchecked_U32(corrLoAddr) & 0xFFFF); //signed??
-						cur += lo;
-						cur += relocateTo;
-						addrToHiLo(cur, hi, lo);
-						found = true;
-						break;
-					}
+					s16 lo = (s32)(s16)(u16)(Memory::ReadUnchecked_U32(addrs[t]) & 0xFFFF); //signed??
+					cur += lo;
+					cur += relocateTo;
+					addrToHiLo(cur, hi, lo);
 				}
-				if (!found)
+				else
 					ERROR_LOG(LOADER, "R_MIPS16: not found");
 
 				op = (op & 0xFFFF0000) | (hi);
@@ -133,8 +201,6 @@ void ElfReader::LoadRelocations(Elf32_Rel *rels, int numRelocs)
 
 		case R_MIPS16_LO: //addiu part of lui-addiu pairs
 			{
-				if (log)
-					DEBUG_LOG(LOADER,"LO reloc %08x", addr);
 				u32 cur = op & 0xFFFF;
 				cur += relocateTo;
 				cur &= 0xFFFF;
@@ -143,8 +209,6 @@ void ElfReader::LoadRelocations(Elf32_Rel *rels, int numRelocs)
 			break;
 
 		case 7: //gp
-			if (log)
-				ERROR_LOG(LOADER,"ARGH IT'S A GP!!!!!!!! %08x", addr);
 			break;
 
 		case 0: // another GP reloc!
@@ -159,7 +223,7 @@ void ElfReader::LoadRelocations(Elf32_Rel *rels, int numRelocs)
 			ERROR_LOG(LOADER,"ARGH IT'S A UNKNOWN RELOCATION!!!!!!!! %08x", addr);
 			break;
 		}
-		Memory::Write_U32(op, addr);
+		Memory::WriteUnchecked_U32(op, addr);
 	}
 }
 
@@ -233,6 +297,7 @@ bool ElfReader::LoadInto(u32 loadAddress)
 
 	// First pass : Get the damn bits into RAM
 	u32 baseAddress = bRelocate?vaddr:0;
+	double start = time_now_d();
 
 	for (int i=0; i<header->e_phnum; i++)
 	{
@@ -244,7 +309,6 @@ bool ElfReader::LoadInto(u32 loadAddress)
 			segmentVAddr[i] = baseAddress + p->p_vaddr;
 			u32 writeAddr = segmentVAddr[i];
 
-			u8 *src = GetSegmentPtr(i);
 			u8 *dst = Memory::GetPointer(writeAddr);
 			u32 srcSize = p->p_filesz;
 			u32 dstSize = p->p_memsz;
@@ -254,11 +318,18 @@ bool ElfReader::LoadInto(u32 loadAddress)
 				memset(dst + srcSize, 0, dstSize - srcSize); //zero out bss
 			}
 
-			memcpy(dst, src, srcSize);
+			if (!source)
+				memcpy(dst, GetSegmentPtr(i), srcSize);
+			else if (!source->ReadAt(p->p_offset, dst, srcSize))
+			{
+				ERROR_LOG(LOADER, "Could not read segment %i", i);
+				return false;
+			}
 			DEBUG_LOG(LOADER,"Loadable Segment Copied to %08x, size %08x", writeAddr, (u32)p->p_memsz);
 		}
 	}
 	userMemory.ListBlocks();
+	segmentTime = time_now_d() - start;
 
 	DEBUG_LOG(LOADER,"%i sections:", header->e_shnum);
 
@@ -282,6 +353,7 @@ bool ElfReader::LoadInto(u32 loadAddress)
 	}
 
 	DEBUG_LOG(LOADER,"Relocations:");
+	start = time_now_d();
 
 	// Second pass: Do necessary relocations
 	for (int i=0; i<GetNumSections(); i++)
@@ -346,6 +418,7 @@ bool ElfReader::LoadInto(u32 loadAddress)
 		}
 	}
 
+	relocateTime = time_now_d() - start;
 	NOTICE_LOG(LOADER,"ELF loading completed successfully.");
 	return true;
 }
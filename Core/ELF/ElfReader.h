@@ -17,6 +17,9 @@
 
 #pragma once
 
+#include <map>
+#include <vector>
+
 #include "../../Globals.h"
 
 #include "ElfTypes.h"
@@ -30,15 +33,26 @@ enum KnownElfTypes
 
 typedef int SectionID;
 
+// Where an ELF that isn't in memory gets read from, offsets are from the ELF header.
+class ElfSource
+{
+public:
+	virtual ~ElfSource() {}
+	virtual bool ReadAt(u32 offset, void *dest, u32 size) = 0;
+};
+
 class ElfReader
 {
 public:
 	ElfReader(void *ptr) :
+		source(0),
 		sectionOffsets(0),
 		sectionAddrs(0),
 		bRelocate(false),
 		entryPoint(0),
-		vaddr(0) {
+		vaddr(0),
+		segmentTime(0.0),
+		relocateTime(0.0) {
 		INFO_LOG(LOADER, "ElfReader: %p", ptr);
 		base = (char*)ptr;
 		base32 = (u32 *)ptr;
@@ -46,6 +60,9 @@ public:
 		segments = (Elf32_Phdr *)(base + header->e_phoff);
 		sections = (Elf32_Shdr *)(base + header->e_shoff);
 	}
+	// Only the headers are read up front. Segments go straight into PSP memory and the
+	// rest is read when first asked for.
+	ElfReader(ElfSource *src);
 
 	~ElfReader() {
 		delete [] sectionOffsets;
@@ -65,6 +82,7 @@ public:
 	int GetNumSegments() { return (int)(header->e_phnum); }
 	int GetNumSections() { return (int)(header->e_shnum); }
 	const char *GetSectionName(int section);
+	bool IsValid() { return header != 0; }
 	u8 *GetPtr(int offset)
 	{
 		return (u8*)base + offset;
@@ -74,13 +92,13 @@ public:
 		if (section < 0 || section >= header->e_shnum)
 			return 0;
 		if (sections[section].sh_type != SHT_NOBITS)
-			return GetPtr(sections[section].sh_offset);
+			return GetData(sections[section].sh_offset, sections[section].sh_size);
 		else
 			return 0;
 	}
 	u8 *GetSegmentPtr(int segment)
 	{
-		return GetPtr(segments[segment].p_offset);
+		return GetData(segments[segment].p_offset, segments[segment].p_filesz);
 	}
 	u32 GetSectionAddr(SectionID section) {return sectionAddrs[section];}
 	int GetSectionSize(SectionID section)
@@ -111,6 +129,10 @@ public:
 		return vaddr;
 	}
 
+	// Seconds LoadInto spent copying segments and relocating.
+	double GetSegmentTime() { return segmentTime; }
+	double GetRelocateTime() { return relocateTime; }
+
 	// More indepth stuff:)
 	bool LoadInto(u32 vaddr);
 	bool LoadSymbols();
@@ -118,6 +140,14 @@ public:
 
 
 private:
+	// In memory that's just base + offset, otherwise read on first use and kept.
+	u8 *GetData(u32 offset, u32 size);
+
+	ElfSource *source;
+	// When reading from a source: the headers, and whatever GetData read.
+	std::vector<u8> headerData;
+	std::map<u32, std::vector<u8> > sourceData;
+
 	char *base;
 	u32 *base32;
 	Elf32_Ehdr *header;
@@ -129,4 +159,6 @@ private:
 	u32 entryPoint;
 	u32 vaddr;
 	u32 segmentVAddr[32];
+	double segmentTime;
+	double relocateTime;
 };
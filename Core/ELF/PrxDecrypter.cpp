@@ -747,6 +747,12 @@ static int DecryptPRX2(const u8 *inbuf, u8 *outbuf, u32 size, u32 tag)
 int pspDecryptPRX(const u8 *inbuf, u8 *outbuf, u32 size)
 {
 	kirk_init();
+	// Decrypting in place, DecryptPRX1 may have scribbled over the header before failing.
+	u8 header[0x150];
+	u32 headerSize = size < sizeof(header) ? size : (u32)sizeof(header);
+	if (inbuf == outbuf)
+		memcpy(header, inbuf, headerSize);
+
 	int retsize = DecryptPRX1(inbuf, outbuf, size, *(u32 *)&inbuf[0xD0]);
 	if (retsize == MISSING_KEY)
 	{
@@ -755,6 +761,8 @@ int pspDecryptPRX(const u8 *inbuf, u8 *outbuf, u32 size)
 
 	if (retsize <= 0)
 	{
+		if (inbuf == outbuf)
+			memcpy(outbuf, header, headerSize);
 		retsize = DecryptPRX2(inbuf, outbuf, size, *(u32 *)&inbuf[0xD0]);
 	}
 
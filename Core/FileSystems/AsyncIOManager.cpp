@@ -0,0 +1,128 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+
+#include "../CoreTiming.h"
+#include "../System.h"
+#include "MetaFileSystem.h"
+#include "AsyncIOManager.h"
+
+AsyncIOManager::AsyncIOManager() : running_(0), shutdown_(false), completionEvent_(-1) {
+}
+
+AsyncIOManager::~AsyncIOManager() {
+	Shutdown();
+}
+
+void AsyncIOManager::Start(int numThreads, int completionEvent) {
+	Shutdown();
+
+	completionEvent_ = completionEvent;
+	shutdown_ = false;
+	for (int i = 0; i < numThreads; i++) {
+		threads_.push_back(new std::thread(&AsyncIOManager::WorkerThread, this));
+	}
+}
+
+void AsyncIOManager::Shutdown() {
+	if (threads_.empty())
+		return;
+
+	WaitForAll();
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		shutdown_ = true;
+		workCond_.notify_all();
+	}
+	for (size_t i = 0; i < threads_.size(); i++) {
+		threads_[i]->join();
+		delete threads_[i];
+	}
+	threads_.clear();
+	results_.clear();
+}
+
+void AsyncIOManager::SetCompletionEvent(int completionEvent) {
+	std::lock_guard<std::mutex> guard(lock_);
+	completionEvent_ = completionEvent;
+}
+
+void AsyncIOManager::Submit(const AsyncIOEvent &ev) {
+	if (threads_.empty()) {
+		// Not started, like when there's nothing to run it on. Do it right here instead.
+		AsyncIOResult result = {ev.id, Execute(ev)};
+		std::lock_guard<std::mutex> guard(lock_);
+		results_.push_back(result);
+		CoreTiming::ScheduleEvent_Threadsafe_Immediate(completionEvent_);
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(lock_);
+	queue_.push_back(ev);
+	workCond_.notify_one();
+}
+
+void AsyncIOManager::WaitForAll() {
+	std::unique_lock<std::mutex> guard(lock_);
+	while (!queue_.empty() || running_ > 0)
+		idleCond_.wait(guard);
+}
+
+bool AsyncIOManager::PopResult(AsyncIOResult &result) {
+	std::lock_guard<std::mutex> guard(lock_);
+	if (results_.empty())
+		return false;
+	result = results_.front();
+	results_.pop_front();
+	return true;
+}
+
+void AsyncIOManager::WorkerThread(AsyncIOManager *manager) {
+	std::unique_lock<std::mutex> guard(manager->lock_);
+	while (true) {
+		while (manager->queue_.empty() && !manager->shutdown_)
+			manager->workCond_.wait(guard);
+		if (manager->shutdown_)
+			break;
+
+		AsyncIOEvent ev = manager->queue_.front();
+		manager->queue_.pop_front();
+		manager->running_++;
+
+		guard.unlock();
+		AsyncIOResult result = {ev.id, manager->Execute(ev)};
+		guard.lock();
+
+		manager->results_.push_back(result);
+		manager->running_--;
+		CoreTiming::ScheduleEvent_Threadsafe_Immediate(manager->completionEvent_);
+		if (manager->queue_.empty() && manager->running_ == 0)
+			manager->idleCond_.notify_all();
+	}
+}
+
+s64 AsyncIOManager::Execute(const AsyncIOEvent &ev) {
+	switch (ev.type) {
+	case IO_EVENT_READ:
+		return (s64)pspFileSystem.ReadFile(ev.handle, ev.buf, ev.bytes);
+	case IO_EVENT_WRITE:
+		return (s64)pspFileSystem.WriteFile(ev.handle, ev.buf, ev.bytes);
+	default:
+		ERROR_LOG(HLE, "Unknown async IO event %i", (int)ev.type);
+		return -1;
+	}
+}
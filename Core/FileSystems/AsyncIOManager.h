@@ -0,0 +1,85 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include "StdMutex.h"
+#include "StdConditionVariable.h"
+#include "StdThread.h"
+
+#include "FileSystem.h"
+
+// Runs reads and writes for the async sceIo calls on host threads, so that the emulated
+// CPU keeps going while the host reads. They go through pspFileSystem, which locks itself.
+// Seeks are quick enough to just do on the spot.
+
+enum AsyncIOEventType {
+	IO_EVENT_READ,
+	IO_EVENT_WRITE,
+};
+
+struct AsyncIOEvent {
+	AsyncIOEventType type;
+	// Whatever the caller wants to know the result by, like the PSP file descriptor.
+	u32 id;
+	u32 handle;
+	// Must stay valid until the operation completes.
+	u8 *buf;
+	s64 bytes;
+};
+
+struct AsyncIOResult {
+	u32 id;
+	s64 result;
+};
+
+class AsyncIOManager {
+public:
+	AsyncIOManager();
+	~AsyncIOManager();
+
+	// After each operation finishes, CoreTiming event completionEvent is scheduled (on the
+	// emulator thread) to go collect the results with PopResult.
+	void Start(int numThreads, int completionEvent);
+	void Shutdown();
+	// Loading a savestate may renumber the event.
+	void SetCompletionEvent(int completionEvent);
+
+	void Submit(const AsyncIOEvent &ev);
+	// Blocks until nothing is queued or running. The results are still waiting in
+	// PopResult afterwards.
+	void WaitForAll();
+	bool PopResult(AsyncIOResult &result);
+
+private:
+	static void WorkerThread(AsyncIOManager *manager);
+	s64 Execute(const AsyncIOEvent &ev);
+
+	std::mutex lock_;
+	std::condition_variable workCond_;
+	std::condition_variable idleCond_;
+	std::deque<AsyncIOEvent> queue_;
+	std::deque<AsyncIOResult> results_;
+	std::vector<std::thread *> threads_;
+	int running_;
+	bool shutdown_;
+	int completionEvent_;
+};
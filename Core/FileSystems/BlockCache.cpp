@@ -0,0 +1,108 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <cstring>
+
+#include "BlockCache.h"
+
+BlockCache::BlockCache(int _blockSize, int _capacity, int numShards)
+: blockSize(_blockSize), hits(0), misses(0)
+{
+	if (numShards < 1)
+		numShards = 1;
+	if (_capacity < 0)
+		_capacity = 0;
+	if (_capacity > 0 && _capacity < numShards)
+		numShards = _capacity;
+	shardCapacity = _capacity / numShards;
+	capacity = shardCapacity * numShards;
+
+	shards.resize(numShards);
+	storage.resize((size_t)capacity * blockSize);
+	Clear();
+}
+
+bool BlockCache::Lookup(u32 blockNumber, u8 *outPtr)
+{
+	if (capacity == 0)
+		return false;
+
+	Shard &shard = ShardFor(blockNumber);
+	Shard::IndexMap::iterator iter = shard.index.find(blockNumber);
+	if (iter == shard.index.end())
+	{
+		misses++;
+		return false;
+	}
+
+	shard.lru.splice(shard.lru.begin(), shard.lru, iter->second.first);
+	memcpy(outPtr, &storage[(size_t)iter->second.second * blockSize], blockSize);
+	hits++;
+	return true;
+}
+
+void BlockCache::Insert(u32 blockNumber, const u8 *data)
+{
+	if (capacity == 0)
+		return;
+
+	Shard &shard = ShardFor(blockNumber);
+	int slot;
+	Shard::IndexMap::iterator iter = shard.index.find(blockNumber);
+	if (iter != shard.index.end())
+	{
+		shard.lru.splice(shard.lru.begin(), shard.lru, iter->second.first);
+		slot = iter->second.second;
+	}
+	else
+	{
+		if (shard.freeSlots.empty())
+		{
+			u32 oldest = shard.lru.back();
+			shard.lru.pop_back();
+			Shard::IndexMap::iterator old = shard.index.find(oldest);
+			shard.freeSlots.push_back(old->second.second);
+			shard.index.erase(old);
+		}
+		slot = shard.freeSlots.back();
+		shard.freeSlots.pop_back();
+		shard.lru.push_front(blockNumber);
+		shard.index[blockNumber] = std::make_pair(shard.lru.begin(), slot);
+	}
+	memcpy(&storage[(size_t)slot * blockSize], data, blockSize);
+}
+
+void BlockCache::Clear()
+{
+	for (size_t i = 0; i < shards.size(); i++)
+	{
+		Shard &shard = shards[i];
+		shard.lru.clear();
+		shard.index.clear();
+		shard.freeSlots.clear();
+		for (int j = shardCapacity - 1; j >= 0; j--)
+			shard.freeSlots.push_back((int)i * shardCapacity + j);
+	}
+}
+
+int BlockCache::Size() const
+{
+	int size = 0;
+	for (size_t i = 0; i < shards.size(); i++)
+		size += (int)shards[i].index.size();
+	return size;
+}
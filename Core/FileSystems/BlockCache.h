@@ -0,0 +1,75 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <vector>
+
+#include "../../Globals.h"
+
+// An LRU cache of fixed size blocks, keyed by block number. It's split into shards by
+// block number, so each shard's map and recency list stay short and one stream of
+// sequential reads can't push everything else out at once.
+// Not thread safe, the owner has to serialize access.
+
+class BlockCache
+{
+public:
+	BlockCache(int blockSize, int capacity, int numShards = 8);
+
+	// Copies the block to outPtr and marks it recently used. False if not cached.
+	bool Lookup(u32 blockNumber, u8 *outPtr);
+	// Doesn't count as a use.
+	bool Contains(u32 blockNumber) const {
+		const Shard &shard = shards[blockNumber % shards.size()];
+		return capacity != 0 && shard.index.find(blockNumber) != shard.index.end();
+	}
+	// Adds or refreshes a block, evicting the least recently used block of its shard if full.
+	void Insert(u32 blockNumber, const u8 *data);
+	void Clear();
+
+	int Capacity() const { return capacity; }
+	int Size() const;
+	u32 Hits() const { return hits; }
+	u32 Misses() const { return misses; }
+
+private:
+	struct Shard
+	{
+		// Front is the most recently used.
+		std::list<u32> lru;
+		// Block number -> position in lru and storage slot.
+		typedef std::map<u32, std::pair<std::list<u32>::iterator, int> > IndexMap;
+		IndexMap index;
+		std::vector<int> freeSlots;
+	};
+
+	Shard &ShardFor(u32 blockNumber) {
+		return shards[blockNumber % shards.size()];
+	}
+
+	int blockSize;
+	int capacity;
+	int shardCapacity;
+	std::vector<Shard> shards;
+	// Shard i owns slots [i * shardCapacity, (i + 1) * shardCapacity).
+	std::vector<u8> storage;
+	u32 hits;
+	u32 misses;
+};
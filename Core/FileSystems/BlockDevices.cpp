@@ -20,9 +20,22 @@ extern "C"
 #include "zlib.h"
 };
 
+#include "../../ext/snappy/snappy-c.h"
+
 #include "BlockDevices.h"
+#include "CommonFuncs.h"
 #include <cstdio>
 #include <cstring>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 FileBlockDevice::FileBlockDevice(std::string _filename)
 : filename(_filename)
@@ -47,6 +60,90 @@ bool FileBlockDevice::ReadBlock(int blockNumber, u8 *outPtr)
 	return true;
 }
 
+bool FileBlockDevice::ReadBlocks(u32 minBlock, int count, u8 *outPtr)
+{
+	fseek(f, (long)minBlock * GetBlockSize(), SEEK_SET);
+	if (fread(outPtr, 2048, count, f) != (size_t)count)
+		DEBUG_LOG(LOADER, "Could not read %i blocks from block %i", count, minBlock);
+
+	return true;
+}
+
+MmapBlockDevice::MmapBlockDevice(std::string _filename)
+: filename(_filename), base(0), filesize(0)
+{
+#ifdef _WIN32
+	hMapping = NULL;
+	hFile = CreateFileA(_filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size))
+		return;
+	filesize = (size_t)size.QuadPart;
+	hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (hMapping == NULL)
+		return;
+	base = (const u8 *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	fd = open(_filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return;
+	filesize = (size_t)st.st_size;
+	void *mapped = mmap(0, filesize, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED)
+		return;
+	base = (const u8 *)mapped;
+#endif
+	if (base == 0)
+		WARN_LOG(LOADER, "Could not map %s", _filename.c_str());
+}
+
+MmapBlockDevice::~MmapBlockDevice()
+{
+#ifdef _WIN32
+	if (base)
+		UnmapViewOfFile(base);
+	if (hMapping != NULL)
+		CloseHandle(hMapping);
+	if (hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile);
+#else
+	if (base)
+		munmap((void *)base, filesize);
+	if (fd >= 0)
+		close(fd);
+#endif
+}
+
+bool MmapBlockDevice::ReadBlock(int blockNumber, u8 *outPtr)
+{
+	return ReadBlocks(blockNumber, 1, outPtr);
+}
+
+bool MmapBlockDevice::ReadBlocks(u32 minBlock, int count, u8 *outPtr)
+{
+	size_t offset = (size_t)minBlock * GetBlockSize();
+	size_t bytes = (size_t)count * GetBlockSize();
+	if (offset >= filesize)
+	{
+		DEBUG_LOG(LOADER, "Could not read %i blocks from block %i", count, minBlock);
+		memset(outPtr, 0, bytes);
+		return true;
+	}
+	if (offset + bytes > filesize)
+	{
+		DEBUG_LOG(LOADER, "Could not read %i blocks from block %i", count, minBlock);
+		memset(outPtr + (filesize - offset), 0, offset + bytes - filesize);
+		bytes = filesize - offset;
+	}
+	memcpy(outPtr, base + offset, bytes);
+	return true;
+}
+
 // .CSO format
 
 // complessed ISO(9660) header format
@@ -75,8 +172,8 @@ typedef struct ciso_header
 
 // TODO: Need much better error handling.
 
-CISOFileBlockDevice::CISOFileBlockDevice(std::string _filename)
-: filename(_filename)
+CISOFileBlockDevice::CISOFileBlockDevice(std::string _filename, int cacheBlocks)
+: filename(_filename), cache(2048, cacheBlocks)
 {
 	// CISO format is EXTREMELY crappy and incomplete. All tools make broken CISO.
 
@@ -113,66 +210,430 @@ CISOFileBlockDevice::CISOFileBlockDevice(std::string _filename)
 	index = new u32[indexSize];
 	if(fread(index, sizeof(u32), indexSize, f) != indexSize)
 		memset(index, 0, indexSize * sizeof(u32));
+
 }
 
 CISOFileBlockDevice::~CISOFileBlockDevice()
 {
+	for (size_t i = 0; i < freeStreams.size(); i++)
+	{
+		inflateEnd(freeStreams[i]);
+		delete freeStreams[i];
+	}
 	fclose(f);
 	delete [] index;
 }
 
-bool CISOFileBlockDevice::ReadBlock(int blockNumber, u8 *outPtr) 
+z_stream_s *CISOFileBlockDevice::AllocStream()
 {
-	u32 idx = index[blockNumber];
-	u32 idx2 = index[blockNumber+1];
-	u8 inbuffer[4096]; //too big
-	z_stream z;
-
-	int plain = idx & 0x80000000;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!freeStreams.empty())
+		{
+			z_stream *z = freeStreams.back();
+			freeStreams.pop_back();
+			return z;
+		}
+	}
 
-	idx = (idx & 0x7FFFFFFF) << indexShift;
-	idx2 = (idx2 & 0x7FFFFFFF) << indexShift;
+	z_stream *z = new z_stream;
+	z->zalloc = Z_NULL;
+	z->zfree = Z_NULL;
+	z->opaque = Z_NULL;
+	z->next_in = Z_NULL;
+	z->avail_in = 0;
+	if (inflateInit2(z, -15) != Z_OK)
+	{
+		ERROR_LOG(LOADER, "inflateInit ERROR : %s\n", (z->msg) ? z->msg : "???");
+		delete z;
+		return 0;
+	}
+	return z;
+}
 
-	u32 compressedReadPos = idx;
-	u32 compressedReadSize = idx2 - idx;
+void CISOFileBlockDevice::FreeStream(z_stream_s *z)
+{
+	if (!z)
+		return;
+	std::lock_guard<std::mutex> guard(lock);
+	freeStreams.push_back(z);
+}
 
-	fseek(f, compressedReadPos, SEEK_SET);
-	u32 readSize = (u32)fread(inbuffer, 1, compressedReadSize, f);
+bool CISOFileBlockDevice::DecompressBlock(z_stream_s *z, u32 blockNumber, const u8 *data, u32 size, u8 *outPtr)
+{
+	bool plain = (index[blockNumber] & 0x80000000) != 0;
 
+	memset(outPtr, 0, 2048);
 	if (plain)
 	{
-		memset(outPtr, 0, 2048);
-		memcpy(outPtr, inbuffer, readSize);
+		memcpy(outPtr, data, std::min(size, (u32)2048));
+		return true;
+	}
+
+	if (!z || inflateReset(z) != Z_OK)
+	{
+		ERROR_LOG(LOADER, "block %d: inflate not available\n", blockNumber);
+		return false;
+	}
+	z->avail_in = size;
+	z->next_in = (Bytef *)data;
+	z->next_out = outPtr;
+	z->avail_out = blockSize;
+
+	int status = inflate(z, Z_FULL_FLUSH);
+	if (status != Z_STREAM_END)
+	{
+		ERROR_LOG(LOADER, "block %d:inflate : %s[%d]\n", blockNumber, (z->msg) ? z->msg : "error", status);
+		return false;
+	}
+	int cmp_size = blockSize - z->avail_out;
+	if (cmp_size != (int)blockSize)
+	{
+		ERROR_LOG(LOADER, "block %d : block size error %d != %d\n", blockNumber, cmp_size, blockSize);
+		return false;
+	}
+	return true;
+}
+
+bool CISOFileBlockDevice::ReadBlock(int blockNumber, u8 *outPtr)
+{
+	return ReadBlocks(blockNumber, 1, outPtr);
+}
+
+bool CISOFileBlockDevice::ReadBlocks(u32 minBlock, int count, u8 *outPtr)
+{
+	if (minBlock + count > numBlocks)
+	{
+		ERROR_LOG(LOADER, "Reading blocks %i-%i past the end of the CSO", minBlock, minBlock + count - 1);
+		memset(outPtr, 0, count * 2048);
+		if (minBlock >= numBlocks)
+			return false;
+		count = numBlocks - minBlock;
+	}
+
+	bool success = true;
+	std::vector<u8> readBuffer;
+	int i = 0;
+	while (i < count)
+	{
+		lock.lock();
+		if (cache.Lookup(minBlock + i, outPtr + i * 2048))
+		{
+			lock.unlock();
+			i++;
+			continue;
+		}
+
+		// Gather the run of uncached blocks, their compressed data is contiguous in the file.
+		int runEnd = i + 1;
+		while (runEnd < count && !cache.Lookup(minBlock + runEnd, outPtr + runEnd * 2048))
+			runEnd++;
+
+		u32 first = minBlock + i;
+		u32 last = minBlock + runEnd;
+		u32 runStart = (index[first] & 0x7FFFFFFF) << indexShift;
+		u32 runStop = (index[last] & 0x7FFFFFFF) << indexShift;
+		if (runStop < runStart)
+			runStop = runStart;
+
+		readBuffer.resize(runStop - runStart);
+		fseek(f, runStart, SEEK_SET);
+		u32 readSize = readBuffer.empty() ? 0 : (u32)fread(&readBuffer[0], 1, readBuffer.size(), f);
+		lock.unlock();
+
+		// Inflating doesn't need the lock, so other threads can read meanwhile.
+		z_stream *z = AllocStream();
+		for (u32 block = first; block < last; block++)
+		{
+			u32 idx = (index[block] & 0x7FFFFFFF) << indexShift;
+			u32 idx2 = (index[block + 1] & 0x7FFFFFFF) << indexShift;
+			u32 offset = idx - runStart;
+			u32 size = idx2 > idx ? idx2 - idx : 0;
+			if (offset > readSize)
+				offset = readSize;
+			if (offset + size > readSize)
+				size = readSize - offset;
+
+			u8 *dest = outPtr + (block - minBlock) * 2048;
+			const u8 *data = readBuffer.empty() ? 0 : &readBuffer[0] + offset;
+			if (DecompressBlock(z, block, data, size, dest))
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				cache.Insert(block, dest);
+			}
+			else
+				success = false;
+		}
+		FreeStream(z);
+
+		// The block at runEnd was already copied by the lookup above.
+		i = runEnd + 1;
+	}
+	return success;
+}
+
+SSOFileBlockDevice::SSOFileBlockDevice(std::string _filename, int cacheBytes)
+: filename(_filename), blockSize(SSO_MIN_BLOCK_SIZE), numBlocks(0), totalBytes(0)
+{
+	f = fopen(_filename.c_str(), "rb");
+	SSOHeader hdr;
+	if (!f || fread(&hdr, sizeof(SSOHeader), 1, f) != 1 || memcmp(hdr.magic, "SSO", 4) != 0)
+	{
+		ERROR_LOG(LOADER, "Invalid SSO!");
+	}
+	else if (hdr.version > SSO_VERSION)
+	{
+		ERROR_LOG(LOADER, "SSO version too high!");
+	}
+	else if (hdr.blockSize < SSO_MIN_BLOCK_SIZE || hdr.blockSize > SSO_MAX_BLOCK_SIZE || (hdr.blockSize & (hdr.blockSize - 1)) != 0)
+	{
+		ERROR_LOG(LOADER, "SSO Unsupported Block Size %i", hdr.blockSize);
 	}
 	else
 	{
-		memset(outPtr, 0, 2048);
-		z.zalloc = Z_NULL;
-		z.zfree = Z_NULL;
-		z.opaque = Z_NULL;
-		if(inflateInit2(&z, -15) != Z_OK)
+		blockSize = hdr.blockSize;
+		totalBytes = hdr.totalBytes;
+		numBlocks = (u32)((totalBytes + blockSize - 1) / blockSize);
+		DEBUG_LOG(LOADER, "SSO: %i blocks of %i bytes", numBlocks, blockSize);
+
+		index.resize(numBlocks + 1);
+		fseeko(f, hdr.headerSize, SEEK_SET);
+		if (fread(&index[0], sizeof(u64), numBlocks + 1, f) != numBlocks + 1)
+		{
+			ERROR_LOG(LOADER, "SSO index truncated");
+			index.clear();
+			numBlocks = 0;
+			totalBytes = 0;
+		}
+	}
+
+	int cacheBlocks = cacheBytes / blockSize;
+	cache = new BlockCache(blockSize, cacheBlocks < 2 ? 2 : cacheBlocks, 2);
+}
+
+SSOFileBlockDevice::~SSOFileBlockDevice()
+{
+	if (f)
+		fclose(f);
+	delete cache;
+}
+
+bool SSOFileBlockDevice::ReadImageBlock(u32 blockNumber, u8 *outPtr)
+{
+	std::vector<u8> compressed;
+	bool plain;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (cache->Lookup(blockNumber, outPtr))
+			return true;
+
+		u64 start = index[blockNumber] & ~SSO_BLOCK_PLAIN;
+		u64 end = index[blockNumber + 1] & ~SSO_BLOCK_PLAIN;
+		plain = (index[blockNumber] & SSO_BLOCK_PLAIN) != 0;
+		if (end < start || end - start > snappy_max_compressed_length(blockSize))
 		{
-			ERROR_LOG(LOADER, "deflateInit ERROR : %s\n", (z.msg) ? z.msg : "???");
-			return 1;
+			ERROR_LOG(LOADER, "SSO block %i has a bad index entry", blockNumber);
+			memset(outPtr, 0, blockSize);
+			return false;
 		}
-		z.avail_in = readSize;
-		z.next_out = outPtr;
-		z.avail_out = blockSize;
-		z.next_in = inbuffer;
-
-		int status = inflate(&z, Z_FULL_FLUSH);
-		if(status != Z_STREAM_END)
-			//if (status != Z_OK)
+		compressed.resize((size_t)(end - start));
+		fseeko(f, start, SEEK_SET);
+		if (!compressed.empty() && fread(&compressed[0], 1, compressed.size(), f) != compressed.size())
 		{
-			ERROR_LOG(LOADER, "block %d:inflate : %s[%d]\n", blockNumber, (z.msg) ? z.msg : "error", status);
-			return 1;
+			ERROR_LOG(LOADER, "Could not read SSO block %i", blockNumber);
+			memset(outPtr, 0, blockSize);
+			return false;
 		}
-		int cmp_size = blockSize - z.avail_out;
-		if (cmp_size != (int)blockSize)
+	}
+
+	// Decompress outside the lock, so other threads can read meanwhile.
+	if (plain)
+	{
+		memset(outPtr, 0, blockSize);
+		if (!compressed.empty())
+			memcpy(outPtr, &compressed[0], std::min((size_t)blockSize, compressed.size()));
+	}
+	else
+	{
+		size_t outSize = blockSize;
+		if (compressed.empty() || snappy_uncompress((const char *)&compressed[0], compressed.size(), (char *)outPtr, &outSize) != SNAPPY_OK || outSize != blockSize)
 		{
-			ERROR_LOG(LOADER, "block %d : block size error %d != %d\n", blockNumber, cmp_size, blockSize);
-			return 1;
+			ERROR_LOG(LOADER, "SSO block %i: decompression failed", blockNumber);
+			memset(outPtr, 0, blockSize);
+			return false;
 		}
 	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	cache->Insert(blockNumber, outPtr);
 	return true;
 }
+
+bool SSOFileBlockDevice::ReadBlock(int blockNumber, u8 *outPtr)
+{
+	return ReadBlocks(blockNumber, 1, outPtr);
+}
+
+bool SSOFileBlockDevice::ReadBlocks(u32 minBlock, int count, u8 *outPtr)
+{
+	if (minBlock + count > GetNumBlocks())
+	{
+		ERROR_LOG(LOADER, "Reading blocks %i-%i past the end of the SSO", minBlock, minBlock + count - 1);
+		memset(outPtr, 0, count * 2048);
+		if (minBlock >= GetNumBlocks())
+			return false;
+		count = GetNumBlocks() - minBlock;
+	}
+
+	const u32 sectorsPerBlock = blockSize / 2048;
+	bool success = true;
+	std::vector<u8> temp;
+	u32 sector = minBlock;
+	u32 end = minBlock + count;
+	while (sector < end)
+	{
+		u32 imageBlock = sector / sectorsPerBlock;
+		u32 offset = sector % sectorsPerBlock;
+		u32 sectors = std::min(sectorsPerBlock - offset, end - sector);
+		u8 *dest = outPtr + (sector - minBlock) * 2048;
+
+		if (sectors == sectorsPerBlock)
+		{
+			// The whole block is wanted, skip the copy.
+			success = ReadImageBlock(imageBlock, dest) && success;
+		}
+		else
+		{
+			temp.resize(blockSize);
+			success = ReadImageBlock(imageBlock, &temp[0]) && success;
+			memcpy(dest, &temp[offset * 2048], sectors * 2048);
+		}
+		sector += sectors;
+	}
+	return success;
+}
+
+ReadAheadBlockDevice::ReadAheadBlockDevice(BlockDevice *_device, int _readAhead, int numThreads)
+: device(_device), readAhead(_readAhead), cache(2048, _readAhead * 2), shutdown(false), hits(0), misses(0)
+{
+	for (int i = 0; i < numThreads; i++)
+		threads.push_back(new std::thread(&ReadAheadBlockDevice::WorkerThread, this));
+}
+
+ReadAheadBlockDevice::~ReadAheadBlockDevice()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		shutdown = true;
+		queue.clear();
+		workCond.notify_all();
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i]->join();
+		delete threads[i];
+	}
+	INFO_LOG(LOADER, "Read ahead: %i hits, %i misses", hits, misses);
+	delete device;
+}
+
+bool ReadAheadBlockDevice::ReadFromDevice(u32 minBlock, int count, u8 *outPtr)
+{
+	if (device->IsThreadSafe())
+		return device->ReadBlocks(minBlock, count, outPtr);
+	std::lock_guard<std::mutex> guard(deviceLock);
+	return device->ReadBlocks(minBlock, count, outPtr);
+}
+
+bool ReadAheadBlockDevice::ReadBlock(int blockNumber, u8 *outPtr)
+{
+	return ReadBlocks(blockNumber, 1, outPtr);
+}
+
+bool ReadAheadBlockDevice::ReadBlocks(u32 minBlock, int count, u8 *outPtr)
+{
+	bool success = true;
+	int i = 0;
+	while (i < count)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		while (inFlight.find(minBlock + i) != inFlight.end())
+			doneCond.wait(guard);
+		if (cache.Lookup(minBlock + i, outPtr + i * 2048))
+		{
+			hits++;
+			i++;
+			continue;
+		}
+
+		int runEnd = i + 1;
+		while (runEnd < count && inFlight.find(minBlock + runEnd) == inFlight.end() && !cache.Contains(minBlock + runEnd))
+			runEnd++;
+		misses += runEnd - i;
+		guard.unlock();
+
+		if (!ReadFromDevice(minBlock + i, runEnd - i, outPtr + i * 2048))
+			success = false;
+		i = runEnd;
+	}
+	return success;
+}
+
+void ReadAheadBlockDevice::Prefetch(u32 minBlock)
+{
+	// Chunks are what the workers split up, each one read and decompressed in one go.
+	const int chunkSize = 16;
+
+	u32 numBlocks = device->GetNumBlocks();
+	u32 end = std::min(minBlock + readAhead, numBlocks);
+
+	std::lock_guard<std::mutex> guard(lock);
+	u32 block = minBlock;
+	while (block < end)
+	{
+		if (inFlight.find(block) != inFlight.end() || cache.Contains(block))
+		{
+			block++;
+			continue;
+		}
+
+		Chunk chunk = {block, 0};
+		while (block < end && chunk.count < chunkSize && inFlight.find(block) == inFlight.end() && !cache.Contains(block))
+		{
+			inFlight.insert(block);
+			chunk.count++;
+			block++;
+		}
+		queue.push_back(chunk);
+		workCond.notify_one();
+	}
+}
+
+void ReadAheadBlockDevice::WorkerThread(ReadAheadBlockDevice *dev)
+{
+	std::vector<u8> buffer;
+	std::unique_lock<std::mutex> guard(dev->lock);
+	while (true)
+	{
+		while (dev->queue.empty() && !dev->shutdown)
+			dev->workCond.wait(guard);
+		if (dev->shutdown)
+			break;
+
+		Chunk chunk = dev->queue.front();
+		dev->queue.pop_front();
+
+		guard.unlock();
+		buffer.resize(chunk.count * 2048);
+		bool success = dev->ReadFromDevice(chunk.minBlock, chunk.count, &buffer[0]);
+		guard.lock();
+
+		for (int i = 0; i < chunk.count; i++)
+		{
+			if (success)
+				dev->cache.Insert(chunk.minBlock + i, &buffer[i * 2048]);
+			dev->inFlight.erase(chunk.minBlock + i);
+		}
+		dev->doneCond.notify_all();
+	}
+}
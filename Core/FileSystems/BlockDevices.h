@@ -19,38 +19,128 @@
 
 // Abstractions around read-only blockdevices, such as PSP UMD discs.
 // CISOFileBlockDevice implements compressed iso images, CISO format.
+// SSOFileBlockDevice implements our own SSO format, snappy compressed with bigger blocks.
 //
 // The ISOFileSystemReader reads from a BlockDevice, so it automatically works
 // with CISO images.
+//
+// MmapBlockDevice maps a plain ISO into memory, so reads are just memcpys.
+//
+// ReadAheadBlockDevice wraps any of them and reads ahead on worker threads when told
+// that reads are sequential.
 
 #include "../../Globals.h"
+#include "BlockCache.h"
+#include <deque>
+#include <set>
 #include <string>
+#include <vector>
+
+#include "StdMutex.h"
+#include "StdConditionVariable.h"
+#include "StdThread.h"
 
 class BlockDevice
 {
 public:
 	virtual ~BlockDevice() {}
 	virtual bool ReadBlock(int blockNumber, u8 *outPtr) = 0;
+	// Reads count consecutive blocks. Devices that can do it in one go override this.
+	virtual bool ReadBlocks(u32 minBlock, int count, u8 *outPtr) {
+		for (int i = 0; i < count; i++) {
+			if (!ReadBlock(minBlock + i, outPtr + i * GetBlockSize()))
+				return false;
+		}
+		return true;
+	}
 	int GetBlockSize() const { return 2048;}  // forced, it cannot be changed by subclasses
 	virtual u32 GetNumBlocks() = 0;
+	// Whether ReadBlock(s) can be called from several threads at once.
+	virtual bool IsThreadSafe() const { return false; }
+	// Hint that the blocks from minBlock on are about to be read in order.
+	virtual void Prefetch(u32 minBlock) {}
 };
 
 
+struct z_stream_s;
+
 class CISOFileBlockDevice : public BlockDevice
 {
 public:
-	CISOFileBlockDevice(std::string _filename);
+	// cacheBlocks is how many decompressed blocks to keep around, 0 disables the cache.
+	CISOFileBlockDevice(std::string _filename, int cacheBlocks = 1024);
 	~CISOFileBlockDevice();
 	bool ReadBlock(int blockNumber, u8 *outPtr);
+	bool ReadBlocks(u32 minBlock, int count, u8 *outPtr);
 	u32 GetNumBlocks() { return numBlocks;}
+	// Reads of different runs inflate in parallel.
+	bool IsThreadSafe() const { return true; }
 
 private:
+	// Decompresses one block from its compressed data.
+	bool DecompressBlock(z_stream_s *z, u32 blockNumber, const u8 *data, u32 size, u8 *outPtr);
+	// Streams are reused for every block with inflateReset, one per concurrent reader.
+	z_stream_s *AllocStream();
+	void FreeStream(z_stream_s *z);
+
 	std::string filename;
 	FILE *f;
 	u32 *index;
 	int indexShift;
 	u32 blockSize;
 	u32 numBlocks;
+
+	// Guards f, cache and freeStreams.
+	std::mutex lock;
+	std::vector<z_stream_s *> freeStreams;
+	BlockCache cache;
+};
+
+
+// .SSO format: this header, then numBlocks + 1 u64 offsets into the file (the last one is
+// the end of the data), then the blocks. Blocks with SSO_BLOCK_PLAIN set in their offset
+// are stored uncompressed. All blocks decompress to blockSize bytes, the last one padded.
+struct SSOHeader
+{
+	char magic[4];  // 'S','S','O','\0'
+	u32 headerSize;  // sizeof(SSOHeader)
+	u64 totalBytes;  // of the original image
+	u32 blockSize;  // a power of two multiple of 2048
+	u8 version;  // SSO_VERSION
+	u8 reserved[3];
+	u64 reserved2;
+};
+
+#define SSO_VERSION 1
+#define SSO_BLOCK_PLAIN 0x8000000000000000ULL
+#define SSO_MIN_BLOCK_SIZE 0x800
+#define SSO_MAX_BLOCK_SIZE 0x100000
+
+class SSOFileBlockDevice : public BlockDevice
+{
+public:
+	// Keeps about cacheBytes of decompressed blocks around.
+	SSOFileBlockDevice(std::string _filename, int cacheBytes = 2 * 1024 * 1024);
+	~SSOFileBlockDevice();
+	bool ReadBlock(int blockNumber, u8 *outPtr);
+	bool ReadBlocks(u32 minBlock, int count, u8 *outPtr);
+	u32 GetNumBlocks() { return (u32)(totalBytes / GetBlockSize()); }
+	bool IsThreadSafe() const { return true; }
+
+private:
+	// Fills outPtr with blockSize bytes of image block blockNumber.
+	bool ReadImageBlock(u32 blockNumber, u8 *outPtr);
+
+	std::string filename;
+	FILE *f;
+	std::vector<u64> index;
+	u32 blockSize;
+	u32 numBlocks;
+	u64 totalBytes;
+
+	// Guards f and cache.
+	std::mutex lock;
+	BlockCache *cache;
 };
 
 
@@ -60,6 +150,7 @@ public:
 	FileBlockDevice(std::string _filename);
 	~FileBlockDevice();
 	bool ReadBlock(int blockNumber, u8 *outPtr);
+	bool ReadBlocks(u32 minBlock, int count, u8 *outPtr);
 	u32 GetNumBlocks() {return (u32)(filesize / GetBlockSize());}
 
 private:
@@ -67,3 +158,74 @@ private:
 	FILE *f;
 	size_t filesize;
 };
+
+
+class MmapBlockDevice : public BlockDevice
+{
+public:
+	MmapBlockDevice(std::string _filename);
+	~MmapBlockDevice();
+	// False if the file couldn't be mapped (like a big image in a 32-bit address space.)
+	bool IsValid() const { return base != 0; }
+	bool ReadBlock(int blockNumber, u8 *outPtr);
+	bool ReadBlocks(u32 minBlock, int count, u8 *outPtr);
+	u32 GetNumBlocks() {return (u32)(filesize / GetBlockSize());}
+	bool IsThreadSafe() const { return true; }
+
+private:
+	std::string filename;
+	const u8 *base;
+	size_t filesize;
+#ifdef _WIN32
+	void *hFile;
+	void *hMapping;
+#else
+	int fd;
+#endif
+};
+
+
+class ReadAheadBlockDevice : public BlockDevice
+{
+public:
+	// Takes ownership of device. Prefetch reads up to readAhead blocks ahead.
+	ReadAheadBlockDevice(BlockDevice *device, int readAhead, int numThreads = 2);
+	~ReadAheadBlockDevice();
+	bool ReadBlock(int blockNumber, u8 *outPtr);
+	bool ReadBlocks(u32 minBlock, int count, u8 *outPtr);
+	u32 GetNumBlocks() { return device->GetNumBlocks(); }
+	bool IsThreadSafe() const { return true; }
+	void Prefetch(u32 minBlock);
+
+	// Blocks that were read ahead (or in flight) when asked for, and ones that weren't.
+	u32 Hits() const { return hits; }
+	u32 Misses() const { return misses; }
+
+private:
+	struct Chunk
+	{
+		u32 minBlock;
+		int count;
+	};
+
+	static void WorkerThread(ReadAheadBlockDevice *dev);
+	bool ReadFromDevice(u32 minBlock, int count, u8 *outPtr);
+
+	BlockDevice *device;
+	int readAhead;
+
+	// Only used when the device isn't thread safe.
+	std::mutex deviceLock;
+
+	// Guards everything below.
+	std::mutex lock;
+	std::condition_variable workCond;
+	std::condition_variable doneCond;
+	std::deque<Chunk> queue;
+	std::set<u32> inFlight;
+	BlockCache cache;
+	std::vector<std::thread *> threads;
+	bool shutdown;
+	u32 hits;
+	u32 misses;
+};
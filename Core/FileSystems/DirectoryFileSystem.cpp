@@ -28,55 +28,35 @@
 #include "FileUtil.h"
 #include "DirectoryFileSystem.h"
 
+#if HOST_HAS_INOTIFY
+#include <sys/inotify.h>
+#include <fcntl.h>
+#endif
+
+// Guest writes are held back until this much has collected.
+static const size_t WRITE_BUFFER_SIZE = 64 * 1024;
+// Staged files are kept in memory up to this before spilling to the temp file.
+static const size_t STAGED_BUFFER_SIZE = 16 * 1024 * 1024;
+static const char *STAGED_SUFFIX = ".ppsspp-tmp";
+
 
 #if HOST_IS_CASE_SENSITIVE
 
-static bool FixFilenameCase(const std::string &path, std::string &filename)
+bool DirectoryFileSystem::FixFilenameCase(const std::string &path, std::string &filename)
 {
+	const CachedDir *dir = GetCachedDir(path);
+	if (!dir)
+		return false;
+
 	// Are we lucky?
-	if (File::Exists(path + filename))
+	if (FindCachedEntry(dir, filename, false))
 		return true;
 
-	size_t filenameSize = filename.size();  // size in bytes, not characters
-	for (size_t i = 0; i < filenameSize; i++)
-	{
-		filename[i] = tolower(filename[i]);
-	}
-
-	//TODO: lookup filename in cache for "path"
-
-	struct dirent_large { struct dirent entry; char padding[FILENAME_MAX+1]; } diren;
-	struct dirent_large;
-	struct dirent *result = NULL;
-
-	DIR *dirp = opendir(path.c_str());
-	if (!dirp)
+	const PSPFileInfo *entry = FindCachedEntry(dir, filename, true);
+	if (!entry)
 		return false;
-
-	bool retValue = false;
-
-	while (!readdir_r(dirp, (dirent*) &diren, &result) && result)
-	{
-		if (strlen(result->d_name) != filenameSize)
-			continue;
-
-		size_t i;
-		for (i = 0; i < filenameSize; i++)
-		{
-			if (filename[i] != tolower(result->d_name[i]))
-				break;
-		}
-
-		if (i < filenameSize)
-			continue;
-
-		filename = result->d_name;
-		retValue = true;
-	}
-
-	closedir(dirp);
-
-	return retValue;
+	filename = entry->name;
+	return true;
 }
 
 bool DirectoryFileSystem::FixPathCase(std::string &path, FixPathCaseBehavior behavior)
@@ -133,16 +113,23 @@ bool DirectoryFileSystem::FixPathCase(std::string &path, FixPathCaseBehavior beh
 DirectoryFileSystem::DirectoryFileSystem(IHandleAllocator *_hAlloc, std::string _basePath) : basePath(_basePath) {
 	File::CreateFullPath(basePath);
 	hAlloc = _hAlloc;
+	stagedWrites = false;
+#if HOST_HAS_INOTIFY
+	inotifyFd = inotify_init();
+	if (inotifyFd >= 0)
+		fcntl(inotifyFd, F_SETFL, fcntl(inotifyFd, F_GETFL) | O_NONBLOCK);
+	else
+		WARN_LOG(HLE, "No inotify, won't notice changes to %s while running", basePath.c_str());
+#endif
 }
 
 DirectoryFileSystem::~DirectoryFileSystem() {
-	for (auto iter = entries.begin(); iter != entries.end(); ++iter) {
-#ifdef _WIN32
-		CloseHandle((*iter).second.hFile);
-#else
-		fclose((*iter).second.hFile);
+	for (auto iter = entries.begin(); iter != entries.end(); ++iter)
+		CloseEntry(iter->second);
+#if HOST_HAS_INOTIFY
+	if (inotifyFd >= 0)
+		close(inotifyFd);
 #endif
-	}
 }
 
 std::string DirectoryFileSystem::GetLocalPath(std::string localpath) {
@@ -161,7 +148,236 @@ std::string DirectoryFileSystem::GetLocalPath(std::string localpath) {
 	return basePath + localpath;
 }
 
+std::string DirectoryFileSystem::GetLocalDir(const std::string &path) {
+	std::string localDir = GetLocalPath(path);
+	if (!localDir.empty() && localDir[localDir.size() - 1] != '/' && localDir[localDir.size() - 1] != '\\') {
+#ifdef _WIN32
+		localDir += '\\';
+#else
+		localDir += '/';
+#endif
+	}
+	return localDir;
+}
+
+// Splits off the last component, ignoring leading and trailing slashes.
+static void SplitPath(const std::string &path, std::string &parent, std::string &name) {
+	size_t start = path.find_first_not_of('/');
+	size_t end = path.find_last_not_of('/');
+	if (start == std::string::npos) {
+		parent.clear();
+		name.clear();
+		return;
+	}
+
+	std::string trimmed = path.substr(start, end - start + 1);
+	size_t slash = trimmed.rfind('/');
+	if (slash == std::string::npos) {
+		parent.clear();
+		name = trimmed;
+	} else {
+		parent = trimmed.substr(0, slash);
+		name = trimmed.substr(slash + 1);
+	}
+}
+
+static std::string DirCacheKey(const std::string &localDir) {
+#if HOST_IS_CASE_SENSITIVE
+	return localDir;
+#else
+	std::string key = localDir;
+	for (size_t i = 0; i < key.size(); i++)
+		key[i] = tolower(key[i]);
+	return key;
+#endif
+}
+
+static bool IsStagedName(const std::string &name) {
+	size_t len = strlen(STAGED_SUFFIX);
+	return name.size() > len && name.compare(name.size() - len, len, STAGED_SUFFIX) == 0;
+}
+
+static void FillInfoFromStat(PSPFileInfo &info, struct stat &s) {
+	info.access = s.st_mode & 0x1FF;
+	localtime_r((time_t*)&s.st_atime,&info.atime);
+	localtime_r((time_t*)&s.st_ctime,&info.ctime);
+	localtime_r((time_t*)&s.st_mtime,&info.mtime);
+}
+
+const DirectoryFileSystem::CachedDir *DirectoryFileSystem::GetCachedDir(const std::string &localDir) {
+	std::string key = DirCacheKey(localDir);
+	DirCache::iterator iter = dirCache.find(key);
+	if (iter != dirCache.end())
+		return &iter->second;
+
+	CachedDir dir;
+#ifdef _WIN32
+	WIN32_FIND_DATA findData;
+	HANDLE hFind = FindFirstFile((localDir + "*.*").c_str(), &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	while (true) {
+		PSPFileInfo entry;
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			entry.type = FILETYPE_DIRECTORY;
+		else
+			entry.type = FILETYPE_NORMAL;
+		// TODO: is this just for .. or all subdirectories? Need to add a directory to the test
+		// to find out. Also why so different than the old test results?
+		if (!strcmp(findData.cFileName, "..") )
+			entry.size = 4096;
+		else
+			entry.size = findData.nFileSizeLow | ((u64)findData.nFileSizeHigh<<32);
+		entry.name = findData.cFileName;
+		if (IsStagedName(entry.name)) {
+			if (!FindNextFile(hFind, &findData))
+				break;
+			continue;
+		}
+		struct stat s;
+		if (stat((localDir + findData.cFileName).c_str(), &s) == 0)
+			FillInfoFromStat(entry, s);
+		else {
+			memset(&entry.atime, 0, sizeof(entry.atime));
+			memset(&entry.ctime, 0, sizeof(entry.ctime));
+			memset(&entry.mtime, 0, sizeof(entry.mtime));
+		}
+		entry.exists = true;
+		dir.entries.push_back(entry);
+
+		int retval = FindNextFile(hFind, &findData);
+		if (!retval)
+			break;
+	}
+	FindClose(hFind);
+#else
+	DIR *dp = opendir(localDir.c_str());
+	if (dp == NULL)
+		return NULL;
+
+	dirent *dirp;
+	while ((dirp = readdir(dp)) != NULL) {
+		if (IsStagedName(dirp->d_name))
+			continue;
+		PSPFileInfo entry;
+		struct stat s;
+		std::string fullName = localDir + dirp->d_name;
+		// Vanished (or dangling link) since readdir, don't cache garbage.
+		if (stat(fullName.c_str(), &s) != 0)
+			continue;
+		if (S_ISDIR(s.st_mode))
+			entry.type = FILETYPE_DIRECTORY;
+		else
+			entry.type = FILETYPE_NORMAL;
+		entry.name = dirp->d_name;
+		entry.size = s.st_size;
+		entry.exists = true;
+		FillInfoFromStat(entry, s);
+		dir.entries.push_back(entry);
+	}
+	closedir(dp);
+#endif
+
+#if HOST_HAS_INOTIFY
+	dir.watch = -1;
+	if (inotifyFd >= 0) {
+		dir.watch = inotify_add_watch(inotifyFd, localDir.c_str(), IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+		if (dir.watch >= 0)
+			watches[dir.watch] = key;
+	}
+#endif
+
+	return &(dirCache[key] = dir);
+}
+
+const PSPFileInfo *DirectoryFileSystem::FindCachedEntry(const CachedDir *dir, const std::string &name, bool ignoreCase) {
+	if (!dir)
+		return NULL;
+
+	for (size_t i = 0; i < dir->entries.size(); i++) {
+		const std::string &entryName = dir->entries[i].name;
+		if (entryName.size() != name.size())
+			continue;
+		if (!ignoreCase) {
+			if (entryName == name)
+				return &dir->entries[i];
+			continue;
+		}
+
+		size_t j = 0;
+		while (j < name.size() && tolower(entryName[j]) == tolower(name[j]))
+			j++;
+		if (j == name.size())
+			return &dir->entries[i];
+	}
+	return NULL;
+}
+
+void DirectoryFileSystem::InvalidateDir(const std::string &localDir) {
+	DirCache::iterator iter = dirCache.find(DirCacheKey(localDir));
+	if (iter == dirCache.end())
+		return;
+
+#if HOST_HAS_INOTIFY
+	if (iter->second.watch >= 0) {
+		inotify_rm_watch(inotifyFd, iter->second.watch);
+		watches.erase(iter->second.watch);
+	}
+#endif
+	dirCache.erase(iter);
+}
+
+void DirectoryFileSystem::InvalidateParentDir(const std::string &path) {
+	std::string parent, name;
+	SplitPath(path, parent, name);
+	InvalidateDir(GetLocalDir(parent));
+}
+
+void DirectoryFileSystem::InvalidateAllDirs() {
+#if HOST_HAS_INOTIFY
+	for (DirCache::iterator iter = dirCache.begin(); iter != dirCache.end(); ++iter) {
+		if (iter->second.watch >= 0)
+			inotify_rm_watch(inotifyFd, iter->second.watch);
+	}
+	watches.clear();
+#endif
+	dirCache.clear();
+}
+
+void DirectoryFileSystem::CheckHostChanges() {
+#if HOST_HAS_INOTIFY
+	if (inotifyFd < 0 || watches.empty())
+		return;
+
+	char buffer[4096];
+	while (true) {
+		ssize_t len = read(inotifyFd, buffer, sizeof(buffer));
+		if (len <= 0)
+			break;
+
+		for (ssize_t pos = 0; pos < len; ) {
+			const struct inotify_event *event = (const struct inotify_event *)(buffer + pos);
+			if (event->wd == -1 || (event->mask & IN_Q_OVERFLOW)) {
+				// Events were dropped, we can't tell which dirs changed.
+				InvalidateAllDirs();
+				pos += sizeof(struct inotify_event) + event->len;
+				continue;
+			}
+			std::map<int, std::string>::iterator watch = watches.find(event->wd);
+			if (watch != watches.end()) {
+				// Copy, InvalidateDir erases it.
+				std::string key = watch->second;
+				InvalidateDir(key);
+			}
+			pos += sizeof(struct inotify_event) + event->len;
+		}
+	}
+#endif
+}
+
 bool DirectoryFileSystem::MkDir(const std::string &dirname) {
+	std::lock_guard<std::mutex> guard(lock);
 
 #if HOST_IS_CASE_SENSITIVE
 	// Must fix case BEFORE attempting, because MkDir would create
@@ -171,14 +387,18 @@ bool DirectoryFileSystem::MkDir(const std::string &dirname) {
 	if ( ! FixPathCase(fixedCase, FPC_PARTIAL_ALLOWED) )
 		return false;
 
+	InvalidateAllDirs();
 	return File::CreateFullPath(GetLocalPath(fixedCase));
 #else
+	InvalidateAllDirs();
 	return File::CreateFullPath(GetLocalPath(dirname));
 #endif
 }
 
 bool DirectoryFileSystem::RmDir(const std::string &dirname) {
+	std::lock_guard<std::mutex> guard(lock);
 	std::string fullName = GetLocalPath(dirname);
+	InvalidateAllDirs();
 
 #if HOST_IS_CASE_SENSITIVE
 	// Maybe we're lucky?
@@ -189,6 +409,8 @@ bool DirectoryFileSystem::RmDir(const std::string &dirname) {
 	fullName = dirname;
 	if ( ! FixPathCase(fullName, FPC_FILE_MUST_EXIST) )
 		return false;  // or go on and attempt (for a better error code than just false?)
+	// FixPathCase reloads the cache, and the dir is about to go away.
+	InvalidateAllDirs();
 
 	fullName = GetLocalPath(fullName);
 #endif
@@ -202,6 +424,7 @@ bool DirectoryFileSystem::RmDir(const std::string &dirname) {
 }
 
 bool DirectoryFileSystem::RenameFile(const std::string &from, const std::string &to) {
+	std::lock_guard<std::mutex> guard(lock);
 	std::string fullTo = to;
 
 	// Rename only work for filename in current directory
@@ -216,6 +439,7 @@ bool DirectoryFileSystem::RenameFile(const std::string &from, const std::string
 
 	fullTo = GetLocalPath(fullTo);
 	const char * fullToC = fullTo.c_str();
+	InvalidateAllDirs();
 
 #ifdef _WIN32
 	bool retValue = (MoveFile(fullFrom.c_str(), fullToC) == TRUE);
@@ -230,6 +454,7 @@ bool DirectoryFileSystem::RenameFile(const std::string &from, const std::string
 		fullFrom = from;
 		if ( ! FixPathCase(fullFrom, FPC_FILE_MUST_EXIST) )
 			return false;  // or go on and attempt (for a better error code than just false?)
+		InvalidateAllDirs();
 		fullFrom = GetLocalPath(fullFrom);
 
 #ifdef _WIN32
@@ -244,7 +469,9 @@ bool DirectoryFileSystem::RenameFile(const std::string &from, const std::string
 }
 
 bool DirectoryFileSystem::DeleteFile(const std::string &filename) {
+	std::lock_guard<std::mutex> guard(lock);
 	std::string fullName = GetLocalPath(filename);
+	InvalidateParentDir(filename);
 #ifdef _WIN32
 	bool retValue = (::DeleteFile(fullName.c_str()) == TRUE);
 #else
@@ -258,6 +485,7 @@ bool DirectoryFileSystem::DeleteFile(const std::string &filename) {
 		fullName = filename;
 		if ( ! FixPathCase(fullName, FPC_FILE_MUST_EXIST) )
 			return false;  // or go on and attempt (for a better error code than just false?)
+		InvalidateParentDir(fullName);
 		fullName = GetLocalPath(fullName);
 
 #ifdef _WIN32
@@ -272,6 +500,7 @@ bool DirectoryFileSystem::DeleteFile(const std::string &filename) {
 }
 
 u32 DirectoryFileSystem::OpenFile(std::string filename, FileAccess access) {
+	std::lock_guard<std::mutex> guard(lock);
 #if HOST_IS_CASE_SENSITIVE
 	if (access & (FILEACCESS_APPEND|FILEACCESS_CREATE|FILEACCESS_WRITE))
 	{
@@ -288,6 +517,29 @@ u32 DirectoryFileSystem::OpenFile(std::string filename, FileAccess access) {
 
 	OpenFileEntry entry;
 
+	// Only files that get rewritten from scratch, appends and updates in place go to the real file.
+	const int staged = FILEACCESS_WRITE | FILEACCESS_CREATE;
+	if (stagedWrites && (access & (staged | FILEACCESS_READ | FILEACCESS_APPEND)) == staged) {
+		entry.commitPath = fullName;
+		entry.tempPath = fullName + STAGED_SUFFIX;
+#ifdef _WIN32
+		// OPEN_ALWAYS keeps the old contents, so the temp file has to start out as a copy.
+		// Elsewhere "wb" truncates the real file too, so there's nothing to carry over.
+		bool seeded;
+		if (File::Exists(fullName))
+			seeded = File::Copy(fullName, entry.tempPath);
+		else
+			seeded = !File::Exists(entry.tempPath) || File::Delete(entry.tempPath);
+		if (!seeded) {
+			WARN_LOG(HLE, "Unable to stage %s, writing in place", fullNameC);
+			entry.commitPath.clear();
+			entry.tempPath.clear();
+		}
+#endif
+		if (!entry.tempPath.empty())
+			fullNameC = entry.tempPath.c_str();
+	}
+
 	//TODO: tests, should append seek to end of file? seeking in a file opened for append?
 #ifdef _WIN32
 	// Convert parameters to Windows permissions and access
@@ -376,6 +628,14 @@ u32 DirectoryFileSystem::OpenFile(std::string filename, FileAccess access) {
 			SetFilePointer(entry.hFile, 0, NULL, FILE_END);
 #endif
 
+		if (access & (FILEACCESS_APPEND|FILEACCESS_CREATE|FILEACCESS_WRITE)) {
+			std::string parent, name;
+			SplitPath(filename, parent, name);
+			entry.cachedDir = GetLocalDir(parent);
+			entry.localPath = fullName;
+			InvalidateDir(entry.cachedDir);
+		}
+
 		u32 newHandle = hAlloc->GetNewHandle();
 		entries[newHandle] = entry;
 
@@ -384,36 +644,147 @@ u32 DirectoryFileSystem::OpenFile(std::string filename, FileAccess access) {
 }
 
 void DirectoryFileSystem::CloseFile(u32 handle) {
-	EntryMap::iterator iter = entries.find(handle);
-	if (iter != entries.end()) {
+	std::unique_lock<std::mutex> guard(lock);
+	OpenFileEntry *entry = AcquireEntry(guard, handle);
+	if (entry) {
 		hAlloc->FreeHandle(handle);
-#ifdef _WIN32
-		CloseHandle((*iter).second.hFile);
-#else
-		fclose((*iter).second.hFile);
-#endif
-		entries.erase(iter);
+		CloseEntry(*entry);
+		entries.erase(handle);
+		// Anyone waiting for it will find it gone.
+		entryIdle.notify_all();
 	} else {
 		//This shouldn't happen...
 		ERROR_LOG(HLE,"Cannot close file that hasn't been opened: %08x", handle);
 	}
 }
 
+DirectoryFileSystem::OpenFileEntry *DirectoryFileSystem::AcquireEntry(std::unique_lock<std::mutex> &guard, u32 handle) {
+	while (true) {
+		// Look again after waiting, it may have been closed meanwhile.
+		EntryMap::iterator iter = entries.find(handle);
+		if (iter == entries.end())
+			return NULL;
+		if (!iter->second.busy) {
+			iter->second.busy = true;
+			return &iter->second;
+		}
+		entryIdle.wait(guard);
+	}
+}
+
+void DirectoryFileSystem::ReleaseEntry(OpenFileEntry *entry) {
+	entry->busy = false;
+	entryIdle.notify_all();
+}
+
+bool DirectoryFileSystem::FlushEntry(OpenFileEntry &entry) {
+	if (entry.writeBuffer.empty())
+		return true;
+
+	size_t size = entry.writeBuffer.size();
+	size_t bytesWritten;
+#ifdef _WIN32
+	DWORD written = 0;
+	::WriteFile(entry.hFile, (LPVOID)&entry.writeBuffer[0], (DWORD)size, &written, 0);
+	bytesWritten = written;
+#else
+	bytesWritten = fwrite(&entry.writeBuffer[0], 1, size, entry.hFile);
+#endif
+	entry.writeBuffer.clear();
+
+	if (bytesWritten != size) {
+		ERROR_LOG(FILESYS, "DirectoryFileSystem: only wrote %i of %i buffered bytes", (int)bytesWritten, (int)size);
+		return false;
+	}
+	return true;
+}
+
+void DirectoryFileSystem::CloseEntry(OpenFileEntry &entry) {
+	bool written = FlushEntry(entry);
+#ifdef _WIN32
+	CloseHandle(entry.hFile);
+#else
+	written = fclose(entry.hFile) == 0 && written;
+#endif
+
+	if (!entry.tempPath.empty()) {
+		// Never replace a good file with one we know is short.
+		bool committed = false;
+		if (written) {
+#ifdef _WIN32
+			committed = MoveFileEx(entry.tempPath.c_str(), entry.commitPath.c_str(), MOVEFILE_REPLACE_EXISTING) == TRUE;
+#else
+			committed = rename(entry.tempPath.c_str(), entry.commitPath.c_str()) == 0;
+#endif
+		}
+		if (!committed) {
+			ERROR_LOG(FILESYS, "DirectoryFileSystem: failed to replace %s, keeping the old file", entry.commitPath.c_str());
+#ifdef _WIN32
+			::DeleteFile(entry.tempPath.c_str());
+#else
+			unlink(entry.tempPath.c_str());
+#endif
+		}
+	}
+
+	if (!entry.cachedDir.empty())
+		InvalidateDir(entry.cachedDir);
+}
+
+void DirectoryFileSystem::FlushEntries(std::unique_lock<std::mutex> &guard, const std::string &localPath) {
+	// AcquireEntry may wait and let the map change, so go by handle.
+	std::vector<u32> handles;
+	for (EntryMap::iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+		const OpenFileEntry &entry = iter->second;
+		if (entry.cachedDir.empty())
+			continue;
+		// Ignoring case can only flush a bit more than needed.
+		if (localPath.empty() || !strcasecmp(entry.localPath.c_str(), localPath.c_str()) || !strcasecmp(entry.cachedDir.c_str(), localPath.c_str()))
+			handles.push_back(iter->first);
+	}
+
+	for (size_t i = 0; i < handles.size(); i++) {
+		OpenFileEntry *entry = AcquireEntry(guard, handles[i]);
+		if (!entry)
+			continue;
+		FlushEntry(*entry);
+#ifndef _WIN32
+		fflush(entry->hFile);
+#endif
+		InvalidateDir(entry->cachedDir);
+		ReleaseEntry(entry);
+	}
+}
+
+void DirectoryFileSystem::FlushAll() {
+	std::unique_lock<std::mutex> guard(lock);
+	FlushEntries(guard, "");
+}
+
 bool DirectoryFileSystem::OwnsHandle(u32 handle) {
+	std::lock_guard<std::mutex> guard(lock);
 	EntryMap::iterator iter = entries.find(handle);
 	return (iter != entries.end());
 }
 
 size_t DirectoryFileSystem::ReadFile(u32 handle, u8 *pointer, s64 size) {
-	EntryMap::iterator iter = entries.find(handle);
-	if (iter != entries.end())
+	std::unique_lock<std::mutex> guard(lock);
+	OpenFileEntry *entry = AcquireEntry(guard, handle);
+	if (entry)
 	{
+		guard.unlock();
+		bool flushed = !entry->writeBuffer.empty();
+		FlushEntry(*entry);
 		size_t bytesRead;
 #ifdef _WIN32
-		::ReadFile(iter->second.hFile, (LPVOID)pointer, (DWORD)size, (LPDWORD)&bytesRead, 0);
+		::ReadFile(entry->hFile, (LPVOID)pointer, (DWORD)size, (LPDWORD)&bytesRead, 0);
 #else
-		bytesRead = fread(pointer, 1, size, iter->second.hFile);
+		bytesRead = fread(pointer, 1, size, entry->hFile);
 #endif
+		guard.lock();
+		if (flushed && !entry->cachedDir.empty())
+			InvalidateDir(entry->cachedDir);
+		ReleaseEntry(entry);
 		return bytesRead;
 	} else {
 		//This shouldn't happen...
@@ -423,15 +794,29 @@ size_t DirectoryFileSystem::ReadFile(u32 handle, u8 *pointer, s64 size) {
 }
 
 size_t DirectoryFileSystem::WriteFile(u32 handle, const u8 *pointer, s64 size) {
-	EntryMap::iterator iter = entries.find(handle);
-	if (iter != entries.end())
+	std::unique_lock<std::mutex> guard(lock);
+	OpenFileEntry *entry = AcquireEntry(guard, handle);
+	if (entry)
 	{
-		size_t bytesWritten;
+		guard.unlock();
+		size_t bytesWritten = (size_t)size;
+		size_t limit = entry->tempPath.empty() ? WRITE_BUFFER_SIZE : STAGED_BUFFER_SIZE;
+		if (entry->writeBuffer.size() + size > limit)
+			FlushEntry(*entry);
+		if ((size_t)size < limit) {
+			// The host write happens later, errors there only get logged.
+			entry->writeBuffer.insert(entry->writeBuffer.end(), pointer, pointer + size);
+		} else {
 #ifdef _WIN32
-		::WriteFile(iter->second.hFile, (LPVOID)pointer, (DWORD)size, (LPDWORD)&bytesWritten, 0);
+			::WriteFile(entry->hFile, (LPVOID)pointer, (DWORD)size, (LPDWORD)&bytesWritten, 0);
 #else
-		bytesWritten = fwrite(pointer, 1, size, iter->second.hFile);
+			bytesWritten = fwrite(pointer, 1, size, entry->hFile);
 #endif
+		}
+		guard.lock();
+		if (!entry->cachedDir.empty())
+			InvalidateDir(entry->cachedDir);
+		ReleaseEntry(entry);
 		return bytesWritten;
 	} else {
 		//This shouldn't happen...
@@ -441,8 +826,14 @@ size_t DirectoryFileSystem::WriteFile(u32 handle, const u8 *pointer, s64 size) {
 }
 
 size_t DirectoryFileSystem::SeekFile(u32 handle, s32 position, FileMove type) {
-	EntryMap::iterator iter = entries.find(handle);
-	if (iter != entries.end()) {
+	std::unique_lock<std::mutex> guard(lock);
+	OpenFileEntry *entry = AcquireEntry(guard, handle);
+	if (entry) {
+		bool flushed = !entry->writeBuffer.empty();
+		FlushEntry(*entry);
+		if (flushed && !entry->cachedDir.empty())
+			InvalidateDir(entry->cachedDir);
+		size_t newPos;
 #ifdef _WIN32
 		DWORD moveMethod = 0;
 		switch (type) {
@@ -450,8 +841,7 @@ size_t DirectoryFileSystem::SeekFile(u32 handle, s32 position, FileMove type) {
 		case FILEMOVE_CURRENT:  moveMethod = FILE_CURRENT;  break;
 		case FILEMOVE_END:      moveMethod = FILE_END;      break;
 		}
-		DWORD newPos = SetFilePointer((*iter).second.hFile, (LONG)position, 0, moveMethod);
-		return newPos;
+		newPos = SetFilePointer(entry->hFile, (LONG)position, 0, moveMethod);
 #else
 		int moveMethod = 0;
 		switch (type) {
@@ -459,9 +849,11 @@ size_t DirectoryFileSystem::SeekFile(u32 handle, s32 position, FileMove type) {
 		case FILEMOVE_CURRENT:  moveMethod = SEEK_CUR;  break;
 		case FILEMOVE_END:      moveMethod = SEEK_END;  break;
 		}
-		fseek(iter->second.hFile, position, moveMethod);
-		return ftell(iter->second.hFile);
+		fseek(entry->hFile, position, moveMethod);
+		newPos = ftell(entry->hFile);
 #endif
+		ReleaseEntry(entry);
+		return newPos;
 	} else {
 		//This shouldn't happen...
 		ERROR_LOG(HLE,"Cannot seek in file that hasn't been opened: %08x", handle);
@@ -472,39 +864,44 @@ size_t DirectoryFileSystem::SeekFile(u32 handle, s32 position, FileMove type) {
 PSPFileInfo DirectoryFileSystem::GetFileInfo(std::string filename) {
 	PSPFileInfo x;
 	x.name = filename;
+	std::unique_lock<std::mutex> guard(lock);
+	// Sizes should include what's still buffered.
+	FlushEntries(guard, GetLocalPath(filename));
+	CheckHostChanges();
+
+	std::string parent, name;
+	SplitPath(filename, parent, name);
+	if (name.empty()) {
+		// The root of the mount.
+		if (File::Exists(basePath)) {
+			x.type = FILETYPE_DIRECTORY;
+			x.exists = true;
+		}
+		return x;
+	}
 
-	std::string fullName = GetLocalPath(filename);
-	if (! File::Exists(fullName)) {
+	const PSPFileInfo *entry = FindCachedEntry(GetCachedDir(GetLocalDir(parent)), name, !HOST_IS_CASE_SENSITIVE);
 #if HOST_IS_CASE_SENSITIVE
+	if (!entry) {
 		if (! FixPathCase(filename, FPC_FILE_MUST_EXIST))
 			return x;
-		fullName = GetLocalPath(filename);
-
-		if (! File::Exists(fullName))
-			return x;
-#else
-		return x;
-#endif
+		SplitPath(filename, parent, name);
+		entry = FindCachedEntry(GetCachedDir(GetLocalDir(parent)), name, false);
 	}
-	x.type = File::IsDirectory(fullName) ? FILETYPE_DIRECTORY : FILETYPE_NORMAL;
+#endif
+	if (!entry)
+		return x;
+
+	x.type = entry->type;
 	x.exists = true;
 
 	if (x.type != FILETYPE_DIRECTORY)
 	{
-		struct stat s;
-		stat(fullName.c_str(), &s);
-#ifdef _WIN32
-		WIN32_FILE_ATTRIBUTE_DATA data;
-		GetFileAttributesEx(fullName.c_str(), GetFileExInfoStandard, &data);
-
-		x.size = data.nFileSizeLow | ((u64)data.nFileSizeHigh<<32);
-#else
-		x.size = s.st_size;
-#endif
-		x.access = s.st_mode & 0x1FF;
-		localtime_r((time_t*)&s.st_atime,&x.atime);
-		localtime_r((time_t*)&s.st_ctime,&x.ctime);
-		localtime_r((time_t*)&s.st_mtime,&x.mtime);
+		x.size = entry->size;
+		x.access = entry->access;
+		x.atime = entry->atime;
+		x.ctime = entry->ctime;
+		x.mtime = entry->mtime;
 	}
 
 	return x;
@@ -516,79 +913,29 @@ bool DirectoryFileSystem::GetHostPath(const std::string &inpath, std::string &ou
 }
 
 std::vector<PSPFileInfo> DirectoryFileSystem::GetDirListing(std::string path) {
-	std::vector<PSPFileInfo> myVector;
-#ifdef _WIN32
-	WIN32_FIND_DATA findData;
-	HANDLE hFind;
-
-	std::string w32path = GetLocalPath(path) + "\\*.*";
-
-	hFind = FindFirstFile(w32path.c_str(), &findData);
-
-	if (hFind == INVALID_HANDLE_VALUE) {
-		return myVector; //the empty list
-	}
-
-	while (true) {
-		PSPFileInfo entry;
-		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			entry.type = FILETYPE_DIRECTORY;
-		else
-			entry.type = FILETYPE_NORMAL;
-		// TODO: is this just for .. or all subdirectories? Need to add a directory to the test
-		// to find out. Also why so different than the old test results?
-		if (!strcmp(findData.cFileName, "..") )
-			entry.size = 4096;
-		else
-			entry.size = findData.nFileSizeLow | ((u64)findData.nFileSizeHigh<<32);
-		entry.name = findData.cFileName;
-		myVector.push_back(entry);
-
-		int retval = FindNextFile(hFind, &findData);
-		if (!retval)
-			break;
-	}
-#else
-	dirent *dirp;
-	std::string localPath = GetLocalPath(path);
-	DIR *dp = opendir(localPath.c_str());
+	std::unique_lock<std::mutex> guard(lock);
+	FlushEntries(guard, GetLocalDir(path));
+	CheckHostChanges();
 
+	const CachedDir *dir = GetCachedDir(GetLocalDir(path));
 #if HOST_IS_CASE_SENSITIVE
-	if(dp == NULL && FixPathCase(path, FPC_FILE_MUST_EXIST)) {
+	if (dir == NULL && FixPathCase(path, FPC_FILE_MUST_EXIST)) {
 		// May have failed due to case sensitivity, try again
-		localPath = GetLocalPath(path);
-		dp = opendir(localPath.c_str());
+		dir = GetCachedDir(GetLocalDir(path));
 	}
 #endif
 
-	if (dp == NULL) {
+	if (dir == NULL) {
 		ERROR_LOG(HLE,"Error opening directory %s\n",path.c_str());
-		return myVector;
+		return std::vector<PSPFileInfo>();
 	}
-
-	while ((dirp = readdir(dp)) != NULL) {
-		PSPFileInfo entry;
-		struct stat s;
-		std::string fullName = GetLocalPath(path) + "/"+dirp->d_name;
-		stat(fullName.c_str(), &s);
-		if (S_ISDIR(s.st_mode))
-			entry.type = FILETYPE_DIRECTORY;
-		else
-			entry.type = FILETYPE_NORMAL;
-		entry.access = s.st_mode & 0x1FF;
-		entry.name = dirp->d_name;
-		entry.size = s.st_size;
-		localtime_r((time_t*)&s.st_atime,&entry.atime);
-		localtime_r((time_t*)&s.st_ctime,&entry.ctime);
-		localtime_r((time_t*)&s.st_mtime,&entry.mtime);
-		myVector.push_back(entry);
-	}
-	closedir(dp);
-#endif
-	return myVector;
+	return dir->entries;
 }
 
 void DirectoryFileSystem::DoState(PointerWrap &p) {
+	std::unique_lock<std::mutex> guard(lock);
+	// Whatever the state says was written should be on the disk.
+	FlushEntries(guard, "");
 	if (!entries.empty()) {
 		ERROR_LOG(FILESYS, "FIXME: Open files during savestate, could go badly.");
 	}
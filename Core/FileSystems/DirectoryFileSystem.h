@@ -22,6 +22,8 @@
 #include <map>
 #include <string>
 
+#include "StdMutex.h"
+#include "StdConditionVariable.h"
 #include "../Core/FileSystems/FileSystem.h"
 
 #ifdef _WIN32
@@ -48,6 +50,13 @@ typedef void * HANDLE;
 
 #endif
 
+// Lets the directory cache notice changes made by others.
+#if defined(__linux__)
+#define HOST_HAS_INOTIFY 1
+#else
+#define HOST_HAS_INOTIFY 0
+#endif
+
 class DirectoryFileSystem : public IFileSystem {
 public:
 	DirectoryFileSystem(IHandleAllocator *_hAlloc, std::string _basePath);
@@ -68,23 +77,87 @@ public:
 	bool RenameFile(const std::string &from, const std::string &to);
 	bool DeleteFile(const std::string &filename);
 	bool GetHostPath(const std::string &inpath, std::string &outpath);
+	void FlushAll();
+
+	// Files opened to replace their contents are written under a temp name and
+	// renamed over the real one on close, so a crash never leaves half a save.
+	void SetStagedWrites(bool enable) {
+		stagedWrites = enable;
+	}
 
 private:
 	struct OpenFileEntry {
+		OpenFileEntry() : busy(false) {}
+
 #ifdef _WIN32
 		HANDLE hFile;
 #else
 		FILE *hFile;
+#endif
+		// For files opened for writing, the directory to forget when the file changes.
+		std::string cachedDir;
+		// And the host path of the file itself.
+		std::string localPath;
+		// Small guest writes collect here and go to the host in one write.
+		std::vector<u8> writeBuffer;
+		// For staged files, the host path hFile gets renamed to on close.
+		std::string commitPath;
+		std::string tempPath;
+		// A read or write is using it outside the lock.
+		bool busy;
+	};
+
+	// What we know about a host directory, so that probing paths doesn't hit the disk.
+	// Dropped whenever we change something in it (and on hosts with inotify, when
+	// someone else does.)
+	struct CachedDir {
+		std::vector<PSPFileInfo> entries;
+#if HOST_HAS_INOTIFY
+		int watch;
 #endif
 	};
 
 	typedef std::map<u32, OpenFileEntry> EntryMap;
 	EntryMap entries;
+	// Async reads and writes come from other threads. This guards entries and the dir
+	// cache, but the host transfers run without it, with their entry marked busy.
+	std::mutex lock;
+	std::condition_variable entryIdle;
 	std::string basePath;
 	IHandleAllocator *hAlloc;
+	bool stagedWrites;
+
+	typedef std::map<std::string, CachedDir> DirCache;
+	DirCache dirCache;
+#if HOST_HAS_INOTIFY
+	int inotifyFd;
+	std::map<int, std::string> watches;
+#endif
 
 	// In case of Windows: Translate slashes, etc.
 	std::string GetLocalPath(std::string localpath);
+	// Same, but with a trailing separator.
+	std::string GetLocalDir(const std::string &path);
+
+	// NULL if the directory doesn't exist, those aren't cached.
+	const CachedDir *GetCachedDir(const std::string &localDir);
+	const PSPFileInfo *FindCachedEntry(const CachedDir *dir, const std::string &name, bool ignoreCase);
+	void InvalidateDir(const std::string &localDir);
+	void InvalidateParentDir(const std::string &path);
+	void InvalidateAllDirs();
+	// Drops the directories that inotify says changed.
+	void CheckHostChanges();
+
+	// Waits until nobody else is using the handle and marks it busy. NULL if not open.
+	OpenFileEntry *AcquireEntry(std::unique_lock<std::mutex> &guard, u32 handle);
+	void ReleaseEntry(OpenFileEntry *entry);
+
+	// False if the host didn't take all of it. Callers forget entry.cachedDir.
+	bool FlushEntry(OpenFileEntry &entry);
+	// Only the files written at localPath, or directly in it for a dir. All of them if empty.
+	void FlushEntries(std::unique_lock<std::mutex> &guard, const std::string &localPath);
+	// Flushes, closes, and for staged files renames into place.
+	void CloseEntry(OpenFileEntry &entry);
 
 #if HOST_IS_CASE_SENSITIVE
 	typedef enum {
@@ -93,5 +166,6 @@ private:
 		FPC_PARTIAL_ALLOWED,  // don't care how many exist (mkdir recursive)
 	} FixPathCaseBehavior;
 	bool FixPathCase(std::string &path, FixPathCaseBehavior behavior);
+	bool FixFilenameCase(const std::string &path, std::string &filename);
 #endif
 };
@@ -112,6 +112,8 @@ public:
 	virtual bool     RenameFile(const std::string &from, const std::string &to) = 0;
 	virtual bool     DeleteFile(const std::string &filename) = 0;
 	virtual bool     GetHostPath(const std::string &inpath, std::string &outpath) = 0;
+	// Writes out anything held back for open files.
+	virtual void     FlushAll() = 0;
 };
 
 
@@ -132,6 +134,7 @@ public:
 	virtual bool RenameFile(const std::string &from, const std::string &to) {return false;}
 	virtual bool DeleteFile(const std::string &filename) {return false;}
 	virtual bool     GetHostPath(const std::string &inpath, std::string &outpath) {return false;}
+	virtual void     FlushAll() {}
 };
 
 
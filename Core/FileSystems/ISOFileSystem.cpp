@@ -25,6 +25,18 @@
 
 const int sectorSize = 2048;
 
+// FNV-1a of the lowercased path.
+static u32 HashPathLower(const char *path, size_t length)
+{
+	u32 hash = 2166136261U;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= (u8)tolower(path[i]);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
 static bool parseLBN(std::string filename, u32 *sectorStart, u32 *readSize)
 {
 	// Looks like: /sce_lbn0x10_size0x100 or /sce_lbn10_size100 (always hex.)
@@ -168,6 +180,7 @@ ISOFileSystem::ISOFileSystem(IHandleAllocator *_hAlloc, BlockDevice *_blockDevic
 	u32 rootSize = desc.root.dataLengthLE;
 
 	ReadDirectory(rootSector, rootSize, treeroot);
+	BuildPathIndex();
 }
 
 ISOFileSystem::~ISOFileSystem()
@@ -254,6 +267,84 @@ nextblock:
 
 }
 
+void ISOFileSystem::BuildPathIndex()
+{
+	pathIndex.clear();
+	pathArena.clear();
+	IndexDirectory(treeroot, "");
+
+	size_t numSlots = 16;
+	while (numSlots < pathIndex.size() * 2)
+		numSlots *= 2;
+	pathSlots.assign(numSlots, 0);
+
+	const u32 mask = (u32)numSlots - 1;
+	for (size_t i = 0; i < pathIndex.size(); i++)
+	{
+		const PathIndexEntry &entry = pathIndex[i];
+		u32 slot = entry.hash & mask;
+		bool duplicate = false;
+		while (pathSlots[slot] != 0 && !duplicate)
+		{
+			const PathIndexEntry &other = pathIndex[pathSlots[slot] - 1];
+			// Keep the first one, like walking the tree would find.
+			duplicate = other.hash == entry.hash && other.pathLength == entry.pathLength &&
+				!memcmp(&pathArena[other.pathOffset], &pathArena[entry.pathOffset], entry.pathLength);
+			slot = (slot + 1) & mask;
+		}
+		if (!duplicate)
+			pathSlots[slot] = (u32)i + 1;
+	}
+
+	DEBUG_LOG(FILESYS, "Indexed %i paths, %i bytes of names", (int)pathIndex.size(), (int)pathArena.size());
+}
+
+void ISOFileSystem::IndexDirectory(TreeEntry *dir, const std::string &prefix)
+{
+	for (size_t i = 0; i < dir->children.size(); i++)
+	{
+		TreeEntry *e = dir->children[i];
+		if (e->name == "." || e->name == "..")
+			continue;
+
+		std::string path = prefix + e->name;
+		PathIndexEntry entry;
+		entry.hash = HashPathLower(path.c_str(), path.size());
+		entry.pathOffset = (u32)pathArena.size();
+		entry.pathLength = (u32)path.size();
+		entry.entry = e;
+		for (size_t j = 0; j < path.size(); j++)
+			pathArena.push_back((char)tolower(path[j]));
+		pathIndex.push_back(entry);
+
+		if (e->isDirectory)
+			IndexDirectory(e, path + "/");
+	}
+}
+
+ISOFileSystem::TreeEntry *ISOFileSystem::LookupPath(const std::string &path)
+{
+	if (pathSlots.empty())
+		return 0;
+
+	const u32 hash = HashPathLower(path.c_str(), path.size());
+	const u32 mask = (u32)pathSlots.size() - 1;
+	for (u32 slot = hash & mask; pathSlots[slot] != 0; slot = (slot + 1) & mask)
+	{
+		const PathIndexEntry &entry = pathIndex[pathSlots[slot] - 1];
+		if (entry.hash != hash || entry.pathLength != path.size())
+			continue;
+
+		const char *name = &pathArena[entry.pathOffset];
+		size_t i = 0;
+		while (i < path.size() && name[i] == tolower(path[i]))
+			i++;
+		if (i == path.size())
+			return entry.entry;
+	}
+	return 0;
+}
+
 ISOFileSystem::TreeEntry *ISOFileSystem::GetFromPath(std::string path, bool catchError)
 {
 	if (path.length() == 0)
@@ -265,6 +356,36 @@ ISOFileSystem::TreeEntry *ISOFileSystem::GetFromPath(std::string path, bool catc
 	if (path.substr(0,2) == "./")
 		path.erase(0,2);
 
+	// Make it look like the paths in the index: no leading, trailing or double slashes.
+	std::string key;
+	key.reserve(path.size());
+	bool dotComponent = false;
+	for (size_t i = 0; i < path.size(); i++)
+	{
+		if (path[i] == '/' && (key.empty() || key[key.size() - 1] == '/'))
+			continue;
+		if (path[i] == '.' && (key.empty() || key[key.size() - 1] == '/'))
+			dotComponent = true;
+		key += path[i];
+	}
+	if (!key.empty() && key[key.size() - 1] == '/')
+		key.resize(key.size() - 1);
+
+	if (key.empty())
+		return treeroot;
+	if (dotComponent)
+		return WalkPath(path, catchError);
+
+	TreeEntry *e = LookupPath(key);
+	if (!e && catchError)
+	{
+		ERROR_LOG(FILESYS,"File %s not found", key.c_str());
+	}
+	return e;
+}
+
+ISOFileSystem::TreeEntry *ISOFileSystem::WalkPath(std::string path, bool catchError)
+{
 	if (path[0] == '/')
 		path.erase(0,1);
 
@@ -331,7 +452,7 @@ u32 ISOFileSystem::OpenFile(std::string filename, FileAccess access)
 		ERROR_LOG(FILESYS, "faillbn: %08x %08x", a, b);
 	}*/
 
-
+	std::lock_guard<std::mutex> guard(lock);
 	OpenFileEntry entry;
 	if (filename.compare(0,8,"/sce_lbn") == 0)
 	{
@@ -350,6 +471,7 @@ u32 ISOFileSystem::OpenFile(std::string filename, FileAccess access)
 		entry.isRawSector = true;
 		entry.sectorStart = sectorStart;
 		entry.openSize = readSize;
+		entry.nextSector = 0xFFFFFFFF;
 		entries[newHandle] = entry;
 		return newHandle;
 	}
@@ -368,6 +490,7 @@ u32 ISOFileSystem::OpenFile(std::string filename, FileAccess access)
 		return 0;
 
 	entry.seekPos = 0;
+	entry.nextSector = 0xFFFFFFFF;
 
 	u32 newHandle = hAlloc->GetNewHandle();
 	entries[newHandle] = entry;
@@ -376,6 +499,7 @@ u32 ISOFileSystem::OpenFile(std::string filename, FileAccess access)
 
 void ISOFileSystem::CloseFile(u32 handle)
 {
+	std::lock_guard<std::mutex> guard(lock);
 	EntryMap::iterator iter = entries.find(handle);
 	if (iter != entries.end())
 	{
@@ -392,25 +516,41 @@ void ISOFileSystem::CloseFile(u32 handle)
 
 bool ISOFileSystem::OwnsHandle(u32 handle)
 {
+	std::lock_guard<std::mutex> guard(lock);
 	EntryMap::iterator iter = entries.find(handle);
 	return (iter != entries.end());
 }
 
+void ISOFileSystem::CheckSequentialRead(OpenFileEntry &e, u32 firstSector, u32 nextSector)
+{
+	if (firstSector == e.nextSector)
+		blockDevice->Prefetch(nextSector);
+	e.nextSector = nextSector;
+}
+
 size_t ISOFileSystem::ReadFile(u32 handle, u8 *pointer, s64 size)
 {
-	EntryMap::iterator iter = entries.find(handle);
-	if (iter != entries.end())
+	OpenFileEntry *entry = NULL;
 	{
-		OpenFileEntry &e = iter->second;
-		
+		std::lock_guard<std::mutex> guard(lock);
+		EntryMap::iterator iter = entries.find(handle);
+		if (iter != entries.end())
+			entry = &iter->second;
+	}
+
+	if (entry)
+	{
+		OpenFileEntry &e = *entry;
+		std::unique_lock<std::mutex> device(deviceLock, std::defer_lock);
+		if (!blockDevice->IsThreadSafe())
+			device.lock();
+
 		if (e.file != 0 && e.file->isBlockSectorMode)
 		{
 			// Whole sectors! Shortcut to this simple code.
-			for (int i = 0; i < size; i++)
-			{
-				blockDevice->ReadBlock(e.seekPos, pointer + i * 2048);
-				e.seekPos++;
-			}
+			CheckSequentialRead(e, e.seekPos, e.seekPos + (u32)size);
+			blockDevice->ReadBlocks(e.seekPos, (int)size, pointer);
+			e.seekPos += (u32)size;
 			return (size_t)size;
 		}
 
@@ -443,10 +583,25 @@ size_t ISOFileSystem::ReadFile(u32 handle, u8 *pointer, s64 size)
 		int posInSector = positionOnIso & 2047;
 		s64 remain = size;		
 
+		CheckSequentialRead(e, secNum, (u32)((positionOnIso + size) / 2048));
+
 		u8 theSector[2048];
 
 		while (remain > 0)
 		{
+			if (posInSector == 0 && remain >= 2048)
+			{
+				// Aligned run of whole sectors, straight into the destination.
+				int sectors = (int)(remain / 2048);
+				blockDevice->ReadBlocks(secNum, sectors, pointer);
+				size_t bytesRead = (size_t)sectors * 2048;
+				totalRead += (u32)bytesRead;
+				pointer += bytesRead;
+				remain -= bytesRead;
+				secNum += sectors;
+				continue;
+			}
+
 			blockDevice->ReadBlock(secNum, theSector);
 			size_t bytesToCopy = 2048 - posInSector;
 			if ((s64)bytesToCopy > remain)
@@ -478,6 +633,7 @@ size_t ISOFileSystem::WriteFile(u32 handle, const u8 *pointer, s64 size)
 
 size_t ISOFileSystem::SeekFile(u32 handle, s32 position, FileMove type) 
 {
+	std::lock_guard<std::mutex> guard(lock);
 	EntryMap::iterator iter = entries.find(handle);
 	if (iter != entries.end())
 	{
@@ -600,6 +756,7 @@ std::string ISOFileSystem::EntryFullPath(TreeEntry *e)
 
 void ISOFileSystem::DoState(PointerWrap &p)
 {
+	std::lock_guard<std::mutex> guard(lock);
 	int n = (int) entries.size();
 	p.Do(n);
 
@@ -618,6 +775,7 @@ void ISOFileSystem::DoState(PointerWrap &p)
 			p.Do(of.isRawSector);
 			p.Do(of.sectorStart);
 			p.Do(of.openSize);
+			of.nextSector = 0xFFFFFFFF;
 			entries[fd] = of;
 		}
 	}
@@ -41,6 +41,7 @@ public:
 
 	size_t WriteFile(u32 handle, const u8 *pointer, s64 size);
 	bool GetHostPath(const std::string &inpath, std::string &outpath) {return false;}
+	void FlushAll() {}
 	virtual bool MkDir(const std::string &dirname) {return false;}
 	virtual bool RmDir(const std::string &dirname) {return false;}
 	virtual bool RenameFile(const std::string &from, const std::string &to) {return false;}
@@ -75,18 +76,47 @@ private:
 		bool isRawSector;   // "/sce_lbn" mode
 		u32 sectorStart;
 		u32 openSize;
+		// The sector right after the last read, to notice sequential reads.
+		u32 nextSector;
 	};
+
+	// Tells the block device to read ahead if this read continues the previous one.
+	void CheckSequentialRead(OpenFileEntry &e, u32 firstSector, u32 nextSector);
 	
 
 	typedef std::map<u32,OpenFileEntry> EntryMap;
 	EntryMap entries;
+	// Async reads run on other threads. This guards entries, an entry itself is only
+	// ever used by one read or seek at a time.
+	std::mutex lock;
+	// Held while reading, unless the block device can take several readers.
+	std::mutex deviceLock;
 	IHandleAllocator *hAlloc;
 	TreeEntry *treeroot;
 	BlockDevice *blockDevice;
 
 	TreeEntry entireISO;
 
+	// Every path in the tree, lowercased, hashed into an open addressing table. Built once
+	// at mount so lookups don't have to walk the tree.
+	struct PathIndexEntry
+	{
+		u32 hash;
+		u32 pathOffset;  // in pathArena
+		u32 pathLength;
+		TreeEntry *entry;
+	};
+	std::vector<PathIndexEntry> pathIndex;
+	// Index into pathIndex + 1, 0 for empty. Always a power of two in size.
+	std::vector<u32> pathSlots;
+	std::vector<char> pathArena;
+
 	void ReadDirectory(u32 startsector, u32 dirsize, TreeEntry *root);
+	void BuildPathIndex();
+	void IndexDirectory(TreeEntry *dir, const std::string &prefix);
+	TreeEntry *LookupPath(const std::string &path);
 	TreeEntry *GetFromPath(std::string path, bool catchError=true);
+	// The slow way, through the tree. Only for paths with . or .. in them.
+	TreeEntry *WalkPath(std::string path, bool catchError);
 	std::string EntryFullPath(TreeEntry *e);
 };
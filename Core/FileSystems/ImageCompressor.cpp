@@ -0,0 +1,151 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <algorithm>
+#include <cstring>
+
+#include "StdThread.h"
+#include "../../ext/snappy/snappy-c.h"
+
+#include "BlockDevices.h"
+#include "ImageCompressor.h"
+#include "CommonFuncs.h"
+
+// Blocks each thread gets per batch.
+static const int BLOCKS_PER_THREAD = 16;
+
+struct CompressJob
+{
+	const u8 *raw;
+	u32 blockSize;
+	int count;
+	int first;
+	int step;
+	std::vector<u8> *compressed;
+	std::vector<u8> *plain;  // Not vector<bool>, the workers write neighbouring entries.
+};
+
+static void CompressWorker(CompressJob *job)
+{
+	size_t maxSize = snappy_max_compressed_length(job->blockSize);
+	for (int i = job->first; i < job->count; i += job->step)
+	{
+		const u8 *src = job->raw + (size_t)i * job->blockSize;
+		std::vector<u8> &out = job->compressed[i];
+		out.resize(maxSize);
+		size_t outSize = maxSize;
+		if (snappy_compress((const char *)src, job->blockSize, (char *)&out[0], &outSize) != SNAPPY_OK || outSize >= job->blockSize)
+		{
+			// Doesn't compress, store it as is.
+			out.assign(src, src + job->blockSize);
+			(*job->plain)[i] = 1;
+		}
+		else
+		{
+			out.resize(outSize);
+			(*job->plain)[i] = 0;
+		}
+	}
+}
+
+bool CompressImageToSSO(BlockDevice *input, const std::string &filename, u32 blockSize, int numThreads, std::string *error_string)
+{
+	if (blockSize < SSO_MIN_BLOCK_SIZE || blockSize > SSO_MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0)
+	{
+		*error_string = "Block size must be a power of two between 2048 and 1048576";
+		return false;
+	}
+	if (numThreads < 1)
+		numThreads = 1;
+
+	FILE *f = fopen(filename.c_str(), "wb");
+	if (!f)
+	{
+		*error_string = "Could not open " + filename + " for writing";
+		return false;
+	}
+
+	const u32 sectorsPerBlock = blockSize / 2048;
+	const u32 numSectors = input->GetNumBlocks();
+	const u32 numBlocks = (numSectors + sectorsPerBlock - 1) / sectorsPerBlock;
+
+	SSOHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "SSO", 4);
+	hdr.headerSize = sizeof(SSOHeader);
+	hdr.totalBytes = (u64)numSectors * 2048;
+	hdr.blockSize = blockSize;
+	hdr.version = SSO_VERSION;
+
+	// The index gets written again at the end, once it's known.
+	std::vector<u64> index(numBlocks + 1);
+	bool success = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+	success = success && fwrite(&index[0], sizeof(u64), index.size(), f) == index.size();
+	u64 pos = sizeof(hdr) + index.size() * sizeof(u64);
+
+	const int batchSize = numThreads * BLOCKS_PER_THREAD;
+	std::vector<u8> raw((size_t)batchSize * blockSize);
+	std::vector<std::vector<u8> > compressed(batchSize);
+	std::vector<u8> plain(batchSize);
+	std::vector<CompressJob> jobs(numThreads);
+	std::vector<std::thread *> threads;
+
+	for (u32 block = 0; block < numBlocks && success; block += batchSize)
+	{
+		int count = (int)std::min((u32)batchSize, numBlocks - block);
+		u32 firstSector = block * sectorsPerBlock;
+		u32 sectors = std::min(count * sectorsPerBlock, numSectors - firstSector);
+		// The last block is padded.
+		memset(&raw[0], 0, (size_t)count * blockSize);
+		input->ReadBlocks(firstSector, sectors, &raw[0]);
+
+		for (int t = 0; t < numThreads; t++)
+		{
+			CompressJob job = {&raw[0], blockSize, count, t, numThreads, &compressed[0], &plain};
+			jobs[t] = job;
+			threads.push_back(new std::thread(&CompressWorker, &jobs[t]));
+		}
+		for (size_t t = 0; t < threads.size(); t++)
+		{
+			threads[t]->join();
+			delete threads[t];
+		}
+		threads.clear();
+
+		for (int i = 0; i < count && success; i++)
+		{
+			index[block + i] = pos | (plain[i] ? SSO_BLOCK_PLAIN : 0);
+			success = fwrite(&compressed[i][0], 1, compressed[i].size(), f) == compressed[i].size();
+			pos += compressed[i].size();
+		}
+	}
+	index[numBlocks] = pos;
+
+	success = success && fseeko(f, sizeof(hdr), SEEK_SET) == 0;
+	success = success && fwrite(&index[0], sizeof(u64), index.size(), f) == index.size();
+	if (fclose(f) != 0)
+		success = false;
+
+	if (!success)
+	{
+		*error_string = "Could not write " + filename;
+		return false;
+	}
+
+	INFO_LOG(LOADER, "Wrote %s: %i blocks, %lld bytes from %lld", filename.c_str(), numBlocks, (long long)pos, (long long)hdr.totalBytes);
+	return true;
+}
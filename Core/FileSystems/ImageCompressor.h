@@ -0,0 +1,28 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include <string>
+
+#include "../../Globals.h"
+
+class BlockDevice;
+
+// Writes the contents of a block device (a plain or CSO image) to filename in the SSO
+// format, see BlockDevices.h. Blocks are compressed on numThreads threads.
+bool CompressImageToSSO(BlockDevice *input, const std::string &filename, u32 blockSize, int numThreads, std::string *error_string);
@@ -16,6 +16,7 @@
 // https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
 
 #include <set>
+#include <ctype.h>
 #include "Common/StringUtil.h"
 #include "../HLE/sceKernelThread.h"
 #include "MetaFileSystem.h"
@@ -152,8 +153,106 @@ static bool RealPath(const std::string &currentDirectory, const std::string &inP
 	return true;
 }
 
+// Whether RealPath would return path as is, so it can be skipped: "device:/a/b", without
+// ., .., empty components or a trailing slash.
+static bool IsRealPath(const std::string &path, size_t colon)
+{
+	size_t len = path.length();
+	if (colon == std::string::npos || colon + 1 == len || path[colon + 1] != '/')
+		return false;
+
+	size_t start = colon + 2;
+	while (true)
+	{
+		size_t end = path.find('/', start);
+		if (end == std::string::npos)
+			end = len;
+
+		size_t componentLen = end - start;
+		if (componentLen == 0)
+			return false;
+		if (path[start] == '.' && (componentLen == 1 || (componentLen == 2 && path[start + 1] == '.')))
+			return false;
+
+		if (end == len)
+			return true;
+		start = end + 1;
+	}
+}
+
+void MetaFileSystem::RebuildPrefixTrie()
+{
+	prefixTrie.clear();
+	PrefixTrieNode root;
+	root.mount = -1;
+	prefixTrie.push_back(root);
+
+	for (size_t i = 0; i < fileSystems.size(); i++)
+	{
+		const std::string &prefix = fileSystems[i].prefix;
+		int node = 0;
+		for (size_t j = 0; j < prefix.size(); j++)
+		{
+			char c = (char)tolower(prefix[j]);
+			int next = -1;
+			for (size_t k = 0; k < prefixTrie[node].children.size(); k++)
+			{
+				if (prefixTrie[node].children[k].first == c)
+				{
+					next = prefixTrie[node].children[k].second;
+					break;
+				}
+			}
+			if (next == -1)
+			{
+				PrefixTrieNode child;
+				child.mount = -1;
+				next = (int)prefixTrie.size();
+				prefixTrie.push_back(child);
+				prefixTrie[node].children.push_back(std::make_pair(c, next));
+			}
+			node = next;
+		}
+		if (prefixTrie[node].mount == -1)
+			prefixTrie[node].mount = (int)i;
+	}
+}
+
+int MetaFileSystem::FindMount(const std::string &path) const
+{
+	if (prefixTrie.empty())
+		return -1;
+
+	int best = -1;
+	int node = 0;
+	for (size_t i = 0; ; i++)
+	{
+		int mount = prefixTrie[node].mount;
+		if (mount != -1 && (best == -1 || mount < best))
+			best = mount;
+		if (i == path.size())
+			break;
+
+		char c = (char)tolower(path[i]);
+		const std::vector<std::pair<char, int> > &children = prefixTrie[node].children;
+		node = -1;
+		for (size_t k = 0; k < children.size(); k++)
+		{
+			if (children[k].first == c)
+			{
+				node = children[k].second;
+				break;
+			}
+		}
+		if (node == -1)
+			break;
+	}
+	return best;
+}
+
 IFileSystem *MetaFileSystem::GetHandleOwner(u32 handle)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	for (size_t i = 0; i < fileSystems.size(); i++)
 	{
 		if (fileSystems[i].system->OwnsHandle(handle))
@@ -165,62 +264,76 @@ IFileSystem *MetaFileSystem::GetHandleOwner(u32 handle)
 
 bool MetaFileSystem::MapFilePath(const std::string &_inpath, std::string &outpath, MountPoint **system)
 {
-	std::string realpath;
+	std::lock_guard<std::recursive_mutex> guard(lock);
 
 	// Special handling: host0:command.txt (as seen in Super Monkey Ball Adventures, for example)
 	// appears to mean the current directory on the UMD. Let's just assume the current directory.
-	std::string inpath = _inpath;
-	if (strncasecmp(inpath.c_str(), "host0:", 5) == 0) {
-		INFO_LOG(HLE, "Host0 path detected, stripping: %s", inpath.c_str());
-		inpath = inpath.substr(6);
-	}
+	const std::string *inpath = &_inpath;
+	std::string stripped;
+	if (strncasecmp(_inpath.c_str(), "host0:", 5) == 0) {
+		INFO_LOG(HLE, "Host0 path detected, stripping: %s", _inpath.c_str());
+		stripped = _inpath.substr(6);
+		inpath = &stripped;
+	}
+
+	// Most paths are absolute and clean already, those go straight to the mount lookup.
+	const std::string *realpath = inpath;
+	std::string normalized;
+	size_t colon = inpath->find(':');
+	if (!IsRealPath(*inpath, colon))
+	{
+		const std::string *currentDirectory = &startingDirectory;
 
-	const std::string *currentDirectory = &startingDirectory;
+		int currentThread = __KernelGetCurThread();
+		currentDir_t::iterator i = currentDir.find(currentThread);
+		if (i == currentDir.end())
+		{
+			//TODO: emulate PSP's error 8002032C: "no current working directory" if relative... may break things requiring fixes elsewhere
+			if (colon == std::string::npos  /* means path is relative */)
+				WARN_LOG(HLE, "Path is relative, but current directory not set for thread %i. Should give error, instead falling back to %s", currentThread, startingDirectory.c_str());
+		}
+		else
+		{
+			currentDirectory = &(i->second);
+		}
 
-	int currentThread = __KernelGetCurThread();
-	currentDir_t::iterator i = currentDir.find(currentThread);
-	if (i == currentDir.end())
-	{
-		//TODO: emulate PSP's error 8002032C: "no current working directory" if relative... may break things requiring fixes elsewhere
-		if (inpath.find(':') == std::string::npos  /* means path is relative */)
-			WARN_LOG(HLE, "Path is relative, but current directory not set for thread %i. Should give error, instead falling back to %s", currentThread, startingDirectory.c_str());
-	}
-	else
-	{
-		currentDirectory = &(i->second);
+		if (!RealPath(*currentDirectory, *inpath, normalized))
+		{
+			DEBUG_LOG(HLE, "MapFilePath: failed mapping \"%s\", returning false", inpath->c_str());
+			return false;
+		}
+		realpath = &normalized;
 	}
 
-	if ( RealPath(*currentDirectory, inpath, realpath) )
+	int mount = FindMount(*realpath);
+	if (mount != -1)
 	{
-		for (size_t i = 0; i < fileSystems.size(); i++)
-		{
-			size_t prefLen = fileSystems[i].prefix.size();
-			if (strncasecmp(fileSystems[i].prefix.c_str(), realpath.c_str(), prefLen) == 0)
-			{
-				outpath = realpath.substr(prefLen);
-				*system = &(fileSystems[i]);
+		size_t prefLen = fileSystems[mount].prefix.size();
+		outpath.assign(*realpath, prefLen, std::string::npos);
+		*system = &(fileSystems[mount]);
 
-				DEBUG_LOG(HLE, "MapFilePath: mapped \"%s\" to prefix: \"%s\", path: \"%s\"", inpath.c_str(), fileSystems[i].prefix.c_str(), outpath.c_str());
+		DEBUG_LOG(HLE, "MapFilePath: mapped \"%s\" to prefix: \"%s\", path: \"%s\"", inpath->c_str(), fileSystems[mount].prefix.c_str(), outpath.c_str());
 
-				return true;
-			}
-		}
+		return true;
 	}
 
-	DEBUG_LOG(HLE, "MapFilePath: failed mapping \"%s\", returning false", inpath.c_str());
+	DEBUG_LOG(HLE, "MapFilePath: failed mapping \"%s\", returning false", inpath->c_str());
 	return false;
 }
 
 void MetaFileSystem::Mount(std::string prefix, IFileSystem *system)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	MountPoint x;
 	x.prefix=prefix;
 	x.system=system;
 	fileSystems.push_back(x);
+	RebuildPrefixTrie();
 }
 
 void MetaFileSystem::Shutdown()
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	current = 6;
 
 	// Ownership is a bit convoluted. Let's just delete everything once.
@@ -236,12 +349,14 @@ void MetaFileSystem::Shutdown()
 	}
 
 	fileSystems.clear();
+	prefixTrie.clear();
 	currentDir.clear();
 	startingDirectory = "";
 }
 
 u32 MetaFileSystem::OpenFile(std::string filename, FileAccess access)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	std::string of;
 	IFileSystem *system;
 	if (MapFilePath(filename, of, &system))
@@ -256,6 +371,7 @@ u32 MetaFileSystem::OpenFile(std::string filename, FileAccess access)
 
 PSPFileInfo MetaFileSystem::GetFileInfo(std::string filename)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	std::string of;
 	IFileSystem *system;
 	if (MapFilePath(filename, of, &system))
@@ -271,6 +387,7 @@ PSPFileInfo MetaFileSystem::GetFileInfo(std::string filename)
 
 bool MetaFileSystem::GetHostPath(const std::string &inpath, std::string &outpath)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	std::string of;
 	IFileSystem *system;
 	if (MapFilePath(inpath, of, &system)) {
@@ -282,6 +399,7 @@ bool MetaFileSystem::GetHostPath(const std::string &inpath, std::string &outpath
 
 std::vector<PSPFileInfo> MetaFileSystem::GetDirListing(std::string path)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	std::string of;
 	IFileSystem *system;
 	if (MapFilePath(path, of, &system))
@@ -297,11 +415,13 @@ std::vector<PSPFileInfo> MetaFileSystem::GetDirListing(std::string path)
 
 void MetaFileSystem::ThreadEnded(int threadID)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	currentDir.erase(threadID);
 }
 
 void MetaFileSystem::ChDir(const std::string &dir)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	int curThread = __KernelGetCurThread();
 	
 	std::string of;
@@ -322,6 +442,7 @@ void MetaFileSystem::ChDir(const std::string &dir)
 
 bool MetaFileSystem::MkDir(const std::string &dirname)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	std::string of;
 	IFileSystem *system;
 	if (MapFilePath(dirname, of, &system))
@@ -336,6 +457,7 @@ bool MetaFileSystem::MkDir(const std::string &dirname)
 
 bool MetaFileSystem::RmDir(const std::string &dirname)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	std::string of;
 	IFileSystem *system;
 	if (MapFilePath(dirname, of, &system))
@@ -350,6 +472,7 @@ bool MetaFileSystem::RmDir(const std::string &dirname)
 
 bool MetaFileSystem::RenameFile(const std::string &from, const std::string &to)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	std::string of;
 	std::string rf;
 	IFileSystem *system;
@@ -365,6 +488,7 @@ bool MetaFileSystem::RenameFile(const std::string &from, const std::string &to)
 
 bool MetaFileSystem::DeleteFile(const std::string &filename)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	std::string of;
 	IFileSystem *system;
 	if (MapFilePath(filename, of, &system))
@@ -379,6 +503,7 @@ bool MetaFileSystem::DeleteFile(const std::string &filename)
 
 void MetaFileSystem::CloseFile(u32 handle)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	IFileSystem *sys = GetHandleOwner(handle);
 	if (sys)
 		sys->CloseFile(handle);
@@ -386,7 +511,12 @@ void MetaFileSystem::CloseFile(u32 handle)
 
 size_t MetaFileSystem::ReadFile(u32 handle, u8 *pointer, s64 size)
 {
-	IFileSystem *sys = GetHandleOwner(handle);
+	IFileSystem *sys;
+	{
+		std::lock_guard<std::recursive_mutex> guard(lock);
+		sys = GetHandleOwner(handle);
+	}
+	// Not under the lock, async transfers shouldn't stall the emulator's own calls.
 	if (sys)
 		return sys->ReadFile(handle,pointer,size);
 	else
@@ -395,7 +525,12 @@ size_t MetaFileSystem::ReadFile(u32 handle, u8 *pointer, s64 size)
 
 size_t MetaFileSystem::WriteFile(u32 handle, const u8 *pointer, s64 size)
 {
-	IFileSystem *sys = GetHandleOwner(handle);
+	IFileSystem *sys;
+	{
+		std::lock_guard<std::recursive_mutex> guard(lock);
+		sys = GetHandleOwner(handle);
+	}
+	// Not under the lock, async transfers shouldn't stall the emulator's own calls.
 	if (sys)
 		return sys->WriteFile(handle,pointer,size);
 	else
@@ -404,6 +539,7 @@ size_t MetaFileSystem::WriteFile(u32 handle, const u8 *pointer, s64 size)
 
 size_t MetaFileSystem::SeekFile(u32 handle, s32 position, FileMove type)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	IFileSystem *sys = GetHandleOwner(handle);
 	if (sys)
 		return sys->SeekFile(handle,position,type);
@@ -411,8 +547,17 @@ size_t MetaFileSystem::SeekFile(u32 handle, s32 position, FileMove type)
 		return 0;
 }
 
+void MetaFileSystem::FlushAll()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+	// Some are mounted more than once, flushing again is cheap.
+	for (size_t i = 0; i < fileSystems.size(); i++)
+		fileSystems[i].system->FlushAll();
+}
+
 void MetaFileSystem::DoState(PointerWrap &p)
 {
+	std::lock_guard<std::recursive_mutex> guard(lock);
 	p.Do(current);
 
 	// Save/load per-thread current directory map
@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include "StdMutex.h"
 #include "FileSystem.h"
 
 class MetaFileSystem : public IHandleAllocator, public IFileSystem
@@ -30,11 +31,28 @@ private:
 	};
 	std::vector<MountPoint> fileSystems;
 
+	// The lowercased mount prefixes, so MapFilePath finds the mount in one pass over the path.
+	struct PrefixTrieNode
+	{
+		std::vector<std::pair<char, int> > children;
+		// Index in fileSystems of the mount whose prefix ends here, -1 for none.
+		int mount;
+	};
+	std::vector<PrefixTrieNode> prefixTrie;
+
+	void RebuildPrefixTrie();
+	// Like trying each prefix in mount order, the first match wins. -1 if none.
+	int FindMount(const std::string &path) const;
+
 	typedef std::map<int, std::string> currentDir_t;
 	currentDir_t currentDir;
 
 	std::string startingDirectory;
 
+	// Async sceIo calls read and write from other threads. Those only hold this to find
+	// the owner, the file systems guard their own handles during the transfer.
+	std::recursive_mutex lock;
+
 public:
 	MetaFileSystem()
 	{
@@ -79,6 +97,7 @@ public:
 	size_t   SeekFile(u32 handle, s32 position, FileMove type);
 	PSPFileInfo GetFileInfo(std::string filename);
 	bool     OwnsHandle(u32 handle) {return false;}
+	void     FlushAll();
 	inline size_t GetSeekPos(u32 handle)
 	{
 		return SeekFile(handle, 0, FILEMOVE_CURRENT);
@@ -43,6 +43,8 @@
 #include "../../GPU/GLES/TextureCache.h"
 #include "../../GPU/GPUState.h"
 #include "../../GPU/GPUInterface.h"
+#include "../../GPU/GETrace.h"
+#include "../../GPU/GPUStatsLog.h"
 // Internal drawing library
 #include "../Util/PPGeDraw.h"
 
@@ -85,6 +87,12 @@ std::vector<VblankCallback> vblankListeners;
 const double vblankMs = 0.7315;
 const double frameMs = 1000.0 / 60.0;
 
+// Auto frameskip. This is host timing, so not part of the state.
+static double nextFrameTime;
+static int consecutiveSkips;
+// Something should still show up now and then when it's hopelessly slow.
+const int maxConsecutiveSkips = 3;
+
 enum {
 	PSP_DISPLAY_SETBUF_IMMEDIATE = 0,
 	PSP_DISPLAY_SETBUF_NEXTFRAME = 1
@@ -110,6 +118,8 @@ void __DisplayInit() {
 	hCount = 0;
 	hCountTotal = 0;
 	lastFrameTime = 0;
+	nextFrameTime = 0.0;
+	consecutiveSkips = 0;
 
 	InitGfxState();
 }
@@ -166,6 +176,38 @@ void __DisplayFireVblank() {
 	}
 }
 
+// Decides whether the coming frame gets drawn, by how far the host has fallen behind
+// real time.
+static void DecideFrameSkip() {
+	time_update();
+	double now = time_now_d();
+	bool skip = false;
+	if (g_Config.bAutoFrameSkip && nextFrameTime != 0.0) {
+		nextFrameTime += frameMs / 1000.0;
+		if (now > nextFrameTime + 0.25) {
+			// Way behind, probably after loading or pausing. Don't try to catch all that up.
+			nextFrameTime = now;
+		} else if (nextFrameTime > now + frameMs / 1000.0) {
+			// Running fast with nothing throttling it. Don't bank time for later.
+			nextFrameTime = now + frameMs / 1000.0;
+		}
+		// Half a frame of slack, so that timer jitter doesn't cause skips.
+		skip = now > nextFrameTime + frameMs / 2000.0 && consecutiveSkips < maxConsecutiveSkips;
+	} else {
+		nextFrameTime = now;
+	}
+
+	// Only the GLES backend honours skipDrawing, don't count skips nothing will do.
+	// Without buffered rendering there's no previous frame to show again, only the undrawn backbuffer.
+	if (PSP_CoreParameter().gpuCore != GPU_GLES || !g_Config.bBufferedRendering)
+		skip = false;
+
+	consecutiveSkips = skip ? consecutiveSkips + 1 : 0;
+	gstate_c.skipDrawing = skip;
+	if (skip)
+		gpuStats.numFramesSkipped++;
+}
+
 void hleEnterVblank(u64 userdata, int cyclesLate) {
 	int vbCount = userdata;
 
@@ -198,28 +240,37 @@ void hleEnterVblank(u64 userdata, int cyclesLate) {
 	// Draw screen overlays before blitting. Saves and restores the Ge context.
 	gpuStats.numFrames++;
 
+	if (GPUStatsLog_IsActive()) {
+		gpu->UpdateStats();
+		GPUStatsLog_RecordFrame();
+	}
+
 	// Now we can subvert the Ge engine in order to draw custom overlays like stat counters etc.
-	if (g_Config.bShowDebugStats && gpuStats.numDrawCalls) {
+	bool showDebugStats = g_Config.bShowDebugStats && gpuStats.numDrawCalls;
+	if (showDebugStats) {
 		gpu->UpdateStats();
 		char stats[2048];
 		sprintf(stats,
-			"Frames: %i\n"
+			"Frames: %i, skipped: %i\n"
 			"DL processing time: %0.2f ms\n"
 			"Kernel processing time: %0.2f ms\n"
 			"Slowest syscall: %s : %0.2f ms\n"
 			"Most active syscall: %s : %0.2f ms\n"
-			"Draw calls: %i, flushes %i\n"
+			"Draw calls: %i, flushes %i, avoided %i\n"
 			"Cached Draw calls: %i\n"
 			"Num Tracked Vertex Arrays: %i\n"
 			"Vertices Transformed: %i\n"
 			"Cached Vertices Drawn: %i\n"
-			"FBOs active: %i\n"
+			"FBOs active: %i, readbacks: %i, avoided: %i\n"
 			"Textures active: %i, decoded: %i\n"
 			"Texture invalidations: %i\n"
+			"Patches tessellated: %i, cached: %i\n"
+			"Shaders compiled: %i\n"
 			"Vertex shaders loaded: %i\n"
 			"Fragment shaders loaded: %i\n"
 			"Combined shaders loaded: %i\n",
 			gpuStats.numFrames,
+			gpuStats.numFramesSkipped,
 			gpuStats.msProcessingDisplayLists * 1000.0f,
 			kernelStats.msInSyscalls * 1000.0f,
 			kernelStats.slowestSyscallName ? kernelStats.slowestSyscallName : "(none)",
@@ -228,14 +279,20 @@ void hleEnterVblank(u64 userdata, int cyclesLate) {
 			kernelStats.summedSlowestSyscallTime * 1000.0f,
 			gpuStats.numDrawCalls,
 			gpuStats.numFlushes,
+			gpuStats.numFlushesAvoided,
 			gpuStats.numCachedDrawCalls,
 			gpuStats.numTrackedVertexArrays,
 			gpuStats.numVertsTransformed,
 			gpuStats.numCachedVertsDrawn,
 			gpuStats.numFBOs,
+			gpuStats.numReadbacks,
+			gpuStats.numReadbacksAvoided,
 			gpuStats.numTextures,
 			gpuStats.numTexturesDecoded,
 			gpuStats.numTextureInvalidations,
+			gpuStats.numPatchesTessellated,
+			gpuStats.numCachedPatches,
+			gpuStats.numShadersCompiled,
 			gpuStats.numVertexShaders,
 			gpuStats.numFragmentShaders,
 			gpuStats.numShaders
@@ -247,7 +304,9 @@ void hleEnterVblank(u64 userdata, int cyclesLate) {
 		PPGeDrawText(stats, -1, -1, 0, zoom, 0xFF000000);
 		PPGeDrawText(stats, 0, 0, 0, zoom, 0xFFFFFFFF);
 		PPGeEnd();
+	}
 
+	if (showDebugStats || GPUStatsLog_IsActive()) {
 		gpuStats.resetFrame();
 		kernelStats.ResetFrame();
 	}
@@ -255,6 +314,8 @@ void hleEnterVblank(u64 userdata, int cyclesLate) {
 	// Yeah, this has to be the right moment to end the frame. Give the graphics backend opportunity
 	// to blit the framebuffer, in order to support half-framerate games that otherwise wouldn't have
 	// anything to draw here.
+	if (GETrace_IsRecording())
+		GETrace_RecordFrame(framebuf.topaddr, framebuf.pspFramebufLinesize, framebuf.pspFramebufFormat);
 	gpu->CopyDisplayToOutput();
 
 	host->EndFrame();
@@ -280,6 +341,8 @@ void hleEnterVblank(u64 userdata, int cyclesLate) {
 
 #endif
 
+	DecideFrameSkip();
+
 	host->BeginFrame();
 	gpu->BeginFrame();
 
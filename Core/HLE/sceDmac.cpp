@@ -17,11 +17,14 @@
 
 #include "Globals.h"
 #include "HLE.h"
+#include "../../GPU/GPUInterface.h"
+#include "../../GPU/GPUState.h"
 
 u32 sceDmacMemcpy(u32 dst, u32 src, u32 size)
 {
 	DEBUG_LOG(HLE, "sceDmacMemcpy(dest=%08x, src=%08x, size=%i)", dst, src, size);
 	// TODO: check the addresses.
+	gpu->ResolveMemory(src, size);
 	Memory::Memcpy(dst, Memory::GetPointer(src), size);
 	return 0;
 }
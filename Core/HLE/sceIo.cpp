@@ -23,6 +23,7 @@
 #include "../Config.h"
 #include "../Host.h"
 #include "../SaveState.h"
+#include "../CoreTiming.h"
 #include "HLE.h"
 #include "../MIPS/MIPS.h"
 #include "../HW/MemoryStick.h"
@@ -31,6 +32,7 @@
 #include "../FileSystems/MetaFileSystem.h"
 #include "../FileSystems/ISOFileSystem.h"
 #include "../FileSystems/DirectoryFileSystem.h"
+#include "../FileSystems/AsyncIOManager.h"
 
 #include "sceIo.h"
 #include "sceRtc.h"
@@ -46,6 +48,9 @@
 
 #define PSP_DEV_TYPE_ALIAS 0x20
 
+// Host threads that run the reads and writes of the async calls.
+const int IO_THREADS = 2;
+
 /*
 
 TODO: async io is missing features!
@@ -84,6 +89,9 @@ typedef u32 (*DeferredAction)(SceUID id, int param);
 DeferredAction defAction = 0;
 u32 defParam = 0;
 
+static AsyncIOManager ioManager;
+static int asyncNotifyEvent = -1;
+
 #define SCE_STM_FDIR 0x1000
 #define SCE_STM_FREG 0x2000
 #define SCE_STM_FLNK 0x4000
@@ -126,8 +134,11 @@ struct dirent {
 
 class FileNode : public KernelObject {
 public:
-	FileNode() : callbackID(0), callbackArg(0), asyncResult(0), closePending(false), pendingAsyncResult(false), sectorBlockMode(false) {}
+	FileNode() : callbackID(0), callbackArg(0), asyncResult(0), closePending(false), pendingAsyncResult(false), sectorBlockMode(false), asyncBusy(false) {}
 	~FileNode() {
+		// The host might still be reading into the file.
+		if (asyncBusy)
+			ioManager.WaitForAll();
 		pspFileSystem.CloseFile(handle);
 	}
 	const char *GetName() {return fullpath.c_str();}
@@ -139,6 +150,8 @@ public:
 	int GetIDType() const { return PPSSPP_KERNEL_TMID_File; }
 
 	virtual void DoState(PointerWrap &p) {
+		int s = p.Section("FileNode", 1, 1);
+
 		p.Do(fullpath);
 		p.Do(handle);
 		p.Do(callbackID);
@@ -148,6 +161,13 @@ public:
 		p.Do(pendingAsyncResult);
 		p.Do(sectorBlockMode);
 		p.Do(openMode);
+		if (s >= 1) {
+			p.Do(asyncBusy);
+			p.Do(waitingThreads);
+		} else {
+			asyncBusy = false;
+			waitingThreads.clear();
+		}
 		p.DoMarker("File");
 	}
 
@@ -165,12 +185,19 @@ public:
 
 	PSPFileInfo info;
 	u32 openMode;
+
+	// An async read or write is running on the host.
+	bool asyncBusy;
+	// Threads in sceIoWaitAsync for it.
+	std::vector<SceUID> waitingThreads;
 };
 
 static void TellFsThreadEnded (SceUID threadID) {
 	pspFileSystem.ThreadEnded(threadID);
 }
 
+static void __IoAsyncNotify(u64 userdata, int cyclesLate);
+
 void __IoInit() {
 	INFO_LOG(HLE, "Starting up I/O...");
 
@@ -206,6 +233,7 @@ void __IoInit() {
 
 	memstick = new DirectoryFileSystem(&pspFileSystem, memstickpath);
 	flash = new DirectoryFileSystem(&pspFileSystem, flashpath);
+	memstick->SetStagedWrites(g_Config.bStagedSaveWrites);
 	pspFileSystem.Mount("ms0:", memstick);
 	pspFileSystem.Mount("fatms0:", memstick);
 	pspFileSystem.Mount("fatms:", memstick);
@@ -213,6 +241,14 @@ void __IoInit() {
 	pspFileSystem.Mount("flash1:", flash);
 	
 	__KernelListenThreadEnd(&TellFsThreadEnded);
+
+	asyncNotifyEvent = CoreTiming::RegisterEvent("IoAsyncNotify", __IoAsyncNotify);
+	ioManager.Start(IO_THREADS, asyncNotifyEvent);
+}
+
+void __IoFinishAsync() {
+	ioManager.WaitForAll();
+	__IoAsyncNotify(0, 0);
 }
 
 void __IoDoState(PointerWrap &p) {
@@ -221,9 +257,21 @@ void __IoDoState(PointerWrap &p) {
 	if (defAction != NULL) {
 		WARN_LOG(HLE, "FIXME: Savestate failure: deferred IO not saved yet.");
 	}
+
+	int s = p.Section("sceIo", 1, 1);
+	if (s >= 1) {
+		p.Do(asyncNotifyEvent);
+		CoreTiming::RestoreRegisterEvent(asyncNotifyEvent, "IoAsyncNotify", __IoAsyncNotify);
+		p.DoMarker("sceIo");
+	} else if (p.mode == p.MODE_READ) {
+		// From before async I/O, the state's event list doesn't have ours yet.
+		asyncNotifyEvent = CoreTiming::RegisterEvent("IoAsyncNotify", __IoAsyncNotify);
+	}
+	ioManager.SetCompletionEvent(asyncNotifyEvent);
 }
 
 void __IoShutdown() {
+	ioManager.Shutdown();
 	defAction = 0;
 	defParam = 0;
 }
@@ -284,12 +332,53 @@ void __IoCompleteAsyncIO(SceUID id) {
 	u32 error;
 	FileNode *f = kernelObjects.Get < FileNode > (id, error);
 	if (f) {
+		f->pendingAsyncResult = true;
 		if (f->callbackID) {
 			__KernelNotifyCallback(THREAD_CALLBACK_IO, f->callbackID, f->callbackArg);
 		}
 	}
 }
 
+static void __IoStartAsync(FileNode *f, const AsyncIOEvent &ev) {
+	f->asyncBusy = true;
+	f->pendingAsyncResult = false;
+	ioManager.Submit(ev);
+}
+
+// Runs on the emulator thread after the host finished some operations.
+static void __IoAsyncNotify(u64 userdata, int cyclesLate) {
+	AsyncIOResult result;
+	while (ioManager.PopResult(result)) {
+		u32 error;
+		FileNode *f = kernelObjects.Get < FileNode > (result.id, error);
+		if (!f) {
+			// Closed while the host was still at it.
+			continue;
+		}
+
+		f->asyncBusy = false;
+		f->asyncResult = (u32) result.result;
+		DEBUG_LOG(HLE, "Async IO on %i done: %i", result.id, f->asyncResult);
+
+		bool collected = false;
+		for (size_t i = 0; i < f->waitingThreads.size(); i++) {
+			SceUID threadID = f->waitingThreads[i];
+			if (__KernelGetWaitID(threadID, WAITTYPE_IO, error) != (SceUID) result.id)
+				continue;
+			u32 address = __KernelGetWaitValue(threadID, error);
+			if (Memory::IsValidAddress(address))
+				Memory::Write_U64((u64) f->asyncResult, address);
+			__KernelResumeThreadFromWait(threadID, 0);
+			collected = true;
+		}
+		f->waitingThreads.clear();
+
+		__IoCompleteAsyncIO(result.id);
+		if (collected)
+			f->pendingAsyncResult = false;
+	}
+}
+
 void __IoCopyDate(ScePspDateTime& date_out, const tm& date_in)
 {
 	date_out.year = date_in.tm_year+1900;
@@ -348,6 +437,10 @@ u32 sceIoRead(int id, u32 data_addr, int size) {
 
 	u32 error;
 	FileNode *f = kernelObjects.Get < FileNode > (id, error);
+	if (f && f->asyncBusy) {
+		WARN_LOG(HLE, "SCE_KERNEL_ERROR_ASYNC_BUSY=sceIoRead(%d)", id);
+		return SCE_KERNEL_ERROR_ASYNC_BUSY;
+	}
 	if (f) {
 		if(!(f->openMode & FILEACCESS_READ))
 		{
@@ -386,6 +479,10 @@ u32 sceIoWrite(int id, void *data_ptr, int size)
 	}
 	u32 error;
 	FileNode *f = kernelObjects.Get < FileNode > (id, error);
+	if (f && f->asyncBusy) {
+		WARN_LOG(HLE, "SCE_KERNEL_ERROR_ASYNC_BUSY=sceIoWrite(%d)", id);
+		return SCE_KERNEL_ERROR_ASYNC_BUSY;
+	}
 	if (f) {
 		if(!(f->openMode & FILEACCESS_WRITE))
 		{
@@ -405,9 +502,28 @@ u32 sceIoWrite(int id, void *data_ptr, int size)
 
 u32 sceIoWriteAsync(int id, void *data_ptr, int size) 
 {
-	DEBUG_LOG(HLE, "sceIoWriteAsync(%d)", id);
-	sceIoWrite(id, data_ptr, size);
-	__IoCompleteAsyncIO(id);
+	if (id == 1 || id == 2) {
+		sceIoWrite(id, data_ptr, size);
+		return 0;
+	}
+
+	u32 error;
+	FileNode *f = kernelObjects.Get < FileNode > (id, error);
+	if (!f) {
+		ERROR_LOG(HLE, "sceIoWriteAsync ERROR: no file open");
+		return error;
+	}
+	if (f->asyncBusy) {
+		WARN_LOG(HLE, "SCE_KERNEL_ERROR_ASYNC_BUSY=sceIoWriteAsync(%d)", id);
+		return SCE_KERNEL_ERROR_ASYNC_BUSY;
+	}
+	if (!(f->openMode & FILEACCESS_WRITE)) {
+		return ERROR_KERNEL_BAD_FILE_DESCRIPTOR;
+	}
+
+	DEBUG_LOG(HLE, "sceIoWriteAsync(%d, %i)", id, size);
+	AsyncIOEvent ev = {IO_EVENT_WRITE, (u32) id, f->handle, (u8 *) data_ptr, size};
+	__IoStartAsync(f, ev);
 	return 0;
 }
 
@@ -446,6 +562,10 @@ u32 sceIoCancel(int id)
 s64 sceIoLseek(int id, s64 offset, int whence) {
 	u32 error;
 	FileNode *f = kernelObjects.Get < FileNode > (id, error);
+	if (f && f->asyncBusy) {
+		WARN_LOG(HLE, "SCE_KERNEL_ERROR_ASYNC_BUSY=sceIoLseek(%d)", id);
+		return SCE_KERNEL_ERROR_ASYNC_BUSY;
+	}
 	if (f) {
 		FileMove seek = FILEMOVE_BEGIN;
 		bool outOfBound = false;
@@ -478,6 +598,10 @@ s64 sceIoLseek(int id, s64 offset, int whence) {
 u32 sceIoLseek32(int id, int offset, int whence) {
 	u32 error;
 	FileNode *f = kernelObjects.Get < FileNode > (id, error);
+	if (f && f->asyncBusy) {
+		WARN_LOG(HLE, "SCE_KERNEL_ERROR_ASYNC_BUSY=sceIoLseek32(%d)", id);
+		return SCE_KERNEL_ERROR_ASYNC_BUSY;
+	}
 	if (f) {
 		DEBUG_LOG(HLE, "sceIoLseek32(%d,%08x,%i)", id, (int) offset, whence);
 
@@ -542,6 +666,12 @@ u32 sceIoOpen(const char* filename, int flags, int mode) {
 
 u32 sceIoClose(int id) {
 	DEBUG_LOG(HLE, "sceIoClose(%d)", id);
+	u32 error;
+	FileNode *f = kernelObjects.Get < FileNode > (id, error);
+	if (f && f->asyncBusy) {
+		WARN_LOG(HLE, "SCE_KERNEL_ERROR_ASYNC_BUSY=sceIoClose(%d)", id);
+		return SCE_KERNEL_ERROR_ASYNC_BUSY;
+	}
 	return kernelObjects.Destroy < FileNode > (id);
 }
 
@@ -572,7 +702,8 @@ u32 sceIoRmdir(const char *dirname) {
 }
 
 u32 sceIoSync(const char *devicename, int flag) {
-	DEBUG_LOG(HLE, "UNIMPL sceIoSync(%s, %i)", devicename, flag);
+	DEBUG_LOG(HLE, "sceIoSync(%s, %i)", devicename, flag);
+	pspFileSystem.FlushAll();
 	return 0;
 }
 
@@ -842,9 +973,18 @@ int sceIoCloseAsync(int id)
 	return 0;
 }
 
+static bool __IoAsyncBusy(int id) {
+	u32 error;
+	FileNode *f = kernelObjects.Get < FileNode > (id, error);
+	return f && f->asyncBusy;
+}
+
+// Seeks don't go to the host threads, they're quick.
 u32 sceIoLseekAsync(int id, s64 offset, int whence)
 {
-	DEBUG_LOG(HLE, "sceIoLseekAsync(%d) sorta implemented", id);
+	DEBUG_LOG(HLE, "sceIoLseekAsync(%d)", id);
+	if (__IoAsyncBusy(id))
+		return SCE_KERNEL_ERROR_ASYNC_BUSY;
 	sceIoLseek(id, offset, whence);
 	__IoCompleteAsyncIO(id);
 	return 0;
@@ -871,7 +1011,9 @@ u32 sceIoSetAsyncCallback(int id, u32 clbckId, u32 clbckArg)
 
 u32 sceIoLseek32Async(int id, int offset, int whence)
 {
-	DEBUG_LOG(HLE, "sceIoLseek32Async(%d) sorta implemented", id);
+	DEBUG_LOG(HLE, "sceIoLseek32Async(%d)", id);
+	if (__IoAsyncBusy(id))
+		return SCE_KERNEL_ERROR_ASYNC_BUSY;
 	sceIoLseek32(id, offset, whence);
 	__IoCompleteAsyncIO(id);
 	return 0;
@@ -888,45 +1030,60 @@ u32 sceIoOpenAsync(const char *filename, int flags, int mode)
 }
 
 u32 sceIoReadAsync(int id, u32 data_addr, int size)
-{
-	DEBUG_LOG(HLE, "sceIoReadAsync(%d)", id);
-	sceIoRead(id, data_addr, size);
-	__IoCompleteAsyncIO(id);
-	return 0;
-}
-
-u32 sceIoGetAsyncStat(int id, u32 poll, u32 address)
 {
 	u32 error;
 	FileNode *f = kernelObjects.Get < FileNode > (id, error);
-	if (f)
-	{
-		Memory::Write_U64(f->asyncResult, address);
-		DEBUG_LOG(HLE, "%i = sceIoGetAsyncStat(%i, %i, %08x) (HACK)", (u32) f->asyncResult, id, poll, address);
-		if (!poll)
-			hleReSchedule("io waited");
-		return 0; //completed
+	if (!f) {
+		ERROR_LOG(HLE, "sceIoReadAsync ERROR: no file open");
+		return error;
 	}
-	else
-	{
-		ERROR_LOG(HLE, "ERROR - sceIoGetAsyncStat with invalid id %i", id);
+	if (f->asyncBusy) {
+		WARN_LOG(HLE, "SCE_KERNEL_ERROR_ASYNC_BUSY=sceIoReadAsync(%d)", id);
+		return SCE_KERNEL_ERROR_ASYNC_BUSY;
+	}
+	if (!(f->openMode & FILEACCESS_READ)) {
+		return ERROR_KERNEL_BAD_FILE_DESCRIPTOR;
+	}
+	if (!Memory::IsValidAddress(data_addr)) {
+		ERROR_LOG(HLE, "sceIoReadAsync Reading into bad pointer %08x", data_addr);
 		return -1;
 	}
+
+	DEBUG_LOG(HLE, "sceIoReadAsync(%d, %08x, %i)", id, data_addr, size);
+	AsyncIOEvent ev = {IO_EVENT_READ, (u32) id, f->handle, Memory::GetPointer(data_addr), size};
+	__IoStartAsync(f, ev);
+	return 0;
+}
+
+// Writes the result of the last async operation to address, unless it's still running.
+static bool __IoCollectAsyncResult(FileNode *f, int id, u32 address) {
+	if (f->asyncBusy)
+		return false;
+
+	f->pendingAsyncResult = false;
+	u64 res = f->asyncResult;
+	if (defAction) {
+		// This may close f.
+		res = defAction(id, defParam);
+		defAction = 0;
+	}
+	Memory::Write_U64(res, address);
+	return true;
 }
 
 int sceIoWaitAsync(int id, u32 address) {
 	u32 error;
 	FileNode *f = kernelObjects.Get < FileNode > (id, error);
 	if (f) {
-		u64 res = f->asyncResult;
-		if (defAction) {
-			res = defAction(id, defParam);
-			defAction = 0;
+		if (__IoCollectAsyncResult(f, id, address)) {
+			DEBUG_LOG(HLE, "0=sceIoWaitAsync(%i, %08x)", id, address);
+			hleReSchedule("io waited");
+		} else {
+			DEBUG_LOG(HLE, "0=sceIoWaitAsync(%i, %08x) - waiting", id, address);
+			f->waitingThreads.push_back(__KernelGetCurThread());
+			__KernelWaitCurThread(WAITTYPE_IO, id, address, 0, false);
 		}
-		Memory::Write_U64(res, address);
-		DEBUG_LOG(HLE, "%i = sceIoWaitAsync(%i, %08x) (HACK)", (u32) res, id, address);
-		hleReSchedule("io waited");
-		return 0; //completed
+		return 0;
 	} else {
 		ERROR_LOG(HLE, "ERROR - sceIoWaitAsync waiting for invalid id %i", id);
 		return -1;
@@ -934,20 +1091,19 @@ int sceIoWaitAsync(int id, u32 address) {
 }
 
 int sceIoWaitAsyncCB(int id, u32 address) {
-	// Should process callbacks here
 	u32 error;
 	FileNode *f = kernelObjects.Get < FileNode > (id, error);
 	if (f) {
-		u64 res = f->asyncResult;
-		if (defAction) {
-			res = defAction(id, defParam);
-			defAction = 0;
-		}
-		Memory::Write_U64(res, address);
-		DEBUG_LOG(HLE, "%i = sceIoWaitAsyncCB(%i, %08x) (HACK)", (u32) res, id,	address);
 		hleCheckCurrentCallbacks();
-		hleReSchedule(true, "io waited");
-		return 0; //completed
+		if (__IoCollectAsyncResult(f, id, address)) {
+			DEBUG_LOG(HLE, "0=sceIoWaitAsyncCB(%i, %08x)", id, address);
+			hleReSchedule(true, "io waited");
+		} else {
+			DEBUG_LOG(HLE, "0=sceIoWaitAsyncCB(%i, %08x) - waiting", id, address);
+			f->waitingThreads.push_back(__KernelGetCurThread());
+			__KernelWaitCurThread(WAITTYPE_IO, id, address, 0, true);
+		}
+		return 0;
 	} else {
 		ERROR_LOG(HLE, "ERROR - sceIoWaitAsyncCB waiting for invalid id %i", id);
 		return -1;
@@ -958,20 +1114,26 @@ u32 sceIoPollAsync(int id, u32 address) {
 	u32 error;
 	FileNode *f = kernelObjects.Get < FileNode > (id, error);
 	if (f) {
-		u64 res = f->asyncResult;
-		if (defAction) {
-			res = defAction(id, defParam);
-			defAction = 0;
+		if (__IoCollectAsyncResult(f, id, address)) {
+			DEBUG_LOG(HLE, "0=sceIoPollAsync(%i, %08x)", id, address);
+			return 0; //completed
 		}
-		Memory::Write_U64(res, address);
-		DEBUG_LOG(HLE, "%i = sceIoPollAsync(%i, %08x) (HACK)", (u32) res, id, address);
-		return 0; //completed
+		DEBUG_LOG(HLE, "1=sceIoPollAsync(%i, %08x) - still busy", id, address);
+		return 1;
 	} else {
 		ERROR_LOG(HLE, "ERROR - sceIoPollAsync waiting for invalid id %i", id);
 		return -1;  // TODO: correct error code
 	}
 }
 
+u32 sceIoGetAsyncStat(int id, u32 poll, u32 address)
+{
+	DEBUG_LOG(HLE, "sceIoGetAsyncStat(%i, %i, %08x)", id, poll, address);
+	if (poll)
+		return sceIoPollAsync(id, address);
+	return sceIoWaitAsync(id, address);
+}
+
 class DirListing : public KernelObject {
 public:
 	const char *GetName() {return name.c_str();}
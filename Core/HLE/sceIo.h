@@ -26,6 +26,9 @@
 void __IoInit();
 void __IoDoState(PointerWrap &p);
 void __IoShutdown();
+// Waits for the host side of async reads and writes, and hands out the results. State
+// can only be saved or loaded with none running.
+void __IoFinishAsync();
 u32 __IoGetFileHandleFromId(u32 id, u32 &outError);
 KernelObject *__KernelFileNodeObject();
 KernelObject *__KernelDirListingObject();
@@ -149,6 +149,7 @@ void __KernelShutdown()
 
 void __KernelDoState(PointerWrap &p)
 {
+	__IoFinishAsync();
 	p.Do(kernelRunning);
 	kernelObjects.DoState(p);
 	p.DoMarker("KernelObjects");
@@ -265,8 +266,11 @@ int sceKernelDcacheInvalidateRange(u32 addr, int size)
 		if ((addr % 64) != 0 || (size % 64) != 0)
 			return SCE_KERNEL_ERROR_CACHE_ALIGNMENT;
 
-		if (addr != 0)
+		if (addr != 0) {
+			// Usually done before reading what the GPU or some other device wrote.
+			gpu->ResolveMemory(addr, size);
 			gpu->InvalidateCache(addr, size);
+		}
 	}
 	return 0;
 }
@@ -18,6 +18,8 @@
 #include <fstream>
 #include <algorithm>
 
+#include "base/timeutil.h"
+
 #include "HLE.h"
 #include "Common/FileUtil.h"
 #include "../Host.h"
@@ -241,68 +243,41 @@ void __KernelModuleDoState(PointerWrap &p)
 	p.DoMarker("sceKernelModule");
 }
 
-Module *__KernelLoadELFFromPtr(const u8 *ptr, u32 loadAddress, std::string *error_string)
+// Reads a module straight out of an open file, offsets are from the start of the module.
+class ModuleFileSource : public ElfSource
 {
-	Module *module = new Module;
-	kernelObjects.Create(module);
-	memset(&module->nm, 0, sizeof(module->nm));
+public:
+	ModuleFileSource(u32 handle, u32 offset, u32 size) : handle_(handle), offset_(offset), size_(size) {}
 
-	u8 *newptr = 0;
-	if (*(u32*)ptr == 0x4543537e) { // "~SCE"
-		INFO_LOG(HLE, "~SCE module, skipping header");
-		ptr += *(u32*)(ptr + 4);
+	bool ReadAt(u32 pos, void *dest, u32 size)
+	{
+		if (pos > size_ || size > size_ - pos)
+			return false;
+		pspFileSystem.SeekFile(handle_, (s32)(offset_ + pos), FILEMOVE_BEGIN);
+		return pspFileSystem.ReadFile(handle_, (u8 *)dest, size) == size;
 	}
 
-	if (*(u32*)ptr == 0x5053507e) { // "~PSP"
-		// Decrypt module! YAY!
-		INFO_LOG(HLE, "Decrypting ~PSP file");
-		PSP_Header *head = (PSP_Header*)ptr;
-		const u8 *in = ptr;
-		u32 size = head->elf_size;
-		if (head->psp_size > size)
-		{
-			size = head->psp_size;
-		}
-		newptr = new u8[head->elf_size + head->psp_size];
-		ptr = newptr;
-		int ret = pspDecryptPRX(in, (u8*)ptr, head->psp_size);
-		if (ret == MISSING_KEY)
-		{
-			*error_string = "Missing key";
-			delete [] newptr;
-			module->isFake = true;
-			strncpy(module->nm.name, head->modname, 28);
-			module->nm.entry_addr = -1;
-			module->nm.gp_value = -1;
-			return module;
-		}
-		else if (ret <= 0)
-		{
-			ERROR_LOG(HLE, "Failed decrypting PRX! That's not normal!\n");
-		}
-	}
+private:
+	u32 handle_;
+	u32 offset_;
+	u32 size_;
+};
 
-	if (*(u32*)ptr != 0x464c457f)
-	{
-		ERROR_LOG(HLE, "Wrong magic number %08x",*(u32*)ptr);
-		*error_string = "File corrupt";
-		if (newptr)
-		{
-			delete [] newptr;
-		}
-		kernelObjects.Destroy<Module>(module->GetUID());
-		return 0;
-	}
-	// Open ELF reader
-	ElfReader reader((void*)ptr);
+static Module *__KernelCreateModule()
+{
+	Module *module = new Module;
+	kernelObjects.Create(module);
+	memset(&module->nm, 0, sizeof(module->nm));
+	return module;
+}
 
+// The part after the ELF is readable, wherever it's read from. readTime and
+// decryptTime are only for the log.
+static Module *__KernelLoadELF(Module *module, ElfReader &reader, u32 loadAddress, double readTime, double decryptTime, std::string *error_string)
+{
 	if (!reader.LoadInto(loadAddress))
 	{
 		ERROR_LOG(HLE, "LoadInto failed");
-		if (newptr)
-		{
-			delete [] newptr;
-		}
 		kernelObjects.Destroy<Module>(module->GetUID());
 		return 0;
 	}
@@ -349,10 +324,6 @@ Module *__KernelLoadELFFromPtr(const u8 *ptr, u32 loadAddress, std::string *erro
 	for (u32 i = 0; i < ARRAY_SIZE(blacklistedModules); i++) {
 		if (strcmp(modinfo->name, blacklistedModules[i]) == 0) {
 			*error_string = "Blacklisted";
-			if (newptr)
-			{
-				delete [] newptr;
-			}
 			module->isFake = true;
 			module->nm.entry_addr = -1;
 			return module;
@@ -361,6 +332,7 @@ Module *__KernelLoadELFFromPtr(const u8 *ptr, u32 loadAddress, std::string *erro
 
 	bool hasSymbols = false;
 	bool dontadd = false;
+	double start = time_now_d();
 
 	SectionID textSection = reader.GetSectionByName(".text");
 
@@ -384,6 +356,9 @@ Module *__KernelLoadELFFromPtr(const u8 *ptr, u32 loadAddress, std::string *erro
 		}
 	}
 
+	double symbolTime = time_now_d() - start;
+	start = time_now_d();
+
 	INFO_LOG(LOADER,"Module %s: %08x %08x %08x", modinfo->name, modinfo->gp, modinfo->libent,modinfo->libstub);
 
 	struct PspLibStubEntry
@@ -555,10 +530,110 @@ Module *__KernelLoadELFFromPtr(const u8 *ptr, u32 loadAddress, std::string *erro
 
 	module->nm.entry_addr = reader.GetEntryPoint();
 
-	if (newptr)
+	double linkTime = time_now_d() - start;
+	INFO_LOG(LOADER, "Module %s load times: read %0.2fms, decrypt %0.2fms, segments %0.2fms, relocate %0.2fms, symbols %0.2fms, imports/exports %0.2fms",
+		module->nm.name, readTime * 1000.0, decryptTime * 1000.0, reader.GetSegmentTime() * 1000.0, reader.GetRelocateTime() * 1000.0, symbolTime * 1000.0, linkTime * 1000.0);
+	return module;
+}
+
+// Decrypts in place, so ptr must be writable. size is what's readable at ptr.
+Module *__KernelLoadELFFromPtr(u8 *ptr, u32 size, u32 loadAddress, std::string *error_string, double readTime = 0.0)
+{
+	if (size >= 8 && *(u32*)ptr == 0x4543537e) { // "~SCE"
+		INFO_LOG(HLE, "~SCE module, skipping header");
+		u32 skip = std::min(*(u32*)(ptr + 4), size);
+		ptr += skip;
+		size -= skip;
+	}
+
+	if (size < sizeof(PSP_Header) && size < sizeof(Elf32_Ehdr))
+	{
+		ERROR_LOG(HLE, "Module too small: %d bytes", size);
+		*error_string = "File corrupt";
+		return 0;
+	}
+
+	Module *module = __KernelCreateModule();
+
+	double decryptTime = 0.0;
+	if (*(u32*)ptr == 0x5053507e && size >= sizeof(PSP_Header)) { // "~PSP"
+		// Decrypt module! YAY!
+		INFO_LOG(HLE, "Decrypting ~PSP file");
+		PSP_Header *head = (PSP_Header*)ptr;
+		if (head->psp_size > size)
+		{
+			ERROR_LOG(HLE, "~PSP file claims %d bytes, only %d there", head->psp_size, size);
+			*error_string = "File corrupt";
+			kernelObjects.Destroy<Module>(module->GetUID());
+			return 0;
+		}
+		// The header gets decrypted over.
+		strncpy(module->nm.name, head->modname, 28);
+		double start = time_now_d();
+		// The decrypted ELF is smaller than the module, so it can go right where it was.
+		int ret = pspDecryptPRX(ptr, ptr, head->psp_size);
+		decryptTime = time_now_d() - start;
+		if (ret == MISSING_KEY)
+		{
+			*error_string = "Missing key";
+			module->isFake = true;
+			module->nm.entry_addr = -1;
+			module->nm.gp_value = -1;
+			return module;
+		}
+		else if (ret <= 0)
+		{
+			ERROR_LOG(HLE, "Failed decrypting PRX! That's not normal!\n");
+		}
+	}
+
+	if (*(u32*)ptr != 0x464c457f)
 	{
-		delete [] newptr;
+		ERROR_LOG(HLE, "Wrong magic number %08x",*(u32*)ptr);
+		*error_string = "File corrupt";
+		kernelObjects.Destroy<Module>(module->GetUID());
+		return 0;
 	}
+	// Open ELF reader
+	ElfReader reader((void*)ptr);
+	return __KernelLoadELF(module, reader, loadAddress, readTime, decryptTime, error_string);
+}
+
+// Plain ELFs are streamed from the file into PSP memory. Encrypted ones have to be
+// read whole to be decrypted.
+Module *__KernelLoadELFFromFile(u32 handle, u32 offset, u32 size, u32 loadAddress, std::string *error_string)
+{
+	double start = time_now_d();
+	u32 magic[2] = {0, 0};
+	pspFileSystem.SeekFile(handle, (s32)offset, FILEMOVE_BEGIN);
+	pspFileSystem.ReadFile(handle, (u8 *)magic, sizeof(magic));
+	if (magic[0] == 0x4543537e && magic[1] < size) { // "~SCE"
+		INFO_LOG(HLE, "~SCE module, skipping header");
+		offset += magic[1];
+		size -= magic[1];
+		pspFileSystem.SeekFile(handle, (s32)offset, FILEMOVE_BEGIN);
+		pspFileSystem.ReadFile(handle, (u8 *)magic, sizeof(magic));
+	}
+
+	if (magic[0] == 0x464c457f)
+	{
+		Module *module = __KernelCreateModule();
+		ModuleFileSource source(handle, offset, size);
+		ElfReader reader(&source);
+		if (!reader.IsValid())
+		{
+			*error_string = "File corrupt";
+			kernelObjects.Destroy<Module>(module->GetUID());
+			return 0;
+		}
+		return __KernelLoadELF(module, reader, loadAddress, time_now_d() - start, 0.0, error_string);
+	}
+
+	u8 *temp = new u8[size];
+	pspFileSystem.SeekFile(handle, (s32)offset, FILEMOVE_BEGIN);
+	size_t bytesRead = pspFileSystem.ReadFile(handle, temp, size);
+	Module *module = __KernelLoadELFFromPtr(temp, (u32)bytesRead, loadAddress, error_string, time_now_d() - start);
+	delete [] temp;
 	return module;
 }
 
@@ -600,7 +675,7 @@ bool __KernelLoadPBP(const char *filename, std::string *error_string)
 	{
 		u8 *elftemp = new u8[1024*1024*8];
 		in.read((char*)elftemp, 1024*1024*8);
-		Module *module = __KernelLoadELFFromPtr(elftemp, PSP_GetDefaultLoadAddress(), error_string);
+		Module *module = __KernelLoadELFFromPtr(elftemp, (u32)in.gcount(), PSP_GetDefaultLoadAddress(), error_string);
 		if (!module)
 			return false;
 		mipsr4k.pc = module->nm.entry_addr;
@@ -610,31 +685,30 @@ bool __KernelLoadPBP(const char *filename, std::string *error_string)
 	return true;
 }
 
-Module *__KernelLoadModule(u8 *fileptr, SceKernelLMOption *options, std::string *error_string)
+Module *__KernelLoadModule(u32 handle, u32 size, SceKernelLMOption *options, std::string *error_string)
 {
-	Module *module = 0;
+	u8 header[0x28] = {0};
+	pspFileSystem.SeekFile(handle, 0, FILEMOVE_BEGIN);
+	pspFileSystem.ReadFile(handle, header, sizeof(header));
+
 	// Check for PBP
-	if (memcmp(fileptr, "\0PBP", 4) == 0)
+	if (memcmp(header, "\0PBP", 4) == 0)
 	{
-		// PBP!
-		u32 version;
-		memcpy(&version, fileptr + 4, 4);
-		u32 offset0, offsets[16];
-		int numfiles;
-
-		memcpy(&offset0, fileptr + 8, 4);
-		numfiles = (offset0 - 8)/4;
-		offsets[0] = offset0;
-		for (int i = 1; i < numfiles; i++)
-			memcpy(&offsets[i], fileptr + 12 + 4*i, 4);
-		module = __KernelLoadELFFromPtr(fileptr + offsets[5], PSP_GetDefaultLoadAddress(), error_string);
+		// PBP! The offsets start at 8, DATA.PSP is the 7th file.
+		u32 offset;
+		memcpy(&offset, header + 8 + 6 * 4, 4);
+		if (offset >= size)
+		{
+			ERROR_LOG(LOADER, "PBP executable offset %08x past the end", offset);
+			*error_string = "File corrupt";
+			return 0;
+		}
+		return __KernelLoadELFFromFile(handle, offset, size - offset, PSP_GetDefaultLoadAddress(), error_string);
 	}
 	else
 	{
-		module = __KernelLoadELFFromPtr(fileptr, PSP_GetDefaultLoadAddress(), error_string);
+		return __KernelLoadELFFromFile(handle, 0, size, PSP_GetDefaultLoadAddress(), error_string);
 	}
-
-	return module;
 }
 
 void __KernelStartModule(Module *m, int args, const char *argp, SceKernelSMOption *options)
@@ -677,12 +751,14 @@ bool __KernelLoadExec(const char *filename, SceKernelLoadExecParam *param, std::
 	PSPFileInfo info = pspFileSystem.GetFileInfo(filename);
 
 	u32 handle = pspFileSystem.OpenFile(filename, FILEACCESS_READ);
+	if (handle == 0) {
+		ERROR_LOG(LOADER, "Failed to open module %s", filename);
+		*error_string = "File not found";
+		return false;
+	}
 
-	u8 *temp = new u8[(int)info.size + 0x1000000];
-
-	pspFileSystem.ReadFile(handle, temp, (size_t)info.size);
-
-	Module *module = __KernelLoadModule(temp, 0, error_string);
+	Module *module = __KernelLoadModule(handle, (u32)info.size, 0, error_string);
+	pspFileSystem.CloseFile(handle);
 
 	if (!module) {
 		ERROR_LOG(LOADER, "Failed to load module %s", filename);
@@ -693,10 +769,6 @@ bool __KernelLoadExec(const char *filename, SceKernelLoadExecParam *param, std::
 
 	INFO_LOG(LOADER, "Module entry: %08x", mipsr4k.pc);
 
-	delete [] temp;
-
-	pspFileSystem.CloseFile(handle);
-
 	SceKernelSMOption option;
 	option.size = sizeof(SceKernelSMOption);
 	option.attribute = PSP_THREAD_ATTR_USER;
@@ -779,11 +851,8 @@ u32 sceKernelLoadModule(const char *name, u32 flags)
 	}
 
 	Module *module = 0;
-	u8 *temp = new u8[(int)size];
 	u32 handle = pspFileSystem.OpenFile(name, FILEACCESS_READ);
-	pspFileSystem.ReadFile(handle, temp, (size_t)size);
-	module = __KernelLoadELFFromPtr(temp, 0, &error_string);
-	delete [] temp;
+	module = __KernelLoadELFFromFile(handle, 0, (u32)size, 0, &error_string);
 	pspFileSystem.CloseFile(handle);
 
 	if (!module) {
@@ -916,10 +985,7 @@ u32 sceKernelLoadModuleByID(u32 id, u32 flags, u32 lmoptionPtr)
 	std::string error_string;
 	pspFileSystem.SeekFile(handle, pos, FILEMOVE_BEGIN);
 	Module *module = 0;
-	u8 *temp = new u8[size];
-	pspFileSystem.ReadFile(handle, temp, size);
-	module = __KernelLoadELFFromPtr(temp, 0, &error_string);
-	delete [] temp;
+	module = __KernelLoadELFFromFile(handle, pos, (u32)(size - pos), 0, &error_string);
 
 	if (!module) {
 		// Module was blacklisted or couldn't be decrypted, which means it's a kernel module we don't want to run.
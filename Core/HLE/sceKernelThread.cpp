@@ -72,6 +72,7 @@ const char *waitTypeStrings[] = {
 	"Mutex",
 	"LwMutex",
 	"Ctrl",
+	"Io",
 };
 
 struct NativeCallback
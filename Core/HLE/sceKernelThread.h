@@ -82,6 +82,7 @@ enum WaitType //probably not the real values
 	WAITTYPE_MUTEX = 13,
 	WAITTYPE_LWMUTEX = 14,
 	WAITTYPE_CTRL = 15,
+	WAITTYPE_IO = 16,
 	// Remember to update sceKernelThread.cpp's waitTypeStrings to match.
 };
 
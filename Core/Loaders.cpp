@@ -76,6 +76,10 @@ EmuFileType Identify_File(const char *filename)
 		{
 			return FILETYPE_PSP_ISO;
 		}
+		else if (!strcasecmp(extension,".sso"))
+		{
+			return FILETYPE_PSP_ISO;
+		}
 		else if (!strcasecmp(extension,".bin"))
 		{
 			return FILETYPE_UNKNOWN_BIN;
@@ -29,6 +29,7 @@
 #include "StringUtil.h"
 
 #include "Host.h"
+#include "Config.h"
 
 #include "System.h"
 #include "PSPLoaders.h"
@@ -39,23 +40,50 @@
 #include "HLE/sceKernelMemory.h"
 #include "ELF/ParamSFO.h"
 
-BlockDevice *constructBlockDevice(const char *filename)
+static BlockDevice *constructRawBlockDevice(const char *filename)
 {
-	// Check for CISO
+	// Check for CISO and SSO
 	FILE *f = fopen(filename, "rb");
+	if (!f)
+	{
+		ERROR_LOG(LOADER, "Could not open %s", filename);
+		return NULL;
+	}
 	char buffer[4];
 	auto size = fread(buffer, 1, 4, f); //size_t
 	fclose(f);
 	if (!memcmp(buffer, "CISO", 4) && size == 4)
-		return new CISOFileBlockDevice(filename);
-	else
-		return new FileBlockDevice(filename);
+		return new CISOFileBlockDevice(filename, g_Config.iCSOCacheBlocks);
+	if (!memcmp(buffer, "SSO", 4) && size == 4)
+		return new SSOFileBlockDevice(filename, g_Config.iCSOCacheBlocks * 2048);
+
+	MmapBlockDevice *mapped = new MmapBlockDevice(filename);
+	if (mapped->IsValid())
+		return mapped;
+	delete mapped;
+	return new FileBlockDevice(filename);
+}
+
+BlockDevice *constructBlockDevice(const char *filename)
+{
+	BlockDevice *device = constructRawBlockDevice(filename);
+	if (!device)
+		return NULL;
+	if (g_Config.iReadAheadBlocks > 0)
+		return new ReadAheadBlockDevice(device, g_Config.iReadAheadBlocks);
+	return device;
 }
 
 
 bool Load_PSP_ISO(const char *filename, std::string *error_string)
 {
-	ISOFileSystem *umd2 = new ISOFileSystem(&pspFileSystem, constructBlockDevice(filename));
+	BlockDevice *device = constructBlockDevice(filename);
+	if (!device)
+	{
+		*error_string = std::string("Could not open ") + filename;
+		return false;
+	}
+	ISOFileSystem *umd2 = new ISOFileSystem(&pspFileSystem, device);
 
 	// Parse PARAM.SFO
 
@@ -113,9 +141,12 @@ bool Load_PSP_ISO(const char *filename, std::string *error_string)
 bool Load_PSP_ELF_PBP(const char *filename, std::string *error_string)
 {
 	// This is really just for headless, might need tweaking later.
+	BlockDevice *device = NULL;
 	if (!PSP_CoreParameter().mountIso.empty())
+		device = constructBlockDevice(PSP_CoreParameter().mountIso.c_str());
+	if (device)
 	{
-		ISOFileSystem *umd2 = new ISOFileSystem(&pspFileSystem, constructBlockDevice(PSP_CoreParameter().mountIso.c_str()));
+		ISOFileSystem *umd2 = new ISOFileSystem(&pspFileSystem, device);
 
 		pspFileSystem.Mount("umd1:", umd2);
 		pspFileSystem.Mount("disc0:", umd2);
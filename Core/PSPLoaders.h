@@ -21,5 +21,9 @@
 
 #include "MemMap.h"
 
+class BlockDevice;
+
+// Picks the right BlockDevice for a plain, CSO or SSO image.
+BlockDevice *constructBlockDevice(const char *filename);
 bool Load_PSP_ISO(const char *filename, std::string *error_string);
 bool Load_PSP_ELF_PBP(const char *filename, std::string *error_string);
@@ -0,0 +1,108 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <algorithm>
+#include <cstring>
+
+#include "../Core/MemMap.h"
+#include "GPUState.h"
+#include "BlockTransfer.h"
+
+bool TransferRect::Overlaps(u32 rangeStart, u32 rangeEnd) const {
+	if (bottom <= top || rangeEnd <= Start() || rangeStart >= End())
+		return false;
+	// If the rows touch, it's all one range.
+	if (RowBytes() >= stride)
+		return true;
+	// The first row that ends after rangeStart, then check that it starts before rangeEnd.
+	u32 start = Start();
+	int row = 0;
+	if (rangeStart >= start + RowBytes())
+		row = (rangeStart - start - RowBytes()) / stride + 1;
+	return row < Rows() && start + row * stride < rangeEnd;
+}
+
+void BlockTransfer::ReadGState() {
+	srcBasePtr = (gstate.transfersrc & 0xFFFFFF) | ((gstate.transfersrcw & 0xFF0000) << 8);
+	srcStride = gstate.transfersrcw & 0x3FF;
+
+	dstBasePtr = (gstate.transferdst & 0xFFFFFF) | ((gstate.transferdstw & 0xFF0000) << 8);
+	dstStride = gstate.transferdstw & 0x3FF;
+
+	srcX = gstate.transfersrcpos & 0x3FF;
+	srcY = (gstate.transfersrcpos >> 10) & 0x3FF;
+
+	dstX = gstate.transferdstpos & 0x3FF;
+	dstY = (gstate.transferdstpos >> 10) & 0x3FF;
+
+	width = (gstate.transfersize & 0x3FF) + 1;
+	height = ((gstate.transfersize >> 10) & 0x3FF) + 1;
+
+	bpp = (gstate.transferstart & 1) ? 4 : 2;
+}
+
+TransferRect BlockTransfer::SrcRect() const {
+	TransferRect rect = {srcBasePtr, srcStride * bpp, srcX * bpp, (srcX + width) * bpp, srcY, srcY + height};
+	return rect;
+}
+
+TransferRect BlockTransfer::DstRect() const {
+	TransferRect rect = {dstBasePtr, dstStride * bpp, dstX * bpp, (dstX + width) * bpp, dstY, dstY + height};
+	return rect;
+}
+
+bool BlockTransfer::Execute() const {
+	const TransferRect src = SrcRect();
+	const TransferRect dst = DstRect();
+	if (!Memory::IsValidAddress(src.Start()) || !Memory::IsValidAddress(src.End() - 1) ||
+		  !Memory::IsValidAddress(dst.Start()) || !Memory::IsValidAddress(dst.End() - 1)) {
+		ERROR_LOG(G3D, "Bad block transfer: %08x to %08x, %i x %i", src.Start(), dst.Start(), width, height);
+		return false;
+	}
+
+	const u8 *srcp = Memory::GetPointer(src.Start());
+	u8 *dstp = Memory::GetPointer(dst.Start());
+	const u32 rowBytes = width * bpp;
+	if (rowBytes == src.stride && rowBytes == dst.stride) {
+		// Both sides are contiguous.
+		memmove(dstp, srcp, rowBytes * height);
+	} else if (dstp > srcp && dstp < srcp + (src.End() - src.Start())) {
+		// Copying down into the source, go bottom up so rows aren't overwritten before they're read.
+		for (int y = height - 1; y >= 0; y--) {
+			memmove(dstp + y * dst.stride, srcp + y * src.stride, rowBytes);
+		}
+	} else {
+		for (int y = 0; y < height; y++) {
+			memmove(dstp + y * dst.stride, srcp + y * src.stride, rowBytes);
+		}
+	}
+	return true;
+}
+
+void TransferTracker::Add(const TransferRect &rect) {
+	for (size_t i = 0; i < rects_.size(); i++) {
+		TransferRect &r = rects_[i];
+		if (r.base == rect.base && r.stride == rect.stride) {
+			r.left = std::min(r.left, rect.left);
+			r.right = std::max(r.right, rect.right);
+			r.top = std::min(r.top, rect.top);
+			r.bottom = std::max(r.bottom, rect.bottom);
+			return;
+		}
+	}
+	rects_.push_back(rect);
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include <vector>
+
+#include "../Globals.h"
+
+// A rectangle in a buffer of rows stride bytes apart. left and right are byte offsets
+// within a row, top and bottom are rows, right and bottom exclusive.
+struct TransferRect {
+	u32 base;
+	u32 stride;
+	u32 left;
+	u32 right;
+	int top;
+	int bottom;
+
+	u32 RowBytes() const { return right - left; }
+	int Rows() const { return bottom - top; }
+	u32 Start() const { return base + top * stride + left; }
+	u32 End() const { return base + (bottom - 1) * stride + right; }
+	// True if any row has a byte in [rangeStart, rangeEnd).
+	bool Overlaps(u32 rangeStart, u32 rangeEnd) const;
+};
+
+// A GE block transfer (TRXKICK), as set up in the transfer registers.
+struct BlockTransfer {
+	u32 srcBasePtr;
+	u32 srcStride;
+	int srcX;
+	int srcY;
+
+	u32 dstBasePtr;
+	u32 dstStride;
+	int dstX;
+	int dstY;
+
+	int width;
+	int height;
+	int bpp;
+
+	void ReadGState();
+
+	// Copies the pixels. Whole-row transfers are a single memmove, others go row by row,
+	// in whichever direction keeps an overlapping source intact. Returns false, without
+	// copying anything, if either side is outside valid memory.
+	bool Execute() const;
+
+	TransferRect SrcRect() const;
+	TransferRect DstRect() const;
+};
+
+// Collects what recent transfers have written, so that caches can be told about it once
+// instead of after every transfer. Transfers into the same buffer (same base and stride)
+// are merged into their bounding rectangle.
+class TransferTracker {
+public:
+	void Add(const TransferRect &rect);
+	bool Empty() const { return rects_.empty(); }
+	const std::vector<TransferRect> &Rects() const { return rects_; }
+	void Clear() { rects_.clear(); }
+
+private:
+	std::vector<TransferRect> rects_;
+};
@@ -0,0 +1,317 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <map>
+#include <vector>
+
+#include "base/timeutil.h"
+#include "../Common/FileUtil.h"
+#include "../Core/MemMap.h"
+#include "../native/ext/cityhash/city.h"
+#include "ge_constants.h"
+#include "GPUInterface.h"
+#include "GPUState.h"
+#include "BlockTransfer.h"
+#include "GETrace.h"
+#include "GLES/VertexDecoder.h"
+
+static const u32 TRACE_MAGIC = 0x54474750;  // "PPGT"
+static const u32 TRACE_VERSION = 1;
+
+struct TraceHeader {
+	u32 magic;
+	u32 version;
+	u32 stateSize;
+	u32 stateCacheSize;
+};
+
+enum TraceRecordType {
+	TRACE_OP = 0,
+	TRACE_MEMORY = 1,  // addr, size, then size bytes
+	TRACE_FRAME = 2,  // framebuf, stride, format
+};
+
+static const u8 textureBitsPerPixel[16] = {
+	16, 16, 16, 32, 4, 8, 16, 32, 4, 8, 8, 0, 0, 0, 0, 0,
+};
+
+namespace {
+
+class TraceRecorder {
+public:
+	TraceRecorder() : lastVType_(0xFFFFFFFF) {}
+
+	bool Begin(const std::string &filename);
+	void End();
+	void RecordOp(u32 op);
+	void RecordFrame(u32 framebuf, u32 stride, int format);
+
+private:
+	void Write(u32 value) { file_.WriteArray(&value, 1); }
+	void RecordMemory(u32 addr, u32 size);
+	void RecordVertices(int count);
+	void RecordTexture();
+	void RecordClut(u32 blocks);
+
+	File::IOFile file_;
+
+	// What was last written at each address, to avoid writing it again.
+	struct MemoryState {
+		u32 size;
+		u32 hash;
+	};
+	std::map<u32, MemoryState> written_;
+
+	VertexDecoder dec_;
+	u32 lastVType_;
+};
+
+}
+
+static TraceRecorder *recorder = NULL;
+
+bool TraceRecorder::Begin(const std::string &filename) {
+	if (!file_.Open(filename, "wb"))
+		return false;
+
+	TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof(gstate), sizeof(gstate_c)};
+	file_.WriteArray(&header, 1);
+	file_.WriteArray(&gstate, 1);
+	file_.WriteArray(&gstate_c, 1);
+
+	// A CLUT may have been loaded before we started.
+	RecordClut(gstate.loadclut & 0x3F);
+	return file_.IsGood();
+}
+
+void TraceRecorder::End() {
+	file_.Close();
+}
+
+void TraceRecorder::RecordMemory(u32 addr, u32 size) {
+	if (size == 0 || !Memory::IsValidAddress(addr) || !Memory::IsValidAddress(addr + size - 1))
+		return;
+	const u8 *data = Memory::GetPointer(addr);
+	u32 hash = CityHash32((const char *)data, size);
+	std::map<u32, MemoryState>::iterator iter = written_.find(addr);
+	if (iter != written_.end() && iter->second.size == size && iter->second.hash == hash)
+		return;
+	MemoryState &state = written_[addr];
+	state.size = size;
+	state.hash = hash;
+
+	Write(TRACE_MEMORY);
+	Write(addr);
+	Write(size);
+	file_.WriteBytes(data, size);
+}
+
+void TraceRecorder::RecordVertices(int count) {
+	u32 vertType = gstate.vertType;
+	if (vertType != lastVType_) {
+		dec_.SetVertexType(vertType);
+		lastVType_ = vertType;
+	}
+
+	int numVerts = count;
+	if ((vertType & GE_VTYPE_IDX_MASK) != GE_VTYPE_IDX_NONE) {
+		int indexSize = (vertType & GE_VTYPE_IDX_MASK) == GE_VTYPE_IDX_16BIT ? 2 : 1;
+		if (!Memory::IsValidAddress(gstate_c.indexAddr))
+			return;
+		RecordMemory(gstate_c.indexAddr, count * indexSize);
+		u16 lower, upper;
+		GetIndexBounds(Memory::GetPointer(gstate_c.indexAddr), count, vertType, &lower, &upper);
+		numVerts = upper + 1;
+	}
+	// Morphing repeats each vertex for each weight, which is included in the size.
+	RecordMemory(gstate_c.vertexAddr, numVerts * dec_.VertexSize());
+}
+
+void TraceRecorder::RecordTexture() {
+	if (!(gstate.textureMapEnable & 1) || (gstate.clearmode & 1))
+		return;
+	int format = gstate.texformat & 0xF;
+	int maxLevel = (gstate.texmode >> 16) & 7;
+	for (int level = 0; level <= maxLevel; level++) {
+		u32 addr = (gstate.texaddr[level] & 0xFFFFF0) | ((gstate.texbufwidth[level] << 8) & 0x0F000000);
+		u32 bufw = gstate.texbufwidth[level] & 0x3FF;
+		u32 h = 1 << ((gstate.texsize[level] >> 8) & 0xF);
+		RecordMemory(addr, textureBitsPerPixel[format] * bufw * h / 8);
+	}
+}
+
+void TraceRecorder::RecordClut(u32 blocks) {
+	u32 addr = (gstate.clutaddr & 0xFFFFFF) | ((gstate.clutaddrupper << 8) & 0x0F000000);
+	RecordMemory(addr, blocks * 32);
+}
+
+void TraceRecorder::RecordOp(u32 op) {
+	u32 cmd = op >> 24;
+	switch (cmd) {
+	case GE_CMD_PRIM:
+		RecordVertices(op & 0xFFFF);
+		RecordTexture();
+		break;
+
+	case GE_CMD_BEZIER:
+	case GE_CMD_SPLINE:
+		RecordVertices((op & 0xFF) * ((op >> 8) & 0xFF));
+		RecordTexture();
+		break;
+
+	case GE_CMD_LOADCLUT:
+		RecordClut(op & 0x3F);
+		break;
+
+	case GE_CMD_TRANSFERSTART:
+		{
+			BlockTransfer transfer;
+			transfer.ReadGState();
+			transfer.bpp = (op & 1) ? 4 : 2;
+			TransferRect src = transfer.SrcRect();
+			RecordMemory(src.Start(), src.End() - src.Start());
+		}
+		break;
+	}
+
+	Write(TRACE_OP);
+	Write(op);
+}
+
+void TraceRecorder::RecordFrame(u32 framebuf, u32 stride, int format) {
+	Write(TRACE_FRAME);
+	Write(framebuf);
+	Write(stride);
+	Write(format);
+}
+
+bool GETrace_BeginRecording(const std::string &filename) {
+	GETrace_EndRecording();
+	recorder = new TraceRecorder();
+	if (!recorder->Begin(filename)) {
+		ERROR_LOG(G3D, "Could not start a GE trace in %s", filename.c_str());
+		GETrace_EndRecording();
+		return false;
+	}
+	NOTICE_LOG(G3D, "Recording GE trace to %s", filename.c_str());
+	return true;
+}
+
+void GETrace_EndRecording() {
+	if (recorder != NULL) {
+		recorder->End();
+		delete recorder;
+		recorder = NULL;
+	}
+}
+
+bool GETrace_IsRecording() {
+	return recorder != NULL;
+}
+
+void GETrace_RecordOp(u32 op) {
+	recorder->RecordOp(op);
+}
+
+void GETrace_RecordFrame(u32 framebuf, u32 stride, int format) {
+	recorder->RecordFrame(framebuf, stride, format);
+}
+
+bool GETrace_Replay(const std::string &filename, GPUInterface *gpu, GETraceStats &stats) {
+	memset(&stats, 0, sizeof(stats));
+
+	File::IOFile file(filename, "rb");
+	TraceHeader header;
+	if (!file.ReadArray(&header, 1) || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+		ERROR_LOG(G3D, "%s is not a GE trace", filename.c_str());
+		return false;
+	}
+	if (header.stateSize != sizeof(gstate) || header.stateCacheSize != sizeof(gstate_c)) {
+		ERROR_LOG(G3D, "GE trace %s is from an incompatible build", filename.c_str());
+		return false;
+	}
+	file.ReadArray(&gstate, 1);
+	file.ReadArray(&gstate_c, 1);
+	gstate_c.textureChanged = true;
+	ReapplyGfxState();
+	gpu->BeginFrame();
+
+	std::vector<u8> data;
+	u32 type;
+	while (file.ReadArray(&type, 1)) {
+		switch (type) {
+		case TRACE_OP:
+			{
+				u32 op;
+				if (!file.ReadArray(&op, 1))
+					break;
+				u32 cmd = op >> 24;
+				// Flow control was already done when recording, and would need a list.
+				if ((cmd >= GE_CMD_JUMP && cmd <= GE_CMD_FINISH) || cmd == GE_CMD_ORIGIN)
+					break;
+
+				double start = time_now_d();
+				u32 diff = op ^ gstate.cmdmem[cmd];
+				gpu->PreExecuteOp(op, diff);
+				gstate.cmdmem[cmd] = op;
+				gpu->ExecuteOp(op, diff);
+				stats.seconds[cmd] += time_now_d() - start;
+				if (stats.count[cmd]++ == 0)
+					stats.sampleOp[cmd] = op;
+			}
+			break;
+
+		case TRACE_MEMORY:
+			{
+				u32 range[2];
+				if (!file.ReadArray(range, 2))
+					break;
+				if (range[1] == 0)
+					break;
+				data.resize(range[1]);
+				if (!file.ReadBytes(&data[0], range[1]))
+					break;
+				if (Memory::IsValidAddress(range[0]) && Memory::IsValidAddress(range[0] + range[1] - 1)) {
+					Memory::Memcpy(range[0], &data[0], range[1]);
+					stats.memoryBytes += range[1];
+				}
+			}
+			break;
+
+		case TRACE_FRAME:
+			{
+				u32 display[3];
+				if (!file.ReadArray(display, 3))
+					break;
+				double start = time_now_d();
+				gpu->SetDisplayFramebuffer(display[0], display[1], display[2]);
+				gpu->CopyDisplayToOutput();
+				gpu->BeginFrame();
+				stats.frameSeconds += time_now_d() - start;
+				stats.frames++;
+			}
+			break;
+
+		default:
+			ERROR_LOG(G3D, "Bad record %i in GE trace %s", type, filename.c_str());
+			return false;
+		}
+	}
+
+	gpu->Flush();
+	return true;
+}
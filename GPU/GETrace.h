@@ -0,0 +1,55 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include <string>
+
+#include "../Globals.h"
+
+class GPUInterface;
+
+// GE command traces, for replaying a game's rendering without the game.
+//
+// A trace starts with a snapshot of the GPU state, followed by the commands in the order
+// the GPU executed them. Jumps, calls and returns have already been followed, so it's one
+// flat stream. Just before a command that reads memory (vertices, indices, textures, CLUTs,
+// block transfer sources), the memory it reads is written out, if it changed since it was
+// last written. Display flips are marked, so a trace can be replayed frame by frame.
+
+// Starts writing a trace of everything the GPU executes from now on.
+bool GETrace_BeginRecording(const std::string &filename);
+void GETrace_EndRecording();
+bool GETrace_IsRecording();
+
+// Called by the list interpreter before each command is executed.
+void GETrace_RecordOp(u32 op);
+// Called at the display flip, with the framebuffer being displayed.
+void GETrace_RecordFrame(u32 framebuf, u32 stride, int format);
+
+struct GETraceStats {
+	u32 count[256];
+	double seconds[256];  // Including PreExecuteOp, so any flush the command causes.
+	u32 sampleOp[256];  // The first op seen of each command, for the report.
+	int frames;
+	double frameSeconds;  // Spent in CopyDisplayToOutput and BeginFrame.
+	u32 memoryBytes;
+};
+
+// Feeds a trace into a GPU. Memory must be initialized, and the GPU's state is replaced
+// with the trace's. Per-command timing ends up in stats.
+bool GETrace_Replay(const std::string &filename, GPUInterface *gpu, GETraceStats &stats);
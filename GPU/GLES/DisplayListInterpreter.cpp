@@ -37,13 +37,9 @@
 extern u32 curTextureWidth;
 extern u32 curTextureHeight;
 
-// Aggressively delete unused FBO:s to save gpu memory.
-enum {
-	FBO_OLD_AGE = 4
-};
-
+// GE_CMD_VERTEXTYPE is handled separately in PreExecuteOp, as many vertex type changes
+// don't need to break the batch.
 const int flushOnChangedBeforeCommandList[] = {
-	GE_CMD_VERTEXTYPE,
 	GE_CMD_BLENDMODE,
 	GE_CMD_BLENDFIXEDA,
 	GE_CMD_BLENDFIXEDB,
@@ -68,14 +64,6 @@ const int flushOnChangedBeforeCommandList[] = {
 	GE_CMD_LMODE,
 	GE_CMD_REVERSENORMAL,
 	GE_CMD_MATERIALUPDATE,
-	GE_CMD_MATERIALEMISSIVE,
-	GE_CMD_MATERIALAMBIENT,
-	GE_CMD_MATERIALDIFFUSE,
-	GE_CMD_MATERIALSPECULAR,
-	GE_CMD_MATERIALALPHA,
-	GE_CMD_MATERIALSPECULARCOEF,
-	GE_CMD_AMBIENTCOLOR,
-	GE_CMD_AMBIENTALPHA,
 	GE_CMD_COLORMODEL,
 	GE_CMD_LIGHTTYPE0, GE_CMD_LIGHTTYPE1, GE_CMD_LIGHTTYPE2, GE_CMD_LIGHTTYPE3,
 	GE_CMD_LX0,GE_CMD_LY0,GE_CMD_LZ0,
@@ -121,6 +109,20 @@ const int flushOnChangedBeforeCommandList[] = {
 	GE_CMD_MASKALPHA,
 };
 
+// Changes to these only need a flush if the batch is hardware transformed, otherwise
+// each draw gets them baked into its vertices. See TransformUniforms.
+// GE_CMD_WORLDMATRIXDATA does the same check itself.
+const int bakeOnChangedBeforeCommandList[] = {
+	GE_CMD_MATERIALEMISSIVE,
+	GE_CMD_MATERIALAMBIENT,
+	GE_CMD_MATERIALDIFFUSE,
+	GE_CMD_MATERIALSPECULAR,
+	GE_CMD_MATERIALALPHA,
+	GE_CMD_MATERIALSPECULARCOEF,
+	GE_CMD_AMBIENTCOLOR,
+	GE_CMD_AMBIENTALPHA,
+};
+
 const int flushBeforeCommandList[] = {
 	GE_CMD_BEZIER,
 	GE_CMD_SPLINE,
@@ -165,16 +167,13 @@ const int flushBeforeCommandList[] = {
 
 GLES_GPU::GLES_GPU(int renderWidth, int renderHeight)
 :		interruptsEnabled_(true),
-		displayFramebufPtr_(0),
-		prevDisplayFramebufPtr_(0),
-		prevPrevDisplayFramebufPtr_(0),
-		renderWidth_(renderWidth),
-		renderHeight_(renderHeight)
+		shaderCacheLoaded_(false)
 {
-	renderWidthFactor_ = (float)renderWidth / 480.0f;
-	renderHeightFactor_ = (float)renderHeight / 272.0f;
 	shaderManager_ = new ShaderManager();
 	transformDraw_.SetShaderManager(shaderManager_);
+	framebufferManager.SetTransformDrawEngine(&transformDraw_);
+	framebufferManager.SetShaderManager(shaderManager_);
+	framebufferManager.SetRenderSize(renderWidth, renderHeight);
 	TextureCache_Init();
 	// Sanity check gstate
 	if ((int *)&gstate.transferstart - (int *)&gstate != 0xEA) {
@@ -186,6 +185,9 @@ GLES_GPU::GLES_GPU(int renderWidth, int renderHeight)
 	for (size_t i = 0; i < ARRAY_SIZE(flushOnChangedBeforeCommandList); i++) {
 		flushBeforeCommand_[flushOnChangedBeforeCommandList[i]] = 2;
 	}
+	for (size_t i = 0; i < ARRAY_SIZE(bakeOnChangedBeforeCommandList); i++) {
+		flushBeforeCommand_[bakeOnChangedBeforeCommandList[i]] = 3;
+	}
 	for (size_t i = 0; i < ARRAY_SIZE(flushBeforeCommandList); i++) {
 		flushBeforeCommand_[flushBeforeCommandList[i]] = 1;
 	}
@@ -194,11 +196,7 @@ GLES_GPU::GLES_GPU(int renderWidth, int renderHeight)
 
 GLES_GPU::~GLES_GPU() {
 	TextureCache_Shutdown();
-	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
-		fbo_destroy((*iter)->fbo);
-		delete (*iter);
-	}
-	vfbs_.clear();
+	framebufferManager.DestroyAllFBOs();
 	shaderManager_->ClearCache(true);
 	delete shaderManager_;
 	delete [] flushBeforeCommand_;
@@ -224,9 +222,31 @@ void GLES_GPU::DumpNextFrame() {
 	dumpNextFrame_ = true;
 }
 
+// The game isn't loaded yet when the GPU is created, so this waits for the first frame.
+void GLES_GPU::LoadShaderCache() {
+	shaderCacheLoaded_ = true;
+	std::string discID = g_paramSFO.GetValueString("DISC_ID");
+	if (discID.empty())
+		return;
+
+	char temp[256];
+	snprintf(temp, sizeof(temp), "ms0:/PSP/PPSSPP_STATE/%s_%s.shadercache",
+		discID.c_str(), g_paramSFO.GetValueString("DISC_VERSION").c_str());
+	std::string hostPath;
+	pspFileSystem.MkDir("ms0:/PSP/PPSSPP_STATE");
+	if (pspFileSystem.GetHostPath(std::string(temp), hostPath)) {
+		shaderManager_->LoadCache(hostPath);
+	}
+}
+
 void GLES_GPU::BeginFrame() {
+	if (!shaderCacheLoaded_)
+		LoadShaderCache();
+	// Shaders from earlier sessions, a few milliseconds' worth per frame.
+	shaderManager_->CompilePending(0.004);
+
 	TextureCache_StartFrame();
-	DecimateFBOs();
+	framebufferManager.BeginFrame();
 	transformDraw_.DecimateTrackedVertexArrays();
 
 	if (dumpNextFrame_) {
@@ -240,208 +260,25 @@ void GLES_GPU::BeginFrame() {
 
 	// Not sure if this is really needed.
 	shaderManager_->DirtyUniform(DIRTY_ALL);
-
-	// NOTE - this is all wrong. At the beginning of the frame is a TERRIBLE time to draw the fb.
-	if (g_Config.bDisplayFramebuffer && displayFramebufPtr_) {
-		INFO_LOG(HLE, "Drawing the framebuffer");
-		const u8 *pspframebuf = Memory::GetPointer((0x44000000) | (displayFramebufPtr_ & 0x1FFFFF));	// TODO - check
-		glstate.cullFace.disable();
-		glstate.depthTest.disable();
-		glstate.blend.disable();
-		framebufferManager.DrawPixels(pspframebuf, displayFormat_, displayStride_);
-		// TODO: restore state?
-	}
-	currentRenderVfb_ = 0;
 }
 
 void GLES_GPU::SetDisplayFramebuffer(u32 framebuf, u32 stride, int format) {
-	if (framebuf & 0x04000000) {
-		//DEBUG_LOG(G3D, "Switch display framebuffer %08x", framebuf);
-		prevPrevDisplayFramebufPtr_ = prevDisplayFramebufPtr_;
-		prevDisplayFramebufPtr_ = displayFramebufPtr_;
-		displayFramebufPtr_ = framebuf;
-		displayStride_ = stride;
-		displayFormat_ = format;
-	} else {
-		ERROR_LOG(HLE, "Bogus framebuffer address: %08x", framebuf);
-	}
+	framebufferManager.SetDisplayFramebuffer(framebuf, stride, format);
 }
 
 void GLES_GPU::CopyDisplayToOutput() {
 	transformDraw_.Flush();
+	FlushTransfers();
 	if (!g_Config.bBufferedRendering)
 		return;
 
 	EndDebugDraw();
 
-	VirtualFramebuffer *vfb = GetDisplayFBO();
-	fbo_unbind();
-
-	glstate.viewport.set(0, 0, PSP_CoreParameter().pixelWidth, PSP_CoreParameter().pixelHeight);
-
-	currentRenderVfb_ = 0;
-
-	if (!vfb) {
-		DEBUG_LOG(HLE, "Found no FBO! displayFBPtr = %08x", displayFramebufPtr_);
-		// No framebuffer to display! Clear to black.
-		glClearColor(0,0,0,1);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
-		return;
-	}
-
-	DEBUG_LOG(HLE, "Displaying FBO %08x", vfb->fb_address);
-	glstate.blend.disable();
-	glstate.cullFace.disable();
-	glstate.depthTest.disable();
-	glstate.scissorTest.disable();
-
-	fbo_bind_color_as_texture(vfb->fbo, 0);
-
-	// These are in the output display coordinates
-	framebufferManager.DrawActiveTexture(480, 272, true);
-
-	shaderManager_->DirtyShader();
-	shaderManager_->DirtyUniform(DIRTY_ALL);
-	gstate_c.textureChanged = true;
+	framebufferManager.CopyDisplayToOutput();
 
 	BeginDebugDraw();
 }
 
-static bool MaskedEqual(u32 addr1, u32 addr2) {
-	return (addr1 & 0x3FFFFFF) == (addr2 & 0x3FFFFFF);
-}
-
-
-void GLES_GPU::DecimateFBOs() {
-	for (auto iter = vfbs_.begin(); iter != vfbs_.end();) {
-		VirtualFramebuffer *v = *iter;
-		if (MaskedEqual(v->fb_address, displayFramebufPtr_) ||
-				MaskedEqual(v->fb_address, prevDisplayFramebufPtr_) ||
-				MaskedEqual(v->fb_address, prevPrevDisplayFramebufPtr_)) {
-			++iter;
-			continue;
-		}
-		if ((*iter)->last_frame_used + FBO_OLD_AGE < gpuStats.numFrames) {
-			fbo_destroy((*iter)->fbo);
-			vfbs_.erase(iter++);
-		}
-		else
-			++iter;
-	}
-}
-
-GLES_GPU::VirtualFramebuffer *GLES_GPU::GetDisplayFBO() {
-	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
-		if (MaskedEqual((*iter)->fb_address, displayFramebufPtr_)) {
-			// Could check w to but whatever
-			return *iter;
-		}
-	}
-	DEBUG_LOG(HLE, "Finding no FBO matching address %08x", displayFramebufPtr_);
-#ifdef _DEBUG
-	std::string debug = "FBOs: ";
-	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
-		char temp[256];
-		sprintf(temp, "%08x %i %i", (*iter)->fb_address, (*iter)->width, (*iter)->height);
-		debug += std::string(temp);
-	}
-	ERROR_LOG(HLE, "FBOs: %s", debug.c_str());
-#endif
-	return 0;
-}
-
-void GLES_GPU::SetRenderFrameBuffer() {
-	if (!g_Config.bBufferedRendering)
-		return;
-	// Get parameters
-	u32 fb_address = (gstate.fbptr & 0xFFE000) | ((gstate.fbwidth & 0xFF0000) << 8);
-	int fb_stride = gstate.fbwidth & 0x3C0;
-
-	u32 z_address = (gstate.zbptr & 0xFFE000) | ((gstate.zbwidth & 0xFF0000) << 8);
-	int z_stride = gstate.zbwidth & 0x3C0;
-
-	// Yeah this is not completely right. but it'll do for now.
-	int drawing_width = ((gstate.region2) & 0x3FF) + 1;
-	int drawing_height = ((gstate.region2 >> 10) & 0x3FF) + 1;
-
-	// HACK for first frame where some games don't init things right
-	if (drawing_width == 1 && drawing_height == 1) {
-		drawing_width = 480;
-		drawing_height = 272;
-	}
-
-	int fmt = gstate.framebufpixformat & 3;
-
-	// Find a matching framebuffer
-	VirtualFramebuffer *vfb = 0;
-	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
-		VirtualFramebuffer *v = *iter;
-		if (v->fb_address == fb_address && v->width == drawing_width && v->height == drawing_height && v->format == fmt) {
-			// Let's not be so picky for now. Let's say this is the one.
-			vfb = v;
-			// Update fb stride in case it changed
-			vfb->fb_stride = fb_stride;
-			break;
-		}
-	}
-
-	// None found? Create one.
-	if (!vfb) {
-		transformDraw_.Flush();
-		gstate_c.textureChanged = true;
-		vfb = new VirtualFramebuffer;
-		vfb->fb_address = fb_address;
-		vfb->fb_stride = fb_stride;
-		vfb->z_address = z_address;
-		vfb->z_stride = z_stride;
-		vfb->width = drawing_width;
-		vfb->height = drawing_height;
-		vfb->format = fmt;
-
-		//vfb->colorDepth = FBO_8888;
-		switch (gstate.framebufpixformat & 0x3) {
-		case GE_FORMAT_4444: vfb->colorDepth = FBO_4444;
-		case GE_FORMAT_5551: vfb->colorDepth = FBO_5551;
-		case GE_FORMAT_565: vfb->colorDepth = FBO_565;
-		case GE_FORMAT_8888: vfb->colorDepth = FBO_8888;
-		}
-//#ifdef ANDROID
-//		vfb->colorDepth = FBO_5551;
-//#endif
-
-		vfb->fbo = fbo_create(vfb->width * renderWidthFactor_, vfb->height * renderHeightFactor_, 1, true, vfb->colorDepth);
-
-		vfb->last_frame_used = gpuStats.numFrames;
-		vfbs_.push_back(vfb);
-		fbo_bind_as_render_target(vfb->fbo);
-		glEnable(GL_DITHER);
-		glstate.viewport.set(0, 0, renderWidth_, renderHeight_);
-		currentRenderVfb_ = vfb;
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
-		INFO_LOG(HLE, "Creating FBO for %08x : %i x %i", vfb->fb_address, vfb->width, vfb->height);
-		return;
-	}
-
-	if (vfb != currentRenderVfb_) {
-		transformDraw_.Flush();
-		// Use it as a render target.
-		DEBUG_LOG(HLE, "Switching render target to FBO for %08x", vfb->fb_address);
-		gstate_c.textureChanged = true;
-		fbo_bind_as_render_target(vfb->fbo);
-
-#ifdef USING_GLES2
-		// Tiled renderers benefit IMMENSELY from clearing an FBO before rendering
-		// to it. Let's hope this doesn't break too many things...
-		// It did, will have to find a better solution like clearing only if this is
-		// the first time the buffer is bound on this frame.
-		// glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
-#endif
-		glstate.viewport.set(0, 0, renderWidth_, renderHeight_);
-		currentRenderVfb_ = vfb;
-		vfb->last_frame_used = gpuStats.numFrames;
-	}
-}
-
 void GLES_GPU::BeginDebugDraw() {
 	if (g_Config.bDrawWireframe) {
 #ifndef USING_GLES2
@@ -492,7 +329,12 @@ static void LeaveClearMode() {
 
 void GLES_GPU::PreExecuteOp(u32 op, u32 diff) {
 	u32 cmd = op >> 24;
-	if (flushBeforeCommand_[cmd] == 1 || (diff && flushBeforeCommand_[cmd] == 2))
+	bool flush = flushBeforeCommand_[cmd] == 1 || (diff && flushBeforeCommand_[cmd] == 2);
+	if (cmd == GE_CMD_VERTEXTYPE && diff)
+		flush = !transformDraw_.CanBatchVertexType(op & 0xFFFFFF);
+	else if (diff && flushBeforeCommand_[cmd] == 3)
+		flush = !transformDraw_.BakeUniformChange();
+	if (flush)
 	{
 		if (dumpThisFrame_) {
 			NOTICE_LOG(G3D, "================ FLUSH ================");
@@ -523,11 +365,25 @@ void GLES_GPU::ExecuteOp(u32 op, u32 diff) {
 
 	case GE_CMD_PRIM:
 		{
-			SetRenderFrameBuffer();
+			FlushTransfers();
 
 			u32 count = data & 0xFFFF;
 			u32 type = data >> 16;
 
+			if (gstate_c.skipDrawing) {
+				// Nothing is drawn this frame, but the addresses advance just the same.
+				if ((gstate.vertType & GE_VTYPE_IDX_MASK) != GE_VTYPE_IDX_NONE)
+					gstate_c.indexAddr += count * ((gstate.vertType & GE_VTYPE_IDX_MASK) == GE_VTYPE_IDX_16BIT ? 2 : 1);
+				else
+					gstate_c.vertexAddr += count * transformDraw_.VertexSize(gstate.vertType);
+				break;
+			}
+
+			framebufferManager.SetRenderFrameBuffer();
+			// Textures rendered earlier only get copied to memory once they're used.
+			if (gstate_c.textureChanged && (gstate.textureMapEnable & 1))
+				framebufferManager.ResolveTexture();
+
 			if (!Memory::IsValidAddress(gstate_c.vertexAddr)) {
 				ERROR_LOG(G3D, "Bad vertex address %08x!", gstate_c.vertexAddr);
 				break;
@@ -566,7 +422,9 @@ void GLES_GPU::ExecuteOp(u32 op, u32 diff) {
 		{
 			int bz_ucount = data & 0xFF;
 			int bz_vcount = (data >> 8) & 0xFF;
-			transformDraw_.DrawBezier(bz_ucount, bz_vcount);
+			FlushTransfers();
+			if (!gstate_c.skipDrawing)
+				transformDraw_.DrawBezier(bz_ucount, bz_vcount);
 		}
 		break;
 
@@ -576,7 +434,9 @@ void GLES_GPU::ExecuteOp(u32 op, u32 diff) {
 			int sp_vcount = (data >> 8) & 0xFF;
 			int sp_utype = (data >> 16) & 0x3;
 			int sp_vtype = (data >> 18) & 0x3;
-			transformDraw_.DrawSpline(sp_ucount, sp_vcount, sp_utype, sp_vtype);
+			FlushTransfers();
+			if (!gstate_c.skipDrawing)
+				transformDraw_.DrawSpline(sp_ucount, sp_vcount, sp_utype, sp_vtype);
 		}
 		break;
 
@@ -1086,7 +946,8 @@ void GLES_GPU::ExecuteOp(u32 op, u32 diff) {
 			int num = gstate.worldmtxnum & 0xF;
 			float newVal = getFloat24(data);
 			if (num < 12 && newVal != gstate.worldMatrix[num]) {
-				Flush();
+				if (!transformDraw_.BakeUniformChange())
+					Flush();
 				gstate.worldMatrix[num] = getFloat24(data);
 				shaderManager_->DirtyUniform(DIRTY_WORLDMATRIX);
 			}
@@ -1178,7 +1039,7 @@ void GLES_GPU::UpdateStats() {
 	gpuStats.numFragmentShaders = shaderManager_->NumFragmentShaders();
 	gpuStats.numShaders = shaderManager_->NumPrograms();
 	gpuStats.numTextures = TextureCache_NumLoadedTextures();
-	gpuStats.numFBOs = (int)vfbs_.size();
+	gpuStats.numFBOs = framebufferManager.NumVFBs();
 }
 
 void GLES_GPU::DoBlockTransfer() {
@@ -1191,38 +1052,38 @@ void GLES_GPU::DoBlockTransfer() {
 	//
 	// etc....
 
-	u32 srcBasePtr = (gstate.transfersrc & 0xFFFFFF) | ((gstate.transfersrcw & 0xFF0000) << 8);
-	u32 srcStride = gstate.transfersrcw & 0x3FF;
-
-	u32 dstBasePtr = (gstate.transferdst & 0xFFFFFF) | ((gstate.transferdstw & 0xFF0000) << 8);
-	u32 dstStride = gstate.transferdstw & 0x3FF;
+	BlockTransfer transfer;
+	transfer.ReadGState();
 
-	int srcX = gstate.transfersrcpos & 0x3FF;
-	int srcY = (gstate.transfersrcpos >> 10) & 0x3FF;
+	DEBUG_LOG(G3D, "Block transfer: %08x to %08x, %i x %i , ...", transfer.srcBasePtr, transfer.dstBasePtr, transfer.width, transfer.height);
 
-	int dstX = gstate.transferdstpos & 0x3FF;
-	int dstY = (gstate.transferdstpos >> 10) & 0x3FF;
+	// Whatever was rendered into either side has to be in memory first.
+	framebufferManager.ResolveBlockTransfer(transfer);
 
-	int width = (gstate.transfersize & 0x3FF) + 1;
-	int height = ((gstate.transfersize >> 10) & 0x3FF) + 1;
+	// Do the copy!
+	if (!transfer.Execute())
+		return;
 
-	int bpp = (gstate.transferstart & 1) ? 4 : 2;
+	// Games often upload a texture in several transfers, so the caches only hear about it
+	// before the next draw.
+	transfers_.Add(transfer.DstRect());
+}
 
-	DEBUG_LOG(G3D, "Block transfer: %08x to %08x, %i x %i , ...", srcBasePtr, dstBasePtr, width, height);
+void GLES_GPU::FlushTransfers() {
+	if (transfers_.Empty())
+		return;
 
-	// Do the copy!
-	for (int y = 0; y < height; y++) {
-		const u8 *src = Memory::GetPointer(srcBasePtr + ((y + srcY) * srcStride + srcX) * bpp);
-		u8 *dst = Memory::GetPointer(dstBasePtr + ((y + dstY) * srcStride + dstX) * bpp);
-		memcpy(dst, src, width * bpp);
+	const std::vector<TransferRect> &rects = transfers_.Rects();
+	for (size_t i = 0; i < rects.size(); i++) {
+		TextureCache_InvalidateRect(rects[i]);
+		transformDraw_.MemoryWritten(rects[i].Start(), rects[i].End() - rects[i].Start());
+		framebufferManager.NotifyBlockTransfer(rects[i]);
 	}
-
-	// TODO: Notify all overlapping FBOs that they need to reload.
-
-	TextureCache_Invalidate(dstBasePtr + dstY * dstStride + dstX, height * dstStride + width * bpp, true);
+	transfers_.Clear();
 }
 
 void GLES_GPU::InvalidateCache(u32 addr, int size) {
+	transformDraw_.MemoryWritten(addr, size);
 	if (size > 0)
 		TextureCache_Invalidate(addr, size, true);
 	else
@@ -1230,10 +1091,18 @@ void GLES_GPU::InvalidateCache(u32 addr, int size) {
 }
 
 void GLES_GPU::InvalidateCacheHint(u32 addr, int size) {
-	if (size > 0)
+	// Dcache writebacks end up here, the vertex cache has to hear about them.
+	if (size > 0) {
+		transformDraw_.MemoryWritten(addr, size);
 		TextureCache_Invalidate(addr, size, false);
-	else
+	} else {
+		transformDraw_.MemoryWritten(0, -1);
 		TextureCache_InvalidateAll(false);
+	}
+}
+
+void GLES_GPU::ResolveMemory(u32 addr, int size) {
+	framebufferManager.ResolveMemory(addr, size);
 }
 
 void GLES_GPU::Flush() {
@@ -1245,10 +1114,7 @@ void GLES_GPU::DoState(PointerWrap &p) {
 
 	TextureCache_Clear(true);
 	gstate_c.textureChanged = true;
-	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
-		fbo_destroy((*iter)->fbo);
-		delete (*iter);
-	}
-	vfbs_.clear();
+	transformDraw_.MemoryWritten(0, -1);
+	framebufferManager.DestroyAllFBOs();
 	shaderManager_->ClearCache(true);
 }
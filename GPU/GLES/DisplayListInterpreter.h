@@ -21,6 +21,7 @@
 #include <deque>
 
 #include "../GPUCommon.h"
+#include "../BlockTransfer.h"
 #include "Framebuffer.h"
 #include "VertexDecoder.h"
 #include "TransformPipeline.h"
@@ -50,6 +51,7 @@ public:
 	virtual void UpdateStats();
 	virtual void InvalidateCache(u32 addr, int size);
 	virtual void InvalidateCacheHint(u32 addr, int size);
+	virtual void ResolveMemory(u32 addr, int size);
 	virtual void DeviceLost();  // Only happens on Android. Drop all textures and shaders.
 
 	virtual void DumpNextFrame();
@@ -58,13 +60,14 @@ public:
 
 private:
 	void DoBlockTransfer();
+	// Tells the texture cache and framebuffers about the block transfers since last time.
+	void FlushTransfers();
 
 	// Applies states for debugging if enabled.
 	void BeginDebugDraw();
 	void EndDebugDraw();
 
-	// Deletes old FBOs.
-	void DecimateFBOs();
+	void LoadShaderCache();
 
 	FramebufferManager framebufferManager;
 	TransformDrawEngine transformDraw_;
@@ -72,17 +75,7 @@ private:
 	u8 *flushBeforeCommand_;
 	bool interruptsEnabled_;
 
-	u32 displayFramebufPtr_;
-	u32 prevDisplayFramebufPtr_;
-	u32 prevPrevDisplayFramebufPtr_;
-	u32 displayStride_;
-	int displayFormat_;
-
-	int renderWidth_;
-	int renderHeight_;
-
-	float renderWidthFactor_;
-	float renderHeightFactor_;
+	bool shaderCacheLoaded_;
 
 	struct CmdProcessorState {
 		u32 pc;
@@ -90,30 +83,7 @@ private:
 		int subIntrBase;
 	};
 
-	struct VirtualFramebuffer {
-		int last_frame_used;
-
-		u32 fb_address;
-		u32 z_address;
-		int fb_stride;
-		int z_stride;
-
-		// There's also a top left of the drawing region, but meh...
-		int width;
-		int height;
-
-		int format;  // virtual, right now they are all RGBA8888
-		FBOColorDepth colorDepth;
-		FBO *fbo;
-	};
-
-	void SetRenderFrameBuffer();  // Uses parameters computed from gstate
-	// TODO: Break out into some form of FBO manager
-	VirtualFramebuffer *GetDisplayFBO();
-
-	std::list<VirtualFramebuffer *> vfbs_;
-
-	VirtualFramebuffer *currentRenderVfb_;
+	TransferTracker transfers_;
 
 	u8 bezierBuf[16000];
 };
@@ -54,7 +54,7 @@ void ComputeFragmentShaderID(FragmentShaderID *id)
 			id->d[0] |= 1 << 1;
 			id->d[0] |= (gstate.texfunc & 0x7) << 2;
 			id->d[0] |= ((gstate.texfunc & 0x100) >> 8) << 5; // rgb or rgba
-			id->d[0] |= ((gstate.texfunc & 0x10000) >> 16) << 6;	// color double
+			id->d[0] |= ((gstate.texfunc & 0x10000) >> 16) << 7;	// color double
 		}
 		id->d[0] |= (lmode & 1) << 6;
 		id->d[0] |= (gstate.alphaTestEnable & 1) << 8;
@@ -71,7 +71,8 @@ void ComputeFragmentShaderID(FragmentShaderID *id)
 // Also, logic ops etc, of course. Urgh.
 // We could do all this with booleans, but I don't trust the shader compilers on
 // Android devices to be anything but stupid.
-void GenerateFragmentShader(char *buffer)
+// Like the vertex shader, this only looks at the ID, never at gstate.
+void GenerateFragmentShader(const FragmentShaderID &id, char *buffer)
 {
 	char *p = buffer;
 
@@ -82,14 +83,20 @@ void GenerateFragmentShader(char *buffer)
 	WRITE(p, "#version 110\n");
 #endif
 
-	int lmode = (gstate.lmode & 1) && (gstate.lightingEnable & 1);
-
-	int doTexture = (gstate.textureMapEnable & 1) && !(gstate.clearmode & 1);
-	bool enableFog = gstate.isFogEnabled() && !gstate.isModeThrough() && !gstate.isModeClear();
+	bool clearMode = id.d[0] == 1;
+	bool lmode = !clearMode && (id.d[0] & (1 << 6)) != 0;
+	bool doTexture = !clearMode && (id.d[0] & (1 << 1)) != 0;
+	int texFunc = (id.d[0] >> 2) & 7;
+	bool textureAlpha = (id.d[0] & (1 << 5)) != 0;
+	bool doColorDouble = (id.d[0] & (1 << 7)) != 0;
+	bool enableAlphaTest = !clearMode && (id.d[0] & (1 << 8)) != 0;
+	int alphaTestFunc = (id.d[0] >> 9) & 7;
+	bool enableColorTest = !clearMode && (id.d[0] & (1 << 12)) != 0;
+	bool enableFog = !clearMode && (id.d[0] & (1 << 15)) != 0;
 
 	if (doTexture)
 		WRITE(p, "uniform sampler2D tex;\n");
-	if ((gstate.alphaTestEnable & 1) || (gstate.colorTestEnable & 1)) {
+	if (enableAlphaTest || enableColorTest) {
 		WRITE(p, "uniform vec4 u_alphacolorref;\n");
 	}
 	WRITE(p, "uniform vec3 u_texenv;\n");
@@ -106,7 +113,7 @@ void GenerateFragmentShader(char *buffer)
 	WRITE(p, "void main() {\n");
 	WRITE(p, "  vec4 v;\n");
 
-	if (gstate.clearmode & 1)
+	if (clearMode)
 	{
 		// Clear mode does not allow any fancy shading.
 		WRITE(p, "  v = v_color0;\n");
@@ -123,12 +130,12 @@ void GenerateFragmentShader(char *buffer)
 			secondary = "";
 		}
 
-		if (gstate.textureMapEnable & 1) {
+		if (doTexture) {
 			WRITE(p, "  vec4 t = texture2D(tex, v_texcoord);\n");
 			WRITE(p, "  vec4 p = clamp(v_color0, 0.0, 1.0);\n");
 
-			if (gstate.texfunc & 0x100) { // texfmt == RGBA
-				switch (gstate.texfunc & 0x7) {
+			if (textureAlpha) { // texfmt == RGBA
+				switch (texFunc) {
 				case GE_TEXFUNC_MODULATE:
 					WRITE(p, "  v = t * p%s;\n", secondary); break;
 				case GE_TEXFUNC_DECAL:
@@ -143,7 +150,7 @@ void GenerateFragmentShader(char *buffer)
 					WRITE(p, "  v = p;\n"); break;
 				}
 			} else {	// texfmt == RGB
-				switch (gstate.texfunc & 0x7) {
+				switch (texFunc) {
 				case GE_TEXFUNC_MODULATE:
 					WRITE(p, "	v = vec4(t.rgb * p.rgb, p.a)%s;\n", secondary); break;
 				case GE_TEXFUNC_DECAL:
@@ -163,12 +170,11 @@ void GenerateFragmentShader(char *buffer)
 			WRITE(p, "  v = clamp(v_color0, 0.0, 1.0)%s;\n", secondary);
 		}
 		// Color doubling
-		if (gstate.texfunc & 0x10000) {
+		if (doColorDouble) {
 			WRITE(p, "  v = v * vec4(2.0, 2.0, 2.0, 2.0);");
 		}
 
-		if (gstate.alphaTestEnable & 1) {
-			int alphaTestFunc = gstate.alphatest & 7;
+		if (enableAlphaTest) {
 			const char *alphaTestFuncs[] = { "#", "#", " == ", " != ", " < ", " <= ", " > ", " >= " };	// never/always don't make sense
 			if (alphaTestFuncs[alphaTestFunc][0] != '#')
 				WRITE(p, "if (!(v.a %s u_alphacolorref.a)) discard;", alphaTestFuncs[alphaTestFunc]);
@@ -176,9 +182,9 @@ void GenerateFragmentShader(char *buffer)
 
 		// Disabled for now until we actually find a need for it.
 		/*
-		if (gstate.colorTestEnable & 1) {
+		if (enableColorTest) {
 			// TODO: There are some colortestmasks we could handle.
-			int colorTestFunc = gstate.colortest & 3;
+			int colorTestFunc = (id.d[0] >> 13) & 3;
 			const char *colorTestFuncs[] = { "#", "#", " == ", " != " };	// never/always don't make sense}
 			int colorTestMask = gstate.colormask;
 			if (colorTestFuncs[colorTestFunc][0] != '#')
@@ -49,4 +49,4 @@ struct FragmentShaderID
 
 void ComputeFragmentShaderID(FragmentShaderID *id);
 
-void GenerateFragmentShader(char *buffer);
+void GenerateFragmentShader(const FragmentShaderID &id, char *buffer);
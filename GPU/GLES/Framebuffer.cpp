@@ -15,16 +15,35 @@
 // Official git repository and contact information can be found at
 // https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
 
+#include <algorithm>
+
 #include "gfx_es2/glsl_program.h"
 #include "gfx_es2/gl_state.h"
 #include "math/lin/matrix4x4.h"
+#include "../../native/ext/cityhash/city.h"
 
 #include "../../Core/Host.h"
 #include "../../Core/MemMap.h"
+#include "../../Core/Config.h"
+#include "../../Core/System.h"
 #include "../ge_constants.h"
 #include "../GPUState.h"
+#include "../BlockTransfer.h"
 
 #include "Framebuffer.h"
+#include "PixelConvert.h"
+#include "ShaderManager.h"
+#include "TextureCache.h"
+#include "TransformPipeline.h"
+
+// The display is 480 wide, but the backbuffer texture is as wide as the usual stride so
+// that an 8888 framebuffer can be uploaded straight from memory.
+static const int BACKBUF_WIDTH = 512;
+
+// Aggressively delete unused FBO:s to save gpu memory.
+enum {
+	FBO_OLD_AGE = 4
+};
 
 const char tex_fs[] =
 	"#ifdef GL_ES\n"
@@ -50,7 +69,12 @@ const char basic_vs[] =
 	"  gl_Position = u_viewproj * a_position;\n"
 	"}\n";
 
-FramebufferManager::FramebufferManager() {
+FramebufferManager::FramebufferManager()
+		: transformDraw_(0), shaderManager_(0),
+			displayFramebufPtr_(0), prevDisplayFramebufPtr_(0), prevPrevDisplayFramebufPtr_(0),
+			displayStride_(0), displayFormat_(0), currentRenderVfb_(0),
+			backbufFormat(-1), backbufHash(0), backbufStride(0) {
+	SetRenderSize(480, 272);
 	glGenTextures(1, &backbufTex);
 
 	//initialize backbuffer texture
@@ -60,7 +84,6 @@ FramebufferManager::FramebufferManager() {
 	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 480, 272, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
 	draw2dprogram = glsl_create_source(basic_vs, tex_fs);
@@ -74,84 +97,63 @@ FramebufferManager::FramebufferManager() {
 	glClearColor(0, 0, 0, 0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-	convBuf = new u8[480 * 272 * 4];
+	convBuf = new u8[BACKBUF_WIDTH * 272 * 4];
 }
 
 FramebufferManager::~FramebufferManager() {
+	DestroyAllFBOs();
 	glDeleteTextures(1, &backbufTex);
 	glsl_destroy(draw2dprogram);
 	delete [] convBuf;
 }
 
 void FramebufferManager::DrawPixels(const u8 *framebuf, int pixelFormat, int linesize) {
-	// TODO: We can trivially do these in the shader, and there's no need to
-	// upconvert to 8888 for the 16-bit formats.
-	for (int y = 0; y < 272; y++) {
-		switch (pixelFormat) {
-		case PSP_DISPLAY_PIXEL_FORMAT_565:
-			{
-				const u16 *src = (const u16 *)framebuf + linesize * y;
-				u8 *dst = convBuf + 4 * 480 * y;
-				for (int x = 0; x < 480; x++)
-				{
-					u16 col = src[x];
-					dst[x * 4] = ((col) & 0x1f) << 3;
-					dst[x * 4 + 1] = ((col >> 5) & 0x3f) << 2;
-					dst[x * 4 + 2] = ((col >> 11) & 0x1f) << 3;
-					dst[x * 4 + 3] = 255;
-				}
-			}
-			break;
-
-		case PSP_DISPLAY_PIXEL_FORMAT_5551:
-			{
-				const u16 *src = (const u16 *)framebuf + linesize * y;
-				u8 *dst = convBuf + 4 * 480 * y;
-				for (int x = 0; x < 480; x++)
-				{
-					u16 col = src[x];
-					dst[x * 4] = ((col) & 0x1f) << 3;
-					dst[x * 4 + 1] = ((col >> 5) & 0x1f) << 3;
-					dst[x * 4 + 2] = ((col >> 10) & 0x1f) << 3;
-					dst[x * 4 + 3] = (col >> 15) ? 255 : 0;
-				}
-			}
-			break;
+	// 16-bit formats are uploaded as 16-bit, just with the channels swapped around.
+	GLenum glFormat = GL_RGBA;
+	GLenum glType;
+	int bpp = 2;
+	switch (pixelFormat) {
+	case PSP_DISPLAY_PIXEL_FORMAT_565:
+		glFormat = GL_RGB;
+		glType = GL_UNSIGNED_SHORT_5_6_5;
+		break;
+	case PSP_DISPLAY_PIXEL_FORMAT_5551:
+		glType = GL_UNSIGNED_SHORT_5_5_5_1;
+		break;
+	case PSP_DISPLAY_PIXEL_FORMAT_4444:
+		glType = GL_UNSIGNED_SHORT_4_4_4_4;
+		break;
+	case PSP_DISPLAY_PIXEL_FORMAT_8888:
+		glType = GL_UNSIGNED_BYTE;
+		bpp = 4;
+		break;
+	default:
+		return;
+	}
 
-		case PSP_DISPLAY_PIXEL_FORMAT_8888:
-			{
-				const u8 *src = framebuf + linesize * 4 * y;
-				u8 *dst = convBuf + 4 * 480 * y;
-				for (int x = 0; x < 480; x++)
-				{
-					dst[x * 4] = src[x * 4];
-					dst[x * 4 + 1] = src[x * 4 + 3];
-					dst[x * 4 + 2] = src[x * 4 + 2];
-					dst[x * 4 + 3] = src[x * 4 + 1];
-				}
-			}
-			break;
+	glBindTexture(GL_TEXTURE_2D, backbufTex);
 
-		case PSP_DISPLAY_PIXEL_FORMAT_4444:
-			{
-				const u16 *src = (const u16 *)framebuf + linesize * y;
-				u8 *dst = convBuf + 4 * 480 * y;
-				for (int x = 0; x < 480; x++)
-				{
-					u16 col = src[x];
-					dst[x * 4] = ((col >> 8) & 0xf) << 4;
-					dst[x * 4 + 1] = ((col >> 4) & 0xf) << 4;
-					dst[x * 4 + 2] = (col & 0xf) << 4;
-					dst[x * 4 + 3] = (col >> 12) << 4;
-				}
-			}
-			break;
+	// Lots of homebrew and menus keep showing the same frame, no need to upload it again.
+	// The last row stops at the visible width, the stride past it may be past the end of VRAM.
+	u32 hash = CityHash32((const char *)framebuf, (linesize * 271 + 480) * bpp);
+	if (hash != backbufHash || pixelFormat != backbufFormat || linesize != backbufStride) {
+		const u8 *pixels = framebuf;
+		if (pixelFormat != PSP_DISPLAY_PIXEL_FORMAT_8888 || linesize != BACKBUF_WIDTH) {
+			ConvertDisplayPixels(convBuf, BACKBUF_WIDTH, framebuf, linesize, pixelFormat, 480, 272);
+			pixels = convBuf;
+		}
+		if (pixelFormat != backbufFormat) {
+			glTexImage2D(GL_TEXTURE_2D, 0, glFormat, BACKBUF_WIDTH, 272, 0, glFormat, glType, pixels);
+		} else {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, BACKBUF_WIDTH, 272, glFormat, glType, pixels);
 		}
+		backbufHash = hash;
+		backbufFormat = pixelFormat;
+		backbufStride = linesize;
 	}
 
-	glBindTexture(GL_TEXTURE_2D,backbufTex);
-	glTexSubImage2D(GL_TEXTURE_2D,0,0,0,480,272, GL_RGBA, GL_UNSIGNED_BYTE, convBuf);
-	DrawActiveTexture(480, 272);
+	// The columns past 480 end up off screen.
+	DrawActiveTexture(BACKBUF_WIDTH, 272);
 }
 
 void FramebufferManager::DrawActiveTexture(float w, float h, bool flip) {
@@ -177,3 +179,384 @@ void FramebufferManager::DrawActiveTexture(float w, float h, bool flip) {
 	glDisableVertexAttribArray(draw2dprogram->a_texcoord0);
 	glsl_unbind();
 }
+
+void FramebufferManager::SetRenderSize(int width, int height) {
+	renderWidth_ = width;
+	renderHeight_ = height;
+	renderWidthFactor_ = (float)width / 480.0f;
+	renderHeightFactor_ = (float)height / 272.0f;
+}
+
+static bool MaskedEqual(u32 addr1, u32 addr2) {
+	return (addr1 & 0x3FFFFFF) == (addr2 & 0x3FFFFFF);
+}
+
+// Framebuffer pointers are offsets into VRAM, and VRAM is mirrored a few times, so
+// overlap checks happen on addresses in the first mirror. Returns 0 outside VRAM.
+static u32 VRAMAddress(u32 addr) {
+	if ((addr & 0x0F800000) != 0x04000000)
+		return 0;
+	return 0x04000000 | (addr & 0x1FFFFF);
+}
+
+static u32 FramebufferStart(const VirtualFramebuffer *vfb) {
+	return 0x04000000 | (vfb->fb_address & 0x1FFFFF);
+}
+
+static u32 FramebufferBytes(const VirtualFramebuffer *vfb) {
+	return vfb->fb_stride * vfb->height * (vfb->format == GE_FORMAT_8888 ? 4 : 2);
+}
+
+void FramebufferManager::BeginFrame() {
+	DecimateFBOs();
+
+	// Every framebuffer drawn into last frame would have needed a copy to memory if
+	// we didn't wait for something to read it.
+	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
+		VirtualFramebuffer *v = *iter;
+		if (v->renderedThisFrame && v->memoryStale)
+			gpuStats.numReadbacksAvoided++;
+		v->renderedThisFrame = false;
+	}
+
+	// NOTE - this is all wrong. At the beginning of the frame is a TERRIBLE time to draw the fb.
+	if (g_Config.bDisplayFramebuffer && displayFramebufPtr_) {
+		INFO_LOG(HLE, "Drawing the framebuffer");
+		const u8 *pspframebuf = Memory::GetPointer((0x44000000) | (displayFramebufPtr_ & 0x1FFFFF));	// TODO - check
+		glstate.cullFace.disable();
+		glstate.depthTest.disable();
+		glstate.blend.disable();
+		DrawPixels(pspframebuf, displayFormat_, displayStride_);
+		// TODO: restore state?
+	}
+	currentRenderVfb_ = 0;
+}
+
+void FramebufferManager::SetDisplayFramebuffer(u32 framebuf, u32 stride, int format) {
+	if (framebuf & 0x04000000) {
+		//DEBUG_LOG(G3D, "Switch display framebuffer %08x", framebuf);
+		prevPrevDisplayFramebufPtr_ = prevDisplayFramebufPtr_;
+		prevDisplayFramebufPtr_ = displayFramebufPtr_;
+		displayFramebufPtr_ = framebuf;
+		displayStride_ = stride;
+		displayFormat_ = format;
+	} else {
+		ERROR_LOG(HLE, "Bogus framebuffer address: %08x", framebuf);
+	}
+}
+
+void FramebufferManager::CopyDisplayToOutput() {
+	VirtualFramebuffer *vfb = GetDisplayFBO();
+	fbo_unbind();
+
+	glstate.viewport.set(0, 0, PSP_CoreParameter().pixelWidth, PSP_CoreParameter().pixelHeight);
+
+	currentRenderVfb_ = 0;
+
+	if (!vfb) {
+		DEBUG_LOG(HLE, "Found no FBO! displayFBPtr = %08x", displayFramebufPtr_);
+		// No framebuffer to display! Clear to black.
+		glClearColor(0,0,0,1);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+		return;
+	}
+
+	DEBUG_LOG(HLE, "Displaying FBO %08x", vfb->fb_address);
+	glstate.blend.disable();
+	glstate.cullFace.disable();
+	glstate.depthTest.disable();
+	glstate.scissorTest.disable();
+
+	if (vfb->overwrittenByTransfer) {
+		// Something was copied over it after drawing, like a video frame. Show that instead.
+		const u8 *pspframebuf = Memory::GetPointer((0x44000000) | (displayFramebufPtr_ & 0x1FFFFF));
+		DrawPixels(pspframebuf, displayFormat_, displayStride_);
+	} else {
+		fbo_bind_color_as_texture(vfb->fbo, 0);
+
+		// These are in the output display coordinates
+		DrawActiveTexture(480, 272, true);
+	}
+
+	shaderManager_->DirtyShader();
+	shaderManager_->DirtyUniform(DIRTY_ALL);
+	gstate_c.textureChanged = true;
+}
+
+void FramebufferManager::DecimateFBOs() {
+	for (auto iter = vfbs_.begin(); iter != vfbs_.end();) {
+		VirtualFramebuffer *v = *iter;
+		if (MaskedEqual(v->fb_address, displayFramebufPtr_) ||
+				MaskedEqual(v->fb_address, prevDisplayFramebufPtr_) ||
+				MaskedEqual(v->fb_address, prevPrevDisplayFramebufPtr_)) {
+			++iter;
+			continue;
+		}
+		if (v->last_frame_used + FBO_OLD_AGE < gpuStats.numFrames) {
+			fbo_destroy(v->fbo);
+			delete v;
+			vfbs_.erase(iter++);
+		}
+		else
+			++iter;
+	}
+}
+
+void FramebufferManager::DestroyAllFBOs() {
+	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
+		fbo_destroy((*iter)->fbo);
+		delete (*iter);
+	}
+	vfbs_.clear();
+	currentRenderVfb_ = 0;
+}
+
+VirtualFramebuffer *FramebufferManager::GetDisplayFBO() {
+	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
+		if (MaskedEqual((*iter)->fb_address, displayFramebufPtr_)) {
+			// Could check w to but whatever
+			return *iter;
+		}
+	}
+	DEBUG_LOG(HLE, "Finding no FBO matching address %08x", displayFramebufPtr_);
+#ifdef _DEBUG
+	std::string debug = "FBOs: ";
+	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
+		char temp[256];
+		sprintf(temp, "%08x %i %i", (*iter)->fb_address, (*iter)->width, (*iter)->height);
+		debug += std::string(temp);
+	}
+	ERROR_LOG(HLE, "FBOs: %s", debug.c_str());
+#endif
+	return 0;
+}
+
+void FramebufferManager::SetRenderFrameBuffer() {
+	if (!g_Config.bBufferedRendering)
+		return;
+	// Get parameters
+	u32 fb_address = (gstate.fbptr & 0xFFE000) | ((gstate.fbwidth & 0xFF0000) << 8);
+	int fb_stride = gstate.fbwidth & 0x3C0;
+
+	u32 z_address = (gstate.zbptr & 0xFFE000) | ((gstate.zbwidth & 0xFF0000) << 8);
+	int z_stride = gstate.zbwidth & 0x3C0;
+
+	// Yeah this is not completely right. but it'll do for now.
+	int drawing_width = ((gstate.region2) & 0x3FF) + 1;
+	int drawing_height = ((gstate.region2 >> 10) & 0x3FF) + 1;
+
+	// HACK for first frame where some games don't init things right
+	if (drawing_width == 1 && drawing_height == 1) {
+		drawing_width = 480;
+		drawing_height = 272;
+	}
+
+	int fmt = gstate.framebufpixformat & 3;
+
+	// Find a matching framebuffer
+	VirtualFramebuffer *vfb = 0;
+	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
+		VirtualFramebuffer *v = *iter;
+		if (v->fb_address == fb_address && v->width == drawing_width && v->height == drawing_height && v->format == fmt) {
+			// Let's not be so picky for now. Let's say this is the one.
+			vfb = v;
+			// Update fb stride in case it changed
+			vfb->fb_stride = fb_stride;
+			break;
+		}
+	}
+
+	// None found? Create one.
+	if (!vfb) {
+		transformDraw_->Flush();
+		gstate_c.textureChanged = true;
+		vfb = new VirtualFramebuffer;
+		vfb->fb_address = fb_address;
+		vfb->fb_stride = fb_stride;
+		vfb->z_address = z_address;
+		vfb->z_stride = z_stride;
+		vfb->width = drawing_width;
+		vfb->height = drawing_height;
+		vfb->format = fmt;
+		vfb->overwrittenByTransfer = false;
+		vfb->memoryStale = true;
+		vfb->renderedThisFrame = true;
+
+		//vfb->colorDepth = FBO_8888;
+		switch (gstate.framebufpixformat & 0x3) {
+		case GE_FORMAT_4444: vfb->colorDepth = FBO_4444;
+		case GE_FORMAT_5551: vfb->colorDepth = FBO_5551;
+		case GE_FORMAT_565: vfb->colorDepth = FBO_565;
+		case GE_FORMAT_8888: vfb->colorDepth = FBO_8888;
+		}
+//#ifdef ANDROID
+//		vfb->colorDepth = FBO_5551;
+//#endif
+
+		vfb->fbo = fbo_create(vfb->width * renderWidthFactor_, vfb->height * renderHeightFactor_, 1, true, vfb->colorDepth);
+
+		vfb->last_frame_used = gpuStats.numFrames;
+		vfbs_.push_back(vfb);
+		fbo_bind_as_render_target(vfb->fbo);
+		glEnable(GL_DITHER);
+		glstate.viewport.set(0, 0, renderWidth_, renderHeight_);
+		currentRenderVfb_ = vfb;
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+		INFO_LOG(HLE, "Creating FBO for %08x : %i x %i", vfb->fb_address, vfb->width, vfb->height);
+		return;
+	}
+
+	if (vfb != currentRenderVfb_) {
+		transformDraw_->Flush();
+		// Use it as a render target.
+		DEBUG_LOG(HLE, "Switching render target to FBO for %08x", vfb->fb_address);
+		gstate_c.textureChanged = true;
+		fbo_bind_as_render_target(vfb->fbo);
+
+#ifdef USING_GLES2
+		// Tiled renderers benefit IMMENSELY from clearing an FBO before rendering
+		// to it. Let's hope this doesn't break too many things...
+		// It did, will have to find a better solution like clearing only if this is
+		// the first time the buffer is bound on this frame.
+		// glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+#endif
+		glstate.viewport.set(0, 0, renderWidth_, renderHeight_);
+		currentRenderVfb_ = vfb;
+		vfb->last_frame_used = gpuStats.numFrames;
+	}
+
+	vfb->overwrittenByTransfer = false;
+	vfb->memoryStale = true;
+	vfb->renderedThisFrame = true;
+}
+
+void FramebufferManager::NotifyBlockTransfer(const TransferRect &rect) {
+	TransferRect r = rect;
+	r.base = VRAMAddress(r.base);
+	if (!r.base)
+		return;
+	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
+		VirtualFramebuffer *v = *iter;
+		u32 fbStart = FramebufferStart(v);
+		if (r.Overlaps(fbStart, fbStart + FramebufferBytes(v))) {
+			v->overwrittenByTransfer = true;
+		}
+	}
+}
+
+int FramebufferManager::ResolveMemory(u32 addr, int size) {
+	if (size <= 0)
+		return 0;
+	TransferRect r = {addr, (u32)size, 0, (u32)size, 0, 1};
+	return ResolveRect(r, 0);
+}
+
+int FramebufferManager::ResolveBlockTransfer(const BlockTransfer &transfer) {
+	int count = ResolveRect(transfer.SrcRect(), 0);
+
+	TransferRect dst = transfer.DstRect();
+	dst.base = VRAMAddress(dst.base);
+	if (dst.base && dst.RowBytes() == dst.stride) {
+		// Whole rows, so it's one range. Framebuffers inside it are about to be entirely
+		// replaced and don't need reading back.
+		for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
+			VirtualFramebuffer *v = *iter;
+			u32 fbStart = FramebufferStart(v);
+			if (v->memoryStale && v != currentRenderVfb_ && dst.Start() <= fbStart && fbStart + FramebufferBytes(v) <= dst.End())
+				v->memoryStale = false;
+		}
+	}
+	return count + ResolveRect(transfer.DstRect(), 0);
+}
+
+int FramebufferManager::ResolveTexture() {
+	u32 addr, bytes;
+	TextureCache_GetTextureRange(&addr, &bytes);
+	if (bytes == 0)
+		return 0;
+	TransferRect r = {addr, bytes, 0, bytes, 0, 1};
+	return ResolveRect(r, currentRenderVfb_);
+}
+
+int FramebufferManager::ResolveRect(const TransferRect &rect, VirtualFramebuffer *skip) {
+	TransferRect r = rect;
+	r.base = VRAMAddress(r.base);
+	if (!r.base)
+		return 0;
+
+	int count = 0;
+	for (auto iter = vfbs_.begin(); iter != vfbs_.end(); ++iter) {
+		VirtualFramebuffer *v = *iter;
+		if (!v->memoryStale || v == skip)
+			continue;
+		u32 fbStart = FramebufferStart(v);
+		if (!r.Overlaps(fbStart, fbStart + FramebufferBytes(v)))
+			continue;
+		if (count == 0) {
+			// The pending draws may be into this one.
+			transformDraw_->Flush();
+		}
+		ReadFramebufferToMemory(v);
+		count++;
+	}
+	if (count) {
+		RestoreAfterReadback();
+		gpuStats.numReadbacks += count;
+	}
+	return count;
+}
+
+void FramebufferManager::ReadFramebufferToMemory(VirtualFramebuffer *vfb) {
+	vfb->memoryStale = false;
+
+	u32 addr = FramebufferStart(vfb);
+	u32 bytes = FramebufferBytes(vfb);
+	if (!Memory::IsValidAddress(addr) || !Memory::IsValidAddress(addr + bytes - 1)) {
+		ERROR_LOG(G3D, "Framebuffer %08x doesn't fit in VRAM, can't read it back", vfb->fb_address);
+		return;
+	}
+
+	DEBUG_LOG(G3D, "Reading back FBO for %08x", vfb->fb_address);
+	FBO *scaled = 0;
+	if (renderWidth_ != 480 || renderHeight_ != 272) {
+		// Scale it down to the PSP's resolution first, keeping the rows in the same order.
+		scaled = fbo_create(vfb->width, vfb->height, 1, false, FBO_8888);
+		fbo_bind_as_render_target(scaled);
+		glstate.viewport.set(0, 0, vfb->width, vfb->height);
+		glstate.blend.disable();
+		glstate.cullFace.disable();
+		glstate.depthTest.disable();
+		glstate.scissorTest.disable();
+		fbo_bind_color_as_texture(vfb->fbo, 0);
+		DrawActiveTexture(480, 272, true);
+	} else {
+		fbo_bind_as_render_target(vfb->fbo);
+	}
+
+	readbackBuf_.resize(vfb->width * vfb->height * 4);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, vfb->width, vfb->height, GL_RGBA, GL_UNSIGNED_BYTE, &readbackBuf_[0]);
+	if (scaled)
+		fbo_destroy(scaled);
+
+	// Anything drawn past the stride isn't in memory on the PSP either.
+	int width = std::min(vfb->width, vfb->fb_stride);
+	ConvertReadbackPixels(Memory::GetPointer(addr), vfb->fb_stride, &readbackBuf_[0], vfb->width, vfb->format, width, vfb->height);
+
+	// It's a write as far as the caches are concerned.
+	TextureCache_Invalidate(addr, bytes, true);
+	transformDraw_->MemoryWritten(addr, bytes);
+}
+
+void FramebufferManager::RestoreAfterReadback() {
+	if (currentRenderVfb_) {
+		fbo_bind_as_render_target(currentRenderVfb_->fbo);
+		glstate.viewport.set(0, 0, renderWidth_, renderHeight_);
+	} else {
+		fbo_unbind();
+		glstate.viewport.set(0, 0, PSP_CoreParameter().pixelWidth, PSP_CoreParameter().pixelHeight);
+	}
+	shaderManager_->DirtyShader();
+	shaderManager_->DirtyUniform(DIRTY_ALL);
+	gstate_c.textureChanged = true;
+}
@@ -17,12 +17,22 @@
 
 #pragma once
 
-// Utility to draw a PSP framebuffer to the screen using OpenGL. Useful for running
-// homebrew but the approach isn't great.
+// Keeps track of the FBOs that stand in for the PSP's framebuffers, and draws PSP
+// framebuffers from memory to the screen (useful for running homebrew but the approach
+// isn't great).
+
+#include <list>
+#include <vector>
+
+#include "gfx_es2/fbo.h"
 
 #include "../Globals.h"
 
 struct GLSLProgram;
+struct TransferRect;
+struct BlockTransfer;
+class TransformDrawEngine;
+class ShaderManager;
 
 enum PspDisplayPixelFormat {
 	PSP_DISPLAY_PIXEL_FORMAT_565 = 0,
@@ -31,11 +41,43 @@ enum PspDisplayPixelFormat {
 	PSP_DISPLAY_PIXEL_FORMAT_8888 = 3,
 };
 
+struct VirtualFramebuffer {
+	int last_frame_used;
+
+	u32 fb_address;
+	u32 z_address;
+	int fb_stride;
+	int z_stride;
+
+	// There's also a top left of the drawing region, but meh...
+	int width;
+	int height;
+
+	int format;  // virtual, right now they are all RGBA8888
+	FBOColorDepth colorDepth;
+	FBO *fbo;
+
+	// A block transfer wrote into the memory since we last drew into the FBO, so
+	// memory is more up to date.
+	bool overwrittenByTransfer;
+	// Drawn into since memory last got a copy, so reading its memory needs a readback.
+	bool memoryStale;
+	bool renderedThisFrame;
+};
+
 class FramebufferManager {
 public:
 	FramebufferManager();
 	~FramebufferManager();
 
+	void SetTransformDrawEngine(TransformDrawEngine *td) {
+		transformDraw_ = td;
+	}
+	void SetShaderManager(ShaderManager *sm) {
+		shaderManager_ = sm;
+	}
+	void SetRenderSize(int width, int height);
+
 	/* Better do this first:
 	glstate.cullFace.disable();
 	glstate.depthTest.disable();
@@ -45,10 +87,64 @@ public:
 	void DrawPixels(const u8 *framebuf, int pixelFormat, int linesize);
 	void DrawActiveTexture(float w, float h, bool flip = false);
 
+	void BeginFrame();
+	void SetDisplayFramebuffer(u32 framebuf, u32 stride, int format);
+	void CopyDisplayToOutput();
+	// Called before each draw, uses parameters computed from gstate.
+	void SetRenderFrameBuffer();
+	// Deletes old FBOs.
+	void DecimateFBOs();
+	void DestroyAllFBOs();
+	int NumVFBs() const {
+		return (int)vfbs_.size();
+	}
+
+	// The FBOs aren't copied to memory after drawing, only when something is about to
+	// read that memory. These check for that and do the copy. Each returns the number of
+	// framebuffers read back.
+	int ResolveMemory(u32 addr, int size);
+	// Before a transfer executes. A destination that covers a framebuffer completely
+	// doesn't need its old contents.
+	int ResolveBlockTransfer(const BlockTransfer &transfer);
+	// Before a draw with the current texture. Not the render target itself though, that
+	// would mean a readback per draw.
+	int ResolveTexture();
+	// A transfer wrote into memory, after ResolveBlockTransfer.
+	void NotifyBlockTransfer(const TransferRect &rect);
+
 private:
+	VirtualFramebuffer *GetDisplayFBO();
+	int ResolveRect(const TransferRect &rect, VirtualFramebuffer *skip);
+	void ReadFramebufferToMemory(VirtualFramebuffer *vfb);
+	// Puts back the render target and the state that a readback changed.
+	void RestoreAfterReadback();
+
+	TransformDrawEngine *transformDraw_;
+	ShaderManager *shaderManager_;
+
+	u32 displayFramebufPtr_;
+	u32 prevDisplayFramebufPtr_;
+	u32 prevPrevDisplayFramebufPtr_;
+	u32 displayStride_;
+	int displayFormat_;
+
+	int renderWidth_;
+	int renderHeight_;
+	float renderWidthFactor_;
+	float renderHeightFactor_;
+
+	std::list<VirtualFramebuffer *> vfbs_;
+	VirtualFramebuffer *currentRenderVfb_;
+
+	// Used by ReadFramebufferToMemory
+	std::vector<u8> readbackBuf_;
 
 	// Used by DrawPixels
 	unsigned int backbufTex;
+	// What's in backbufTex, to skip the upload when the frame hasn't changed.
+	int backbufFormat;
+	u32 backbufHash;
+	int backbufStride;
 
 	u8 *convBuf;
 	GLSLProgram *draw2dprogram;
@@ -15,8 +15,58 @@
 // Official git repository and contact information can be found at
 // https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
 
+#include "Common.h"
 #include "IndexGenerator.h"
 
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+#include <emmintrin.h>
+#elif defined(ARM) && defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// Writes inds[i] + base for every index. Lists, points, lines and rectangles all keep
+// their indices in order, so their translation is just this, eight indices at a time.
+static u16 *TranslateIndices(u16 *out, const u16 *inds, int count, u16 base) {
+	int i = 0;
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+	const __m128i vbase = _mm_set1_epi16((short)base);
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(inds + i));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_add_epi16(v, vbase));
+	}
+#elif defined(ARM) && defined(__ARM_NEON__)
+	const uint16x8_t vbase = vdupq_n_u16(base);
+	for (; i + 8 <= count; i += 8) {
+		vst1q_u16(out + i, vaddq_u16(vld1q_u16(inds + i), vbase));
+	}
+#endif
+	for (; i < count; i++) {
+		out[i] = base + inds[i];
+	}
+	return out + count;
+}
+
+static u16 *TranslateIndices(u16 *out, const u8 *inds, int count, u16 base) {
+	int i = 0;
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+	const __m128i vbase = _mm_set1_epi16((short)base);
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(inds + i)), zero);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_add_epi16(v, vbase));
+	}
+#elif defined(ARM) && defined(__ARM_NEON__)
+	const uint16x8_t vbase = vdupq_n_u16(base);
+	for (; i + 8 <= count; i += 8) {
+		vst1q_u16(out + i, vaddq_u16(vmovl_u8(vld1_u8(inds + i)), vbase));
+	}
+#endif
+	for (; i < count; i++) {
+		out[i] = base + inds[i];
+	}
+	return out + count;
+}
+
 // Points don't need indexing...
 const u8 indexedPrimitiveType[7] = {
 	GE_PRIM_POINTS,
@@ -118,10 +168,7 @@ void IndexGenerator::AddFan(int numVerts)
 
 void IndexGenerator::TranslatePoints(int numVerts, const u8 *inds, int offset)
 {
-	for (int i = 0; i < numVerts; i++)
-	{
-		*inds_++ = index_ + offset + inds[i];
-	}
+	inds_ = TranslateIndices(inds_, inds, numVerts, index_ + offset);
 	index_ += numVerts;
 	count_ += numVerts;
 	prim_ = GE_PRIM_POINTS;
@@ -130,10 +177,7 @@ void IndexGenerator::TranslatePoints(int numVerts, const u8 *inds, int offset)
 
 void IndexGenerator::TranslatePoints(int numVerts, const u16 *inds, int offset)
 {
-	for (int i = 0; i < numVerts; i++)
-	{
-		*inds_++ = index_ + offset + inds[i];
-	}
+	inds_ = TranslateIndices(inds_, inds, numVerts, index_ + offset);
 	index_ += numVerts;
 	count_ += numVerts;
 	prim_ = GE_PRIM_POINTS;
@@ -143,12 +187,7 @@ void IndexGenerator::TranslatePoints(int numVerts, const u16 *inds, int offset)
 void IndexGenerator::TranslateList(int numVerts, const u8 *inds, int offset)
 {
 	int numTris = numVerts / 3;
-	for (int i = 0; i < numTris; i++)
-	{
-		*inds_++ = index_ + offset + inds[i*3];
-		*inds_++ = index_ + offset + inds[i*3 + 1];
-		*inds_++ = index_ + offset + inds[i*3 + 2];
-	}
+	inds_ = TranslateIndices(inds_, inds, numTris * 3, index_ + offset);
 	index_ += numVerts;
 	count_ += numTris * 3;
 	prim_ = GE_PRIM_TRIANGLES;
@@ -157,14 +196,25 @@ void IndexGenerator::TranslateList(int numVerts, const u8 *inds, int offset)
 
 void IndexGenerator::TranslateStrip(int numVerts, const u8 *inds, int offset)
 {
-	bool wind = false;
+	const u16 base = index_ + offset;
 	int numTris = numVerts - 2;
-	for (int i = 0; i < numTris; i++)
+	// Two triangles per iteration, so the winding alternation needs no branch.
+	int i = 0;
+	for (; i + 1 < numTris; i += 2)
 	{
-		*inds_++ = index_ + offset + inds[i];
-		*inds_++ = index_ + offset + inds[i + (wind?2:1)];
-		*inds_++ = index_ + offset + inds[i + (wind?1:2)];
-		wind = !wind;
+		inds_[0] = base + inds[i];
+		inds_[1] = base + inds[i + 1];
+		inds_[2] = base + inds[i + 2];
+		inds_[3] = base + inds[i + 1];
+		inds_[4] = base + inds[i + 3];
+		inds_[5] = base + inds[i + 2];
+		inds_ += 6;
+	}
+	if (i < numTris)
+	{
+		*inds_++ = base + inds[i];
+		*inds_++ = base + inds[i + 1];
+		*inds_++ = base + inds[i + 2];
 	}
 	index_ += numVerts;
 	count_ += numTris * 3;
@@ -175,12 +225,15 @@ void IndexGenerator::TranslateStrip(int numVerts, const u8 *inds, int offset)
 void IndexGenerator::TranslateFan(int numVerts, const u8 *inds, int offset)
 {
 	if (numVerts <= 0) return;
+	const u16 first = index_ + offset + inds[0];
+	const u16 base = index_ + offset;
 	int numTris = numVerts - 2;
 	for (int i = 0; i < numTris; i++)
 	{
-		*inds_++ = index_ + offset + inds[0];
-		*inds_++ = index_ + offset + inds[i + 1];
-		*inds_++ = index_ + offset + inds[i + 2];
+		inds_[0] = first;
+		inds_[1] = base + inds[i + 1];
+		inds_[2] = base + inds[i + 2];
+		inds_ += 3;
 	}
 	index_ += numVerts;
 	count_ += numTris * 3;
@@ -191,12 +244,7 @@ void IndexGenerator::TranslateFan(int numVerts, const u8 *inds, int offset)
 void IndexGenerator::TranslateList(int numVerts, const u16 *inds, int offset)
 {
 	int numTris = numVerts / 3;
-	for (int i = 0; i < numTris; i++)
-	{
-		*inds_++ = index_ + offset + inds[i*3];
-		*inds_++ = index_ + offset + inds[i*3 + 1];
-		*inds_++ = index_ + offset + inds[i*3 + 2];
-	}
+	inds_ = TranslateIndices(inds_, inds, numTris * 3, index_ + offset);
 	index_ += numVerts;
 	count_ += numTris * 3;
 	prim_ = GE_PRIM_TRIANGLES;
@@ -205,14 +253,25 @@ void IndexGenerator::TranslateList(int numVerts, const u16 *inds, int offset)
 
 void IndexGenerator::TranslateStrip(int numVerts, const u16 *inds, int offset)
 {
-	bool wind = false;
+	const u16 base = index_ + offset;
 	int numTris = numVerts - 2;
-	for (int i = 0; i < numTris; i++)
+	// Two triangles per iteration, so the winding alternation needs no branch.
+	int i = 0;
+	for (; i + 1 < numTris; i += 2)
 	{
-		*inds_++ = index_ + offset + inds[i];
-		*inds_++ = index_ + offset + inds[i + (wind?2:1)];
-		*inds_++ = index_ + offset + inds[i + (wind?1:2)];
-		wind = !wind;
+		inds_[0] = base + inds[i];
+		inds_[1] = base + inds[i + 1];
+		inds_[2] = base + inds[i + 2];
+		inds_[3] = base + inds[i + 1];
+		inds_[4] = base + inds[i + 3];
+		inds_[5] = base + inds[i + 2];
+		inds_ += 6;
+	}
+	if (i < numTris)
+	{
+		*inds_++ = base + inds[i];
+		*inds_++ = base + inds[i + 1];
+		*inds_++ = base + inds[i + 2];
 	}
 	index_ += numVerts;
 	count_ += numTris * 3;
@@ -223,12 +282,15 @@ void IndexGenerator::TranslateStrip(int numVerts, const u16 *inds, int offset)
 void IndexGenerator::TranslateFan(int numVerts, const u16 *inds, int offset)
 {
 	if (numVerts <= 0) return;
+	const u16 first = index_ + offset + inds[0];
+	const u16 base = index_ + offset;
 	int numTris = numVerts - 2;
 	for (int i = 0; i < numTris; i++)
 	{
-		*inds_++ = index_ + offset + inds[0];
-		*inds_++ = index_ + offset + inds[i + 1];
-		*inds_++ = index_ + offset + inds[i + 2];
+		inds_[0] = first;
+		inds_[1] = base + inds[i + 1];
+		inds_[2] = base + inds[i + 2];
+		inds_ += 3;
 	}
 	index_ += numVerts;
 	count_ += numTris * 3;
@@ -282,11 +344,7 @@ void IndexGenerator::AddRectangles(int numVerts)
 void IndexGenerator::TranslateLineList(int numVerts, const u8 *inds, int offset)
 {
 	int numLines = numVerts / 2;
-	for (int i = 0; i < numLines; i++)
-	{
-		*inds_++ = index_ + offset + inds[i*2];
-		*inds_++ = index_ + offset + inds[i*2+1];
-	}
+	inds_ = TranslateIndices(inds_, inds, numLines * 2, index_ + offset);
 	index_ += numVerts;
 	count_ += numLines * 2;
 	prim_ = GE_PRIM_LINES;
@@ -310,11 +368,7 @@ void IndexGenerator::TranslateLineStrip(int numVerts, const u8 *inds, int offset
 void IndexGenerator::TranslateLineList(int numVerts, const u16 *inds, int offset)
 {
 	int numLines = numVerts / 2;
-	for (int i = 0; i < numLines; i++)
-	{
-		*inds_++ = index_ + offset + inds[i*2];
-		*inds_++ = index_ + offset + inds[i*2+1];
-	}
+	inds_ = TranslateIndices(inds_, inds, numLines * 2, index_ + offset);
 	index_ += numVerts;
 	count_ += numLines * 2;
 	prim_ = GE_PRIM_LINES;
@@ -338,11 +392,7 @@ void IndexGenerator::TranslateLineStrip(int numVerts, const u16 *inds, int offse
 void IndexGenerator::TranslateRectangles(int numVerts, const u8 *inds, int offset)
 {
 	int numRects = numVerts / 2;
-	for (int i = 0; i < numRects; i++)
-	{
-		*inds_++ = index_ + offset + inds[i*2];
-		*inds_++ = index_ + offset + inds[i*2+1];
-	}
+	inds_ = TranslateIndices(inds_, inds, numRects * 2, index_ + offset);
 	index_ += numVerts;
 	count_ += numRects * 2;
 	prim_ = GE_PRIM_RECTANGLES;
@@ -352,11 +402,7 @@ void IndexGenerator::TranslateRectangles(int numVerts, const u8 *inds, int offse
 void IndexGenerator::TranslateRectangles(int numVerts, const u16 *inds, int offset)
 {
 	int numRects = numVerts / 2;
-	for (int i = 0; i < numRects; i++)
-	{
-		*inds_++ = index_ + offset + inds[i*2];
-		*inds_++ = index_ + offset + inds[i*2+1];
-	}
+	inds_ = TranslateIndices(inds_, inds, numRects * 2, index_ + offset);
 	index_ += numVerts;
 	count_ += numRects * 2;
 	prim_ = GE_PRIM_RECTANGLES;
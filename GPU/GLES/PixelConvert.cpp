@@ -0,0 +1,154 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <cstring>
+
+#include "Framebuffer.h"
+#include "PixelConvert.h"
+
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+#include <emmintrin.h>
+#elif defined(ARM) && defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// Each of these does eight pixels at a time with shifts and masks, then finishes up one
+// at a time.
+
+void ConvertRGB565ToGL(u16 *dst, const u16 *src, int count) {
+	int i = 0;
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+	const __m128i gmask = _mm_set1_epi16(0x07E0);
+	for (; i + 8 <= count; i += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i v = _mm_or_si128(_mm_srli_epi16(c, 11), _mm_slli_epi16(c, 11));
+		v = _mm_or_si128(v, _mm_and_si128(c, gmask));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+#elif defined(ARM) && defined(__ARM_NEON__)
+	const uint16x8_t gmask = vdupq_n_u16(0x07E0);
+	for (; i + 8 <= count; i += 8) {
+		uint16x8_t c = vld1q_u16(src + i);
+		uint16x8_t v = vorrq_u16(vshrq_n_u16(c, 11), vshlq_n_u16(c, 11));
+		vst1q_u16(dst + i, vorrq_u16(v, vandq_u16(c, gmask)));
+	}
+#endif
+	for (; i < count; i++) {
+		u16 c = src[i];
+		dst[i] = (c >> 11) | (c & 0x07E0) | (c << 11);
+	}
+}
+
+void ConvertRGBA5551ToGL(u16 *dst, const u16 *src, int count) {
+	int i = 0;
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+	const __m128i bmask = _mm_set1_epi16(0x003E);
+	const __m128i gmask = _mm_set1_epi16(0x07C0);
+	for (; i + 8 <= count; i += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i v = _mm_or_si128(_mm_srli_epi16(c, 15), _mm_slli_epi16(c, 11));
+		v = _mm_or_si128(v, _mm_and_si128(_mm_srli_epi16(c, 9), bmask));
+		v = _mm_or_si128(v, _mm_and_si128(_mm_slli_epi16(c, 1), gmask));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+#elif defined(ARM) && defined(__ARM_NEON__)
+	const uint16x8_t bmask = vdupq_n_u16(0x003E);
+	const uint16x8_t gmask = vdupq_n_u16(0x07C0);
+	for (; i + 8 <= count; i += 8) {
+		uint16x8_t c = vld1q_u16(src + i);
+		uint16x8_t v = vorrq_u16(vshrq_n_u16(c, 15), vshlq_n_u16(c, 11));
+		v = vorrq_u16(v, vandq_u16(vshrq_n_u16(c, 9), bmask));
+		vst1q_u16(dst + i, vorrq_u16(v, vandq_u16(vshlq_n_u16(c, 1), gmask)));
+	}
+#endif
+	for (; i < count; i++) {
+		u16 c = src[i];
+		dst[i] = (c >> 15) | ((c >> 9) & 0x003E) | ((c << 1) & 0x07C0) | (c << 11);
+	}
+}
+
+void ConvertRGBA4444ToGL(u16 *dst, const u16 *src, int count) {
+	int i = 0;
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+	const __m128i bmask = _mm_set1_epi16(0x00F0);
+	const __m128i gmask = _mm_set1_epi16(0x0F00);
+	for (; i + 8 <= count; i += 8) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i v = _mm_or_si128(_mm_srli_epi16(c, 12), _mm_slli_epi16(c, 12));
+		v = _mm_or_si128(v, _mm_and_si128(_mm_srli_epi16(c, 4), bmask));
+		v = _mm_or_si128(v, _mm_and_si128(_mm_slli_epi16(c, 4), gmask));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+#elif defined(ARM) && defined(__ARM_NEON__)
+	const uint16x8_t bmask = vdupq_n_u16(0x00F0);
+	const uint16x8_t gmask = vdupq_n_u16(0x0F00);
+	for (; i + 8 <= count; i += 8) {
+		uint16x8_t c = vld1q_u16(src + i);
+		uint16x8_t v = vorrq_u16(vshrq_n_u16(c, 12), vshlq_n_u16(c, 12));
+		v = vorrq_u16(v, vandq_u16(vshrq_n_u16(c, 4), bmask));
+		vst1q_u16(dst + i, vorrq_u16(v, vandq_u16(vshlq_n_u16(c, 4), gmask)));
+	}
+#endif
+	for (; i < count; i++) {
+		u16 c = src[i];
+		dst[i] = (c >> 12) | ((c >> 4) & 0x00F0) | ((c << 4) & 0x0F00) | (c << 12);
+	}
+}
+
+void ConvertDisplayPixels(u8 *dst, int dstStride, const u8 *src, int srcStride, int pixelFormat, int width, int height) {
+	for (int y = 0; y < height; y++) {
+		switch (pixelFormat) {
+		case PSP_DISPLAY_PIXEL_FORMAT_565:
+			ConvertRGB565ToGL((u16 *)dst + dstStride * y, (const u16 *)src + srcStride * y, width);
+			break;
+		case PSP_DISPLAY_PIXEL_FORMAT_5551:
+			ConvertRGBA5551ToGL((u16 *)dst + dstStride * y, (const u16 *)src + srcStride * y, width);
+			break;
+		case PSP_DISPLAY_PIXEL_FORMAT_4444:
+			ConvertRGBA4444ToGL((u16 *)dst + dstStride * y, (const u16 *)src + srcStride * y, width);
+			break;
+		case PSP_DISPLAY_PIXEL_FORMAT_8888:
+			// Already RGBA in memory.
+			memcpy(dst + dstStride * 4 * y, src + srcStride * 4 * y, width * 4);
+			break;
+		}
+	}
+}
+
+void ConvertReadbackPixels(u8 *dst, int dstStride, const u8 *src, int srcStride, int pixelFormat, int width, int height) {
+	for (int y = 0; y < height; y++) {
+		const u8 *s = src + srcStride * 4 * (height - 1 - y);
+		u16 *d16 = (u16 *)dst + dstStride * y;
+		switch (pixelFormat) {
+		case PSP_DISPLAY_PIXEL_FORMAT_565:
+			for (int x = 0; x < width; x++, s += 4)
+				d16[x] = (s[0] >> 3) | ((s[1] >> 2) << 5) | ((s[2] >> 3) << 11);
+			break;
+		case PSP_DISPLAY_PIXEL_FORMAT_5551:
+			for (int x = 0; x < width; x++, s += 4)
+				d16[x] = (s[0] >> 3) | ((s[1] >> 3) << 5) | ((s[2] >> 3) << 10) | ((s[3] >> 7) << 15);
+			break;
+		case PSP_DISPLAY_PIXEL_FORMAT_4444:
+			for (int x = 0; x < width; x++, s += 4)
+				d16[x] = (s[0] >> 4) | ((s[1] >> 4) << 4) | ((s[2] >> 4) << 8) | ((s[3] >> 4) << 12);
+			break;
+		case PSP_DISPLAY_PIXEL_FORMAT_8888:
+			memcpy(dst + dstStride * 4 * y, s, width * 4);
+			break;
+		}
+	}
+}
@@ -0,0 +1,40 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include "../../Globals.h"
+
+// Pixel format conversions for uploading PSP colors to GL. Doesn't touch GL, so they can
+// be tested without a context.
+
+// The PSP keeps red in the low bits of its 16-bit colors, GL's packed formats in the high
+// bits. These reorder the channels for GL_UNSIGNED_SHORT_5_6_5, _5_5_5_1 and _4_4_4_4.
+// dst may be the same as src.
+void ConvertRGB565ToGL(u16 *dst, const u16 *src, int count);
+void ConvertRGBA5551ToGL(u16 *dst, const u16 *src, int count);
+void ConvertRGBA4444ToGL(u16 *dst, const u16 *src, int count);
+
+// Converts width x height pixels of a display framebuffer in one of the
+// PspDisplayPixelFormats to what GL takes for the same format: the 16-bit formats as
+// above, 8888 as is. Strides are in pixels.
+void ConvertDisplayPixels(u8 *dst, int dstStride, const u8 *src, int srcStride, int pixelFormat, int width, int height);
+
+// The other way, for reading rendered pixels back into PSP memory. src is what
+// glReadPixels returns for GL_RGBA / GL_UNSIGNED_BYTE, so its rows are bottom up; they're
+// written top down into dst, in one of the PspDisplayPixelFormats. Strides are in pixels.
+void ConvertReadbackPixels(u8 *dst, int dstStride, const u8 *src, int srcStride, int pixelFormat, int width, int height);
@@ -24,10 +24,10 @@
 #include <windows.h>
 #endif
 
-#include <map>
-
+#include "base/timeutil.h"
 #include "math/lin/matrix4x4.h"
 
+#include "../../Common/FileUtil.h"
 #include "../GPUState.h"
 #include "../ge_constants.h"
 #include "ShaderManager.h"
@@ -315,23 +315,45 @@ void LinkedShader::updateUniforms() {
 	dirtyUniforms = 0;
 }
 
+// Written at the start of a shader cache file. Bump the version whenever the meaning of the
+// shader ID bits changes, old files are then ignored.
+static const u32 SHADER_CACHE_MAGIC = 0x48535050;  // "PPSH"
+static const u32 SHADER_CACHE_VERSION = 1;
+
+struct ShaderCacheHeader {
+	u32 magic;
+	u32 version;
+	u32 count;
+};
+
+ShaderManager::ShaderManager()
+		: lastShader(NULL), globalDirty(0xFFFFFFFF), pendingPos_(0), precompileThread_(NULL), precompileQuit_(false) {
+	codeBuffer_ = new char[16384];
+}
+
+ShaderManager::~ShaderManager() {
+	StopPrecompile();
+	SaveCache();
+	delete [] codeBuffer_;
+}
+
 void ShaderManager::DirtyUniform(u32 what) {
 	globalDirty |= what;
 }
 
 void ShaderManager::Clear() {
 	for (LinkedShaderCache::iterator iter = linkedShaderCache.begin(); iter != linkedShaderCache.end(); ++iter) {
-		delete iter->second;
+		delete iter->value;
 	}
 	for (FSCache::iterator iter = fsCache.begin(); iter != fsCache.end(); ++iter)	{
-		delete iter->second;
+		delete iter->value;
 	}
 	for (VSCache::iterator iter = vsCache.begin(); iter != vsCache.end(); ++iter)	{
-		delete iter->second;
+		delete iter->value;
 	}
-	linkedShaderCache.clear();
-	fsCache.clear();
-	vsCache.clear();
+	linkedShaderCache.Clear();
+	fsCache.Clear();
+	vsCache.Clear();
 	globalDirty = 0xFFFFFFFF;
 }
 
@@ -355,7 +377,7 @@ LinkedShader *ShaderManager::ApplyShader(int prim)
 	if (globalDirty) {
 		// Deferred dirtying! Let's see if we can make this even more clever later.
 		for (LinkedShaderCache::iterator iter = linkedShaderCache.begin(); iter != linkedShaderCache.end(); ++iter) {
-			iter->second->dirtyUniforms |= globalDirty;
+			iter->value->dirtyUniforms |= globalDirty;
 		}
 		globalDirty = 0;
 	}
@@ -379,40 +401,185 @@ LinkedShader *ShaderManager::ApplyShader(int prim)
 	lastVSID = VSID;
 	lastFSID = FSID;
 
-	VSCache::iterator vsIter = vsCache.find(VSID);
-	Shader *vs;
-	if (vsIter == vsCache.end())	{
-		// Vertex shader not in cache. Let's compile it.
-		GenerateVertexShader(prim, codeBuffer_);
-		vs = new Shader(codeBuffer_, GL_VERTEX_SHADER);
-		vsCache[VSID] = vs;
+	// Okay, let's see if there's a linked one.
+	LinkedShaderID linkedID(VSID, FSID);
+	LinkedShader *ls = linkedShaderCache.Get(linkedID);
+	if (ls == NULL) {
+		ls = GetLinkedShader(linkedID, NULL, NULL);	// This does "use" automatically
 	} else {
-		vs = vsIter->second;
+		ls->use();
 	}
 
-	FSCache::iterator fsIter = fsCache.find(FSID);
-	Shader *fs;
-	if (fsIter == fsCache.end())	{
-		// Fragment shader not in cache. Let's compile it.
-		GenerateFragmentShader(codeBuffer_);
-		fs = new Shader(codeBuffer_, GL_FRAGMENT_SHADER);
-		fsCache[FSID] = fs;
-	} else {
-		fs = fsIter->second;
+	lastShader = ls;
+	return ls;
+}
+
+// Compiles whichever of the two shaders are missing and links them. The sources are
+// generated here if not given.
+LinkedShader *ShaderManager::GetLinkedShader(const LinkedShaderID &id, const char *vsSource, const char *fsSource)
+{
+	VertexShaderID VSID = id.VSID();
+	Shader *vs = vsCache.Get(VSID);
+	if (vs == NULL) {
+		// Vertex shader not in cache. Let's compile it.
+		if (vsSource == NULL) {
+			GenerateVertexShader(VSID, codeBuffer_);
+			vsSource = codeBuffer_;
+		}
+		vs = new Shader(vsSource, GL_VERTEX_SHADER);
+		vsCache.Insert(VSID, vs);
+		gpuStats.numShadersCompiled++;
 	}
-	// Okay, we have both shaders. Let's see if there's a linked one.
-	std::pair<Shader*, Shader*> linkedID(vs, fs);
 
-	LinkedShaderCache::iterator iter = linkedShaderCache.find(linkedID);
-	LinkedShader *ls;
-	if (iter == linkedShaderCache.end()) {
-		ls = new LinkedShader(vs, fs);	// This does "use" automatically
-		linkedShaderCache[linkedID] = ls;
-	} else {
-		ls = iter->second;
-		ls->use();
+	FragmentShaderID FSID = id.FSID();
+	Shader *fs = fsCache.Get(FSID);
+	if (fs == NULL) {
+		// Fragment shader not in cache. Let's compile it.
+		if (fsSource == NULL) {
+			GenerateFragmentShader(FSID, codeBuffer_);
+			fsSource = codeBuffer_;
+		}
+		fs = new Shader(fsSource, GL_FRAGMENT_SHADER);
+		fsCache.Insert(FSID, fs);
+		gpuStats.numShadersCompiled++;
 	}
 
-	lastShader = ls;
+	LinkedShader *ls = new LinkedShader(vs, fs);
+	linkedShaderCache.Insert(id, ls);
 	return ls;
 }
+
+void ShaderManager::LoadCache(const std::string &filename)
+{
+	StopPrecompile();
+	cacheFilename_ = filename;
+	loadedIDs_.clear();
+
+	File::IOFile f(filename, "rb");
+	if (!f.IsOpen())
+		return;
+	ShaderCacheHeader header;
+	if (!f.ReadArray(&header, 1) || header.magic != SHADER_CACHE_MAGIC || header.version != SHADER_CACHE_VERSION) {
+		WARN_LOG(G3D, "Ignoring shader cache %s, bad header", filename.c_str());
+		return;
+	}
+	// Don't trust the count further than the file goes.
+	if ((u64)header.count * sizeof(LinkedShaderID) > f.GetSize() - sizeof(header)) {
+		WARN_LOG(G3D, "Ignoring shader cache %s, truncated (%d shaders claimed)", filename.c_str(), header.count);
+		return;
+	}
+	loadedIDs_.resize(header.count);
+	if (header.count == 0 || !f.ReadArray(&loadedIDs_[0], header.count)) {
+		loadedIDs_.clear();
+		return;
+	}
+
+	INFO_LOG(G3D, "Precompiling %d shaders from %s", (int)loadedIDs_.size(), filename.c_str());
+	precompileQuit_ = false;
+	precompileThread_ = new std::thread(&ShaderManager::PrecompileThread, this);
+}
+
+void ShaderManager::SaveCache()
+{
+	if (cacheFilename_.empty())
+		return;
+
+	// Everything linked this session, plus anything loaded that didn't get used.
+	std::vector<LinkedShaderID> ids;
+	ShaderIDMap<LinkedShaderID, bool> seen;
+	for (LinkedShaderCache::iterator iter = linkedShaderCache.begin(); iter != linkedShaderCache.end(); ++iter) {
+		ids.push_back(iter->key);
+		seen.Insert(iter->key, true);
+	}
+	for (size_t i = 0; i < loadedIDs_.size(); i++) {
+		if (!seen.Get(loadedIDs_[i])) {
+			ids.push_back(loadedIDs_[i]);
+			seen.Insert(loadedIDs_[i], true);
+		}
+	}
+	if (ids.empty())
+		return;
+
+	File::IOFile f(cacheFilename_, "wb");
+	ShaderCacheHeader header = {SHADER_CACHE_MAGIC, SHADER_CACHE_VERSION, (u32)ids.size()};
+	if (!f.WriteArray(&header, 1) || !f.WriteArray(&ids[0], ids.size())) {
+		ERROR_LOG(G3D, "Failed to write shader cache %s", cacheFilename_.c_str());
+	}
+}
+
+void ShaderManager::StopPrecompile()
+{
+	if (precompileThread_ != NULL) {
+		{
+			std::lock_guard<std::mutex> guard(pendingLock_);
+			precompileQuit_ = true;
+		}
+		precompileThread_->join();
+		delete precompileThread_;
+		precompileThread_ = NULL;
+	}
+	pending_.clear();
+	pendingPos_ = 0;
+}
+
+// Source generation only reads the IDs, so it doesn't need gstate or GL.
+void ShaderManager::PrecompileThread()
+{
+	Common::SetCurrentThreadName("ShaderPrecompile");
+
+	char *buffer = new char[16384];
+	for (size_t i = 0; i < loadedIDs_.size(); i++) {
+		PendingShader shader;
+		shader.id = loadedIDs_[i];
+		GenerateVertexShader(shader.id.VSID(), buffer);
+		shader.vsSource = buffer;
+		GenerateFragmentShader(shader.id.FSID(), buffer);
+		shader.fsSource = buffer;
+
+		std::lock_guard<std::mutex> guard(pendingLock_);
+		if (precompileQuit_)
+			break;
+		pending_.push_back(shader);
+	}
+	delete [] buffer;
+}
+
+void ShaderManager::CompilePending(double maxSeconds)
+{
+	if (precompileThread_ == NULL)
+		return;
+
+	double start = time_now_d();
+	bool compiled = false;
+	while (true) {
+		PendingShader shader;
+		{
+			std::lock_guard<std::mutex> guard(pendingLock_);
+			if (pendingPos_ >= pending_.size())
+				break;
+			shader = pending_[pendingPos_++];
+			if (pendingPos_ == pending_.size()) {
+				pending_.clear();
+				pendingPos_ = 0;
+			}
+		}
+
+		if (linkedShaderCache.Get(shader.id) != NULL)
+			continue;
+
+		if (!compiled && lastShader != NULL) {
+			lastShader->stop();
+		}
+		compiled = true;
+		LinkedShader *ls = GetLinkedShader(shader.id, shader.vsSource.c_str(), shader.fsSource.c_str());
+		ls->stop();
+
+		if (time_now_d() - start >= maxSeconds)
+			break;
+	}
+
+	if (compiled) {
+		// Linking switched programs behind ApplyShader's back.
+		DirtyShader();
+	}
+}
@@ -19,7 +19,10 @@
 
 #include "base/basictypes.h"
 #include "../../Globals.h"
-#include <map>
+#include <string>
+#include <vector>
+
+#include "../../Common/Thread.h"
 #include "VertexShaderGenerator.h"
 #include "FragmentShaderGenerator.h"
 
@@ -130,29 +133,139 @@ private:
 };
 
 
-class ShaderManager
+// A vertex and fragment shader ID packed together, identifying a linked program.
+struct LinkedShaderID
+{
+	LinkedShaderID() {}
+	LinkedShaderID(const VertexShaderID &vs, const FragmentShaderID &fs) {
+		d[0] = vs.d[0];
+		d[1] = vs.d[1];
+		d[2] = fs.d[0];
+	}
+	VertexShaderID VSID() const {
+		VertexShaderID id;
+		id.d[0] = d[0];
+		id.d[1] = d[1];
+		return id;
+	}
+	FragmentShaderID FSID() const {
+		FragmentShaderID id;
+		id.d[0] = d[2];
+		return id;
+	}
+	bool operator == (const LinkedShaderID &other) const {
+		return d[0] == other.d[0] && d[1] == other.d[1] && d[2] == other.d[2];
+	}
+	u32 d[3];
+};
+
+// Hash table from a shader ID (anything with a u32 d[] array) to Value, where a
+// default-constructed Value means "not found". Entries are kept densely packed in insertion
+// order so walking all of them is cheap, and are only ever removed all at once.
+template <class Key, class Value>
+class ShaderIDMap
 {
 public:
-	ShaderManager() : lastShader(NULL), globalDirty(0xFFFFFFFF) {
-		codeBuffer_ = new char[16384];
+	struct Entry {
+		Key key;
+		Value value;
+	};
+	typedef typename std::vector<Entry>::iterator iterator;
+	typedef typename std::vector<Entry>::const_iterator const_iterator;
+
+	ShaderIDMap() : slots_(16, -1) {}
+
+	Value Get(const Key &key) const {
+		size_t mask = slots_.size() - 1;
+		for (size_t i = Hash(key) & mask; slots_[i] != -1; i = (i + 1) & mask) {
+			const Entry &e = entries_[slots_[i]];
+			if (e.key == key)
+				return e.value;
+		}
+		return Value();
+	}
+
+	// The key must not be in the map already.
+	void Insert(const Key &key, Value value) {
+		if ((entries_.size() + 1) * 2 > slots_.size())
+			Grow();
+		Entry e = {key, value};
+		entries_.push_back(e);
+		Place(Hash(key), (int)entries_.size() - 1);
+	}
+
+	void Clear() {
+		entries_.clear();
+		slots_.assign(16, -1);
+	}
+
+	size_t size() const { return entries_.size(); }
+	iterator begin() { return entries_.begin(); }
+	iterator end() { return entries_.end(); }
+	const_iterator begin() const { return entries_.begin(); }
+	const_iterator end() const { return entries_.end(); }
+
+private:
+	static u32 Hash(const Key &key) {
+		u32 h = 0;
+		for (size_t i = 0; i < sizeof(key.d) / sizeof(u32); i++) {
+			h ^= key.d[i];
+			h *= 0x9E3779B1;
+			h ^= h >> 15;
+		}
+		return h;
 	}
-	~ShaderManager() {
-		delete [] codeBuffer_;
+
+	void Place(u32 hash, int index) {
+		size_t mask = slots_.size() - 1;
+		size_t i = hash & mask;
+		while (slots_[i] != -1)
+			i = (i + 1) & mask;
+		slots_[i] = index;
 	}
 
+	void Grow() {
+		slots_.assign(slots_.size() * 2, -1);
+		for (size_t i = 0; i < entries_.size(); i++)
+			Place(Hash(entries_[i].key), (int)i);
+	}
+
+	std::vector<Entry> entries_;
+	std::vector<int> slots_;
+};
+
+class ShaderManager
+{
+public:
+	ShaderManager();
+	~ShaderManager();
+
 	void ClearCache(bool deleteThem);  // TODO: deleteThem currently not respected
 	LinkedShader *ApplyShader(int prim);
 	void DirtyShader();
 	void DirtyUniform(u32 what);
 
+	// Reads the shader combinations seen in an earlier session and starts generating
+	// their source on a background thread. CompilePending then compiles and links them a
+	// few at a time on the GL thread. The list is written back to the same file by
+	// SaveCache, and on destruction.
+	void LoadCache(const std::string &filename);
+	void SaveCache();
+	// Compiles queued shaders until maxSeconds have passed. Call where a stall does the
+	// least harm, like the start of a frame.
+	void CompilePending(double maxSeconds);
+
 	int NumVertexShaders() const { return (int)vsCache.size(); }
 	int NumFragmentShaders() const { return (int)fsCache.size(); }
 	int NumPrograms() const { return (int)linkedShaderCache.size(); }
 
 private:
 	void Clear();
+	void StopPrecompile();
+	void PrecompileThread();
+	LinkedShader *GetLinkedShader(const LinkedShaderID &id, const char *vsSource, const char *fsSource);
 
-	typedef std::map<std::pair<Shader *, Shader *>, LinkedShader *> LinkedShaderCache;
+	typedef ShaderIDMap<LinkedShaderID, LinkedShader *> LinkedShaderCache;
 
 	LinkedShaderCache linkedShaderCache;
 	FragmentShaderID lastFSID;
@@ -162,9 +275,23 @@ private:
 	u32 globalDirty;
 	char *codeBuffer_;
 
-	typedef std::map<FragmentShaderID, Shader *> FSCache;
+	typedef ShaderIDMap<FragmentShaderID, Shader *> FSCache;
 	FSCache fsCache;
 
-	typedef std::map<VertexShaderID, Shader *> VSCache;
+	typedef ShaderIDMap<VertexShaderID, Shader *> VSCache;
 	VSCache vsCache;
+
+	// Persistent cache. The background thread turns loadedIDs into sources in pending_.
+	struct PendingShader {
+		LinkedShaderID id;
+		std::string vsSource;
+		std::string fsSource;
+	};
+	std::string cacheFilename_;
+	std::vector<LinkedShaderID> loadedIDs_;
+	std::vector<PendingShader> pending_;
+	size_t pendingPos_;
+	std::thread *precompileThread_;
+	std::mutex pendingLock_;
+	bool precompileQuit_;  // Protected by pendingLock_.
 };
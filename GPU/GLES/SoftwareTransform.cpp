@@ -0,0 +1,537 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <cmath>
+
+#include "Common.h"
+#include "../GPUState.h"
+#include "../ge_constants.h"
+
+#include "SoftwareTransform.h"
+#include "Vec4f.h"
+
+// Keeps zero-length vectors from turning into NaNs when normalized.
+static const float MIN_LENGTH2 = 1e-30f;
+
+// m is a 4x3 matrix as stored in gstate. Transforms four vertices at a time.
+static void TransformBatch43(float out[3][SoftwareTransformer::BATCH_SIZE], float in[3][SoftwareTransformer::BATCH_SIZE], const float m[12], bool translate, int padded) {
+	const Vec4f t0 = Vec4f::Splat(translate ? m[9] : 0.0f);
+	const Vec4f t1 = Vec4f::Splat(translate ? m[10] : 0.0f);
+	const Vec4f t2 = Vec4f::Splat(translate ? m[11] : 0.0f);
+	for (int i = 0; i < padded; i += 4) {
+		Vec4f x = Vec4f::Load(&in[0][i]);
+		Vec4f y = Vec4f::Load(&in[1][i]);
+		Vec4f z = Vec4f::Load(&in[2][i]);
+		(x * Vec4f::Splat(m[0]) + y * Vec4f::Splat(m[3]) + z * Vec4f::Splat(m[6]) + t0).Store(&out[0][i]);
+		(x * Vec4f::Splat(m[1]) + y * Vec4f::Splat(m[4]) + z * Vec4f::Splat(m[7]) + t1).Store(&out[1][i]);
+		(x * Vec4f::Splat(m[2]) + y * Vec4f::Splat(m[5]) + z * Vec4f::Splat(m[8]) + t2).Store(&out[2][i]);
+	}
+}
+
+static void GetColorFromRGB(float c[4], u32 rgb) {
+	c[0] = (rgb & 0xFF) / 255.0f;
+	c[1] = ((rgb >> 8) & 0xFF) / 255.0f;
+	c[2] = ((rgb >> 16) & 0xFF) / 255.0f;
+}
+
+void TransformUniforms::FromGState() {
+	memcpy(worldMatrix, gstate.worldMatrix, sizeof(worldMatrix));
+	materialAmbient = gstate.materialambient;
+	materialAlpha = gstate.materialalpha;
+	materialDiffuse = gstate.materialdiffuse;
+	materialSpecular = gstate.materialspecular;
+	materialEmissive = gstate.materialemissive;
+	materialSpecularCoef = gstate.materialspecularcoef;
+	ambientColor = gstate.ambientcolor;
+	ambientAlpha = gstate.ambientalpha;
+}
+
+SoftwareTransformer::SoftwareTransformer(u32 vertType, const DecVtxFormat &decFmt) : decFmt_(decFmt) {
+	TransformUniforms uniforms;
+	uniforms.FromGState();
+	Init(vertType, uniforms);
+}
+
+SoftwareTransformer::SoftwareTransformer(u32 vertType, const DecVtxFormat &decFmt, const TransformUniforms &uniforms) : decFmt_(decFmt) {
+	Init(vertType, uniforms);
+}
+
+void SoftwareTransformer::Init(u32 vertType, const TransformUniforms &uniforms) {
+	throughmode_ = (vertType & GE_VTYPE_THROUGH_MASK) != 0;
+	hasNormal_ = decFmt_.nrmfmt != DEC_NONE;
+	hasUV_ = decFmt_.uvfmt != DEC_NONE;
+	numWeights_ = 0;
+	if ((vertType & GE_VTYPE_WEIGHT_MASK) != GE_VTYPE_WEIGHT_NONE)
+		numWeights_ = ((vertType & GE_VTYPE_WEIGHTCOUNT_MASK) >> GE_VTYPE_WEIGHTCOUNT_SHIFT) + 1;
+
+	lightingEnabled_ = (gstate.lightingEnable & 1) != 0;
+	separateSpecular_ = (gstate.lmode & 1) != 0;
+	uvGenMode_ = gstate.getUVGenMode();
+	doShadeMapping_ = uvGenMode_ == 2;
+	lightsDisabled_ = !doShadeMapping_ && !(gstate.lightEnable[0] & 1) && !(gstate.lightEnable[1] & 1) && !(gstate.lightEnable[2] & 1) && !(gstate.lightEnable[3] & 1);
+	// The lighting results are only used for the colors, or the dots for shade mapping.
+	needLighting_ = lightingEnabled_ || (doShadeMapping_ && hasUV_);
+	materialUpdate_ = gstate.materialupdate & 7;
+
+	fogEnd_ = getFloat24(gstate.fog1);
+	fogSlope_ = getFloat24(gstate.fog2);
+	specCoef_ = getFloat24(uniforms.materialSpecularCoef);
+	memcpy(worldMatrix_, uniforms.worldMatrix, sizeof(worldMatrix_));
+
+	GetColorFromRGB(materialAmbient_, uniforms.materialAmbient);
+	materialAmbient_[3] = (uniforms.materialAlpha & 0xFF) / 255.0f;
+	GetColorFromRGB(materialDiffuse_, uniforms.materialDiffuse);
+	materialDiffuse_[3] = 1.0f;
+	GetColorFromRGB(materialSpecular_, uniforms.materialSpecular);
+	materialSpecular_[3] = 1.0f;
+	GetColorFromRGB(materialEmissive_, uniforms.materialEmissive);
+	materialEmissive_[3] = 0.0f;
+	GetColorFromRGB(globalAmbient_, uniforms.ambientColor);
+	globalAmbient_[3] = (uniforms.ambientAlpha & 0xFF) / 255.0f;
+}
+
+void SoftwareTransformer::Transform(TransformedVertex *transformed, const u8 *decoded, int count) {
+	for (int start = 0; start < count; start += BATCH_SIZE) {
+		int n = count - start < BATCH_SIZE ? count - start : BATCH_SIZE;
+		int padded = (n + 3) & ~3;
+
+		Decode(decoded + start * decFmt_.stride, n, padded);
+		if (throughmode_) {
+			// Do not touch the coordinates or the colors. No lighting.
+			memcpy(b_.viewPos, b_.pos, sizeof(b_.pos));
+			memset(b_.color1, 0, sizeof(b_.color1));
+			for (int i = 0; i < padded; i++)
+				b_.fog[i] = 1.0f;
+		} else {
+			if (numWeights_)
+				Skin(padded);
+			TransformToWorld(padded);
+			if (needLighting_)
+				Light(padded);
+			SelectColors(padded);
+			if (hasUV_)
+				GenerateUVs(padded);
+			TransformToView(padded);
+		}
+		Write(transformed + start, n);
+	}
+}
+
+void SoftwareTransformer::Decode(const u8 *decoded, int count, int padded) {
+	const int stride = decFmt_.stride;
+
+	// Clear everything we might read so that the padding lanes hold harmless values.
+	if (count != padded) {
+		for (int c = 0; c < 3; c++) {
+			for (int i = count; i < padded; i++)
+				b_.pos[c][i] = b_.nrm[c][i] = 0.0f;
+		}
+		for (int c = 0; c < 8; c++) {
+			for (int i = count; i < padded; i++)
+				b_.weights[c][i] = 0.0f;
+		}
+	}
+
+	switch (decFmt_.posfmt) {
+	case DEC_FLOAT_3:
+		for (int i = 0; i < count; i++) {
+			const float *p = (const float *)(decoded + i * stride + decFmt_.posoff);
+			b_.pos[0][i] = p[0];
+			b_.pos[1][i] = p[1];
+			b_.pos[2][i] = p[2];
+		}
+		break;
+	case DEC_S16_3:
+		for (int i = 0; i < count; i++) {
+			const s16 *p = (const s16 *)(decoded + i * stride + decFmt_.posoff);
+			b_.pos[0][i] = p[0] / 32767.0f;
+			b_.pos[1][i] = p[1] / 32767.0f;
+			b_.pos[2][i] = p[2] / 32767.0f;
+		}
+		break;
+	case DEC_S8_3:
+		for (int i = 0; i < count; i++) {
+			const s8 *p = (const s8 *)(decoded + i * stride + decFmt_.posoff);
+			b_.pos[0][i] = p[0] / 127.0f;
+			b_.pos[1][i] = p[1] / 127.0f;
+			b_.pos[2][i] = p[2] / 127.0f;
+		}
+		break;
+	default:
+		ERROR_LOG(G3D, "SoftwareTransformer: Unsupported Pos Format");
+		memset(b_.pos, 0, sizeof(b_.pos));
+		break;
+	}
+
+	switch (decFmt_.nrmfmt) {
+	case DEC_NONE:
+		memset(b_.nrm, 0, sizeof(b_.nrm));
+		break;
+	case DEC_FLOAT_3:
+		for (int i = 0; i < count; i++) {
+			const float *p = (const float *)(decoded + i * stride + decFmt_.nrmoff);
+			b_.nrm[0][i] = p[0];
+			b_.nrm[1][i] = p[1];
+			b_.nrm[2][i] = p[2];
+		}
+		break;
+	case DEC_S16_3:
+		for (int i = 0; i < count; i++) {
+			const s16 *p = (const s16 *)(decoded + i * stride + decFmt_.nrmoff);
+			b_.nrm[0][i] = p[0] / 32767.0f;
+			b_.nrm[1][i] = p[1] / 32767.0f;
+			b_.nrm[2][i] = p[2] / 32767.0f;
+		}
+		break;
+	case DEC_S8_3:
+		for (int i = 0; i < count; i++) {
+			const s8 *p = (const s8 *)(decoded + i * stride + decFmt_.nrmoff);
+			b_.nrm[0][i] = p[0] / 127.0f;
+			b_.nrm[1][i] = p[1] / 127.0f;
+			b_.nrm[2][i] = p[2] / 127.0f;
+		}
+		break;
+	default:
+		ERROR_LOG(G3D, "SoftwareTransformer: Unsupported Nrm Format");
+		memset(b_.nrm, 0, sizeof(b_.nrm));
+		break;
+	}
+
+	if (numWeights_) {
+		// Weights always decode to floats, the first four at w0off and the rest at w1off.
+		for (int w = 0; w < numWeights_; w++) {
+			int off = w < 4 ? decFmt_.w0off + w * 4 : decFmt_.w1off + (w - 4) * 4;
+			for (int i = 0; i < count; i++)
+				b_.weights[w][i] = *(const float *)(decoded + i * stride + off);
+		}
+	}
+
+	if (hasUV_) {
+		for (int i = 0; i < count; i++) {
+			const float *uv = (const float *)(decoded + i * stride + decFmt_.uvoff);
+			b_.uv[0][i] = uv[0];
+			b_.uv[1][i] = uv[1];
+		}
+	} else {
+		memset(b_.uv, 0, sizeof(b_.uv));
+	}
+
+	switch (decFmt_.c0fmt) {
+	case DEC_U8_4:
+		for (int i = 0; i < count; i++) {
+			const u8 *c = decoded + i * stride + decFmt_.c0off;
+			for (int j = 0; j < 4; j++)
+				b_.color0[j][i] = c[j] / 255.0f;
+		}
+		break;
+	case DEC_FLOAT_4:
+		for (int i = 0; i < count; i++) {
+			const float *c = (const float *)(decoded + i * stride + decFmt_.c0off);
+			for (int j = 0; j < 4; j++)
+				b_.color0[j][i] = c[j];
+		}
+		break;
+	default:
+		// No vertex color, the material ambient color is used instead.
+		for (int j = 0; j < 4; j++) {
+			for (int i = 0; i < padded; i++)
+				b_.color0[j][i] = materialAmbient_[j];
+		}
+		break;
+	}
+	if (count != padded) {
+		for (int j = 0; j < 4; j++) {
+			for (int i = count; i < padded; i++)
+				b_.color0[j][i] = 0.0f;
+		}
+	}
+}
+
+void SoftwareTransformer::Skin(int padded) {
+	float bonePos[3][BATCH_SIZE];
+	float boneNrm[3][BATCH_SIZE];
+
+	// Accumulate the weighted bone transforms into worldPos/worldNrm, which
+	// TransformToWorld then transforms again by the world matrix.
+	memset(b_.worldPos, 0, sizeof(b_.worldPos));
+	memset(b_.worldNrm, 0, sizeof(b_.worldNrm));
+	for (int w = 0; w < numWeights_; w++) {
+		const float *bone = gstate.boneMatrix + w * 12;
+		TransformBatch43(bonePos, b_.pos, bone, true, padded);
+		if (hasNormal_)
+			TransformBatch43(boneNrm, b_.nrm, bone, false, padded);
+		for (int i = 0; i < padded; i += 4) {
+			Vec4f weight = Vec4f::Load(&b_.weights[w][i]);
+			for (int c = 0; c < 3; c++) {
+				(Vec4f::Load(&b_.worldPos[c][i]) + Vec4f::Load(&bonePos[c][i]) * weight).Store(&b_.worldPos[c][i]);
+				if (hasNormal_)
+					(Vec4f::Load(&b_.worldNrm[c][i]) + Vec4f::Load(&boneNrm[c][i]) * weight).Store(&b_.worldNrm[c][i]);
+			}
+		}
+	}
+}
+
+void SoftwareTransformer::TransformToWorld(int padded) {
+	// Yes, skinned vertices really get multiplied by the world matrix too.
+	if (numWeights_) {
+		float skinned[3][BATCH_SIZE];
+		memcpy(skinned, b_.worldPos, sizeof(skinned));
+		TransformBatch43(b_.worldPos, skinned, worldMatrix_, true, padded);
+		if (hasNormal_) {
+			memcpy(skinned, b_.worldNrm, sizeof(skinned));
+			TransformBatch43(b_.worldNrm, skinned, worldMatrix_, false, padded);
+		}
+	} else {
+		TransformBatch43(b_.worldPos, b_.pos, worldMatrix_, true, padded);
+		if (hasNormal_)
+			TransformBatch43(b_.worldNrm, b_.nrm, worldMatrix_, false, padded);
+		else
+			memset(b_.worldNrm, 0, sizeof(b_.worldNrm));
+	}
+}
+
+void SoftwareTransformer::Light(int padded) {
+	if (lightsDisabled_) {
+		// color0 is already the unlit color.
+		memset(b_.color1, 0, sizeof(b_.color1));
+		memset(b_.dots, 0, sizeof(b_.dots));
+		return;
+	}
+
+	const Vec4f zero = Vec4f::Splat(0.0f);
+	const Vec4f one = Vec4f::Splat(1.0f);
+	const Vec4f minLength2 = Vec4f::Splat(MIN_LENGTH2);
+
+	for (int i = 0; i < padded; i += 4) {
+		Vec4f nx = Vec4f::Load(&b_.worldNrm[0][i]);
+		Vec4f ny = Vec4f::Load(&b_.worldNrm[1][i]);
+		Vec4f nz = Vec4f::Load(&b_.worldNrm[2][i]);
+		Vec4f invLen = (nx * nx + ny * ny + nz * nz).Max(minLength2).InvSqrt();
+		nx = nx * invLen;
+		ny = ny * invLen;
+		nz = nz * invLen;
+
+		Vec4f px = Vec4f::Load(&b_.worldPos[0][i]);
+		Vec4f py = Vec4f::Load(&b_.worldPos[1][i]);
+		Vec4f pz = Vec4f::Load(&b_.worldPos[2][i]);
+
+		Vec4f in[4], ambient[4], diffuse[4], specular[4];
+		for (int c = 0; c < 4; c++) {
+			in[c] = Vec4f::Load(&b_.color0[c][i]);
+			ambient[c] = (materialUpdate_ & 1) ? in[c] : Vec4f::Splat(materialAmbient_[c]);
+			diffuse[c] = (materialUpdate_ & 2) ? in[c] : Vec4f::Splat(materialDiffuse_[c]);
+			specular[c] = (materialUpdate_ & 4) ? in[c] : Vec4f::Splat(materialSpecular_[c]);
+		}
+		// The material ambient color's alpha only applies to unlit vertices.
+		if (!(materialUpdate_ & 1))
+			ambient[3] = Vec4f::Splat(1.0f);
+
+		Vec4f sum0[4], sum1[3];
+		for (int c = 0; c < 4; c++)
+			sum0[c] = Vec4f::Splat(globalAmbient_[c]) * ambient[c] + Vec4f::Splat(materialEmissive_[c]);
+		for (int c = 0; c < 3; c++)
+			sum1[c] = zero;
+
+		for (int l = 0; l < 4; l++) {
+			bool lightEnabled = (gstate.lightEnable[l] & 1) != 0;
+			if (!lightEnabled && !doShadeMapping_) {
+				zero.Store(&b_.dots[l][i]);
+				continue;
+			}
+
+			GELightComputation comp = (GELightComputation)(gstate.ltype[l] & 3);
+			GELightType type = (GELightType)((gstate.ltype[l] >> 8) & 3);
+			bool directional = type == GE_LIGHTTYPE_DIRECTIONAL;
+
+			Vec4f lx = Vec4f::Splat(gstate_c.lightpos[l][0]);
+			Vec4f ly = Vec4f::Splat(gstate_c.lightpos[l][1]);
+			Vec4f lz = Vec4f::Splat(gstate_c.lightpos[l][2]);
+			if (!directional) {
+				lx = lx - px;
+				ly = ly - py;
+				lz = lz - pz;
+			}
+
+			// Like the PSP, the diffuse dot uses the light vector before normalization.
+			Vec4f dot = (lx * nx + ly * ny + lz * nz).Max(zero);
+			if (comp == GE_LIGHTCOMP_BOTHWITHPOWDIFFUSE) {
+				float d[4];
+				dot.Store(d);
+				for (int j = 0; j < 4; j++)
+					d[j] = powf(d[j], specCoef_);
+				dot = Vec4f::Load(d);
+			}
+
+			Vec4f length2 = (lx * lx + ly * ly + lz * lz).Max(minLength2);
+			Vec4f invDistance = length2.InvSqrt();
+			lx = lx * invDistance;
+			ly = ly * invDistance;
+			lz = lz * invDistance;
+
+			Vec4f lightScale = one;
+			if (!directional) {
+				Vec4f distance = length2 * invDistance;
+				const float *att = gstate_c.lightatt[l];
+				Vec4f denom = Vec4f::Splat(att[0]) + (Vec4f::Splat(att[1]) + Vec4f::Splat(att[2]) * distance) * distance;
+				lightScale = (one / denom).Min(one);
+			}
+
+			if (comp != GE_LIGHTCOMP_ONLYDIFFUSE) {
+				// Real PSP specular uses a fixed (0,0,1) viewer direction.
+				Vec4f hx = lx, hy = ly, hz = lz + one;
+				Vec4f invLenH = (hx * hx + hy * hy + hz * hz).Max(minLength2).InvSqrt();
+				Vec4f specDot = (hx * nx + hy * ny + hz * nz) * invLenH;
+
+				float d[4], s[4], scale[4];
+				specDot.Store(d);
+				lightScale.Store(scale);
+				for (int j = 0; j < 4; j++)
+					s[j] = d[j] >= 0.0f ? powf(d[j], specCoef_) * scale[j] : 0.0f;
+				Vec4f specScale = Vec4f::Load(s);
+				for (int c = 0; c < 3; c++)
+					sum1[c] = sum1[c] + Vec4f::Splat(gstate_c.lightColor[2][l][c]) * specular[c] * specScale;
+				specDot.Store(&b_.dots[l][i]);
+			} else {
+				dot.Store(&b_.dots[l][i]);
+			}
+
+			if (lightEnabled) {
+				Vec4f diffScale = dot * lightScale;
+				for (int c = 0; c < 3; c++) {
+					sum0[c] = sum0[c] + Vec4f::Splat(gstate_c.lightColor[0][l][c]) * ambient[c]
+						+ Vec4f::Splat(gstate_c.lightColor[1][l][c]) * diffuse[c] * diffScale;
+				}
+				sum0[3] = sum0[3] + ambient[3];
+			}
+		}
+
+		// Without lighting enabled, we only came here for the dots.
+		if (lightingEnabled_) {
+			for (int c = 0; c < 4; c++)
+				sum0[c].Min(one).Store(&b_.color0[c][i]);
+			for (int c = 0; c < 3; c++)
+				sum1[c].Min(one).Store(&b_.color1[c][i]);
+			zero.Store(&b_.color1[3][i]);
+		}
+	}
+}
+
+void SoftwareTransformer::SelectColors(int padded) {
+	if (lightingEnabled_) {
+		if (!separateSpecular_) {
+			// Summed color into color0.
+			for (int c = 0; c < 4; c++) {
+				for (int i = 0; i < padded; i += 4)
+					(Vec4f::Load(&b_.color0[c][i]) + Vec4f::Load(&b_.color1[c][i])).Store(&b_.color0[c][i]);
+			}
+			memset(b_.color1, 0, sizeof(b_.color1));
+		}
+	} else {
+		// color0 is still the unlit vertex or material color.
+		memset(b_.color1, 0, sizeof(b_.color1));
+	}
+}
+
+void SoftwareTransformer::GenerateUVs(int padded) {
+	// Texture coordinate generation happens after transform and lighting, as shade mapping depends on the lights.
+	switch (uvGenMode_) {
+	case 0:
+		// UV mapping. Texture scale/offset is only performed in this mode.
+		{
+			const Vec4f uScale = Vec4f::Splat(gstate_c.uScale), uOff = Vec4f::Splat(gstate_c.uOff);
+			const Vec4f vScale = Vec4f::Splat(gstate_c.vScale), vOff = Vec4f::Splat(gstate_c.vOff);
+			for (int i = 0; i < padded; i += 4) {
+				(Vec4f::Load(&b_.uv[0][i]) * uScale + uOff).Store(&b_.uv[0][i]);
+				(Vec4f::Load(&b_.uv[1][i]) * vScale + vOff).Store(&b_.uv[1][i]);
+			}
+		}
+		break;
+
+	case 1:
+		// Projection mapping.
+		{
+			float source[3][BATCH_SIZE];
+			float uvw[3][BATCH_SIZE];
+			switch (gstate.getUVProjMode()) {
+			case 0:  // Use model space XYZ as source
+				memcpy(source, b_.pos, sizeof(source));
+				break;
+			case 1:  // Use unscaled UV as source
+				memcpy(source[0], b_.uv[0], sizeof(source[0]));
+				memcpy(source[1], b_.uv[1], sizeof(source[1]));
+				memset(source[2], 0, sizeof(source[2]));
+				break;
+			case 2:  // Use normalized normal as source
+				{
+					const Vec4f minLength2 = Vec4f::Splat(MIN_LENGTH2);
+					for (int i = 0; i < padded; i += 4) {
+						Vec4f x = Vec4f::Load(&b_.worldNrm[0][i]);
+						Vec4f y = Vec4f::Load(&b_.worldNrm[1][i]);
+						Vec4f z = Vec4f::Load(&b_.worldNrm[2][i]);
+						Vec4f invLen = (x * x + y * y + z * z).Max(minLength2).InvSqrt();
+						(x * invLen).Store(&source[0][i]);
+						(y * invLen).Store(&source[1][i]);
+						(z * invLen).Store(&source[2][i]);
+					}
+				}
+				break;
+			case 3:  // Use non-normalized normal as source!
+				memcpy(source, b_.worldNrm, sizeof(source));
+				break;
+			}
+			TransformBatch43(uvw, source, gstate.tgenMatrix, true, padded);
+			memcpy(b_.uv[0], uvw[0], sizeof(b_.uv[0]));
+			memcpy(b_.uv[1], uvw[1], sizeof(b_.uv[1]));
+		}
+		break;
+
+	case 2:
+		// Shade mapping - use dot products from light sources to generate U and V.
+		memcpy(b_.uv[0], b_.dots[gstate.getUVLS0()], sizeof(b_.uv[0]));
+		memcpy(b_.uv[1], b_.dots[gstate.getUVLS1()], sizeof(b_.uv[1]));
+		break;
+
+	case 3:
+		// Illegal
+		memset(b_.uv, 0, sizeof(b_.uv));
+		break;
+	}
+}
+
+void SoftwareTransformer::TransformToView(int padded) {
+	TransformBatch43(b_.viewPos, b_.worldPos, gstate.viewMatrix, true, padded);
+	const Vec4f fogEnd = Vec4f::Splat(fogEnd_);
+	const Vec4f fogSlope = Vec4f::Splat(fogSlope_);
+	for (int i = 0; i < padded; i += 4)
+		((Vec4f::Load(&b_.viewPos[2][i]) + fogEnd) * fogSlope).Store(&b_.fog[i]);
+}
+
+void SoftwareTransformer::Write(TransformedVertex *transformed, int count) {
+	for (int i = 0; i < count; i++) {
+		TransformedVertex &vert = transformed[i];
+		vert.x = b_.viewPos[0][i];
+		vert.y = b_.viewPos[1][i];
+		vert.z = b_.viewPos[2][i];
+		vert.fog = b_.fog[i];
+		vert.u = b_.uv[0][i];
+		vert.v = b_.uv[1][i];
+		for (int c = 0; c < 4; c++)
+			vert.color0[c] = b_.color0[c][i];
+		for (int c = 0; c < 3; c++)
+			vert.color1[c] = b_.color1[c][i];
+	}
+}
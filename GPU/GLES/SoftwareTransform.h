@@ -0,0 +1,113 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include "VertexDecoder.h"
+
+// Software transform and lighting, for when the vertex shader can't do the job
+// (through mode, rectangles) or hardware transform is turned off.
+//
+// Vertices are processed in batches, converted to structure-of-arrays form so that
+// every stage (decode, skin, transform, light, fog) can work on four vertices at a
+// time with SSE or NEON. Doesn't touch GL, so it can be used and tested without a
+// context.
+//
+// All the GE state is read from gstate and gstate_c when the transformer is
+// constructed, so make a new one for every draw.
+
+// The state that only matters to the software transform, as it's baked into the transformed
+// vertices. Draws that differ only in these can still be batched, if each keeps its own copy.
+struct TransformUniforms {
+	void FromGState();
+
+	float worldMatrix[12];
+	u32 materialAmbient;
+	u32 materialAlpha;
+	u32 materialDiffuse;
+	u32 materialSpecular;
+	u32 materialEmissive;
+	u32 materialSpecularCoef;
+	u32 ambientColor;
+	u32 ambientAlpha;
+};
+
+class SoftwareTransformer {
+public:
+	SoftwareTransformer(u32 vertType, const DecVtxFormat &decFmt);
+	// Takes the world matrix and material colors from uniforms instead of gstate.
+	SoftwareTransformer(u32 vertType, const DecVtxFormat &decFmt, const TransformUniforms &uniforms);
+
+	// Transforms count vertices from decoded (in the format given to the constructor).
+	void Transform(TransformedVertex *transformed, const u8 *decoded, int count);
+
+	enum {
+		BATCH_SIZE = 64,
+	};
+
+private:
+	// One batch of vertices, one array per component.
+	struct Batch {
+		float pos[3][BATCH_SIZE];       // Model space
+		float nrm[3][BATCH_SIZE];
+		float weights[8][BATCH_SIZE];
+		float uv[2][BATCH_SIZE];
+		float color0[4][BATCH_SIZE];    // Unlit, then lit
+		float color1[4][BATCH_SIZE];
+		float worldPos[3][BATCH_SIZE];
+		float worldNrm[3][BATCH_SIZE];
+		float viewPos[3][BATCH_SIZE];
+		float fog[BATCH_SIZE];
+		float dots[4][BATCH_SIZE];      // Per light, for shade mapping
+	};
+
+	void Init(u32 vertType, const TransformUniforms &uniforms);
+	void Decode(const u8 *decoded, int count, int padded);
+	void Skin(int padded);
+	void TransformToWorld(int padded);
+	void Light(int padded);
+	void SelectColors(int padded);
+	void GenerateUVs(int padded);
+	void TransformToView(int padded);
+	void Write(TransformedVertex *transformed, int count);
+
+	const DecVtxFormat decFmt_;
+	bool throughmode_;
+	bool hasNormal_;
+	bool hasUV_;
+	int numWeights_;
+
+	bool lightingEnabled_;
+	bool separateSpecular_;
+	bool needLighting_;
+	bool lightsDisabled_;
+	bool doShadeMapping_;
+	int materialUpdate_;
+	int uvGenMode_;
+
+	float fogEnd_;
+	float fogSlope_;
+	float specCoef_;
+	float worldMatrix_[12];
+	float materialAmbient_[4];
+	float materialDiffuse_[4];
+	float materialSpecular_[4];
+	float materialEmissive_[4];
+	float globalAmbient_[4];
+
+	Batch b_;
+};
@@ -0,0 +1,508 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "../../Core/MemMap.h"
+#include "../../native/ext/cityhash/city.h"
+#include "../GPUState.h"
+#include "../ge_constants.h"
+
+#include "Spline.h"
+#include "Vec4f.h"
+
+enum {
+	// Where each component lives in a control point or evaluated vertex, in floats.
+	// The total is padded to a multiple of four.
+	CP_POS = 0,
+	CP_NRM = 3,
+	CP_UV = 6,
+	CP_COLOR = 8,
+	CP_WEIGHTS = 12,
+
+	// A draw can't have more than 65535 indices.
+	MAX_PATCH_INDICES = 65535,
+
+	PATCH_KILL_AGE = 120,
+};
+
+// One row or column of the tessellated grid: the four control points (starting at first)
+// that affect it, and how much.
+struct PatchSample {
+	int first;
+	float weights[4];
+	float param;  // In patches, used as the texture coordinate if the vertices have none.
+};
+
+static void BezierSamples(std::vector<PatchSample> &samples, int patches, int div) {
+	samples.resize(patches * div + 1);
+	for (int i = 0; i <= patches * div; i++) {
+		int patch = std::min(i / div, patches - 1);
+		float t = (float)(i - patch * div) / (float)div;
+		float s = 1.0f - t;
+		PatchSample &sample = samples[i];
+		sample.first = patch * 3;
+		sample.weights[0] = s * s * s;
+		sample.weights[1] = 3.0f * t * s * s;
+		sample.weights[2] = 3.0f * t * t * s;
+		sample.weights[3] = t * t * t;
+		sample.param = patch + t;
+	}
+}
+
+// Cubic B-spline. A closed end continues the knots uniformly past the last control point,
+// an open end repeats the end knot so the curve reaches the end control point.
+static void SplineSamples(std::vector<PatchSample> &samples, int count, int type, int div) {
+	const int n = count - 1;
+	const int segments = count - 3;
+	float knots[256 + 5];
+	for (int i = 0; i < n + 5; i++)
+		knots[i] = 0.0f;
+	for (int i = 0; i < n - 1; i++)
+		knots[i + 3] = (float)i;
+	if ((type & 1) == 0) {
+		knots[0] = -3.0f;
+		knots[1] = -2.0f;
+		knots[2] = -1.0f;
+	}
+	if ((type & 2) == 0) {
+		knots[n + 2] = (float)(n - 1);
+		knots[n + 3] = (float)n;
+		knots[n + 4] = (float)(n + 1);
+	} else {
+		knots[n + 2] = (float)(n - 2);
+		knots[n + 3] = (float)(n - 2);
+		knots[n + 4] = (float)(n - 2);
+	}
+
+	samples.resize(segments * div + 1);
+	for (int i = 0; i <= segments * div; i++) {
+		int segment = std::min(i / div, segments - 1);
+		float t = segment + (float)(i - segment * div) / (float)div;
+
+		// The four basis functions that are non-zero in this knot span (Cox-de Boor,
+		// evaluated bottom up).
+		const int span = segment + 3;
+		float basis[4] = {1.0f};
+		float left[4], right[4];
+		for (int j = 1; j <= 3; j++) {
+			left[j] = t - knots[span + 1 - j];
+			right[j] = knots[span + j] - t;
+			float saved = 0.0f;
+			for (int r = 0; r < j; r++) {
+				float temp = basis[r] / (right[r + 1] + left[j - r]);
+				basis[r] = saved + right[r + 1] * temp;
+				saved = left[j - r] * temp;
+			}
+			basis[j] = saved;
+		}
+
+		PatchSample &sample = samples[i];
+		sample.first = segment;
+		memcpy(sample.weights, basis, sizeof(basis));
+		sample.param = t;
+	}
+}
+
+// How many indices Tessellate makes for the grid in the current patch primitive.
+static s64 PatchIndexCount(int udiv, int vdiv, int upatches, int vpatches) {
+	const s64 cols = upatches * udiv + 1;
+	const s64 rows = vpatches * vdiv + 1;
+	switch (gstate.patchprimitive & 3) {
+	case GE_PATCHPRIM_POINTS:
+		return rows * cols;
+	case GE_PATCHPRIM_LINES:
+		return 2 * (rows * (cols - 1) + cols * (rows - 1));
+	default:
+		return 6 * (rows - 1) * (cols - 1);
+	}
+}
+
+// Halves the finer division until the grid fits in one draw. Returns false if even one
+// quad per patch is too much.
+static bool LimitDivisions(int &udiv, int &vdiv, int upatches, int vpatches) {
+	while (PatchIndexCount(udiv, vdiv, upatches, vpatches) > MAX_PATCH_INDICES) {
+		if (udiv == 1 && vdiv == 1)
+			return false;
+		if (udiv >= vdiv)
+			udiv = (udiv + 1) / 2;
+		else
+			vdiv = (vdiv + 1) / 2;
+	}
+	return true;
+}
+
+static inline u8 ToColorByte(float f) {
+	int i = (int)(f * 255.0f + 0.5f);
+	return i < 0 ? 0 : (i > 255 ? 255 : i);
+}
+
+static void Tessellate(PatchMesh &mesh, const u8 *controlPoints, const DecVtxFormat &decFmt, u32 vertType, int ucount, int vcount, const std::vector<PatchSample> &usamples, const std::vector<PatchSample> &vsamples) {
+	const bool throughmode = (vertType & GE_VTYPE_THROUGH_MASK) != 0;
+	const bool hasNormal = decFmt.nrmfmt != 0;
+	const bool hasUV = decFmt.uvfmt != 0;
+	const bool hasColor = decFmt.c0fmt != 0;
+	const int numWeights = (vertType & GE_VTYPE_WEIGHT_MASK) ? ((vertType & GE_VTYPE_WEIGHTCOUNT_MASK) >> GE_VTYPE_WEIGHTCOUNT_SHIFT) + 1 : 0;
+	// Without normals there's nothing to light the patch with, so make some up from the surface.
+	const bool computeNormals = !hasNormal && (gstate.lightingEnable & 1) && !throughmode;
+	const int stride = (CP_WEIGHTS + numWeights + 3) & ~3;
+
+	// The decoder scales through mode texture coordinates to the texture size and applies
+	// reversed normals, undo that so the output decodes the same way again.
+	const float uScale = throughmode ? (float)gstate_c.curTextureWidth : 1.0f;
+	const float vScale = throughmode ? (float)gstate_c.curTextureHeight : 1.0f;
+	const float nrmScale = (gstate.reversenormals & 1) ? -1.0f : 1.0f;
+
+	std::vector<float> points(ucount * vcount * stride, 0.0f);
+	VertexReader reader((u8 *)controlPoints, decFmt);
+	for (int i = 0; i < ucount * vcount; i++) {
+		float *p = &points[i * stride];
+		reader.Goto(i);
+		reader.ReadPos(p + CP_POS);
+		if (hasNormal) {
+			reader.ReadNrm(p + CP_NRM);
+			for (int j = 0; j < 3; j++)
+				p[CP_NRM + j] *= nrmScale;
+		}
+		if (hasUV) {
+			reader.ReadUV(p + CP_UV);
+			p[CP_UV + 0] *= uScale;
+			p[CP_UV + 1] *= vScale;
+		}
+		if (hasColor)
+			reader.ReadColor0(p + CP_COLOR);
+		if (numWeights) {
+			float weights[8];
+			reader.ReadWeights(weights);
+			memcpy(p + CP_WEIGHTS, weights, numWeights * sizeof(float));
+		}
+	}
+
+	// Blending the four rows of control points along v first leaves only four points to
+	// blend along u for each vertex in the row.
+	const int cols = (int)usamples.size();
+	const int rows = (int)vsamples.size();
+	const int numVerts = cols * rows;
+	std::vector<float> grid(numVerts * stride);
+	std::vector<float> blended(ucount * stride);
+	for (int r = 0; r < rows; r++) {
+		const PatchSample &vs = vsamples[r];
+		const float *row = &points[vs.first * ucount * stride];
+		const int rowStride = ucount * stride;
+		const Vec4f v0 = Vec4f::Splat(vs.weights[0]);
+		const Vec4f v1 = Vec4f::Splat(vs.weights[1]);
+		const Vec4f v2 = Vec4f::Splat(vs.weights[2]);
+		const Vec4f v3 = Vec4f::Splat(vs.weights[3]);
+		for (int i = 0; i < rowStride; i += 4) {
+			(Vec4f::Load(row + i) * v0 + Vec4f::Load(row + rowStride + i) * v1 +
+				Vec4f::Load(row + 2 * rowStride + i) * v2 + Vec4f::Load(row + 3 * rowStride + i) * v3).Store(&blended[i]);
+		}
+
+		for (int c = 0; c < cols; c++) {
+			const PatchSample &us = usamples[c];
+			const float *b = &blended[us.first * stride];
+			float *out = &grid[(r * cols + c) * stride];
+			const Vec4f u0 = Vec4f::Splat(us.weights[0]);
+			const Vec4f u1 = Vec4f::Splat(us.weights[1]);
+			const Vec4f u2 = Vec4f::Splat(us.weights[2]);
+			const Vec4f u3 = Vec4f::Splat(us.weights[3]);
+			for (int i = 0; i < stride; i += 4) {
+				(Vec4f::Load(b + i) * u0 + Vec4f::Load(b + stride + i) * u1 +
+					Vec4f::Load(b + 2 * stride + i) * u2 + Vec4f::Load(b + 3 * stride + i) * u3).Store(out + i);
+			}
+			if (!hasUV) {
+				out[CP_UV + 0] = us.param * uScale;
+				out[CP_UV + 1] = vs.param * vScale;
+			}
+		}
+	}
+
+	if (computeNormals) {
+		const float facing = (gstate.patchfacing & 1) ? -1.0f : 1.0f;
+		for (int r = 0; r < rows; r++) {
+			for (int c = 0; c < cols; c++) {
+				const float *left = &grid[(r * cols + std::max(c - 1, 0)) * stride];
+				const float *right = &grid[(r * cols + std::min(c + 1, cols - 1)) * stride];
+				const float *up = &grid[(std::max(r - 1, 0) * cols + c) * stride];
+				const float *down = &grid[(std::min(r + 1, rows - 1) * cols + c) * stride];
+				float du[3], dv[3];
+				for (int j = 0; j < 3; j++) {
+					du[j] = right[CP_POS + j] - left[CP_POS + j];
+					dv[j] = down[CP_POS + j] - up[CP_POS + j];
+				}
+				float *n = &grid[(r * cols + c) * stride + CP_NRM];
+				n[0] = du[1] * dv[2] - du[2] * dv[1];
+				n[1] = du[2] * dv[0] - du[0] * dv[2];
+				n[2] = du[0] * dv[1] - du[1] * dv[0];
+				float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				float scale = len > 0.0f ? facing * nrmScale / len : 0.0f;
+				for (int j = 0; j < 3; j++)
+					n[j] *= scale;
+			}
+		}
+	}
+
+	// Write out in the PSP's order: weights, texcoord, color, normal, position.
+	const bool writeNormal = hasNormal || computeNormals;
+	mesh.vertType = GE_VTYPE_TC_FLOAT | GE_VTYPE_POS_FLOAT | GE_VTYPE_IDX_16BIT | (vertType & GE_VTYPE_THROUGH_MASK);
+	if (numWeights)
+		mesh.vertType |= GE_VTYPE_WEIGHT_FLOAT | (vertType & GE_VTYPE_WEIGHTCOUNT_MASK);
+	if (hasColor)
+		mesh.vertType |= GE_VTYPE_COL_8888;
+	if (writeNormal)
+		mesh.vertType |= GE_VTYPE_NRM_FLOAT;
+
+	const int vertexSize = 4 * (numWeights + 2 + (hasColor ? 1 : 0) + (writeNormal ? 3 : 0) + 3);
+	mesh.verts.resize(numVerts * vertexSize);
+	u8 *dst = &mesh.verts[0];
+	for (int i = 0; i < numVerts; i++) {
+		const float *v = &grid[i * stride];
+		float *out = (float *)dst;
+		for (int j = 0; j < numWeights; j++)
+			*out++ = v[CP_WEIGHTS + j];
+		*out++ = v[CP_UV + 0];
+		*out++ = v[CP_UV + 1];
+		if (hasColor) {
+			u8 *color = (u8 *)out++;
+			for (int j = 0; j < 4; j++)
+				color[j] = ToColorByte(v[CP_COLOR + j]);
+		}
+		if (writeNormal) {
+			for (int j = 0; j < 3; j++)
+				*out++ = v[CP_NRM + j];
+		}
+		for (int j = 0; j < 3; j++)
+			*out++ = v[CP_POS + j];
+		dst += vertexSize;
+	}
+
+	mesh.indices.clear();
+	switch (gstate.patchprimitive & 3) {
+	case GE_PATCHPRIM_POINTS:
+		mesh.prim = GE_PRIM_POINTS;
+		mesh.indices.resize(numVerts);
+		for (int i = 0; i < numVerts; i++)
+			mesh.indices[i] = i;
+		break;
+
+	case GE_PATCHPRIM_LINES:
+		mesh.prim = GE_PRIM_LINES;
+		mesh.indices.reserve(4 * numVerts);
+		for (int r = 0; r < rows; r++) {
+			for (int c = 0; c < cols; c++) {
+				int i = r * cols + c;
+				if (c + 1 < cols) {
+					mesh.indices.push_back(i);
+					mesh.indices.push_back(i + 1);
+				}
+				if (r + 1 < rows) {
+					mesh.indices.push_back(i);
+					mesh.indices.push_back(i + cols);
+				}
+			}
+		}
+		break;
+
+	default:
+		{
+			mesh.prim = GE_PRIM_TRIANGLES;
+			mesh.indices.resize((rows - 1) * (cols - 1) * 6);
+			const bool flip = (gstate.patchfacing & 1) != 0;
+			u16 *idx = mesh.indices.empty() ? 0 : &mesh.indices[0];
+			for (int r = 0; r < rows - 1; r++) {
+				for (int c = 0; c < cols - 1; c++) {
+					u16 a = r * cols + c, b = a + 1, d = a + cols, e = d + 1;
+					*idx++ = a;
+					*idx++ = flip ? d : b;
+					*idx++ = flip ? b : d;
+					*idx++ = d;
+					*idx++ = flip ? e : b;
+					*idx++ = flip ? b : e;
+				}
+			}
+		}
+		break;
+	}
+}
+
+void TessellateBezier(PatchMesh &mesh, const u8 *controlPoints, const DecVtxFormat &decFmt, u32 vertType, int ucount, int vcount) {
+	const int upatches = (ucount - 1) / 3;
+	const int vpatches = (vcount - 1) / 3;
+	int udiv = std::max(1, (int)(gstate.patchdivision & 0x7F));
+	int vdiv = std::max(1, (int)((gstate.patchdivision >> 8) & 0x7F));
+	mesh.verts.clear();
+	mesh.indices.clear();
+	if (!LimitDivisions(udiv, vdiv, upatches, vpatches)) {
+		ERROR_LOG(G3D, "Bezier patch too large to draw: %i x %i", ucount, vcount);
+		return;
+	}
+
+	std::vector<PatchSample> usamples, vsamples;
+	BezierSamples(usamples, upatches, udiv);
+	BezierSamples(vsamples, vpatches, vdiv);
+	Tessellate(mesh, controlPoints, decFmt, vertType, ucount, vcount, usamples, vsamples);
+}
+
+void TessellateSpline(PatchMesh &mesh, const u8 *controlPoints, const DecVtxFormat &decFmt, u32 vertType, int ucount, int vcount, int utype, int vtype) {
+	int udiv = std::max(1, (int)(gstate.patchdivision & 0x7F));
+	int vdiv = std::max(1, (int)((gstate.patchdivision >> 8) & 0x7F));
+	mesh.verts.clear();
+	mesh.indices.clear();
+	if (!LimitDivisions(udiv, vdiv, ucount - 3, vcount - 3)) {
+		ERROR_LOG(G3D, "Spline patch too large to draw: %i x %i", ucount, vcount);
+		return;
+	}
+
+	std::vector<PatchSample> usamples, vsamples;
+	SplineSamples(usamples, ucount, utype, udiv);
+	SplineSamples(vsamples, vcount, vtype, vdiv);
+	Tessellate(mesh, controlPoints, decFmt, vertType, ucount, vcount, usamples, vsamples);
+}
+
+bool PatchCache::Key::operator <(const Key &other) const {
+	if (dataHash != other.dataHash)
+		return dataHash < other.dataHash;
+	if (vertType != other.vertType)
+		return vertType < other.vertType;
+	if (counts != other.counts)
+		return counts < other.counts;
+	if (patchState != other.patchState)
+		return patchState < other.patchState;
+	if (texSize != other.texSize)
+		return texSize < other.texSize;
+	return morphHash < other.morphHash;
+}
+
+PatchCache::PatchCache() : lastVType_(-1) {
+}
+
+PatchCache::~PatchCache() {
+	Clear();
+}
+
+const PatchMesh *PatchCache::GetBezier(int ucount, int vcount) {
+	if (ucount < 4 || vcount < 4) {
+		ERROR_LOG(G3D, "Bad bezier patch size %i x %i", ucount, vcount);
+		return NULL;
+	}
+	return Get(ucount, vcount, 0, 0, true);
+}
+
+const PatchMesh *PatchCache::GetSpline(int ucount, int vcount, int utype, int vtype) {
+	if (ucount < 4 || vcount < 4) {
+		ERROR_LOG(G3D, "Bad spline patch size %i x %i", ucount, vcount);
+		return NULL;
+	}
+	return Get(ucount, vcount, utype, vtype, false);
+}
+
+const PatchMesh *PatchCache::Get(int ucount, int vcount, int utype, int vtype, bool bezier) {
+	const u32 vertType = gstate.vertType;
+	const int count = ucount * vcount;
+	if (!Memory::IsValidAddress(gstate_c.vertexAddr)) {
+		ERROR_LOG(G3D, "Bad vertex address %08x!", gstate_c.vertexAddr);
+		return NULL;
+	}
+	const u8 *verts = Memory::GetPointer(gstate_c.vertexAddr);
+	const u8 *inds = 0;
+	const int indexType = vertType & GE_VTYPE_IDX_MASK;
+	if (indexType != GE_VTYPE_IDX_NONE) {
+		if (!Memory::IsValidAddress(gstate_c.indexAddr)) {
+			ERROR_LOG(G3D, "Bad index address %08x!", gstate_c.indexAddr);
+			return NULL;
+		}
+		inds = Memory::GetPointer(gstate_c.indexAddr);
+	}
+
+	if (vertType != lastVType_) {
+		dec_.SetVertexType(vertType);
+		lastVType_ = vertType;
+	}
+
+	u16 lowerBound = 0;
+	u16 upperBound = count - 1;
+	if (inds)
+		GetIndexBounds((void *)inds, count, vertType, &lowerBound, &upperBound);
+
+	Key key;
+	const int vertexSize = dec_.VertexSize();
+	key.dataHash = CityHash32((const char *)verts + lowerBound * vertexSize, (upperBound - lowerBound + 1) * vertexSize);
+	if (inds)
+		key.dataHash += CityHash32((const char *)inds, count * (indexType == GE_VTYPE_IDX_16BIT ? 2 : 1));
+	key.vertType = vertType;
+	key.counts = ucount | (vcount << 8) | (utype << 16) | (vtype << 18) | (bezier ? (1 << 20) : 0);
+	key.patchState = (gstate.patchdivision & 0x7F7F) | ((gstate.patchprimitive & 3) << 16) |
+		((gstate.patchfacing & 1) << 18) | ((gstate.lightingEnable & 1) << 19) | ((gstate.reversenormals & 1) << 20);
+	// Through mode UVs are scaled to the texture size.
+	key.texSize = 0;
+	if (vertType & GE_VTYPE_THROUGH_MASK)
+		key.texSize = (gstate_c.curTextureWidth & 0xFFFF) | (gstate_c.curTextureHeight << 16);
+	key.morphHash = 0;
+	if (vertType & GE_VTYPE_MORPHCOUNT_MASK)
+		key.morphHash = CityHash32((const char *)gstate_c.morphWeights, sizeof(gstate_c.morphWeights));
+
+	auto iter = cache_.find(key);
+	if (iter != cache_.end()) {
+		iter->second->lastFrame = gpuStats.numFrames;
+		gpuStats.numCachedPatches++;
+		return iter->second;
+	}
+
+	const DecVtxFormat &decFmt = dec_.GetDecVtxFmt();
+	decoded_.resize((upperBound - lowerBound + 1) * decFmt.stride);
+	dec_.DecodeVerts(&decoded_[0], verts, inds, GE_PRIM_TRIANGLES, count, lowerBound, upperBound);
+
+	const u8 *controlPoints = &decoded_[0];
+	if (inds) {
+		// Put the control points in grid order.
+		ordered_.resize(count * decFmt.stride);
+		for (int i = 0; i < count; i++) {
+			int index = indexType == GE_VTYPE_IDX_16BIT ? ((const u16 *)inds)[i] : inds[i];
+			memcpy(&ordered_[i * decFmt.stride], &decoded_[(index - lowerBound) * decFmt.stride], decFmt.stride);
+		}
+		controlPoints = &ordered_[0];
+	}
+
+	PatchMesh *mesh = new PatchMesh();
+	if (bezier)
+		TessellateBezier(*mesh, controlPoints, decFmt, vertType, ucount, vcount);
+	else
+		TessellateSpline(*mesh, controlPoints, decFmt, vertType, ucount, vcount, utype, vtype);
+	mesh->lastFrame = gpuStats.numFrames;
+	cache_[key] = mesh;
+	gpuStats.numPatchesTessellated++;
+	return mesh;
+}
+
+void PatchCache::Decimate() {
+	for (auto iter = cache_.begin(); iter != cache_.end(); ) {
+		if (iter->second->lastFrame + PATCH_KILL_AGE < gpuStats.numFrames) {
+			delete iter->second;
+			cache_.erase(iter++);
+		}
+		else
+			++iter;
+	}
+}
+
+void PatchCache::Clear() {
+	for (auto iter = cache_.begin(); iter != cache_.end(); ++iter)
+		delete iter->second;
+	cache_.clear();
+}
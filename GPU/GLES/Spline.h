@@ -0,0 +1,82 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include "VertexDecoder.h"
+
+// Bezier and spline patches, tessellated on the CPU into ordinary indexed draws.
+//
+// The control points are decoded and the whole grid of patches is evaluated at the GE's
+// patch division, four floats at a time. The result is plain vertex data in a float vertex
+// format with 16-bit indices, so it can go through the normal drawing path.
+// Doesn't touch GL.
+struct PatchMesh {
+	std::vector<u8> verts;
+	std::vector<u16> indices;
+	u32 vertType;  // Float components, GE_VTYPE_IDX_16BIT.
+	int prim;
+	int lastFrame;
+};
+
+// controlPoints are ucount * vcount decoded vertices, row by row. The patch division,
+// primitive and facing are read from gstate.
+void TessellateBezier(PatchMesh &mesh, const u8 *controlPoints, const DecVtxFormat &decFmt, u32 vertType, int ucount, int vcount);
+// utype and vtype are the knot types: bit 0 makes the surface start at the first control
+// point, bit 1 end at the last. Otherwise the knots carry on uniformly past the end.
+void TessellateSpline(PatchMesh &mesh, const u8 *controlPoints, const DecVtxFormat &decFmt, u32 vertType, int ucount, int vcount, int utype, int vtype);
+
+// Keeps tessellated meshes around, keyed by a hash of the control points and the patch
+// state, so that static patches aren't evaluated again every frame. A mesh stays valid
+// until Decimate or Clear, so it can be queued up for drawing without a copy.
+class PatchCache {
+public:
+	PatchCache();
+	~PatchCache();
+
+	// Reads the control points at gstate_c.vertexAddr (and indexAddr) in gstate.vertType.
+	// Returns NULL if the counts or addresses are bad.
+	const PatchMesh *GetBezier(int ucount, int vcount);
+	const PatchMesh *GetSpline(int ucount, int vcount, int utype, int vtype);
+
+	void Decimate();
+	void Clear();
+
+private:
+	struct Key {
+		u32 dataHash;
+		u32 vertType;
+		u32 counts;  // ucount, vcount, knot types, bezier flag
+		u32 patchState;  // Division, primitive, facing, lighting, reversed normals
+		u32 texSize;  // Texture width and height in through mode, 0 otherwise
+		u32 morphHash;
+
+		bool operator <(const Key &other) const;
+	};
+
+	const PatchMesh *Get(int ucount, int vcount, int utype, int vtype, bool bezier);
+
+	std::map<Key, PatchMesh *> cache_;
+
+	VertexDecoder dec_;
+	u32 lastVType_;
+	std::vector<u8> decoded_;
+	std::vector<u8> ordered_;
+};
@@ -21,6 +21,8 @@
 #include "../ge_constants.h"
 #include "../GPUState.h"
 #include "TextureCache.h"
+#include "../BlockTransfer.h"
+#include "PixelConvert.h"
 #include "../Core/Config.h"
 
 // If a texture hasn't been seen for 200 frames, get rid of it.
@@ -35,6 +37,7 @@ struct TexCacheEntry {
 	int frameCounter;
 	u32 format;
 	u32 clutaddr;
+	u32 clutBytes;  // How much of the palette was loaded, 0 without one
 	u32 clutformat;
 	u32 cluthash;
 	int dim;
@@ -143,6 +146,24 @@ void TextureCache_InvalidateAll(bool force) {
 		TextureCache_Invalidate(0, 0xFFFFFFFF, force);
 }
 
+void TextureCache_InvalidateRect(const TransferRect &rect) {
+	TransferRect r = rect;
+	r.base &= 0xFFFFFFF;
+
+	for (TexCache::iterator iter = cache.begin(); iter != cache.end(); ) {
+		u32 texAddr = iter->second.addr & 0xFFFFFFF;
+		u32 clutAddr = iter->second.clutaddr & 0xFFFFFFF;
+		bool clutOverlaps = iter->second.clutBytes != 0 && r.Overlaps(clutAddr, clutAddr + iter->second.clutBytes);
+		if (r.Overlaps(texAddr, texAddr + iter->second.sizeInRAM) || clutOverlaps) {
+			gpuStats.numTextureInvalidations++;
+			glDeleteTextures(1, &iter->second.texture);
+			cache.erase(iter++);
+		} else {
+			++iter;
+		}
+	}
+}
+
 int TextureCache_NumLoadedTextures() {
 	return (int)cache.size();
 }
@@ -567,35 +588,16 @@ void decodeDXT5Block(u32 *dst, const DXT5Block *src, int pitch) {
 }
 
 void convertColors(u8 *finalBuf, GLuint dstFmt, int numPixels) {
-	// TODO: All these can be massively sped up with SSE, or even
-	// somewhat sped up using "manual simd" in 32 or 64-bit gprs.
+	u16 *p = (u16 *)finalBuf;
 	switch (dstFmt) {
 	case GL_UNSIGNED_SHORT_4_4_4_4:
-		{
-			u16 *p = (u16 *)finalBuf;
-			for (int i = 0; i < numPixels; i++) {
-				u16 c = p[i];
-				p[i] = (c >> 12) | ((c >> 4) & 0xF0) | ((c << 4) & 0xF00) | (c << 12);
-			}
-		}
+		ConvertRGBA4444ToGL(p, p, numPixels);
 		break;
 	case GL_UNSIGNED_SHORT_5_5_5_1:
-		{
-			u16 *p = (u16 *)finalBuf;
-			for (int i = 0; i < numPixels; i++) {
-				u16 c = p[i];
-				p[i] = ((c & 0x8000) >> 15) | ((c >> 9) & 0x3E) | ((c << 1) & 0x7C0) | ((c << 11) & 0xF800);
-			}
-		}
+		ConvertRGBA5551ToGL(p, p, numPixels);
 		break;
 	case GL_UNSIGNED_SHORT_5_6_5:
-		{
-			u16 *p = (u16 *)finalBuf;
-			for (int i = 0; i < numPixels; i++) {
-				u16 c = p[i];
-				p[i] = (c >> 11) | (c & 0x07E0) | (c << 11);
-			}
-		}
+		ConvertRGB565ToGL(p, p, numPixels);
 		break;
 	default:
 		{
@@ -631,114 +633,12 @@ const int bitsPerPixel[11] = {
 };
 
 
-void PSPSetTexture() {
-	u32 texaddr = (gstate.texaddr[0] & 0xFFFFF0) | ((gstate.texbufwidth[0]<<8) & 0x0F000000);
-
-	if (!Memory::IsValidAddress(texaddr)) {
-		// Bind a null texture and return.
-		glBindTexture(GL_TEXTURE_2D, 0);
-		return;
-	}
-
-	u8 level = 0;
+// Decodes one level of the current texture into one of the temp buffers, still in PSP
+// channel order. Doesn't touch GL, so the software renderer shares it through
+// TextureCache_DecodeTo8888(). Returns NULL for formats we can't decode.
+static void *DecodeTextureLevel(u32 texaddr, u8 *texptr, int level, int &w, int h, int bufw, GLenum &dstFmt, u32 &texByteAlign) {
 	u32 format = gstate.texformat & 0xF;
 	u32 clutformat = gstate.clutformat & 3;
-	u32 clutaddr = GetClutAddr(clutformat == GE_CMODE_32BIT_ABGR8888 ? 4 : 2);
-
-	u8 *texptr = Memory::GetPointer(texaddr);
-	u32 texhash = texptr ? MiniHash((u32*)texptr) : 0;
-
-	u64 cachekey = texaddr ^ texhash;
-	cachekey |= (u64) clutaddr << 32;
-	TexCache::iterator iter = cache.find(cachekey);
-	if (iter != cache.end()) {
-		//Validate the texture here (width, height etc)
-		TexCacheEntry &entry = iter->second;
-
-		int dim = gstate.texsize[0] & 0xF0F;
-		bool match = true;
-		
-		//TODO: Check more texture parameters, compute real texture hash
-		if (dim != entry.dim || entry.hash != texhash || entry.format != format)
-			match = false;
-
-		//TODO: Check more clut parameters, compute clut hash
-		if (match && (format >= GE_TFMT_CLUT4 && format <= GE_TFMT_CLUT32) &&
-			 (entry.clutformat != clutformat ||
-				entry.clutaddr != clutaddr ||
-				entry.cluthash != Memory::Read_U32(entry.clutaddr))) 
-			match = false;
-
-		// If it's not huge or has been invalidated many times, recheck the whole texture.
-		if (entry.invalidHint > 180 || (entry.invalidHint > 15 && dim <= 0x909)) {
-			entry.invalidHint = 0;
-			int bufw = gstate.texbufwidth[0] & 0x3ff;
-			int h = 1 << ((gstate.texsize[0]>>8) & 0xf);
-
-			u32 check = 0;
-			for (int i = 0; i < bufw * h; i += 4) {
-				check += Memory::ReadUnchecked_U32(texaddr + i);
-			}
-
-			if (check != entry.fullhash) {
-				match = false;
-			}
-		}
-
-		if (match) {
-			//got one!
-			entry.frameCounter = gpuStats.numFrames;
-			if (entry.texture != lastBoundTexture) {
-				glBindTexture(GL_TEXTURE_2D, entry.texture);
-				lastBoundTexture = entry.texture;
-			}
-			UpdateSamplingParams(entry, false);
-			DEBUG_LOG(G3D, "Texture at %08x Found in Cache, applying", texaddr);
-			return; //Done!
-		} else {
-			INFO_LOG(G3D, "Texture different or overwritten, reloading at %08x", texaddr);
-			glDeleteTextures(1, &entry.texture);
-			cache.erase(iter);
-		}
-	} else {
-		INFO_LOG(G3D,"No texture in cache, decoding...");
-	}
-
-	//we have to decode it
-
-	TexCacheEntry entry = {0};
-	entry.addr = texaddr;
-	entry.hash = texhash;
-	entry.format = format;
-	entry.frameCounter = gpuStats.numFrames;
-
-	if (format >= GE_TFMT_CLUT4 && format <= GE_TFMT_CLUT32) {
-		entry.clutformat = clutformat;
-		entry.clutaddr = GetClutAddr(clutformat == GE_CMODE_32BIT_ABGR8888 ? 4 : 2);
-		entry.cluthash = Memory::Read_U32(entry.clutaddr);
-	} else {
-		entry.clutaddr = 0;
-	}
-
-	int bufw = gstate.texbufwidth[0] & 0x3ff;
-	
-	entry.dim = gstate.texsize[0] & 0xF0F;
-
-	int w = 1 << (gstate.texsize[0] & 0xf);
-	int h = 1 << ((gstate.texsize[0]>>8) & 0xf);
-
-	// This would overestimate the size in many case so we underestimate instead
-	// to avoid excessive clearing caused by cache invalidations.
-	entry.sizeInRAM = (bitsPerPixel[format < 11 ? format : 0] * bufw * h / 2) / 8;
-
-	for (int i = 0; i < bufw * h; i += 4)
-		entry.fullhash += Memory::ReadUnchecked_U32(texaddr + i);
-
-	gstate_c.curTextureWidth=w;
-	gstate_c.curTextureHeight=h;
-	GLenum dstFmt = 0;
-	u32 texByteAlign = 1;
-
 	void *finalBuf = NULL;
 
 	// TODO: Look into using BGRA for 32-bit textures when the GL_EXT_texture_format_BGRA8888 extension is available, as it's faster than RGBA on some chips.
@@ -813,7 +713,7 @@ void PSPSetTexture() {
 
 		default:
 			ERROR_LOG(G3D, "Unknown CLUT4 texture mode %d", (gstate.clutformat & 3));
-			return;
+			return NULL;
 		}
 		break;
 
@@ -928,13 +828,137 @@ void PSPSetTexture() {
 	default:
 		ERROR_LOG(G3D, "Unknown Texture Format %d!!!", format);
 		finalBuf = tmpTexBuf32;
+		return NULL;
+	}
+
+	return finalBuf;
+}
+
+void TextureCache_GetTextureRange(u32 *addr, u32 *bytes) {
+	u32 format = gstate.texformat & 0xF;
+	u32 bufw = gstate.texbufwidth[0] & 0x3FF;
+	u32 h = 1 << ((gstate.texsize[0] >> 8) & 0xf);
+	*addr = (gstate.texaddr[0] & 0xFFFFF0) | ((gstate.texbufwidth[0]<<8) & 0x0F000000);
+	*bytes = bufw * h * bitsPerPixel[format < 11 ? format : 0] / 8;
+}
+
+void PSPSetTexture() {
+	u32 texaddr = (gstate.texaddr[0] & 0xFFFFF0) | ((gstate.texbufwidth[0]<<8) & 0x0F000000);
+
+	if (!Memory::IsValidAddress(texaddr)) {
+		// Bind a null texture and return.
+		glBindTexture(GL_TEXTURE_2D, 0);
 		return;
 	}
 
-	if (!finalBuf) {
-		ERROR_LOG(G3D, "NO finalbuf! Will crash!");
+	u8 level = 0;
+	u32 format = gstate.texformat & 0xF;
+	u32 clutformat = gstate.clutformat & 3;
+	u32 clutaddr = GetClutAddr(clutformat == GE_CMODE_32BIT_ABGR8888 ? 4 : 2);
+
+	u8 *texptr = Memory::GetPointer(texaddr);
+	u32 texhash = texptr ? MiniHash((u32*)texptr) : 0;
+
+	u64 cachekey = texaddr ^ texhash;
+	cachekey |= (u64) clutaddr << 32;
+	TexCache::iterator iter = cache.find(cachekey);
+	if (iter != cache.end()) {
+		//Validate the texture here (width, height etc)
+		TexCacheEntry &entry = iter->second;
+
+		int dim = gstate.texsize[0] & 0xF0F;
+		bool match = true;
+		
+		//TODO: Check more texture parameters, compute real texture hash
+		if (dim != entry.dim || entry.hash != texhash || entry.format != format)
+			match = false;
+
+		//TODO: Check more clut parameters, compute clut hash
+		if (match && (format >= GE_TFMT_CLUT4 && format <= GE_TFMT_CLUT32) &&
+			 (entry.clutformat != clutformat ||
+				entry.clutaddr != clutaddr ||
+				entry.cluthash != Memory::Read_U32(entry.clutaddr))) 
+			match = false;
+
+		// If it's not huge or has been invalidated many times, recheck the whole texture.
+		if (entry.invalidHint > 180 || (entry.invalidHint > 15 && dim <= 0x909)) {
+			entry.invalidHint = 0;
+			int bufw = gstate.texbufwidth[0] & 0x3ff;
+			int h = 1 << ((gstate.texsize[0]>>8) & 0xf);
+
+			u32 check = 0;
+			for (int i = 0; i < bufw * h; i += 4) {
+				check += Memory::ReadUnchecked_U32(texaddr + i);
+			}
+
+			if (check != entry.fullhash) {
+				match = false;
+			}
+		}
+
+		if (match) {
+			//got one!
+			entry.frameCounter = gpuStats.numFrames;
+			if (entry.texture != lastBoundTexture) {
+				glBindTexture(GL_TEXTURE_2D, entry.texture);
+				lastBoundTexture = entry.texture;
+			}
+			UpdateSamplingParams(entry, false);
+			DEBUG_LOG(G3D, "Texture at %08x Found in Cache, applying", texaddr);
+			return; //Done!
+		} else {
+			INFO_LOG(G3D, "Texture different or overwritten, reloading at %08x", texaddr);
+			glDeleteTextures(1, &entry.texture);
+			cache.erase(iter);
+		}
+	} else {
+		INFO_LOG(G3D,"No texture in cache, decoding...");
+	}
+
+	//we have to decode it
+
+	TexCacheEntry entry = {0};
+	entry.addr = texaddr;
+	entry.hash = texhash;
+	entry.format = format;
+	entry.frameCounter = gpuStats.numFrames;
+
+	if (format >= GE_TFMT_CLUT4 && format <= GE_TFMT_CLUT32) {
+		entry.clutformat = clutformat;
+		entry.clutaddr = GetClutAddr(clutformat == GE_CMODE_32BIT_ABGR8888 ? 4 : 2);
+		entry.cluthash = Memory::Read_U32(entry.clutaddr);
+		// Each loadclut unit is 32 bytes, 16 entries of 16 bits or 8 of 32.
+		entry.clutBytes = (gstate.loadclut & 0x3f) * 32;
+	} else {
+		entry.clutaddr = 0;
+		entry.clutBytes = 0;
 	}
 
+	int bufw = gstate.texbufwidth[0] & 0x3ff;
+	
+	entry.dim = gstate.texsize[0] & 0xF0F;
+
+	int w = 1 << (gstate.texsize[0] & 0xf);
+	int h = 1 << ((gstate.texsize[0]>>8) & 0xf);
+
+	// This would overestimate the size in many case so we underestimate instead
+	// to avoid excessive clearing caused by cache invalidations.
+	entry.sizeInRAM = (bitsPerPixel[format < 11 ? format : 0] * bufw * h / 2) / 8;
+
+	for (int i = 0; i < bufw * h; i += 4)
+		entry.fullhash += Memory::ReadUnchecked_U32(texaddr + i);
+
+	gstate_c.curTextureWidth=w;
+	gstate_c.curTextureHeight=h;
+	GLenum dstFmt = 0;
+	u32 texByteAlign = 1;
+
+	void *finalBuf = NULL;
+
+	finalBuf = DecodeTextureLevel(texaddr, texptr, level, w, h, bufw, dstFmt, texByteAlign);
+	if (!finalBuf)
+		return;
+
 	convertColors((u8*)finalBuf, dstFmt, bufw * h);
 
 	if (w != bufw) {
@@ -990,3 +1014,54 @@ void PSPSetTexture() {
 
 	cache[cachekey] = entry;
 }
+
+const u32 *TextureCache_DecodeTo8888(int *width, int *height) {
+	u32 texaddr = (gstate.texaddr[0] & 0xFFFFF0) | ((gstate.texbufwidth[0]<<8) & 0x0F000000);
+	if (!Memory::IsValidAddress(texaddr))
+		return NULL;
+
+	int bufw = gstate.texbufwidth[0] & 0x3ff;
+	int w = 1 << (gstate.texsize[0] & 0xf);
+	int h = 1 << ((gstate.texsize[0]>>8) & 0xf);
+
+	GLenum dstFmt = 0;
+	u32 texByteAlign = 1;
+	void *finalBuf = DecodeTextureLevel(texaddr, Memory::GetPointer(texaddr), 0, w, h, bufw, dstFmt, texByteAlign);
+	if (!finalBuf)
+		return NULL;
+
+	// Expand to 8888 and drop the stride at the same time.
+	u32 *out = tmpTexBufRearrange;
+	for (int y = 0; y < h; y++) {
+		const u16 *src16 = (const u16 *)finalBuf + y * bufw;
+		const u32 *src32 = (const u32 *)finalBuf + y * bufw;
+		u32 *dst = out + y * w;
+		switch (dstFmt) {
+		case GL_UNSIGNED_SHORT_5_6_5:
+			for (int x = 0; x < w; x++) {
+				u16 c = src16[x];
+				dst[x] = Convert5To8(c & 0x1F) | (Convert6To8((c >> 5) & 0x3F) << 8) | (Convert5To8((c >> 11) & 0x1F) << 16) | 0xFF000000;
+			}
+			break;
+		case GL_UNSIGNED_SHORT_5_5_5_1:
+			for (int x = 0; x < w; x++) {
+				u16 c = src16[x];
+				dst[x] = Convert5To8(c & 0x1F) | (Convert5To8((c >> 5) & 0x1F) << 8) | (Convert5To8((c >> 10) & 0x1F) << 16) | ((c >> 15) ? 0xFF000000 : 0);
+			}
+			break;
+		case GL_UNSIGNED_SHORT_4_4_4_4:
+			for (int x = 0; x < w; x++) {
+				u16 c = src16[x];
+				dst[x] = Convert4To8(c & 0xF) | (Convert4To8((c >> 4) & 0xF) << 8) | (Convert4To8((c >> 8) & 0xF) << 16) | (Convert4To8(c >> 12) << 24);
+			}
+			break;
+		default:
+			memcpy(dst, src32, w * sizeof(u32));
+			break;
+		}
+	}
+
+	*width = w;
+	*height = h;
+	return out;
+}
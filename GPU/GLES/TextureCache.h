@@ -19,6 +19,7 @@
 
 #include "../Globals.h"
 
+struct TransferRect;
 
 void PSPSetTexture();
 void TextureCache_Init();
@@ -28,4 +29,13 @@ void TextureCache_StartFrame();
 void TextureCache_Decimate();  // Run this once per frame to get rid of old textures.
 void TextureCache_Invalidate(u32 addr, int size, bool force);
 void TextureCache_InvalidateAll(bool force);
+// Drops the textures (and CLUTs) that share bytes with the rows of a block transfer.
+void TextureCache_InvalidateRect(const TransferRect &rect);
 int TextureCache_NumLoadedTextures();
+// The memory that level 0 of the current texture (not the CLUT) is read from.
+void TextureCache_GetTextureRange(u32 *addr, u32 *bytes);
+
+// Decodes level 0 of the current texture to 8888 (R in the low byte) without touching GL,
+// for the software renderer. Returns NULL if there's no valid texture. The buffer holds
+// width * height texels and is only valid until the next call.
+const u32 *TextureCache_DecodeTo8888(int *width, int *height);
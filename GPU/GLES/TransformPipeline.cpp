@@ -15,6 +15,8 @@
 // Official git repository and contact information can be found at
 // https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
 
+#include <algorithm>
+
 #include "base/timeutil.h"
 
 #include "../../Core/MemMap.h"
@@ -31,6 +33,8 @@
 #include "StateMapping.h"
 #include "TextureCache.h"
 #include "TransformPipeline.h"
+#include "SoftwareTransform.h"
+#include "Spline.h"
 #include "VertexDecoder.h"
 #include "ShaderManager.h"
 #include "DisplayListInterpreter.h"
@@ -50,8 +54,14 @@ TransformDrawEngine::TransformDrawEngine()
 	  collectedVerts(0),
 		prevPrim_(-1),
 		lastVType_(-1),
+		dec_(0),
 		curVbo_(0),
-		shaderManager_(0) {
+		vaiBytes_(0),
+		shaderManager_(0),
+		numUniforms_(0),
+		uniformsVersion_(0),
+		snapshotVersion_(0) {
+	decJitCache_ = new VertexDecoderJitCache();
 	decoded = new u8[65536 * 48];
 	decIndex = new u16[65536];
 	transformed = new TransformedVertex[65536];
@@ -69,6 +79,10 @@ TransformDrawEngine::~TransformDrawEngine() {
 	delete [] decIndex;
 	delete [] transformed;
 	delete [] transformedExpanded;
+	for (auto iter = decoderMap_.begin(); iter != decoderMap_.end(); iter++) {
+		delete iter->second;
+	}
+	delete decJitCache_;
 	unregister_gl_resource_holder(this);
 }
 
@@ -97,194 +111,19 @@ void TransformDrawEngine::GLLost() {
 	InitDeviceObjects();
 }
 
-// Just to get something on the screen, we'll just not subdivide correctly.
 void TransformDrawEngine::DrawBezier(int ucount, int vcount) {
-	u16 indices[3 * 3 * 6];
-
-	// Generate indices for a rectangular mesh.
-	int c = 0;
-	for (int y = 0; y < 3; y++) {
-		for (int x = 0; x < 3; x++) {
-			indices[c++] = y * 4 + x;
-			indices[c++] = y * 4 + x + 1;
-			indices[c++] = (y + 1) * 4 + x + 1;
-			indices[c++] = (y + 1) * 4 + x + 1;
-			indices[c++] = (y + 1) * 4 + x;
-			indices[c++] = y * 4 + x;
-		}
-	}
-
-	// We are free to use the "decoded" buffer here.
-	// Let's split it into two to get a second buffer, there's enough space.
-	u8 *decoded2 = decoded + 65536 * 24;
-
-	// Alright, now for the vertex data.
-	// For now, we will simply inject UVs.
-
-	float customUV[4 * 4 * 2];
-	for (int y = 0; y < 4; y++) {
-		for (int x = 0; x < 4; x++) {
-			customUV[(y * 4 + x) * 2 + 0] = (float)x/3.0f;
-			customUV[(y * 4 + x) * 2 + 1] = (float)y/3.0f;
-		}
-	}
-
-	if (!(gstate.vertType & GE_VTYPE_TC_MASK)) {
-		dec.SetVertexType(gstate.vertType);
-		u32 newVertType = dec.InjectUVs(decoded2, Memory::GetPointer(gstate_c.vertexAddr), customUV, 16);
-		SubmitPrim(decoded2, &indices[0], GE_PRIM_TRIANGLES, c, newVertType, GE_VTYPE_IDX_16BIT, 0);
-	} else {
-		SubmitPrim(Memory::GetPointer(gstate_c.vertexAddr), &indices[0], GE_PRIM_TRIANGLES, c, gstate.vertType, GE_VTYPE_IDX_16BIT, 0);
-	}
-	Flush();  // as our vertex storage here is temporary, it will only survive one draw.
+	SubmitPatch(patchCache_.GetBezier(ucount, vcount));
 }
 
 void TransformDrawEngine::DrawSpline(int ucount, int vcount, int utype, int vtype) {
-	// TODO
-}
-
-// Convenient way to do precomputation to save the parts of the lighting calculation
-// that's common between the many vertices of a draw call.
-class Lighter {
-public:
-	Lighter();
-	void Light(float colorOut0[4], float colorOut1[4], const float colorIn[4], Vec3 pos, Vec3 normal, float dots[4]);
-
-private:
-	bool disabled_;
-	Color4 globalAmbient;
-	Color4 materialEmissive;
-	Color4 materialAmbient;
-	Color4 materialDiffuse;
-	Color4 materialSpecular;
-	float specCoef_;
-	// Vec3 viewer_;
-	bool doShadeMapping_;
-	int materialUpdate_;
-};
+	SubmitPatch(patchCache_.GetSpline(ucount, vcount, utype, vtype));
+}
 
-Lighter::Lighter() {
-	disabled_ = false;
-	doShadeMapping_ = (gstate.texmapmode & 0x3) == 2;
-	if (!doShadeMapping_ && !(gstate.lightEnable[0]&1) && !(gstate.lightEnable[1]&1) && !(gstate.lightEnable[2]&1) && !(gstate.lightEnable[3]&1))
-	{
-		disabled_ = true;
-	}
-	materialEmissive.GetFromRGB(gstate.materialemissive);
-	materialEmissive.a = 0.0f;
-	globalAmbient.GetFromRGB(gstate.ambientcolor);
-	globalAmbient.GetFromA(gstate.ambientalpha);
-	materialAmbient.GetFromRGB(gstate.materialambient);
-	materialAmbient.a = 1.0f;
-	materialDiffuse.GetFromRGB(gstate.materialdiffuse);
-	materialDiffuse.a = 1.0f;
-	materialSpecular.GetFromRGB(gstate.materialspecular);
-	materialSpecular.a = 1.0f;
-	specCoef_ = getFloat24(gstate.materialspecularcoef);
-	// viewer_ = Vec3(-gstate.viewMatrix[9], -gstate.viewMatrix[10], -gstate.viewMatrix[11]);
-	materialUpdate_ = gstate.materialupdate & 7;
-}
-
-void Lighter::Light(float colorOut0[4], float colorOut1[4], const float colorIn[4], Vec3 pos, Vec3 normal, float dots[4])
-{
-	if (disabled_) {
-		memcpy(colorOut0, colorIn, sizeof(float) * 4);
-		memset(colorOut1, 0, sizeof(float) * 4);
+void TransformDrawEngine::SubmitPatch(const PatchMesh *mesh) {
+	if (!mesh || mesh->indices.empty())
 		return;
-	}
-
-	Vec3 norm = normal.Normalized();
-	Color4 in(colorIn);
-
-	const Color4 *ambient;
-	if (materialUpdate_ & 1)
-		ambient = &in;
-	else
-		ambient = &materialAmbient;
-
-	const Color4 *diffuse;
-	if (materialUpdate_ & 2)
-		diffuse = &in;
-	else
-		diffuse = &materialDiffuse;
-
-	const Color4 *specular;
-	if (materialUpdate_ & 4)
-		specular = &in;
-	else
-		specular = &materialSpecular;
-
-	Color4 lightSum0 = globalAmbient * *ambient + materialEmissive;
-	Color4 lightSum1(0, 0, 0, 0);
-
-	for (int l = 0; l < 4; l++)
-	{
-		// can we skip this light?
-		if ((gstate.lightEnable[l] & 1) == 0 && !doShadeMapping_)
-			continue;
-
-		GELightComputation comp = (GELightComputation)(gstate.ltype[l] & 3);
-		GELightType type = (GELightType)((gstate.ltype[l] >> 8) & 3);
-		Vec3 toLight;
-
-		if (type == GE_LIGHTTYPE_DIRECTIONAL)
-			toLight = Vec3(gstate_c.lightpos[l]);  // lightdir is for spotlights
-		else
-			toLight = Vec3(gstate_c.lightpos[l]) - pos;
-
-		bool doSpecular = (comp != GE_LIGHTCOMP_ONLYDIFFUSE);
-		bool poweredDiffuse = comp == GE_LIGHTCOMP_BOTHWITHPOWDIFFUSE;
-
-		float dot = toLight * norm;
-
-		// Clamp dot to zero.
-		if (dot < 0.0f) dot = 0.0f;
-
-		if (poweredDiffuse)
-			dot = powf(dot, specCoef_);
-
-		float lightScale = 1.0f;
-		float distance = toLight.Normalize();
-		if (type != GE_LIGHTTYPE_DIRECTIONAL)
-		{
-			lightScale = 1.0f / (gstate_c.lightatt[l][0] + gstate_c.lightatt[l][1]*distance + gstate_c.lightatt[l][2]*distance*distance);
-			if (lightScale > 1.0f) lightScale = 1.0f;
-		}
-
-		Color4 lightDiff(gstate_c.lightColor[1][l], 0.0f);
-		Color4 diff = (lightDiff * *diffuse) * (dot * lightScale);
-
-		// Real PSP specular
-		Vec3 toViewer(0,0,1);
-		// Better specular
-		// Vec3 toViewer = (viewer - pos).Normalized();
-
-		if (doSpecular)
-		{
-			Vec3 halfVec = toLight;
-			halfVec += toViewer;
-			halfVec.Normalize();
-
-			dot = halfVec * norm;
-			if (dot >= 0)
-			{
-				Color4 lightSpec(gstate_c.lightColor[2][l], 0.0f);
-				lightSum1 += (lightSpec * *specular * (powf(dot, specCoef_)*lightScale));
-			}
-		}
-		dots[l] = dot;
-		if (gstate.lightEnable[l] & 1)
-		{
-			Color4 lightAmbient(gstate_c.lightColor[0][l], 1.0f);
-			lightSum0 += lightAmbient * *ambient + diff;
-		}
-	}
-
-	// 4?
-	for (int i = 0; i < 4; i++) {
-		colorOut0[i] = lightSum0[i] > 1.0f ? 1.0f : lightSum0[i];
-		colorOut1[i] = lightSum1[i] > 1.0f ? 1.0f : lightSum1[i];
-	}
+	// The cache keeps the mesh alive past the next flush, so it can be batched like any other draw.
+	SubmitPrim((void *)&mesh->verts[0], (void *)&mesh->indices[0], mesh->prim, (int)mesh->indices.size(), mesh->vertType, -1, 0);
 }
 
 struct GlTypeInfo {
@@ -362,8 +201,6 @@ static void RotateUVs(TransformedVertex v[4]) {
 void TransformDrawEngine::SoftwareTransformAndDraw(
 		int prim, u8 *decoded, LinkedShader *program, int vertexCount, u32 vertType, void *inds, int indexType, const DecVtxFormat &decVtxFormat, int maxIndex) {
 
-	bool throughmode = (vertType & GE_VTYPE_THROUGH_MASK) != 0;
-
 	// TODO: Split up into multiple draw calls for GLES 2.0 where you can't guarantee support for more than 0x10000 verts.
 
 #if defined(USING_GLES2)
@@ -371,189 +208,16 @@ void TransformDrawEngine::SoftwareTransformAndDraw(
 		vertexCount = 0x10000/3;
 #endif
 
-	Lighter lighter;
-	float fog_end = getFloat24(gstate.fog1);
-	float fog_slope = getFloat24(gstate.fog2);
-
-	VertexReader reader(decoded, decVtxFormat);
-	for (int index = 0; index < maxIndex; index++) {
-		reader.Goto(index);
-
-		float v[3] = {0, 0, 0};
-		float c0[4] = {1, 1, 1, 1};
-		float c1[4] = {0, 0, 0, 0};
-		float uv[2] = {0, 0};
-		float fogCoef = 1.0f;
-
-		if (throughmode) {
-			// Do not touch the coordinates or the colors. No lighting.
-			reader.ReadPos(v);
-			if (reader.hasColor0()) {
-				reader.ReadColor0(c0);
-				for (int j = 0; j < 4; j++) {
-					c1[j] = 0.0f;
-				}
-			} else {
-				c0[0] = (gstate.materialambient & 0xFF) / 255.f;
-				c0[1] = ((gstate.materialambient >> 8)  & 0xFF) / 255.f;
-				c0[2] = ((gstate.materialambient >> 16) & 0xFF) / 255.f;
-				c0[3] = (gstate.materialalpha & 0xFF) / 255.f;
-			}
-
-			if (reader.hasUV()) {
-				reader.ReadUV(uv);
-			}
-			fogCoef = 1.0f;
-			// Scale UV?
-		} else {
-			// We do software T&L for now
-			float out[3], norm[3];
-			float pos[3], nrm[3] = {0};
-			reader.ReadPos(pos);
-			if (reader.hasNormal())
-				reader.ReadNrm(nrm);
-
-			if ((vertType & GE_VTYPE_WEIGHT_MASK) == GE_VTYPE_WEIGHT_NONE) {
-				Vec3ByMatrix43(out, pos, gstate.worldMatrix);
-				if (reader.hasNormal()) {
-					Norm3ByMatrix43(norm, nrm, gstate.worldMatrix);
-				} else {
-					memset(norm, 0, 12);
-				}
-			} else {
-				float weights[8];
-				reader.ReadWeights(weights);
-				// Skinning
-				Vec3 psum(0,0,0);
-				Vec3 nsum(0,0,0);
-				int nweights = ((vertType & GE_VTYPE_WEIGHTCOUNT_MASK) >> GE_VTYPE_WEIGHTCOUNT_SHIFT) + 1;
-				for (int i = 0; i < nweights; i++)
-				{
-					if (weights[i] != 0.0f) {
-						Vec3ByMatrix43(out, pos, gstate.boneMatrix+i*12);
-						Vec3 tpos(out);
-						psum += tpos * weights[i];
-						if (reader.hasNormal()) {
-							Norm3ByMatrix43(norm, nrm, gstate.boneMatrix+i*12);
-							Vec3 tnorm(norm);
-							nsum += tnorm * weights[i];
-						}
-					}
-				}
-
-				// Yes, we really must multiply by the world matrix too.
-				Vec3ByMatrix43(out, psum.v, gstate.worldMatrix);
-				if (reader.hasNormal()) {
-					Norm3ByMatrix43(norm, nsum.v, gstate.worldMatrix);
-				}
-			}
-
-			// Perform lighting here if enabled. don't need to check through, it's checked above.
-			float dots[4] = {0,0,0,0};
-			float unlitColor[4] = {1, 1, 1, 1};
-			if (reader.hasColor0()) {
-				reader.ReadColor0(unlitColor);
-			} else {
-				unlitColor[0] = (gstate.materialambient & 0xFF) / 255.f;
-				unlitColor[1] = ((gstate.materialambient >> 8)  & 0xFF) / 255.f;
-				unlitColor[2] = ((gstate.materialambient >> 16) & 0xFF) / 255.f;
-				unlitColor[3] = (gstate.materialalpha & 0xFF) / 255.f;
-			}
-			float litColor0[4];
-			float litColor1[4];
-			lighter.Light(litColor0, litColor1, unlitColor, out, norm, dots);
-
-			if (gstate.lightingEnable & 1) {
-				// Don't ignore gstate.lmode - we should send two colors in that case
-				if (gstate.lmode & 1) {
-					// Separate colors
-					for (int j = 0; j < 4; j++) {
-						c0[j] = litColor0[j];
-						c1[j] = litColor1[j];
-					}
-				} else {
-					// Summed color into c0
-					for (int j = 0; j < 4; j++) {
-						c0[j] = litColor0[j] + litColor1[j];
-						c1[j] = 0.0f;
-					}
-				}
-			} else {
-				if (reader.hasColor0()) {
-					for (int j = 0; j < 4; j++) {
-						c0[j] = unlitColor[j];
-						c1[j] = 0.0f;
-					}
-				} else {
-					c0[0] = (gstate.materialambient & 0xFF) / 255.f;
-					c0[1] = ((gstate.materialambient >> 8) & 0xFF) / 255.f;
-					c0[2] = ((gstate.materialambient >> 16)& 0xFF) / 255.f;
-					c0[3] = (gstate.materialalpha & 0xFF) / 255.f;
-					memset(c1, 0, sizeof(c1));
-				}
-			}
-
-			if (reader.hasUV()) {
-				float ruv[2];
-				reader.ReadUV(ruv);
-				// Perform texture coordinate generation after the transform and lighting - one style of UV depends on lights.
-				switch (gstate.getUVGenMode())
-				{
-				case 0:	// UV mapping
-					// Texture scale/offset is only performed in this mode.
-					uv[0] = ruv[0]*gstate_c.uScale + gstate_c.uOff;
-					uv[1] = ruv[1]*gstate_c.vScale + gstate_c.vOff;
-					break;
-				case 1:
-					{
-						// Projection mapping
-						Vec3 source;
-						switch (gstate.getUVProjMode())
-						{
-						case 0: // Use model space XYZ as source
-							source = pos;
-							break;
-						case 1: // Use unscaled UV as source
-							source = Vec3(ruv[0], ruv[1], 0.0f);
-							break;
-						case 2: // Use normalized normal as source
-							source = Vec3(norm).Normalized();
-							break;
-						case 3: // Use non-normalized normal as source!
-							source = Vec3(norm);
-							break;
-						}
-
-						float uvw[3];
-						Vec3ByMatrix43(uvw, &source.x, gstate.tgenMatrix);
-						uv[0] = uvw[0];
-						uv[1] = uvw[1];
-					}
-					break;
-				case 2:
-					// Shade mapping - use dot products from light sources to generate U and V.
-					{
-						uv[0] = dots[gstate.getUVLS0()];
-						uv[1] = dots[gstate.getUVLS1()];
-					}
-					break;
-				case 3:
-					// Illegal
-					break;
-				}
-			}
-
-			// Transform the coord by the view matrix.
-			Vec3ByMatrix43(v, out, gstate.viewMatrix);
-			fogCoef = (v[2] + fog_end) * fog_slope;
-		}
-
-		// TODO: Write to a flexible buffer, we don't always need all four components.
-		memcpy(&transformed[index].x, v, 3 * sizeof(float));
-		transformed[index].fog = fogCoef;
-		memcpy(&transformed[index].u, uv, 2 * sizeof(float));
-		memcpy(&transformed[index].color0, c0, 4 * sizeof(float));
-		memcpy(&transformed[index].color1, c1, 3 * sizeof(float));
+	// Step 1: transform and light all the vertices the indices refer to. Runs of draws that
+	// were batched across uniform changes are transformed with their own uniforms.
+	for (int i = 0; i < numDrawCalls; ) {
+		int uniformIndex = drawCalls[i].uniformIndex;
+		int start = drawCalls[i].decodedStart;
+		while (++i < numDrawCalls && drawCalls[i].uniformIndex == uniformIndex)
+			continue;
+		int end = i < numDrawCalls ? drawCalls[i].decodedStart : maxIndex;
+		SoftwareTransformer transformer(vertType, decVtxFormat, uniforms_[uniformIndex]);
+		transformer.Transform(transformed + start, decoded + start * decVtxFormat.stride, end - start);
 	}
 
 	// Step 2: expand rectangles.
@@ -667,6 +331,47 @@ void TransformDrawEngine::SoftwareTransformAndDraw(
 	}
 }
 
+VertexDecoder *TransformDrawEngine::GetVertexDecoder(u32 vtype) {
+	auto iter = decoderMap_.find(vtype);
+	if (iter != decoderMap_.end())
+		return iter->second;
+	VertexDecoder *dec = new VertexDecoder();
+	dec->SetVertexType(vtype, decJitCache_);
+	decoderMap_[vtype] = dec;
+	return dec;
+}
+
+bool TransformDrawEngine::CanBatchVertexType(u32 vtype) {
+	if (!numDrawCalls || vtype == lastVType_)
+		return true;
+	// Through mode and morphing change the projection and vertex caching, so they always flush.
+	// Otherwise, formats like 565 vs 8888 colors or 8-bit vs 16-bit indices decode identically.
+	if ((vtype ^ lastVType_) & (GE_VTYPE_THROUGH_MASK | GE_VTYPE_MORPHCOUNT_MASK))
+		return false;
+	const DecVtxFormat &cur = dec_->GetDecVtxFmt();
+	const DecVtxFormat &next = GetVertexDecoder(vtype)->GetDecVtxFmt();
+	return memcmp(&cur, &next, sizeof(DecVtxFormat)) == 0;
+}
+
+bool TransformDrawEngine::BakeUniformChange() {
+	if (numDrawCalls) {
+		// Only the software transform bakes these, the shaders would need a flush.
+		// Rectangles and through mode only ever batch with their own kind, so this holds
+		// for the rest of the batch.
+		if (CanUseHardwareTransform(prevPrim_))
+			return false;
+		// Count one flush per state change between draws, not per command.
+		if (uniformsVersion_ == snapshotVersion_)
+			gpuStats.numFlushesAvoided++;
+	}
+	uniformsVersion_++;
+	return true;
+}
+
+int TransformDrawEngine::VertexSize(u32 vtype) {
+	return GetVertexDecoder(vtype)->VertexSize();
+}
+
 void TransformDrawEngine::SubmitPrim(void *verts, void *inds, int prim, int vertexCount, u32 vertType, int forceIndexType, int *bytesRead) {
 	if (vertexCount == 0)
 	{
@@ -676,16 +381,23 @@ void TransformDrawEngine::SubmitPrim(void *verts, void *inds, int prim, int vert
 	if (!indexGen.PrimCompatible(prevPrim_, prim) || numDrawCalls >= MAX_DEFERRED_DRAW_CALLS)
 		Flush();
 
-	prevPrim_ = prim;
-	// If vtype has changed, setup the vertex decoder.
-	// TODO: Simply cache the setup decoders instead.
+	// A vtype change only ends the batch if the new format doesn't decode to the same layout.
+	// The display list interpreter checks this too, but bezier and spline draws come straight here.
 	if (vertType != lastVType_) {
-		dec.SetVertexType(vertType);
+		if (!CanBatchVertexType(vertType))
+			Flush();
+		dec_ = GetVertexDecoder(vertType);
 		lastVType_ = vertType;
 	}
+	prevPrim_ = prim;
+
+	if (numUniforms_ == 0 || uniformsVersion_ != snapshotVersion_) {
+		uniforms_[numUniforms_++].FromGState();
+		snapshotVersion_ = uniformsVersion_;
+	}
 
 	if (bytesRead)
-		*bytesRead = vertexCount * dec.VertexSize();
+		*bytesRead = vertexCount * dec_->VertexSize();
 
 	if (!indexGen.Empty()) {
 		gpuStats.numJoins++;
@@ -697,26 +409,37 @@ void TransformDrawEngine::SubmitPrim(void *verts, void *inds, int prim, int vert
 	dc.verts = verts;
 	dc.inds = inds;
 	dc.vertType = vertType;
+	dc.dec = dec_;
 	dc.indexType = ((forceIndexType == -1) ? (vertType & GE_VTYPE_IDX_MASK) : forceIndexType) >> GE_VTYPE_IDX_SHIFT;
 	dc.prim = prim;
 	dc.vertexCount = vertexCount;
+	dc.uniformIndex = numUniforms_ - 1;
 	if (inds) {
-		GetIndexBounds(inds, vertexCount, vertType, &dc.indexLowerBound, &dc.indexUpperBound);
+		// Scanned lazily in UpdateIndexBounds, as draws served from the vertex cache never need them.
+		dc.indexLowerBound = 0xFFFF;
+		dc.indexUpperBound = 0;
 	} else {
 		dc.indexLowerBound = 0;
 		dc.indexUpperBound = vertexCount - 1;
 	}
 }
 
+inline void TransformDrawEngine::UpdateIndexBounds(DeferredDrawCall &dc) {
+	if (dc.indexLowerBound > dc.indexUpperBound)
+		GetIndexBounds(dc.inds, dc.vertexCount, dc.indexType << GE_VTYPE_IDX_SHIFT, &dc.indexLowerBound, &dc.indexUpperBound);
+}
+
 void TransformDrawEngine::DecodeVerts() {
 	for (int i = 0; i < numDrawCalls; i++) {
-		const DeferredDrawCall &dc = drawCalls[i];
+		DeferredDrawCall &dc = drawCalls[i];
+		UpdateIndexBounds(dc);
 
 		indexGen.SetIndex(collectedVerts);
+		dc.decodedStart = collectedVerts;
 		int indexLowerBound = dc.indexLowerBound, indexUpperBound = dc.indexUpperBound;
 
-		// Decode the verts and apply morphing
-		dec.DecodeVerts(decoded + collectedVerts * (int)dec.GetDecVtxFmt().stride,
+		// Decode the verts and apply morphing. All draws in a batch share the same decoded format.
+		dc.dec->DecodeVerts(decoded + collectedVerts * (int)dec_->GetDecVtxFmt().stride,
 			dc.verts, dc.inds, dc.prim, dc.vertexCount, indexLowerBound, indexUpperBound);
 		collectedVerts += indexUpperBound - indexLowerBound + 1;
 
@@ -765,16 +488,19 @@ void TransformDrawEngine::DecodeVerts() {
 
 u32 TransformDrawEngine::ComputeHash() {
 	u32 fullhash = 0;
-	int vertexSize = dec.GetDecVtxFmt().stride;
 
 	for (int i = 0; i < numDrawCalls; i++) {
-		if (!drawCalls[i].inds) {
-			fullhash += CityHash32((const char *)drawCalls[i].verts, vertexSize * drawCalls[i].vertexCount);
+		DeferredDrawCall &dc = drawCalls[i];
+		// Batches can mix vertex formats, so use the source size of each draw's own format.
+		int vertexSize = dc.dec->VertexSize();
+		if (!dc.inds) {
+			fullhash += CityHash32((const char *)dc.verts, vertexSize * dc.vertexCount);
 		} else {
-			fullhash += CityHash32((const char *)drawCalls[i].verts + vertexSize * drawCalls[i].indexLowerBound,
-				vertexSize * (drawCalls[i].indexUpperBound - drawCalls[i].indexLowerBound));
-			int indexSize = (dec.VertexType() & GE_VTYPE_IDX_MASK) == GE_VTYPE_IDX_16BIT ? 2 : 1;
-			fullhash += CityHash32((const char *)drawCalls[i].inds, indexSize * drawCalls[i].vertexCount);
+			UpdateIndexBounds(dc);
+			fullhash += CityHash32((const char *)dc.verts + vertexSize * dc.indexLowerBound,
+				vertexSize * (dc.indexUpperBound - dc.indexLowerBound + 1));
+			int indexSize = dc.indexType == (GE_VTYPE_IDX_16BIT >> GE_VTYPE_IDX_SHIFT) ? 2 : 1;
+			fullhash += CityHash32((const char *)dc.inds, indexSize * dc.vertexCount);
 		}
 	}
 
@@ -797,11 +523,24 @@ u32 TransformDrawEngine::ComputeFastDCID() {
 	return hash;
 }
 
-enum { VAI_KILL_AGE = 120 };
+enum {
+	VAI_KILL_AGE = 120,
+	// Frames in which a vertex array has to match its full hash before it's trusted.
+	VAI_RELIABLE_FRAMES = 4,
+	// Words sampled from each of the vertex and index data of a reliable array.
+	VAI_SAMPLES = 8,
+	// Size of all the cached buffers together, before the least recently used are dropped.
+	VAI_MAX_BYTES = 32 * 1024 * 1024,
+};
+
+void TransformDrawEngine::FreeVertexArray(VertexArrayInfo *vai) {
+	vaiBytes_ -= vai->bytes;
+	delete vai;
+}
 
 void TransformDrawEngine::ClearTrackedVertexArrays() {
 	for (auto vai = vai_.begin(); vai != vai_.end(); vai++) {
-		delete vai->second;
+		FreeVertexArray(vai->second);
 	}
 	vai_.clear();
 }
@@ -809,12 +548,123 @@ void TransformDrawEngine::ClearTrackedVertexArrays() {
 void TransformDrawEngine::DecimateTrackedVertexArrays() {
 	for (auto iter = vai_.begin(); iter != vai_.end(); ) {
 		if (iter->second->lastFrame + VAI_KILL_AGE < gpuStats.numFrames) {
-			delete iter->second;
+			FreeVertexArray(iter->second);
 			vai_.erase(iter++);
 		}
 		else
 			++iter;
 	}
+
+	if (vaiBytes_ > VAI_MAX_BYTES) {
+		// Drop the least recently used until there's a bit of room, so this doesn't happen every frame.
+		std::vector<std::pair<int, u32> > byAge;
+		byAge.reserve(vai_.size());
+		for (auto iter = vai_.begin(); iter != vai_.end(); ++iter) {
+			if (iter->second->bytes)
+				byAge.push_back(std::make_pair(iter->second->lastFrame, iter->first));
+		}
+		std::sort(byAge.begin(), byAge.end());
+		for (size_t i = 0; i < byAge.size() && vaiBytes_ > VAI_MAX_BYTES / 4 * 3; i++) {
+			auto iter = vai_.find(byAge[i].second);
+			FreeVertexArray(iter->second);
+			vai_.erase(iter);
+		}
+	}
+	patchCache_.Decimate();
+}
+
+void TransformDrawEngine::MemoryWritten(u32 addr, int size) {
+	if (size > 0)
+		pageGenerations_.Written(addr, size);
+	else
+		pageGenerations_.AllWritten();
+}
+
+void TransformDrawEngine::TrackDataRanges(VertexArrayInfo *vai) {
+	const u8 *vertStart = NULL, *vertEnd = NULL;
+	const u8 *indStart = NULL, *indEnd = NULL;
+	for (int i = 0; i < numDrawCalls; i++) {
+		const DeferredDrawCall &dc = drawCalls[i];
+		int vertexSize = dc.dec->VertexSize();
+		const u8 *start = (const u8 *)dc.verts + vertexSize * dc.indexLowerBound;
+		const u8 *end = (const u8 *)dc.verts + vertexSize * (dc.indexUpperBound + 1);
+		if (!vertStart || start < vertStart)
+			vertStart = start;
+		if (!vertEnd || end > vertEnd)
+			vertEnd = end;
+		if (dc.inds) {
+			int indexSize = dc.indexType == (GE_VTYPE_IDX_16BIT >> GE_VTYPE_IDX_SHIFT) ? 2 : 1;
+			start = (const u8 *)dc.inds;
+			end = start + indexSize * dc.vertexCount;
+			if (!indStart || start < indStart)
+				indStart = start;
+			if (!indEnd || end > indEnd)
+				indEnd = end;
+		}
+	}
+
+	vai->vertStart = vertStart;
+	vai->vertBytes = (u32)(vertEnd - vertStart);
+	vai->indStart = indStart;
+	vai->indBytes = (u32)(indEnd - indStart);
+	vai->generation = DataGeneration(vai);
+	vai->sampleHash = SampleHash(vai);
+	vai->framesValidated = 0;
+	vai->lastValidatedFrame = gpuStats.numFrames;
+}
+
+u32 TransformDrawEngine::DataGeneration(const VertexArrayInfo *vai) const {
+	u32 vertGen = pageGenerations_.Get(vai->vertStart, vai->vertBytes);
+	u32 indGen = pageGenerations_.Get(vai->indStart, vai->indBytes);
+	if (vertGen == PageGenerations::UNTRACKED || indGen == PageGenerations::UNTRACKED)
+		return PageGenerations::UNTRACKED;
+	return std::max(vertGen, indGen);
+}
+
+static u32 SampleWords(u32 hash, const u8 *data, u32 bytes) {
+	u32 words = bytes / 4;
+	if (words == 0)
+		return hash;
+	for (int i = 0; i < VAI_SAMPLES; i++) {
+		u32 word;
+		memcpy(&word, data + (words - 1) * i / (VAI_SAMPLES - 1) * 4, 4);
+		hash = (hash ^ word) * 0x01000193;
+	}
+	return hash;
+}
+
+u32 TransformDrawEngine::SampleHash(const VertexArrayInfo *vai) const {
+	return SampleWords(SampleWords(0x811C9DC5, vai->vertStart, vai->vertBytes), vai->indStart, vai->indBytes);
+}
+
+// Decides whether the deferred draws still match the data vai was made from, hashing
+// all of it only when there's a reason to.
+bool TransformDrawEngine::ValidateVertexArray(VertexArrayInfo *vai) {
+	bool newFrame = vai->lastValidatedFrame != gpuStats.numFrames;
+	u32 generation = DataGeneration(vai);
+	u32 sampleHash = generation == PageGenerations::UNTRACKED ? 0 : SampleHash(vai);
+
+	// Hashing arrays are hashed in full on every draw, so data that changes within a frame
+	// never becomes reliable. Reliable ones only when they may have changed. Memory that
+	// isn't tracked is always hashed.
+	bool fullHash = generation == PageGenerations::UNTRACKED || generation != vai->generation || sampleHash != vai->sampleHash;
+	if (vai->status == VertexArrayInfo::VAI_HASHING)
+		fullHash = true;
+	if (fullHash) {
+		if (ComputeHash() != vai->hash)
+			return false;
+		vai->generation = generation;
+		vai->sampleHash = sampleHash;
+	}
+
+	if (newFrame) {
+		vai->lastValidatedFrame = gpuStats.numFrames;
+		if (vai->status == VertexArrayInfo::VAI_HASHING && generation != PageGenerations::UNTRACKED) {
+			if (++vai->framesValidated >= VAI_RELIABLE_FRAMES)
+				vai->status = VertexArrayInfo::VAI_RELIABLE;
+		}
+	}
+	return true;
 }
 
 VertexArrayInfo::~VertexArrayInfo() {
@@ -855,7 +705,7 @@ void TransformDrawEngine::Flush() {
 				vai = iter->second;
 			} else {
 				vai = new VertexArrayInfo();
-				vai->decFmt = dec.GetDecVtxFmt();
+				vai->decFmt = dec_->GetDecVtxFmt();
 				vai_[id] = vai;
 			}
 			vai->lastFrame = gpuStats.numFrames;
@@ -864,24 +714,20 @@ void TransformDrawEngine::Flush() {
 			case VertexArrayInfo::VAI_NEW:
 				{
 					// Haven't seen this one before.
-					u32 dataHash = ComputeHash();
-					vai->hash = dataHash;
+					vai->hash = ComputeHash();
+					TrackDataRanges(vai);
 					vai->status = VertexArrayInfo::VAI_HASHING;
 					DecodeVerts(); // writes to indexGen
 					goto rotateVBO;
 				}
 
-				// Hashing - still gaining confidence about the buffer.
-				// But if we get this far it's likely to be worth creating a vertex buffer.
+				// Hashing - still gaining confidence about the buffer. Reliable - only checked
+				// when it may have changed. Either way it's likely to be worth a vertex buffer.
 			case VertexArrayInfo::VAI_HASHING:
+			case VertexArrayInfo::VAI_RELIABLE:
 				{
-					u32 newHash = ComputeHash();
 					vai->numDraws++;
-					// TODO: tweak
-					if (vai->numDraws > 100000) {
-						vai->status = VertexArrayInfo::VAI_RELIABLE;
-					}
-					if (newHash == vai->hash) {
+					if (ValidateVertexArray(vai)) {
 						gpuStats.numCachedDrawCalls++;
 					} else {
 						vai->status = VertexArrayInfo::VAI_UNRELIABLE;
@@ -893,6 +739,8 @@ void TransformDrawEngine::Flush() {
 							glDeleteBuffers(1, &vai->ebo);
 							vai->ebo = 0;
 						}
+						vaiBytes_ -= vai->bytes;
+						vai->bytes = 0;
 						DecodeVerts();
 						goto rotateVBO;
 					}
@@ -904,7 +752,8 @@ void TransformDrawEngine::Flush() {
 						
 						glGenBuffers(1, &vai->vbo);
 						glBindBuffer(GL_ARRAY_BUFFER, vai->vbo);
-						glBufferData(GL_ARRAY_BUFFER, dec.GetDecVtxFmt().stride * indexGen.MaxIndex(), decoded, GL_STATIC_DRAW);
+						glBufferData(GL_ARRAY_BUFFER, dec_->GetDecVtxFmt().stride * indexGen.MaxIndex(), decoded, GL_STATIC_DRAW);
+						vai->bytes = dec_->GetDecVtxFmt().stride * indexGen.MaxIndex();
 						// If there's only been one primitive type, and it's either TRIANGLES, LINES or POINTS,
 						// there is no need for the index buffer we built. We can then use glDrawArrays instead
 						// for a very minor speed boost.
@@ -912,10 +761,12 @@ void TransformDrawEngine::Flush() {
 							glGenBuffers(1, &vai->ebo);
 							glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vai->ebo);
 							glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(short) * indexGen.VertexCount(), (GLvoid *)decIndex, GL_STATIC_DRAW);
+							vai->bytes += sizeof(short) * indexGen.VertexCount();
 						} else {
 							vai->ebo = 0;
 							glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 						}
+						vaiBytes_ += vai->bytes;
 					} else {
 						glBindBuffer(GL_ARRAY_BUFFER, vai->vbo);
 						if (vai->ebo)
@@ -929,22 +780,6 @@ void TransformDrawEngine::Flush() {
 					break;
 				}
 
-				// Reliable - we don't even bother hashing anymore. Right now we don't go here until after a very long time.
-			case VertexArrayInfo::VAI_RELIABLE:
-				{
-					vai->numDraws++;
-					gpuStats.numCachedDrawCalls++;
-					// DecodeVerts(); // TODO : Remove
-					vbo = vai->vbo;
-					ebo = vai->ebo;
-					glBindBuffer(GL_ARRAY_BUFFER, vbo);
-					if (ebo)
-						glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-					vertexCount = vai->numVerts;
-					prim = vai->prim;
-					break;
-				}
-
 			case VertexArrayInfo::VAI_UNRELIABLE:
 				{
 					vai->numDraws++;
@@ -964,7 +799,7 @@ rotateVBO:
 				if (curVbo_ == NUM_VBOS)
 					curVbo_ = 0;
 				glBindBuffer(GL_ARRAY_BUFFER, vbo);
-				glBufferData(GL_ARRAY_BUFFER, dec.GetDecVtxFmt().stride * indexGen.MaxIndex(), decoded, GL_STREAM_DRAW);
+				glBufferData(GL_ARRAY_BUFFER, dec_->GetDecVtxFmt().stride * indexGen.MaxIndex(), decoded, GL_STREAM_DRAW);
 				if (useElements) {
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
 					glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(short) * indexGen.VertexCount(), (GLvoid *)decIndex, GL_STREAM_DRAW);
@@ -979,7 +814,7 @@ rotateVBO:
 		
 		DEBUG_LOG(G3D, "Flush prim %i! %i verts in one go", prim, vertexCount);
 
-		SetupDecFmtForDraw(program, dec.GetDecVtxFmt(), vbo ? 0 : decoded);
+		SetupDecFmtForDraw(program, dec_->GetDecVtxFmt(), vbo ? 0 : decoded);
 		if (useElements) {
 			glDrawElements(glprim[prim], vertexCount, GL_UNSIGNED_SHORT, ebo ? 0 : (GLvoid*)decIndex);
 			if (ebo)
@@ -994,12 +829,13 @@ rotateVBO:
 		prim = indexGen.Prim();
 		DEBUG_LOG(G3D, "Flush prim %i SW! %i verts in one go", prim, indexGen.VertexCount());
 
-		SoftwareTransformAndDraw(prim, decoded, program, indexGen.VertexCount(), dec.VertexType(), (void *)decIndex, GE_VTYPE_IDX_16BIT, dec.GetDecVtxFmt(),
+		SoftwareTransformAndDraw(prim, decoded, program, indexGen.VertexCount(), dec_->VertexType(), (void *)decIndex, GE_VTYPE_IDX_16BIT, dec_->GetDecVtxFmt(),
 			indexGen.MaxIndex());
 	}
 
 	indexGen.Reset();
 	collectedVerts = 0;
 	numDrawCalls = 0;
+	numUniforms_ = 0;
 	prevPrim_ = -1;
 }
@@ -18,6 +18,9 @@
 #pragma once
 
 #include "IndexGenerator.h"
+#include "../PageGenerations.h"
+#include "SoftwareTransform.h"
+#include "Spline.h"
 #include "VertexDecoder.h"
 #include "gfx/gl_lost_manager.h"
 
@@ -26,15 +29,15 @@ class ShaderManager;
 struct DecVtxFormat;
 
 // States transitions:
-// On creation: DRAWN_NEW
-// DRAWN_NEW -> DRAWN_HASHING
-// DRAWN_HASHING -> DRAWN_RELIABLE
-// DRAWN_HASHING -> DRAWN_UNRELIABLE
-// DRAWN_ONCE -> UNRELIABLE
-// DRAWN_RELIABLE -> DRAWN_SAFE
-// UNRELIABLE -> death
-// DRAWN_ONCE -> death
-// DRAWN_RELIABLE -> death
+// On creation: VAI_NEW
+// VAI_NEW -> VAI_HASHING, hashed in full
+// VAI_HASHING -> VAI_RELIABLE, after matching its hash in VAI_RELIABLE_FRAMES frames
+// VAI_HASHING -> VAI_UNRELIABLE, when the data changed
+// VAI_RELIABLE -> VAI_UNRELIABLE, when the data changed
+// Any -> death, when unused for VAI_KILL_AGE frames or pushed out by VAI_MAX_BYTES
+//
+// Reliable arrays are only hashed in full again if a write to their pages was seen, or a
+// few sampled words of the data changed.
 
 
 // Don't bother storing information about draws smaller than this.
@@ -54,6 +57,7 @@ public:
 		numDraws = 0;
 		lastFrame = gpuStats.numFrames;
 		numVerts = 0;
+		bytes = 0;
 	}
 	~VertexArrayInfo();
 	enum Status {
@@ -80,6 +84,17 @@ public:
 	u8 numDCs;
 	int numDraws;
 	int lastFrame;  // So that we can forget.
+	u32 bytes;  // In vbo and ebo.
+
+	// Validation, see TransformDrawEngine::ValidateVertexArray.
+	const u8 *vertStart;
+	u32 vertBytes;
+	const u8 *indStart;
+	u32 indBytes;
+	u32 generation;
+	u32 sampleHash;
+	int framesValidated;
+	int lastValidatedFrame;
 };
 
 
@@ -93,6 +108,13 @@ public:
 	void DrawSpline(int ucount, int vcount, int utype, int vtype);
 	void DecodeVerts();
 	void Flush();
+	// Returns false if switching to this vertex type requires a flush first.
+	bool CanBatchVertexType(u32 vtype);
+	// Call before changing state in TransformUniforms. Returns false if the batch so far
+	// needs to be flushed first, as it will be transformed in hardware.
+	bool BakeUniformChange();
+	// Bytes per vertex of the format, for draws that are skipped.
+	int VertexSize(u32 vtype);
 	void SetShaderManager(ShaderManager *shaderManager) {
 		shaderManager_ = shaderManager;
 	}
@@ -103,13 +125,23 @@ public:
 
 	void DecimateTrackedVertexArrays();
 	void ClearTrackedVertexArrays();
+	// Tells the vertex cache that memory was written. size <= 0 means all of it.
+	void MemoryWritten(u32 addr, int size);
 
 private:
 	void SoftwareTransformAndDraw(int prim, u8 *decoded, LinkedShader *program, int vertexCount, u32 vertexType, void *inds, int indexType, const DecVtxFormat &decVtxFormat, int maxIndex);
 
+	VertexDecoder *GetVertexDecoder(u32 vtype);
+	void SubmitPatch(const PatchMesh *mesh);
+
 	// drawcall ID
 	u32 ComputeFastDCID();
 	u32 ComputeHash();  // Reads deferred vertex data.
+	void TrackDataRanges(VertexArrayInfo *vai);  // After ComputeHash.
+	u32 DataGeneration(const VertexArrayInfo *vai) const;
+	u32 SampleHash(const VertexArrayInfo *vai) const;
+	bool ValidateVertexArray(VertexArrayInfo *vai);
+	void FreeVertexArray(VertexArrayInfo *vai);
 
 	// Defer all vertex decoding to a Flush, so that we can hash and cache the
 	// generated buffers without having to redecode them every time.
@@ -117,21 +149,29 @@ private:
 		void *verts;
 		void *inds;
 		u32 vertType;
+		VertexDecoder *dec;
 		u8 indexType;
 		u8 prim;
 		u16 vertexCount;
 		u16 indexLowerBound;
 		u16 indexUpperBound;
+		u8 uniformIndex;  // Into uniforms_
+		int decodedStart;  // First vertex in decoded, set by DecodeVerts
 	};
 
+	// Fills in the index bounds of an indexed draw if they haven't been scanned yet.
+	void UpdateIndexBounds(DeferredDrawCall &dc);
+
 	// Vertex collector state
 	IndexGenerator indexGen;
 	int collectedVerts;
 	int prevPrim_;
 
 	// Vertex collector buffers
-	VertexDecoder dec;
 	u32 lastVType_;
+	VertexDecoder *dec_;
+	VertexDecoderJitCache *decJitCache_;
+	std::map<u32, VertexDecoder *> decoderMap_;
 	u8 *decoded;
 	u16 *decIndex;
 
@@ -139,6 +179,9 @@ private:
 	TransformedVertex *transformedExpanded;
 
 	std::map<u32, VertexArrayInfo *> vai_;
+	u32 vaiBytes_;
+	PageGenerations pageGenerations_;
+	PatchCache patchCache_;
 
 	// Vertex buffer objects
 	// Element buffer objects
@@ -153,42 +196,11 @@ private:
 	enum { MAX_DEFERRED_DRAW_CALLS = 128 };
 	DeferredDrawCall drawCalls[MAX_DEFERRED_DRAW_CALLS];
 	int numDrawCalls;
-};
-
-// Only used by SW transform
-struct Color4 {
-	float r, g, b, a;
-
-	Color4() : r(0), g(0), b(0), a(0) { }
-	Color4(float _r, float _g, float _b, float _a=1.0f)
-		: r(_r), g(_g), b(_b), a(_a) {
-	}
-	Color4(const float in[4]) {r=in[0];g=in[1];b=in[2];a=in[3];}
-	Color4(const float in[3], float alpha) {r=in[0];g=in[1];b=in[2];a=alpha;}
-
-	const float &operator [](int i) const {return *(&r + i);}
 
-	Color4 operator *(float f) const {
-		return Color4(f*r,f*g,f*b,f*a);
-	}
-	Color4 operator *(const Color4 &c) const {
-		return Color4(r*c.r,g*c.g,b*c.b,a*c.a);
-	}
-	Color4 operator +(const Color4 &c) const {
-		return Color4(r+c.r,g+c.g,b+c.b,a+c.a);
-	}
-	void operator +=(const Color4 &c) {
-		r+=c.r;
-		g+=c.g;
-		b+=c.b;
-		a+=c.a;
-	}
-	void GetFromRGB(u32 col) {
-		b = ((col>>16) & 0xff)/255.0f;
-		g = ((col>>8) & 0xff)/255.0f;
-		r = ((col>>0) & 0xff)/255.0f;
-	}
-	void GetFromA(u32 col) {
-		a = (col&0xff)/255.0f;
-	}
+	// Versioned snapshots of the baked state, one per change within the batch. Software
+	// transformed draws pick theirs up in the flush, so those changes don't need one.
+	TransformUniforms uniforms_[MAX_DEFERRED_DRAW_CALLS];
+	int numUniforms_;
+	u32 uniformsVersion_;
+	u32 snapshotVersion_;
 };
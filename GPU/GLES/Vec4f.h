@@ -0,0 +1,94 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include <cmath>
+
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#elif defined(ARM) && defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// Four floats operated on at once with SSE or NEON, or plain loops elsewhere. Just enough
+// operations for the software transform and the patch tessellator.
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+
+struct Vec4f {
+	__m128 v;
+	Vec4f() {}
+	Vec4f(__m128 _v) : v(_v) {}
+	static Vec4f Load(const float *p) { return _mm_loadu_ps(p); }
+	static Vec4f Splat(float f) { return _mm_set1_ps(f); }
+	void Store(float *p) const { _mm_storeu_ps(p, v); }
+	Vec4f operator +(const Vec4f &o) const { return _mm_add_ps(v, o.v); }
+	Vec4f operator -(const Vec4f &o) const { return _mm_sub_ps(v, o.v); }
+	Vec4f operator *(const Vec4f &o) const { return _mm_mul_ps(v, o.v); }
+	Vec4f operator /(const Vec4f &o) const { return _mm_div_ps(v, o.v); }
+	Vec4f Min(const Vec4f &o) const { return _mm_min_ps(v, o.v); }
+	Vec4f Max(const Vec4f &o) const { return _mm_max_ps(v, o.v); }
+	Vec4f InvSqrt() const { return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(v)); }
+};
+
+#elif defined(ARM) && defined(__ARM_NEON__)
+
+struct Vec4f {
+	float32x4_t v;
+	Vec4f() {}
+	Vec4f(float32x4_t _v) : v(_v) {}
+	static Vec4f Load(const float *p) { return vld1q_f32(p); }
+	static Vec4f Splat(float f) { return vdupq_n_f32(f); }
+	void Store(float *p) const { vst1q_f32(p, v); }
+	Vec4f operator +(const Vec4f &o) const { return vaddq_f32(v, o.v); }
+	Vec4f operator -(const Vec4f &o) const { return vsubq_f32(v, o.v); }
+	Vec4f operator *(const Vec4f &o) const { return vmulq_f32(v, o.v); }
+	Vec4f operator /(const Vec4f &o) const {
+		// No divide instruction, so refine the reciprocal estimate twice.
+		float32x4_t r = vrecpeq_f32(o.v);
+		r = vmulq_f32(vrecpsq_f32(o.v, r), r);
+		r = vmulq_f32(vrecpsq_f32(o.v, r), r);
+		return vmulq_f32(v, r);
+	}
+	Vec4f Min(const Vec4f &o) const { return vminq_f32(v, o.v); }
+	Vec4f Max(const Vec4f &o) const { return vmaxq_f32(v, o.v); }
+	Vec4f InvSqrt() const {
+		float32x4_t r = vrsqrteq_f32(v);
+		r = vmulq_f32(vrsqrtsq_f32(vmulq_f32(v, r), r), r);
+		r = vmulq_f32(vrsqrtsq_f32(vmulq_f32(v, r), r), r);
+		return r;
+	}
+};
+
+#else
+
+struct Vec4f {
+	float v[4];
+	Vec4f() {}
+	static Vec4f Load(const float *p) { Vec4f r; for (int i = 0; i < 4; i++) r.v[i] = p[i]; return r; }
+	static Vec4f Splat(float f) { Vec4f r; for (int i = 0; i < 4; i++) r.v[i] = f; return r; }
+	void Store(float *p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+	Vec4f operator +(const Vec4f &o) const { Vec4f r; for (int i = 0; i < 4; i++) r.v[i] = v[i] + o.v[i]; return r; }
+	Vec4f operator -(const Vec4f &o) const { Vec4f r; for (int i = 0; i < 4; i++) r.v[i] = v[i] - o.v[i]; return r; }
+	Vec4f operator *(const Vec4f &o) const { Vec4f r; for (int i = 0; i < 4; i++) r.v[i] = v[i] * o.v[i]; return r; }
+	Vec4f operator /(const Vec4f &o) const { Vec4f r; for (int i = 0; i < 4; i++) r.v[i] = v[i] / o.v[i]; return r; }
+	Vec4f Min(const Vec4f &o) const { Vec4f r; for (int i = 0; i < 4; i++) r.v[i] = v[i] < o.v[i] ? v[i] : o.v[i]; return r; }
+	Vec4f Max(const Vec4f &o) const { Vec4f r; for (int i = 0; i < 4; i++) r.v[i] = v[i] > o.v[i] ? v[i] : o.v[i]; return r; }
+	Vec4f InvSqrt() const { Vec4f r; for (int i = 0; i < 4; i++) r.v[i] = 1.0f / sqrtf(v[i]); return r; }
+};
+
+#endif
@@ -22,6 +22,16 @@
 
 #include "VertexDecoder.h"
 
+#if !defined(ARM)
+#include "ABI.h"
+#endif
+
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+#include <emmintrin.h>
+#elif defined(ARM) && defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 void PrintDecodedVertex(VertexReader &vtx) {
 	if (vtx.hasNormal())
 	{
@@ -176,7 +186,7 @@ void VertexDecoder::Step_Color565() const
 	c[0] = Convert5To8(cdata & 0x1f);
 	c[1] = Convert6To8((cdata>>5) & 0x3f);
 	c[2] = Convert5To8((cdata>>11) & 0x1f);
-	c[3] = 1.0f;
+	c[3] = 255;
 }
 
 void VertexDecoder::Step_Color5551() const
@@ -390,7 +400,6 @@ void VertexDecoder::Step_PosS8Through() const
 	v[0] = sv[0];
 	v[1] = sv[1];
 	v[2] = sv[2];
-	v[3] = 0;
 }
 
 void VertexDecoder::Step_PosS16Through() const
@@ -400,7 +409,6 @@ void VertexDecoder::Step_PosS16Through() const
 	v[0] = sv[0];
 	v[1] = sv[1];
 	v[2] = sv[2];
-	v[3] = 0;
 }
 
 void VertexDecoder::Step_PosFloatThrough() const
@@ -520,7 +528,7 @@ const StepFunction posstep_through[4] = {
 };
 
 
-void VertexDecoder::SetVertexType(u32 fmt) {
+void VertexDecoder::SetVertexType(u32 fmt, VertexDecoderJitCache *jitCache) {
 	fmt_ = fmt;
 	throughmode = (fmt & GE_VTYPE_THROUGH) != 0;
 	numSteps_ = 0;
@@ -655,30 +663,125 @@ void VertexDecoder::SetVertexType(u32 fmt) {
 	onesize_ = size;
 	size *= morphcount;
 	DEBUG_LOG(G3D,"SVT : size = %i, aligned to biggest %i", size, biggest);
+
+	jitted_ = 0;
+	if (jitCache) {
+		jitted_ = jitCache->Compile(*this);
+		if (!jitted_) {
+			DEBUG_LOG(G3D, "Vertex decoder for vtype %06x not jitted, using step functions", fmt);
+		}
+	}
+}
+
+static void GetIndexBounds8(const u8 *ind8, int count, int &lowerBound, int &upperBound) {
+	int i = 0;
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+	if (count >= 16) {
+		__m128i vmin = _mm_set1_epi8((char)0xFF);
+		__m128i vmax = _mm_setzero_si128();
+		for (; i + 16 <= count; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(ind8 + i));
+			vmin = _mm_min_epu8(vmin, v);
+			vmax = _mm_max_epu8(vmax, v);
+		}
+		u8 mins[16], maxs[16];
+		_mm_storeu_si128((__m128i *)mins, vmin);
+		_mm_storeu_si128((__m128i *)maxs, vmax);
+		for (int j = 0; j < 16; j++) {
+			if (mins[j] < lowerBound)
+				lowerBound = mins[j];
+			if (maxs[j] > upperBound)
+				upperBound = maxs[j];
+		}
+	}
+#elif defined(ARM) && defined(__ARM_NEON__)
+	if (count >= 16) {
+		uint8x16_t vmin = vdupq_n_u8(0xFF);
+		uint8x16_t vmax = vdupq_n_u8(0);
+		for (; i + 16 <= count; i += 16) {
+			uint8x16_t v = vld1q_u8(ind8 + i);
+			vmin = vminq_u8(vmin, v);
+			vmax = vmaxq_u8(vmax, v);
+		}
+		u8 mins[16], maxs[16];
+		vst1q_u8(mins, vmin);
+		vst1q_u8(maxs, vmax);
+		for (int j = 0; j < 16; j++) {
+			if (mins[j] < lowerBound)
+				lowerBound = mins[j];
+			if (maxs[j] > upperBound)
+				upperBound = maxs[j];
+		}
+	}
+#endif
+	for (; i < count; i++) {
+		if (ind8[i] < lowerBound)
+			lowerBound = ind8[i];
+		if (ind8[i] > upperBound)
+			upperBound = ind8[i];
+	}
+}
+
+static void GetIndexBounds16(const u16 *ind16, int count, int &lowerBound, int &upperBound) {
+	int i = 0;
+#if !defined(ARM) && (defined(_M_IX86) || defined(_M_X64))
+	if (count >= 8) {
+		// SSE2 only has signed 16-bit min/max, so flip the sign bit to keep the unsigned order.
+		const __m128i bias = _mm_set1_epi16((short)0x8000);
+		__m128i vmin = _mm_set1_epi16(0x7FFF);
+		__m128i vmax = _mm_set1_epi16((short)0x8000);
+		for (; i + 8 <= count; i += 8) {
+			__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(ind16 + i)), bias);
+			vmin = _mm_min_epi16(vmin, v);
+			vmax = _mm_max_epi16(vmax, v);
+		}
+		u16 mins[8], maxs[8];
+		_mm_storeu_si128((__m128i *)mins, _mm_xor_si128(vmin, bias));
+		_mm_storeu_si128((__m128i *)maxs, _mm_xor_si128(vmax, bias));
+		for (int j = 0; j < 8; j++) {
+			if (mins[j] < lowerBound)
+				lowerBound = mins[j];
+			if (maxs[j] > upperBound)
+				upperBound = maxs[j];
+		}
+	}
+#elif defined(ARM) && defined(__ARM_NEON__)
+	if (count >= 8) {
+		uint16x8_t vmin = vdupq_n_u16(0xFFFF);
+		uint16x8_t vmax = vdupq_n_u16(0);
+		for (; i + 8 <= count; i += 8) {
+			uint16x8_t v = vld1q_u16(ind16 + i);
+			vmin = vminq_u16(vmin, v);
+			vmax = vmaxq_u16(vmax, v);
+		}
+		u16 mins[8], maxs[8];
+		vst1q_u16(mins, vmin);
+		vst1q_u16(maxs, vmax);
+		for (int j = 0; j < 8; j++) {
+			if (mins[j] < lowerBound)
+				lowerBound = mins[j];
+			if (maxs[j] > upperBound)
+				upperBound = maxs[j];
+		}
+	}
+#endif
+	for (; i < count; i++) {
+		if (ind16[i] < lowerBound)
+			lowerBound = ind16[i];
+		if (ind16[i] > upperBound)
+			upperBound = ind16[i];
+	}
 }
 
 void GetIndexBounds(void *inds, int count, u32 vertType, u16 *indexLowerBound, u16 *indexUpperBound) {
-	// Find index bounds. Could cache this in display lists.
-	// Also, this could be greatly sped up with SSE2/NEON, although rarely a bottleneck.
+	// Find index bounds. The vector paths do 16 (8-bit) or 8 (16-bit) indices per iteration.
 	int lowerBound = 0x7FFFFFFF;
 	int upperBound = 0;
 	u32 idx = vertType & GE_VTYPE_IDX_MASK;
 	if (idx == GE_VTYPE_IDX_8BIT) {
-		const u8 *ind8 = (const u8 *)inds;
-		for (int i = 0; i < count; i++) {
-			if (ind8[i] < lowerBound)
-				lowerBound = ind8[i];
-			if (ind8[i] > upperBound)
-				upperBound = ind8[i];
-		}
+		GetIndexBounds8((const u8 *)inds, count, lowerBound, upperBound);
 	} else if (idx == GE_VTYPE_IDX_16BIT) {
-		const u16 *ind16 = (const u16*)inds;
-		for (int i = 0; i < count; i++) {
-			if (ind16[i] < lowerBound)
-				lowerBound = ind16[i];
-			if (ind16[i] > upperBound)
-				upperBound = ind16[i];
-		}
+		GetIndexBounds16((const u16 *)inds, count, lowerBound, upperBound);
 	} else {
 		lowerBound = 0;
 		upperBound = count - 1;
@@ -688,6 +791,15 @@ void GetIndexBounds(void *inds, int count, u32 vertType, u16 *indexLowerBound, u
 }
 
 void VertexDecoder::DecodeVerts(u8 *decodedptr, const void *verts, const void *inds, int prim, int count, int indexLowerBound, int indexUpperBound) const {
+	// The jitted code doesn't look at gstate, and reversed normals are rare enough to leave to the steps.
+	if (jitted_ && !(nrm && (gstate.reversenormals & 1))) {
+		jitted_((const u8 *)verts + indexLowerBound * size, decodedptr, indexUpperBound - indexLowerBound + 1);
+		return;
+	}
+	DecodeVertsNoJit(decodedptr, verts, indexLowerBound, indexUpperBound);
+}
+
+void VertexDecoder::DecodeVertsNoJit(u8 *decodedptr, const void *verts, int indexLowerBound, int indexUpperBound) const {
 	// Decode the vertices within the found bounds, once each
 	decoded_ = decodedptr;  // + lowerBound * decFmt.stride;
 	ptr_ = (const u8*)verts + indexLowerBound * size;
@@ -700,23 +812,421 @@ void VertexDecoder::DecodeVerts(u8 *decodedptr, const void *verts, const void *i
 	}
 }
 
-// TODO: Does not support morphs, skinning etc.
-u32 VertexDecoder::InjectUVs(u8 *decoded, const void *verts, float *customuv, int count) const {
-	u32 customVertType = (gstate.vertType & ~GE_VTYPE_TC_MASK) | GE_VTYPE_TC_FLOAT;
-	VertexDecoder decOut;
-	decOut.SetVertexType(customVertType);
-	
-	const u8 *inp = (const u8 *)verts;
-	u8 *out = decoded;
+
+#if defined(ARM)
+using namespace ArmGen;
+
+// R0-R3 and R12 are scratch under the ARM ABI, so we don't need to save anything.
+static const ARMReg srcReg = R0;
+static const ARMReg dstReg = R1;
+static const ARMReg counterReg = R2;
+static const ARMReg tempReg1 = R3;
+#else
+using namespace Gen;
+
+#ifdef _M_X64
+#define PTRBITS 64
+static const X64Reg srcReg = ABI_PARAM1;
+static const X64Reg dstReg = ABI_PARAM2;
+static const X64Reg counterReg = ABI_PARAM3;
+static const X64Reg tempReg1 = RAX;
+static const X64Reg tempReg2 = R9;
+static const X64Reg tempReg3 = R10;
+#else
+// Parameters are on the stack, these are loaded in the prologue. ESI, EDI and EBX are saved.
+#define PTRBITS 32
+static const X64Reg srcReg = ESI;
+static const X64Reg dstReg = EDI;
+static const X64Reg counterReg = ECX;
+static const X64Reg tempReg1 = EAX;
+static const X64Reg tempReg2 = EBX;
+static const X64Reg tempReg3 = EDX;
+#endif
+
+// Only XMM0-XMM5 are scratch on Win64.
+static const X64Reg fpScratchReg = XMM0;
+static const X64Reg fpZeroReg = XMM3;
+static const X64Reg fpScaleU8Reg = XMM4;
+static const X64Reg fpScaleU16Reg = XMM5;
+#endif
+
+struct JitLookup {
+	StepFunction func;
+	JitStepFunction jitFunc;
+};
+
+static const JitLookup jitLookup[] = {
+	{&VertexDecoder::Step_WeightsFloat, &VertexDecoderJitCache::Jit_WeightsFloat},
+	{&VertexDecoder::Step_TcFloat, &VertexDecoderJitCache::Jit_TcFloat},
+	{&VertexDecoder::Step_Color8888, &VertexDecoderJitCache::Jit_Color8888},
+
+	{&VertexDecoder::Step_NormalS8, &VertexDecoderJitCache::Jit_NormalS8},
+	{&VertexDecoder::Step_NormalS16, &VertexDecoderJitCache::Jit_NormalS16},
+	{&VertexDecoder::Step_NormalFloat, &VertexDecoderJitCache::Jit_NormalFloat},
+
+	{&VertexDecoder::Step_PosS8, &VertexDecoderJitCache::Jit_PosS8},
+	{&VertexDecoder::Step_PosS16, &VertexDecoderJitCache::Jit_PosS16},
+	{&VertexDecoder::Step_PosFloat, &VertexDecoderJitCache::Jit_PosFloat},
+	{&VertexDecoder::Step_PosFloatThrough, &VertexDecoderJitCache::Jit_PosFloatThrough},
+
+#if !defined(ARM)
+	{&VertexDecoder::Step_WeightsU8, &VertexDecoderJitCache::Jit_WeightsU8},
+	{&VertexDecoder::Step_WeightsU16, &VertexDecoderJitCache::Jit_WeightsU16},
+
+	{&VertexDecoder::Step_TcU8, &VertexDecoderJitCache::Jit_TcU8},
+	{&VertexDecoder::Step_TcU16, &VertexDecoderJitCache::Jit_TcU16},
+
+	{&VertexDecoder::Step_Color4444, &VertexDecoderJitCache::Jit_Color4444},
+	{&VertexDecoder::Step_Color565, &VertexDecoderJitCache::Jit_Color565},
+	{&VertexDecoder::Step_Color5551, &VertexDecoderJitCache::Jit_Color5551},
+
+	{&VertexDecoder::Step_PosS8Through, &VertexDecoderJitCache::Jit_PosS8Through},
+	{&VertexDecoder::Step_PosS16Through, &VertexDecoderJitCache::Jit_PosS16Through},
+#endif
+};
+
+VertexDecoderJitCache::VertexDecoderJitCache() : dec_(0) {
+	// A decoder is a few hundred bytes at most, and games only use a handful of formats.
+	AllocCodeSpace(1024 * 256);
+}
+
+VertexDecoderJitCache::~VertexDecoderJitCache() {
+	FreeCodeSpace();
+}
+
+void VertexDecoderJitCache::Clear() {
+	ClearCodeSpace();
+	cache_.clear();
+}
+
+JittedVertexDecoder VertexDecoderJitCache::Compile(const VertexDecoder &dec) {
+	u32 vtype = dec.VertexType();
+	auto iter = cache_.find(vtype);
+	if (iter != cache_.end())
+		return iter->second;
+
+	JittedVertexDecoder jitted = 0;
+	if (GetSpaceLeft() >= 4096) {
+		jitted = Generate(dec);
+	} else {
+		WARN_LOG(G3D, "Vertex decoder jit cache full, not compiling vtype %06x", vtype);
+	}
+	// Remember failures too, no point in retrying those.
+	cache_[vtype] = jitted;
+	return jitted;
+}
+
+bool VertexDecoderJitCache::CompileStep(const VertexDecoder &dec, int step) {
+	// See if we find a matching JIT function
+	for (size_t i = 0; i < ARRAY_SIZE(jitLookup); i++) {
+		if (dec.steps_[step] == jitLookup[i].func) {
+			((*this).*jitLookup[i].jitFunc)();
+			return true;
+		}
+	}
+	return false;
+}
+
+#if defined(ARM)
+
+JittedVertexDecoder VertexDecoderJitCache::Generate(const VertexDecoder &dec) {
+	dec_ = &dec;
+	u8 *start = (u8 *)AlignCode16();
+
+	CMP(counterReg, IMM(0));
+	FixupBranch skip = B_CC(CC_LE);
+
+	const u8 *loopStart = GetCodePtr();
+	for (int i = 0; i < dec.numSteps_; i++) {
+		if (!CompileStep(dec, i)) {
+			// Reset the code ptr and return zero to indicate that we failed.
+			SetCodePtr(start);
+			return 0;
+		}
+	}
+
+	ADD(srcReg, srcReg, IMM(dec.VertexSize()));
+	ADD(dstReg, dstReg, IMM(dec.decFmt.stride));
+	SUBS(counterReg, counterReg, IMM(1));
+	B_CC(CC_NEQ, loopStart);
+
+	SetJumpTarget(skip);
+	B(_LR);
+
+	FlushIcache();
+	return (JittedVertexDecoder)start;
+}
+
+void VertexDecoderJitCache::Jit_CopyWords(int srcOff, int dstOff, int count) {
+	for (int i = 0; i < count; i++) {
+		LDR(tempReg1, srcReg, IMM(srcOff + i * 4));
+		STR(dstReg, tempReg1, IMM(dstOff + i * 4));
+	}
+}
+
+void VertexDecoderJitCache::Jit_CopyBytes(int srcOff, int dstOff, int count, int padTo) {
+	for (int i = 0; i < count; i++) {
+		LDRB(tempReg1, srcReg, IMM(srcOff + i));
+		STRB(dstReg, tempReg1, IMM(dstOff + i));
+	}
+	if (padTo > count) {
+		MOV(tempReg1, IMM(0));
+		for (int i = count; i < padTo; i++) {
+			STRB(dstReg, tempReg1, IMM(dstOff + i));
+		}
+	}
+}
+
+#else
+
+JittedVertexDecoder VertexDecoderJitCache::Generate(const VertexDecoder &dec) {
+	dec_ = &dec;
+	u8 *start = (u8 *)AlignCode16();
+
+#ifdef _M_IX86
+	PUSH(ESI);
+	PUSH(EDI);
+	PUSH(EBX);
+	// Three pushes and the return address.
+	MOV(32, R(srcReg), MDisp(ESP, 16 + 0));
+	MOV(32, R(dstReg), MDisp(ESP, 16 + 4));
+	MOV(32, R(counterReg), MDisp(ESP, 16 + 8));
+#endif
+
+	TEST(32, R(counterReg), R(counterReg));
+	FixupBranch skip = J_CC(CC_LE, true);
+
+	// Constants used by the integer to float conversions. 1/128 and 1/32768.
+	PXOR(fpZeroReg, R(fpZeroReg));
+	MOV(32, R(tempReg1), Imm32(0x3C000000));
+	MOVD_xmm(fpScaleU8Reg, R(tempReg1));
+	SHUFPS(fpScaleU8Reg, R(fpScaleU8Reg), 0);
+	MOV(32, R(tempReg1), Imm32(0x38000000));
+	MOVD_xmm(fpScaleU16Reg, R(tempReg1));
+	SHUFPS(fpScaleU16Reg, R(fpScaleU16Reg), 0);
+
+	const u8 *loopStart = GetCodePtr();
+	for (int i = 0; i < dec.numSteps_; i++) {
+		if (!CompileStep(dec, i)) {
+			// Reset the code ptr and return zero to indicate that we failed.
+			SetCodePtr(start);
+			return 0;
+		}
+	}
+
+	ADD(PTRBITS, R(srcReg), Imm32(dec.VertexSize()));
+	ADD(PTRBITS, R(dstReg), Imm32(dec.decFmt.stride));
+	SUB(32, R(counterReg), Imm8(1));
+	J_CC(CC_NZ, loopStart, true);
+
+	SetJumpTarget(skip);
+#ifdef _M_IX86
+	POP(EBX);
+	POP(EDI);
+	POP(ESI);
+#endif
+	RET();
+
+	return (JittedVertexDecoder)start;
+}
+
+void VertexDecoderJitCache::Jit_CopyWords(int srcOff, int dstOff, int count) {
 	for (int i = 0; i < count; i++) {
-		if (pos) memcpy(out + decOut.posoff, inp + posoff, possize[pos]);
-		if (nrm) memcpy(out + decOut.nrmoff, inp + nrmoff, nrmsize[pos]);
-		if (col) memcpy(out + decOut.coloff, inp + coloff, colsize[pos]);
-		// Ignore others for now, this is all we need for puzbob.
-		// Inject!
-		memcpy(out + decOut.tcoff, &customuv[i * 2], tcsize[decOut.tc]);
-		inp += this->onesize_;
-		out += decOut.onesize_;
-	}
-	return customVertType;
+		MOV(32, R(tempReg1), MDisp(srcReg, srcOff + i * 4));
+		MOV(32, MDisp(dstReg, dstOff + i * 4), R(tempReg1));
+	}
+}
+
+// Only used for the 3-component s8/s16 formats, which we pad out with zeroes.
+void VertexDecoderJitCache::Jit_CopyBytes(int srcOff, int dstOff, int count, int padTo) {
+	if (count == 3 && padTo == 4) {
+		MOVZX(32, 16, tempReg1, MDisp(srcReg, srcOff));
+		MOVZX(32, 8, tempReg2, MDisp(srcReg, srcOff + 2));
+		SHL(32, R(tempReg2), Imm8(16));
+		OR(32, R(tempReg1), R(tempReg2));
+		MOV(32, MDisp(dstReg, dstOff), R(tempReg1));
+	} else if (count == 6 && padTo == 8) {
+		MOV(32, R(tempReg1), MDisp(srcReg, srcOff));
+		MOVZX(32, 16, tempReg2, MDisp(srcReg, srcOff + 4));
+		MOV(32, MDisp(dstReg, dstOff), R(tempReg1));
+		MOV(32, MDisp(dstReg, dstOff + 4), R(tempReg2));
+	} else {
+		for (int i = 0; i < count; i++) {
+			MOVZX(32, 8, tempReg1, MDisp(srcReg, srcOff + i));
+			MOV(8, MDisp(dstReg, dstOff + i), R(tempReg1));
+		}
+		for (int i = count; i < padTo; i++) {
+			MOV(8, MDisp(dstReg, dstOff + i), Imm8(0));
+		}
+	}
+}
+
+void VertexDecoderJitCache::Jit_WriteWeights(int fmtSize) {
+	const X64Reg scaleReg = fmtSize == 1 ? fpScaleU8Reg : fpScaleU16Reg;
+	const int n = dec_->nweights;
+	int j = 0;
+	// Four at a time, exactly fills an xmm register.
+	for (; j + 4 <= n; j += 4) {
+		if (fmtSize == 1) {
+			MOVD_xmm(fpScratchReg, MDisp(srcReg, j));
+			PUNPCKLBW(fpScratchReg, R(fpZeroReg));
+		} else {
+			MOVQ_xmm(fpScratchReg, MDisp(srcReg, j * 2));
+		}
+		PUNPCKLWD(fpScratchReg, R(fpZeroReg));
+		CVTDQ2PS(fpScratchReg, R(fpScratchReg));
+		MULPS(fpScratchReg, R(scaleReg));
+		MOVUPS(MDisp(dstReg, dec_->decFmt.w0off + j * 4), fpScratchReg);
+	}
+	for (; j < n; j++) {
+		MOVZX(32, fmtSize * 8, tempReg1, MDisp(srcReg, j * fmtSize));
+		MOVD_xmm(fpScratchReg, R(tempReg1));
+		CVTDQ2PS(fpScratchReg, R(fpScratchReg));
+		MULSS(fpScratchReg, R(scaleReg));
+		MOVSS(MDisp(dstReg, dec_->decFmt.w0off + j * 4), fpScratchReg);
+	}
+}
+
+void VertexDecoderJitCache::Jit_WeightsU8() {
+	Jit_WriteWeights(1);
+}
+
+void VertexDecoderJitCache::Jit_WeightsU16() {
+	Jit_WriteWeights(2);
+}
+
+void VertexDecoderJitCache::Jit_TcU8() {
+	MOVZX(32, 16, tempReg1, MDisp(srcReg, dec_->tcoff));
+	MOVD_xmm(fpScratchReg, R(tempReg1));
+	PUNPCKLBW(fpScratchReg, R(fpZeroReg));
+	PUNPCKLWD(fpScratchReg, R(fpZeroReg));
+	CVTDQ2PS(fpScratchReg, R(fpScratchReg));
+	MULPS(fpScratchReg, R(fpScaleU8Reg));
+	MOVQ_xmm(MDisp(dstReg, dec_->decFmt.uvoff), fpScratchReg);
+}
+
+void VertexDecoderJitCache::Jit_TcU16() {
+	MOVD_xmm(fpScratchReg, MDisp(srcReg, dec_->tcoff));
+	PUNPCKLWD(fpScratchReg, R(fpZeroReg));
+	CVTDQ2PS(fpScratchReg, R(fpScratchReg));
+	MULPS(fpScratchReg, R(fpScaleU16Reg));
+	MOVQ_xmm(MDisp(dstReg, dec_->decFmt.uvoff), fpScratchReg);
+}
+
+// Same bit swizzle as Convert4To8 etc: (v << (8 - bits)) | (v >> (2 * bits - 8)), ORed into tempReg2.
+void VertexDecoderJitCache::Jit_ExpandComponent(int shift, int bits, int outByte) {
+	const u32 mask = (1 << bits) - 1;
+	const int lowShift = 2 * bits - 8;
+
+	MOV(32, R(tempReg3), R(tempReg1));
+	if (shift != 0)
+		SHR(32, R(tempReg3), Imm8(shift));
+	AND(32, R(tempReg3), Imm32(mask));
+	SHL(32, R(tempReg3), Imm8(8 - bits + outByte * 8));
+	OR(32, R(tempReg2), R(tempReg3));
+
+	MOV(32, R(tempReg3), R(tempReg1));
+	if (shift + lowShift != 0)
+		SHR(32, R(tempReg3), Imm8(shift + lowShift));
+	AND(32, R(tempReg3), Imm32(mask >> lowShift));
+	if (outByte != 0)
+		SHL(32, R(tempReg3), Imm8(outByte * 8));
+	OR(32, R(tempReg2), R(tempReg3));
+}
+
+void VertexDecoderJitCache::Jit_WriteColor16(int rBits, int gBits, int bBits, int aBits) {
+	const int aShift = rBits + gBits + bBits;
+	MOVZX(32, 16, tempReg1, MDisp(srcReg, dec_->coloff));
+
+	// Start with the alpha, then OR in the other components.
+	if (aBits == 0) {
+		MOV(32, R(tempReg2), Imm32(0xFF000000));
+	} else if (aBits == 1) {
+		MOV(32, R(tempReg2), R(tempReg1));
+		SHR(32, R(tempReg2), Imm8(aShift));
+		NEG(32, R(tempReg2));
+		AND(32, R(tempReg2), Imm32(0xFF000000));
+	} else {
+		XOR(32, R(tempReg2), R(tempReg2));
+		Jit_ExpandComponent(aShift, aBits, 3);
+	}
+	Jit_ExpandComponent(0, rBits, 0);
+	Jit_ExpandComponent(rBits, gBits, 1);
+	Jit_ExpandComponent(rBits + gBits, bBits, 2);
+
+	MOV(32, MDisp(dstReg, dec_->decFmt.c0off), R(tempReg2));
+}
+
+void VertexDecoderJitCache::Jit_Color4444() {
+	Jit_WriteColor16(4, 4, 4, 4);
+}
+
+void VertexDecoderJitCache::Jit_Color565() {
+	Jit_WriteColor16(5, 6, 5, 0);
+}
+
+void VertexDecoderJitCache::Jit_Color5551() {
+	Jit_WriteColor16(5, 5, 5, 1);
+}
+
+void VertexDecoderJitCache::Jit_PosS8Through() {
+	for (int i = 0; i < 3; i++) {
+		MOVSX(32, 8, tempReg1, MDisp(srcReg, dec_->posoff + i));
+		MOVD_xmm(fpScratchReg, R(tempReg1));
+		CVTDQ2PS(fpScratchReg, R(fpScratchReg));
+		MOVSS(MDisp(dstReg, dec_->decFmt.posoff + i * 4), fpScratchReg);
+	}
+}
+
+void VertexDecoderJitCache::Jit_PosS16Through() {
+	for (int i = 0; i < 3; i++) {
+		MOVSX(32, 16, tempReg1, MDisp(srcReg, dec_->posoff + i * 2));
+		MOVD_xmm(fpScratchReg, R(tempReg1));
+		CVTDQ2PS(fpScratchReg, R(fpScratchReg));
+		MOVSS(MDisp(dstReg, dec_->decFmt.posoff + i * 4), fpScratchReg);
+	}
+}
+
+#endif
+
+// The rest are plain copies and are shared between the backends.
+
+void VertexDecoderJitCache::Jit_WeightsFloat() {
+	Jit_CopyWords(0, dec_->decFmt.w0off, dec_->nweights);
+}
+
+void VertexDecoderJitCache::Jit_TcFloat() {
+	Jit_CopyWords(dec_->tcoff, dec_->decFmt.uvoff, 2);
+}
+
+void VertexDecoderJitCache::Jit_Color8888() {
+	Jit_CopyWords(dec_->coloff, dec_->decFmt.c0off, 1);
+}
+
+void VertexDecoderJitCache::Jit_NormalS8() {
+	Jit_CopyBytes(dec_->nrmoff, dec_->decFmt.nrmoff, 3, 4);
+}
+
+void VertexDecoderJitCache::Jit_NormalS16() {
+	Jit_CopyBytes(dec_->nrmoff, dec_->decFmt.nrmoff, 6, 8);
+}
+
+void VertexDecoderJitCache::Jit_NormalFloat() {
+	Jit_CopyWords(dec_->nrmoff, dec_->decFmt.nrmoff, 3);
+}
+
+void VertexDecoderJitCache::Jit_PosS8() {
+	Jit_CopyBytes(dec_->posoff, dec_->decFmt.posoff, 3, 4);
+}
+
+void VertexDecoderJitCache::Jit_PosS16() {
+	Jit_CopyBytes(dec_->posoff, dec_->decFmt.posoff, 6, 8);
+}
+
+void VertexDecoderJitCache::Jit_PosFloat() {
+	Jit_CopyWords(dec_->posoff, dec_->decFmt.posoff, 3);
+}
+
+void VertexDecoderJitCache::Jit_PosFloatThrough() {
+	Jit_CopyWords(dec_->posoff, dec_->decFmt.posoff, 3);
 }
@@ -17,10 +17,18 @@
 
 #pragma once
 
+#include <map>
+
 #include "../GPUState.h"
 #include "../Globals.h"
 #include "base/basictypes.h"
 
+#if defined(ARM)
+#include "ArmEmitter.h"
+#else
+#include "x64Emitter.h"
+#endif
+
 // DecVtxFormat - vertex formats for PC
 // Kind of like a D3D VertexDeclaration.
 // Can write code to easily bind these using OpenGL, or read these manually.
@@ -62,18 +70,22 @@ struct TransformedVertex
 DecVtxFormat GetTransformedVtxFormat(const DecVtxFormat &fmt);
 
 class VertexDecoder;
+class VertexDecoderJitCache;
 
 typedef void (VertexDecoder::*StepFunction)() const;
+typedef void (VertexDecoderJitCache::*JitStepFunction)();
+
+// Generated by VertexDecoderJitCache. Decodes count vertices from src to dst.
+typedef void (*JittedVertexDecoder)(const u8 *src, u8 *dst, int count);
 
 void GetIndexBounds(void *inds, int count, u32 vertType, u16 *indexLowerBound, u16 *indexUpperBound);
 
 // Right now
 //   - only contains computed information
-//   - does decoding in nasty branchfilled loops
+//   - compiles into list of called functions (steps_)
+//   - if a jit cache is supplied, also compiles into fast specialized x86 or ARM code,
+//     falling back to the step functions for the few things the jit can't do.
 // Future TODO
-//   - should be cached, not recreated every time
-//   - will compile into list of called functions
-//   - will compile into lighting fast specialized x86 and ARM
 //   - will not bother translating components that can be read directly
 //     by OpenGL ES. Will still have to translate 565 colors and things
 //     like that. DecodedVertex will not be a fixed struct. Will have to
@@ -81,17 +93,18 @@ void GetIndexBounds(void *inds, int count, u32 vertType, u16 *indexLowerBound, u
 class VertexDecoder
 {
 public:
-	VertexDecoder() : coloff(0), nrmoff(0), posoff(0) {}
+	VertexDecoder() : coloff(0), nrmoff(0), posoff(0), jitted_(0) {}
 	~VertexDecoder() {}
 
-	void SetVertexType(u32 vtype);
+	void SetVertexType(u32 vtype, VertexDecoderJitCache *jitCache = 0);
 	u32 VertexType() const { return fmt_; }
-	const DecVtxFormat &GetDecVtxFmt() { return decFmt; }
+	const DecVtxFormat &GetDecVtxFmt() const { return decFmt; }
 
 	void DecodeVerts(u8 *decoded, const void *verts, const void *inds, int prim, int count, int indexLowerBound, int indexUpperBound) const;
 
-	// This could be easily generalized to inject any one component. Don't know another use for it though.
-	u32 InjectUVs(u8 *decoded, const void *verts, float *customuv, int count) const;
+	// Same as DecodeVerts but never uses the jitted code. Used to verify the jit.
+	void DecodeVertsNoJit(u8 *decoded, const void *verts, int indexLowerBound, int indexUpperBound) const;
+	bool IsJitted() const { return jitted_ != 0; }
 
 	bool hasColor() const { return col != 0; }
 	int VertexSize() const { return size; }
@@ -149,6 +162,9 @@ public:
 	StepFunction steps_[5];
 	int numSteps_;
 
+	// Compiled version of the steps, or NULL if the jit couldn't handle this format.
+	JittedVertexDecoder jitted_;
+
 	u32 fmt_;
 	DecVtxFormat decFmt;
 
@@ -173,6 +189,69 @@ public:
 	int nweights;
 };
 
+// Generates native code for vertex formats, one function per vtype.
+// Morphing and the through mode texcoord scaling read gstate per draw so those
+// are left to the step functions.
+#if defined(ARM)
+class VertexDecoderJitCache : public ArmGen::ARMXCodeBlock
+#else
+class VertexDecoderJitCache : public Gen::XCodeBlock
+#endif
+{
+public:
+	VertexDecoderJitCache();
+	~VertexDecoderJitCache();
+
+	// Returns the cached code for the decoder's vtype, compiling it if necessary.
+	// Returns NULL if any step can't be jitted or the code space is full.
+	JittedVertexDecoder Compile(const VertexDecoder &dec);
+	void Clear();
+
+	void Jit_WeightsFloat();
+	void Jit_TcFloat();
+	void Jit_Color8888();
+
+	void Jit_NormalS8();
+	void Jit_NormalS16();
+	void Jit_NormalFloat();
+
+	void Jit_PosS8();
+	void Jit_PosS16();
+	void Jit_PosFloat();
+	void Jit_PosFloatThrough();
+
+#if !defined(ARM)
+	// These need float conversion, which the ARM emitter can't do yet.
+	void Jit_WeightsU8();
+	void Jit_WeightsU16();
+
+	void Jit_TcU8();
+	void Jit_TcU16();
+
+	void Jit_Color4444();
+	void Jit_Color565();
+	void Jit_Color5551();
+
+	void Jit_PosS8Through();
+	void Jit_PosS16Through();
+#endif
+
+private:
+	bool CompileStep(const VertexDecoder &dec, int i);
+	JittedVertexDecoder Generate(const VertexDecoder &dec);
+
+	void Jit_CopyWords(int srcOff, int dstOff, int count);
+	void Jit_CopyBytes(int srcOff, int dstOff, int count, int padTo);
+#if !defined(ARM)
+	void Jit_WriteWeights(int fmtSize);
+	void Jit_ExpandComponent(int shift, int bits, int outByte);
+	void Jit_WriteColor16(int rBits, int gBits, int bBits, int aBits);
+#endif
+
+	const VertexDecoder *dec_;
+	std::map<u32, JittedVertexDecoder> cache_;
+};
+
 // Reads decoded vertex formats in a convenient way. For software transform and debugging.
 class VertexReader
 {
@@ -124,7 +124,9 @@ enum DoLightComputation {
 	LIGHT_FULL,
 };
 
-void GenerateVertexShader(int prim, char *buffer) {
+// Everything is read from the ID rather than gstate, so this can run on any thread, and for
+// IDs saved by an earlier run.
+void GenerateVertexShader(const VertexShaderID &id, char *buffer) {
 	char *p = buffer;
 #if defined(USING_GLES2)
 	WRITE(p, "precision highp float;\n");
@@ -132,30 +134,39 @@ void GenerateVertexShader(int prim, char *buffer) {
 	WRITE(p, "#version 110\n");
 #endif
 
-	int lmode = (gstate.lmode & 1) && (gstate.lightingEnable & 1);
-	int doTexture = (gstate.textureMapEnable & 1) && !(gstate.clearmode & 1);
-
-	bool hwXForm = CanUseHardwareTransform(prim);
-	bool hasColor = (gstate.vertType & GE_VTYPE_COL_MASK) != 0 || !hwXForm;
-	bool hasNormal = (gstate.vertType & GE_VTYPE_NRM_MASK) != 0 && hwXForm;
-	bool enableFog = gstate.isFogEnabled() && !gstate.isModeThrough() && !gstate.isModeClear();
+	bool lmode = (id.d[0] & 1) != 0;
+	bool throughmode = (id.d[0] & (1 << 1)) != 0;
+	bool enableFog = (id.d[0] & (1 << 2)) != 0;
+	bool doTexture = (id.d[0] & (1 << 3)) != 0;
+	bool hwXForm = (id.d[0] & (1 << 8)) != 0;
+	bool hasColor = (id.d[0] & (1 << 4)) != 0 || !hwXForm;
+	bool hasNormal = (id.d[0] & (1 << 9)) != 0;
+	bool hasBones = (id.d[0] & (1 << 10)) != 0;
+	int uvGenMode = (id.d[0] >> 16) & 3;
+	int uvProjMode = (id.d[0] >> 18) & 3;
+	int uvLS0 = (id.d[0] >> 18) & 3;
+	int uvLS1 = (id.d[0] >> 20) & 3;
+	int numBoneWeights = ((id.d[0] >> 22) & 7) + 1;
+
+	bool lightingEnable = (id.d[1] & (1 << 19)) != 0;
+	int materialUpdate = (id.d[1] >> 16) & 7;
 
 	DoLightComputation doLight[4] = {LIGHT_OFF, LIGHT_OFF, LIGHT_OFF, LIGHT_OFF};
 	if (hwXForm) {
-		int shadeLight0 = gstate.getUVGenMode() == 2 ? gstate.getUVLS0() : -1;
-		int shadeLight1 = gstate.getUVGenMode() == 2 ? gstate.getUVLS1() : -1;
+		int shadeLight0 = uvGenMode == 2 ? uvLS0 : -1;
+		int shadeLight1 = uvGenMode == 2 ? uvLS1 : -1;
 		for (int i = 0; i < 4; i++) {
 			if (!hasNormal)
 				continue;
 			if (i == shadeLight0 || i == shadeLight1)
 				doLight[i] = LIGHT_DOTONLY;
-			if ((gstate.lightingEnable & 1) && (gstate.lightEnable[i] & 1))
+			if (lightingEnable && (id.d[1] & (1 << (20 + i))))
 				doLight[i] = LIGHT_FULL;
 		}
 	}
 
-	if ((gstate.vertType & GE_VTYPE_WEIGHT_MASK) != GE_VTYPE_WEIGHT_NONE) {
-		WRITE(p, "%s", boneWeightAttrDecl[gstate.getNumBoneWeights() - 1]);
+	if (hasBones) {
+		WRITE(p, "%s", boneWeightAttrDecl[numBoneWeights - 1]);
 	}
 
 	if (hwXForm)
@@ -173,7 +184,7 @@ void GenerateVertexShader(int prim, char *buffer) {
 	if (hwXForm && hasNormal)
 		WRITE(p, "attribute vec3 a_normal;\n");
 
-	if (gstate.isModeThrough())	{
+	if (throughmode)	{
 		WRITE(p, "uniform mat4 u_proj_through;\n");
 	} else {
 		WRITE(p, "uniform mat4 u_proj;\n");
@@ -191,21 +202,20 @@ void GenerateVertexShader(int prim, char *buffer) {
 		// When transforming by hardware, we need a great deal more uniforms...
 		WRITE(p, "uniform mat4 u_world;\n");
 		WRITE(p, "uniform mat4 u_view;\n");
-		if (gstate.getUVGenMode() == 0)
+		if (uvGenMode == 0)
 			WRITE(p, "uniform vec4 u_uvscaleoffset;\n");
-		else if (gstate.getUVGenMode() == 1)
+		else if (uvGenMode == 1)
 			WRITE(p, "uniform mat4 u_texmtx;\n");
-		if ((gstate.vertType & GE_VTYPE_WEIGHT_MASK) != GE_VTYPE_WEIGHT_NONE) {
-			int numBones = 1 + ((gstate.vertType & GE_VTYPE_WEIGHTCOUNT_MASK) >> GE_VTYPE_WEIGHTCOUNT_SHIFT);
-			for (int i = 0; i < numBones; i++) {
+		if (hasBones) {
+			for (int i = 0; i < numBoneWeights; i++) {
 				WRITE(p, "uniform mat4 u_bone%i;\n", i);
 			}
 		}
-		if (gstate.lightingEnable & 1) {
+		if (lightingEnable) {
 			WRITE(p, "uniform vec4 u_ambient;\n");
-			if ((gstate.materialupdate & 2) == 0)
+			if ((materialUpdate & 2) == 0)
 				WRITE(p, "uniform vec3 u_matdiffuse;\n");
-			// if ((gstate.materialupdate & 4) == 0)
+			// if ((materialUpdate & 4) == 0)
 			WRITE(p, "uniform vec4 u_matspecular;\n");  // Specular coef is contained in alpha
 			WRITE(p, "uniform vec3 u_matemissive;\n");
 		}
@@ -248,14 +258,14 @@ void GenerateVertexShader(int prim, char *buffer) {
 		if (enableFog) {
 			WRITE(p, "  v_fogdepth = a_position.w;\n");
 		}
-		if (gstate.isModeThrough())	{
+		if (throughmode)	{
 			WRITE(p, "  gl_Position = u_proj_through * vec4(a_position.xyz, 1.0);\n");
 		} else {
 			WRITE(p, "  gl_Position = u_proj * vec4(a_position.xyz, 1.0);\n");
 		}
 	} else {
 		// Step 1: World Transform / Skinning
-		if ((gstate.vertType & GE_VTYPE_WEIGHT_MASK) == GE_VTYPE_WEIGHT_NONE) {
+		if (!hasBones) {
 			// No skinning, just standard T&L.
 			WRITE(p, "  vec3 worldpos = (u_world * vec4(a_position.xyz, 1.0)).xyz;\n");
 			if (hasNormal)
@@ -264,7 +274,7 @@ void GenerateVertexShader(int prim, char *buffer) {
 			WRITE(p, "  vec3 worldpos = vec3(0.0, 0.0, 0.0);\n");
 			if (hasNormal)
 				WRITE(p, "  vec3 worldnormal = vec3(0.0, 0.0, 0.0);\n");
-			int numWeights = 1 + ((gstate.vertType & GE_VTYPE_WEIGHTCOUNT_MASK) >> GE_VTYPE_WEIGHTCOUNT_SHIFT);
+			int numWeights = numBoneWeights;
 			for (int i = 0; i < numWeights; i++) {
 				const char *weightAttr = boneWeightAttr[i];
 				// workaround for "cant do .x of scalar" issue
@@ -292,11 +302,11 @@ void GenerateVertexShader(int prim, char *buffer) {
 		}
 		// TODO: Declare variables for dots for shade mapping if needed.
 
-		const char *ambient = (gstate.materialupdate & 1) ? "unlitColor" : "u_matambientalpha.rgb";
-		const char *diffuse = (gstate.materialupdate & 2) ? "unlitColor" : "u_matdiffuse";
-		const char *specular = (gstate.materialupdate & 4) ? "unlitColor" : "u_matspecular.rgb";
+		const char *ambient = (materialUpdate & 1) ? "unlitColor" : "u_matambientalpha.rgb";
+		const char *diffuse = (materialUpdate & 2) ? "unlitColor" : "u_matdiffuse";
+		const char *specular = (materialUpdate & 4) ? "unlitColor" : "u_matspecular.rgb";
 
-		if (gstate.lightingEnable & 1) {
+		if (lightingEnable) {
 			WRITE(p, "  vec4 lightSum0 = vec4(0.0);\n");
 			WRITE(p, "  vec3 lightSum1 = vec3(0.0);\n");
 		}
@@ -307,8 +317,8 @@ void GenerateVertexShader(int prim, char *buffer) {
 			if (doLight[i] == LIGHT_OFF)
 				continue;
 
-			GELightComputation comp = (GELightComputation)(gstate.ltype[i] & 3);
-			GELightType type = (GELightType)((gstate.ltype[i] >> 8) & 3);
+			GELightComputation comp = (GELightComputation)((id.d[1] >> (i * 4)) & 3);
+			GELightType type = (GELightType)((id.d[1] >> (i * 4 + 2)) & 3);
 
 			if (type == GE_LIGHTTYPE_DIRECTIONAL)
 				WRITE(p, "  vec3 toLight%i = u_lightpos%i;\n", i, i);
@@ -343,7 +353,7 @@ void GenerateVertexShader(int prim, char *buffer) {
 			WRITE(p, "  lightSum0 += vec4(u_lightambient%i + diffuse%i, 0.0);\n", i, i);
 		}
 
-		if (gstate.lightingEnable & 1) {
+		if (lightingEnable) {
 			// Sum up ambient, emissive here.
 			if (hasColor) {
 				WRITE(p, "  v_color0 = clamp(lightSum0 + u_ambient * vec4(%s, a_color0.a) + vec4(u_matemissive, 0.0), 0.0, 1.0);\n", ambient);
@@ -368,13 +378,13 @@ void GenerateVertexShader(int prim, char *buffer) {
 
 		// Step 3: UV generation
 		if (doTexture) {
-			switch (gstate.getUVGenMode()) {
+			switch (uvGenMode) {
 			case 0:  // Scale-offset. Easy.
 				WRITE(p, "  v_texcoord = a_texcoord * u_uvscaleoffset.xy + u_uvscaleoffset.zw;\n");
 				break;
 
 			case 1:  // Projection mapping.
-				switch (gstate.getUVProjMode()) {
+				switch (uvProjMode) {
 				case 0:  // Use model space XYZ as source
 					WRITE(p, "  vec3 temp_tc = a_position.xyz;\n");
 					break;
@@ -393,7 +403,7 @@ void GenerateVertexShader(int prim, char *buffer) {
 				break;
 
 			case 2:  // Shade mapping - use dots from light sources.
-				WRITE(p, "  v_texcoord = vec2(dot%i, dot%i);\n", gstate.getUVLS0(), gstate.getUVLS1());
+				WRITE(p, "  v_texcoord = vec2(dot%i, dot%i);\n", uvLS0, uvLS1);
 				break;
 
 			case 3:
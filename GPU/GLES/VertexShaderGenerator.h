@@ -50,4 +50,4 @@ bool CanUseHardwareTransform(int prim);
 
 void ComputeVertexShaderID(VertexShaderID *id, int prim);
 
-void GenerateVertexShader(int prim, char *buffer);
+void GenerateVertexShader(const VertexShaderID &id, char *buffer);
@@ -1,6 +1,7 @@
 #include "base/timeutil.h"
 #include "../Core/MemMap.h"
 #include "GeDisasm.h"
+#include "GETrace.h"
 #include "GPUCommon.h"
 #include "GPUState.h"
 
@@ -79,6 +80,8 @@ bool GPUCommon::InterpretList(DisplayList &list)
 		op = Memory::ReadUnchecked_U32(list.pc); //read from memory
 		u32 cmd = op >> 24;
 		u32 diff = op ^ gstate.cmdmem[cmd];
+		if (GETrace_IsRecording())
+			GETrace_RecordOp(op);
 		PreExecuteOp(op, diff);
 		// TODO: Add a compiler flag to remove stuff like this at very-final build time.
 		if (dumpThisFrame_) {
@@ -72,6 +72,9 @@ public:
 	// If size = -1, invalidate everything.
 	virtual void InvalidateCache(u32 addr, int size) = 0;
 	virtual void InvalidateCacheHint(u32 addr, int size) = 0;
+	// Makes sure anything the GPU has rendered into the specified range is in memory,
+	// before the CPU or DMA reads it.
+	virtual void ResolveMemory(u32 addr, int size) = 0;
 
 	// Internal hack to avoid interrupts from "PPGe" drawing (utility UI, etc)
 	virtual void EnableInterrupts(bool enable) = 0;
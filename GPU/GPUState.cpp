@@ -20,6 +20,7 @@
 #include "GLES/ShaderManager.h"
 #include "GLES/DisplayListInterpreter.h"
 #include "Null/NullGpu.h"
+#include "Software/SoftGpu.h"
 #include "../Core/CoreParameter.h"
 #include "../Core/System.h"
 
@@ -63,6 +64,9 @@ void InitGfxState()
 	case GPU_GLES:
 		gpu = new GLES_GPU(PSP_CoreParameter().renderWidth, PSP_CoreParameter().renderHeight);
 		break;
+	case GPU_SOFTWARE:
+		gpu = new SoftGPU();
+		break;
 	}
 }
 
@@ -247,6 +247,10 @@ struct GPUStateCache
 
 	float vpWidth;
 	float vpHeight;
+
+	// Set for frames that auto frameskip drops. Display lists still run, for their
+	// side effects, but nothing is drawn.
+	bool skipDrawing;
 };
 
 // TODO: Implement support for these.
@@ -266,7 +270,13 @@ struct GPUStatistics
 		numTextureSwitches = 0;
 		numShaderSwitches = 0;
 		numFlushes = 0;
+		numFlushesAvoided = 0;
 		numTexturesDecoded = 0;
+		numPatchesTessellated = 0;
+		numCachedPatches = 0;
+		numShadersCompiled = 0;
+		numReadbacks = 0;
+		numReadbacksAvoided = 0;
 		msProcessingDisplayLists = 0;
 	}
 
@@ -275,6 +285,7 @@ struct GPUStatistics
 	int numDrawCalls;
 	int numCachedDrawCalls;
 	int numFlushes;
+	int numFlushesAvoided;
 	int numVertsTransformed;
 	int numCachedVertsDrawn;
 	int numTrackedVertexArrays;
@@ -282,10 +293,16 @@ struct GPUStatistics
 	int numTextureSwitches;
 	int numShaderSwitches;
 	int numTexturesDecoded;
+	int numPatchesTessellated;
+	int numCachedPatches;
+	int numShadersCompiled;
+	int numReadbacks;
+	int numReadbacksAvoided;
 	double msProcessingDisplayLists;
 
 	// Total statistics, updated by the GPU core in UpdateStats
 	int numFrames;
+	int numFramesSkipped;
 	int numTextures;
 	int numVertexShaders;
 	int numFragmentShaders;
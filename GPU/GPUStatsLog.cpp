@@ -0,0 +1,188 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+
+#include "base/timeutil.h"
+#include "GPUState.h"
+#include "GPUStatsLog.h"
+
+enum StatsMetric {
+	METRIC_DRAW_CALLS,
+	METRIC_CACHED_DRAW_CALLS,
+	METRIC_FLUSHES,
+	METRIC_FLUSHES_AVOIDED,
+	METRIC_VERTS_TRANSFORMED,
+	METRIC_TEXTURES_DECODED,
+	METRIC_TEXTURE_INVALIDATIONS,
+	METRIC_SHADERS_COMPILED,
+	METRIC_READBACKS,
+	METRIC_READBACKS_AVOIDED,
+	METRIC_SKIPPED,
+	METRIC_LIST_MS,
+	METRIC_FRAME_MS,
+
+	METRIC_COUNT,
+};
+
+static const char *metricNames[METRIC_COUNT] = {
+	"drawCalls",
+	"cachedDrawCalls",
+	"flushes",
+	"flushesAvoided",
+	"vertsTransformed",
+	"texturesDecoded",
+	"textureInvalidations",
+	"shadersCompiled",
+	"readbacks",
+	"readbacksAvoided",
+	"skipped",
+	"listMs",
+	"frameMs",
+};
+
+// Upper bounds of the frame time histogram buckets, in ms. The last bucket has no bound.
+static const float frameBuckets[] = {4.0f, 8.0f, 16.7f, 33.4f, 50.0f, 100.0f};
+static const int NUM_FRAME_BUCKETS = sizeof(frameBuckets) / sizeof(frameBuckets[0]) + 1;
+
+static FILE *statsFile = NULL;
+static bool statsJson;
+static int statsFrame;
+static double lastFrameTime;
+static std::vector<float> samples[METRIC_COUNT];
+
+bool GPUStatsLog_Begin(const std::string &filename) {
+	GPUStatsLog_End(NULL);
+
+	statsFile = fopen(filename.c_str(), "w");
+	if (!statsFile) {
+		ERROR_LOG(G3D, "Could not open %s for GPU stats", filename.c_str());
+		return false;
+	}
+	statsJson = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0;
+	statsFrame = 0;
+	for (int i = 0; i < METRIC_COUNT; i++)
+		samples[i].clear();
+
+	if (!statsJson) {
+		fprintf(statsFile, "frame");
+		for (int i = 0; i < METRIC_COUNT; i++)
+			fprintf(statsFile, ",%s", metricNames[i]);
+		fprintf(statsFile, "\n");
+	}
+
+	time_update();
+	lastFrameTime = time_now_d();
+	return true;
+}
+
+bool GPUStatsLog_IsActive() {
+	return statsFile != NULL;
+}
+
+void GPUStatsLog_RecordFrame() {
+	time_update();
+	double now = time_now_d();
+
+	float values[METRIC_COUNT];
+	values[METRIC_DRAW_CALLS] = (float)gpuStats.numDrawCalls;
+	values[METRIC_CACHED_DRAW_CALLS] = (float)gpuStats.numCachedDrawCalls;
+	values[METRIC_FLUSHES] = (float)gpuStats.numFlushes;
+	values[METRIC_FLUSHES_AVOIDED] = (float)gpuStats.numFlushesAvoided;
+	values[METRIC_VERTS_TRANSFORMED] = (float)gpuStats.numVertsTransformed;
+	values[METRIC_TEXTURES_DECODED] = (float)gpuStats.numTexturesDecoded;
+	values[METRIC_TEXTURE_INVALIDATIONS] = (float)gpuStats.numTextureInvalidations;
+	values[METRIC_SHADERS_COMPILED] = (float)gpuStats.numShadersCompiled;
+	values[METRIC_READBACKS] = (float)gpuStats.numReadbacks;
+	values[METRIC_READBACKS_AVOIDED] = (float)gpuStats.numReadbacksAvoided;
+	values[METRIC_SKIPPED] = gstate_c.skipDrawing ? 1.0f : 0.0f;
+	values[METRIC_LIST_MS] = (float)(gpuStats.msProcessingDisplayLists * 1000.0);
+	values[METRIC_FRAME_MS] = (float)((now - lastFrameTime) * 1000.0);
+	lastFrameTime = now;
+
+	if (statsJson) {
+		fprintf(statsFile, "{\"frame\":%i", statsFrame);
+		for (int i = 0; i < METRIC_COUNT; i++)
+			fprintf(statsFile, ",\"%s\":%g", metricNames[i], values[i]);
+		fprintf(statsFile, "}\n");
+	} else {
+		fprintf(statsFile, "%i", statsFrame);
+		for (int i = 0; i < METRIC_COUNT; i++)
+			fprintf(statsFile, ",%g", values[i]);
+		fprintf(statsFile, "\n");
+	}
+
+	for (int i = 0; i < METRIC_COUNT; i++)
+		samples[i].push_back(values[i]);
+	statsFrame++;
+}
+
+float GPUStatsLog_Percentile(const std::vector<float> &sorted, float percent) {
+	if (sorted.empty())
+		return 0.0f;
+	int rank = (int)ceilf(percent / 100.0f * sorted.size());
+	return sorted[std::max(rank, 1) - 1];
+}
+
+static void PrintSummary(FILE *out) {
+	fprintf(out, "GPU stats over %i frames:\n", statsFrame);
+	fprintf(out, "%-22s %10s %10s %10s %10s %10s %10s\n", "", "mean", "p50", "p90", "p95", "p99", "max");
+	for (int i = 0; i < METRIC_COUNT; i++) {
+		std::vector<float> &sorted = samples[i];
+		std::sort(sorted.begin(), sorted.end());
+		double sum = 0.0;
+		for (size_t j = 0; j < sorted.size(); j++)
+			sum += sorted[j];
+		fprintf(out, "%-22s %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", metricNames[i], sum / sorted.size(),
+			GPUStatsLog_Percentile(sorted, 50), GPUStatsLog_Percentile(sorted, 90), GPUStatsLog_Percentile(sorted, 95),
+			GPUStatsLog_Percentile(sorted, 99), sorted.back());
+	}
+
+	int counts[NUM_FRAME_BUCKETS] = {0};
+	const std::vector<float> &frameMs = samples[METRIC_FRAME_MS];
+	for (size_t j = 0; j < frameMs.size(); j++) {
+		int bucket = 0;
+		while (bucket < NUM_FRAME_BUCKETS - 1 && frameMs[j] > frameBuckets[bucket])
+			bucket++;
+		counts[bucket]++;
+	}
+
+	fprintf(out, "Frame time histogram:\n");
+	for (int i = 0; i < NUM_FRAME_BUCKETS; i++) {
+		char label[32];
+		if (i < NUM_FRAME_BUCKETS - 1)
+			sprintf(label, "<= %.1f ms", frameBuckets[i]);
+		else
+			sprintf(label, "> %.1f ms", frameBuckets[i - 1]);
+		int width = counts[i] * 50 / statsFrame;
+		fprintf(out, "%12s %7i %s\n", label, counts[i], std::string(width, '#').c_str());
+	}
+}
+
+void GPUStatsLog_End(FILE *summary) {
+	if (statsFile == NULL)
+		return;
+	fclose(statsFile);
+	statsFile = NULL;
+
+	if (summary != NULL && statsFrame > 0)
+		PrintSummary(summary);
+	for (int i = 0; i < METRIC_COUNT; i++)
+		samples[i].clear();
+}
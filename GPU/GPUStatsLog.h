@@ -0,0 +1,43 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "../Globals.h"
+
+// Writes gpuStats out once per displayed frame, so runs can be compared by tools instead of
+// by reading the debug overlay. Files ending in .json get one JSON object per line, anything
+// else gets CSV with a header row.
+//
+// Every frame's values are also kept, so that percentiles of each counter can be printed
+// when the log ends.
+
+bool GPUStatsLog_Begin(const std::string &filename);
+// Prints the percentile summary and frame time histogram to summary, if not NULL.
+void GPUStatsLog_End(FILE *summary);
+bool GPUStatsLog_IsActive();
+
+// Called at the flip, before the per frame counters are reset. gpu->UpdateStats() should
+// have been called already.
+void GPUStatsLog_RecordFrame();
+
+// Nearest rank percentile of sorted values, percent from 0 to 100.
+float GPUStatsLog_Percentile(const std::vector<float> &sorted, float percent);
@@ -40,6 +40,7 @@ public:
 	virtual void UpdateStats();
 	virtual void InvalidateCache(u32 addr, int size);
 	virtual void InvalidateCacheHint(u32 addr, int size);
+	virtual void ResolveMemory(u32 addr, int size) {}
 	virtual void Flush() {}
 
 	virtual void DeviceLost() {}
@@ -0,0 +1,66 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <algorithm>
+
+#include "../Core/MemMap.h"
+#include "PageGenerations.h"
+
+static const u32 RAM_PAGES = Memory::RAM_SIZE >> PageGenerations::PAGE_SHIFT;
+static const u32 VRAM_PAGES = Memory::VRAM_SIZE >> PageGenerations::PAGE_SHIFT;
+
+PageGenerations::PageGenerations() : pages_(RAM_PAGES + VRAM_PAGES, 0), current_(0), allWritten_(0) {
+}
+
+// RAM pages come first, then VRAM. NULL if ptr isn't in either.
+u32 *PageGenerations::Page(const u8 *ptr) {
+	if (ptr >= Memory::m_pRAM && ptr < Memory::m_pRAM + Memory::RAM_SIZE)
+		return &pages_[(ptr - Memory::m_pRAM) >> PAGE_SHIFT];
+	if (ptr >= Memory::m_pVRAM && ptr < Memory::m_pVRAM + Memory::VRAM_SIZE)
+		return &pages_[RAM_PAGES + ((ptr - Memory::m_pVRAM) >> PAGE_SHIFT)];
+	return NULL;
+}
+
+void PageGenerations::Written(u32 addr, u32 size) {
+	if (size == 0 || !Memory::IsValidAddress(addr) || !Memory::IsValidAddress(addr + size - 1))
+		return;
+	const u8 *ptr = Memory::GetPointer(addr);
+	u32 *first = Page(ptr);
+	u32 *last = Page(ptr + size - 1);
+	if (first == NULL || last == NULL)
+		return;
+	current_++;
+	std::fill(first, last + 1, current_);
+}
+
+void PageGenerations::AllWritten() {
+	current_++;
+	allWritten_ = current_;
+}
+
+u32 PageGenerations::Get(const u8 *ptr, u32 size) const {
+	if (size == 0)
+		return allWritten_;
+	const u32 *first = Page(ptr);
+	const u32 *last = Page(ptr + size - 1);
+	if (first == NULL || last == NULL || last < first)
+		return UNTRACKED;
+	u32 generation = allWritten_;
+	for (const u32 *page = first; page <= last; page++)
+		generation = std::max(generation, *page);
+	return generation;
+}
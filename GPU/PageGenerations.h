@@ -0,0 +1,58 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include <vector>
+
+#include "../Globals.h"
+
+// Counts the writes to emulated RAM and VRAM that the GPU gets to hear about, per page, so
+// that caches of data read from memory can tell cheaply whether they need to check it again.
+//
+// The GPU is told about dcache writebacks and invalidations and its own block transfers.
+// Writes through the uncached mirror or DMA (file reads, for instance) aren't seen, so an
+// unchanged generation means "probably unchanged", not "unchanged".
+class PageGenerations {
+public:
+	enum {
+		PAGE_SHIFT = 12,
+		// Returned for memory that isn't tracked, which may always have changed.
+		UNTRACKED = 0xFFFFFFFF,
+	};
+
+	PageGenerations();
+
+	// Marks size bytes at the emulated address addr as written.
+	void Written(u32 addr, u32 size);
+	void AllWritten();
+
+	// The generation of the most recently written page of size bytes at ptr, which points
+	// into emulated memory. Bigger means written later.
+	u32 Get(const u8 *ptr, u32 size) const;
+
+private:
+	u32 *Page(const u8 *ptr);
+	const u32 *Page(const u8 *ptr) const {
+		return const_cast<PageGenerations *>(this)->Page(ptr);
+	}
+
+	std::vector<u32> pages_;
+	u32 current_;
+	// Everything written before this counts as written at this generation.
+	u32 allWritten_;
+};
@@ -0,0 +1,484 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <cmath>
+#include <algorithm>
+
+#include "CPUDetect.h"
+#include "../ge_constants.h"
+#include "Rasterizer.h"
+
+BinnedRasterizer::BinnedRasterizer(int threads)
+	: flushCount_(0), generation_(0), busy_(0), nextTile_(0), quit_(false) {
+	if (threads <= 0)
+		threads = cpu_info.num_cores;
+	// The thread calling Flush() does its share of the tiles too.
+	for (int i = 1; i < threads; i++)
+		workers_.push_back(new std::thread(&BinnedRasterizer::WorkerThreadFunc, this));
+}
+
+BinnedRasterizer::~BinnedRasterizer() {
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		quit_ = true;
+		workCond_.notify_all();
+	}
+	for (size_t i = 0; i < workers_.size(); i++) {
+		workers_[i]->join();
+		delete workers_[i];
+	}
+}
+
+int BinnedRasterizer::AddTexture(const u32 *texels, int width, int height) {
+	textures_.push_back(Texture());
+	Texture &tex = textures_.back();
+	tex.texels.assign(texels, texels + width * height);
+	tex.width = width;
+	tex.height = height;
+	return (int)textures_.size() - 1;
+}
+
+int BinnedRasterizer::AddState(const RasterState &state) {
+	states_.push_back(state);
+	return (int)states_.size() - 1;
+}
+
+void BinnedRasterizer::AddTriangle(const RasterVertex &v0, const RasterVertex &v1, const RasterVertex &v2, int state) {
+	const RasterState &st = states_[state];
+	const RasterVertex *v[3] = {&v0, &v1, &v2};
+
+	float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+	if (area == 0.0f || area != area)
+		return;
+	// Culling has already been done, so just make the winding consistent.
+	if (area < 0.0f) {
+		std::swap(v[1], v[2]);
+		area = -area;
+	}
+
+	float minXf = std::min(v0.x, std::min(v1.x, v2.x));
+	float maxXf = std::max(v0.x, std::max(v1.x, v2.x));
+	float minYf = std::min(v0.y, std::min(v1.y, v2.y));
+	float maxYf = std::max(v0.y, std::max(v1.y, v2.y));
+	// Clamp in float first, the vertices can be way outside the screen.
+	int minX = (int)std::max((float)st.scissorX1, floorf(minXf));
+	int maxX = (int)std::min((float)st.scissorX2, ceilf(maxXf));
+	int minY = (int)std::max((float)st.scissorY1, floorf(minYf));
+	int maxY = (int)std::min((float)st.scissorY2, ceilf(maxYf));
+	if (minX > maxX || minY > maxY)
+		return;
+
+	if (triangles_.size() >= MAX_QUEUED_TRIANGLES)
+		DrawQueued();
+
+	triangles_.push_back(Triangle());
+	Triangle &tri = triangles_.back();
+	tri.state = state;
+	tri.minX = minX;
+	tri.maxX = maxX;
+	tri.minY = minY;
+	tri.maxY = maxY;
+
+	for (int i = 0; i < 3; i++) {
+		const RasterVertex &a = *v[i];
+		const RasterVertex &b = *v[(i + 1) % 3];
+		float ea = a.y - b.y;
+		float eb = b.x - a.x;
+		tri.edge[i][0] = ea;
+		tri.edge[i][1] = eb;
+		tri.edge[i][2] = -(ea * a.x + eb * a.y);
+		// The two triangles sharing an edge walk it in opposite directions, so exactly one of them gets it.
+		tri.inclusive[i] = ea > 0.0f || (ea == 0.0f && eb < 0.0f);
+	}
+
+	float values[3][NUM_ATTRS];
+	for (int i = 0; i < 3; i++) {
+		const RasterVertex &vert = *v[i];
+		float w = vert.w;
+		values[i][ATTR_Z] = vert.z;
+		values[i][ATTR_W] = w;
+		values[i][ATTR_U] = vert.u * w;
+		values[i][ATTR_V] = vert.v * w;
+		for (int c = 0; c < 4; c++)
+			values[i][ATTR_R + c] = vert.color0[c] * w;
+		for (int c = 0; c < 3; c++)
+			values[i][ATTR_SR + c] = vert.color1[c] * w;
+		values[i][ATTR_FOG] = vert.fog * w;
+	}
+
+	const float x0 = v[0]->x, y0 = v[0]->y;
+	const float dx1 = v[1]->x - x0, dy1 = v[1]->y - y0;
+	const float dx2 = v[2]->x - x0, dy2 = v[2]->y - y0;
+	const float invArea = 1.0f / area;
+	for (int a = 0; a < NUM_ATTRS; a++) {
+		float f0 = values[0][a];
+		float df1 = values[1][a] - f0;
+		float df2 = values[2][a] - f0;
+		float ddx = (df1 * dy2 - df2 * dy1) * invArea;
+		float ddy = (df2 * dx1 - df1 * dx2) * invArea;
+		tri.attr[a][0] = f0 - ddx * x0 - ddy * y0;
+		tri.attr[a][1] = ddx;
+		tri.attr[a][2] = ddy;
+	}
+}
+
+void BinnedRasterizer::Flush() {
+	DrawQueued();
+	states_.clear();
+	textures_.clear();
+	flushCount_++;
+}
+
+void BinnedRasterizer::DrawQueued() {
+	if (triangles_.empty())
+		return;
+
+	for (size_t i = 0; i < triangles_.size(); i++) {
+		const Triangle &tri = triangles_[i];
+		int tx1 = tri.minX >> TILE_SHIFT, tx2 = std::min(tri.maxX >> TILE_SHIFT, TILES_X - 1);
+		int ty1 = tri.minY >> TILE_SHIFT, ty2 = std::min(tri.maxY >> TILE_SHIFT, TILES_Y - 1);
+		for (int ty = ty1; ty <= ty2; ty++) {
+			for (int tx = tx1; tx <= tx2; tx++) {
+				std::vector<int> &bin = bins_[ty * TILES_X + tx];
+				if (bin.empty())
+					activeTiles_.push_back(ty * TILES_X + tx);
+				bin.push_back((int)i);
+			}
+		}
+	}
+
+	if (workers_.empty() || triangles_.size() < MIN_PARALLEL_TRIANGLES || activeTiles_.size() == 1) {
+		for (size_t i = 0; i < activeTiles_.size(); i++)
+			RasterizeTile(activeTiles_[i]);
+	} else {
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			nextTile_ = 0;
+			busy_ = (int)workers_.size();
+			generation_++;
+			workCond_.notify_all();
+		}
+		RunTiles();
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (busy_ > 0)
+			doneCond_.wait(lock);
+	}
+
+	for (size_t i = 0; i < activeTiles_.size(); i++)
+		bins_[activeTiles_[i]].clear();
+	activeTiles_.clear();
+	triangles_.clear();
+}
+
+void BinnedRasterizer::RunTiles() {
+	while (true) {
+		int tile;
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			if (nextTile_ >= activeTiles_.size())
+				return;
+			tile = activeTiles_[nextTile_++];
+		}
+		RasterizeTile(tile);
+	}
+}
+
+void BinnedRasterizer::WorkerThreadFunc(BinnedRasterizer *rast) {
+	Common::SetCurrentThreadName("SoftGPU Raster");
+	rast->WorkerThread();
+}
+
+void BinnedRasterizer::WorkerThread() {
+	int seen = 0;
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		while (!quit_ && generation_ == seen)
+			workCond_.wait(lock);
+		if (quit_)
+			return;
+		seen = generation_;
+
+		lock.unlock();
+		RunTiles();
+		lock.lock();
+
+		if (--busy_ == 0)
+			doneCond_.notify_all();
+	}
+}
+
+void BinnedRasterizer::RasterizeTile(int tile) {
+	int x1 = (tile % TILES_X) << TILE_SHIFT;
+	int y1 = (tile / TILES_X) << TILE_SHIFT;
+	int x2 = x1 + TILE_SIZE - 1;
+	int y2 = y1 + TILE_SIZE - 1;
+
+	const std::vector<int> &bin = bins_[tile];
+	for (size_t i = 0; i < bin.size(); i++) {
+		const Triangle &tri = triangles_[bin[i]];
+		DrawTriangle(tri, std::max(x1, tri.minX), std::max(y1, tri.minY), std::min(x2, tri.maxX), std::min(y2, tri.maxY));
+	}
+}
+
+// Colors are 8888 with red in the low byte all through the pixel pipeline.
+
+u32 RGBA16To8888(u16 c, int format) {
+	switch (format) {
+	case GE_FORMAT_565:
+		return Convert5To8(c & 0x1F) | (Convert6To8((c >> 5) & 0x3F) << 8) | (Convert5To8((c >> 11) & 0x1F) << 16);
+	case GE_FORMAT_5551:
+		return Convert5To8(c & 0x1F) | (Convert5To8((c >> 5) & 0x1F) << 8) | (Convert5To8((c >> 10) & 0x1F) << 16) | ((c >> 15) ? 0xFF000000 : 0);
+	default:
+		return Convert4To8(c & 0xF) | (Convert4To8((c >> 4) & 0xF) << 8) | (Convert4To8((c >> 8) & 0xF) << 16) | (Convert4To8(c >> 12) << 24);
+	}
+}
+
+static inline u32 ReadPixel(const RasterState &st, int x, int y) {
+	if (st.fbFormat == GE_FORMAT_8888)
+		return ((const u32 *)st.fb)[y * st.fbStride + x];
+	return RGBA16To8888(((const u16 *)st.fb)[y * st.fbStride + x], st.fbFormat);
+}
+
+static inline void WritePixel(const RasterState &st, int x, int y, u32 c) {
+	if (st.fbFormat == GE_FORMAT_8888) {
+		((u32 *)st.fb)[y * st.fbStride + x] = c;
+		return;
+	}
+
+	u32 r = c & 0xFF, g = (c >> 8) & 0xFF, b = (c >> 16) & 0xFF, a = c >> 24;
+	u16 out;
+	switch (st.fbFormat) {
+	case GE_FORMAT_565:
+		out = (r >> 3) | ((g >> 2) << 5) | ((b >> 3) << 11);
+		break;
+	case GE_FORMAT_5551:
+		out = (r >> 3) | ((g >> 3) << 5) | ((b >> 3) << 10) | ((a >> 7) << 15);
+		break;
+	default:
+		out = (r >> 4) | ((g >> 4) << 4) | ((b >> 4) << 8) | ((a >> 4) << 12);
+		break;
+	}
+	((u16 *)st.fb)[y * st.fbStride + x] = out;
+}
+
+static inline bool Compare(int func, int a, int b) {
+	switch (func) {
+	case GE_COMP_NEVER: return false;
+	case GE_COMP_ALWAYS: return true;
+	case GE_COMP_EQUAL: return a == b;
+	case GE_COMP_NOTEQUAL: return a != b;
+	case GE_COMP_LESS: return a < b;
+	case GE_COMP_LEQUAL: return a <= b;
+	case GE_COMP_GREATER: return a > b;
+	case GE_COMP_GEQUAL: return a >= b;
+	}
+	return true;
+}
+
+static inline int Clamp255(int v) {
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline int ToInt255(float f) {
+	return Clamp255((int)(f * 255.0f + 0.5f));
+}
+
+static inline u32 LerpTexel(u32 a, u32 b, int frac) {
+	u32 out = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		int ca = (a >> shift) & 0xFF;
+		int cb = (b >> shift) & 0xFF;
+		out |= (u32)(ca + (((cb - ca) * frac) >> 8)) << shift;
+	}
+	return out;
+}
+
+static inline int WrapCoord(int c, int size, bool clamp) {
+	if (clamp)
+		return c < 0 ? 0 : (c >= size ? size - 1 : c);
+	// Texture sizes are always powers of two.
+	return c & (size - 1);
+}
+
+static u32 SampleTexture(const std::vector<u32> &texels, int w, int h, const RasterState &st, float u, float v) {
+	if (!st.texLinear) {
+		int x = WrapCoord((int)floorf(u * w), w, st.texClampS);
+		int y = WrapCoord((int)floorf(v * h), h, st.texClampT);
+		return texels[y * w + x];
+	}
+
+	float fu = u * w - 0.5f;
+	float fv = v * h - 0.5f;
+	int x0 = (int)floorf(fu);
+	int y0 = (int)floorf(fv);
+	int fracU = (int)((fu - x0) * 256.0f);
+	int fracV = (int)((fv - y0) * 256.0f);
+	int x1 = WrapCoord(x0 + 1, w, st.texClampS);
+	int y1 = WrapCoord(y0 + 1, h, st.texClampT);
+	x0 = WrapCoord(x0, w, st.texClampS);
+	y0 = WrapCoord(y0, h, st.texClampT);
+	u32 top = LerpTexel(texels[y0 * w + x0], texels[y0 * w + x1], fracU);
+	u32 bottom = LerpTexel(texels[y1 * w + x0], texels[y1 * w + x1], fracU);
+	return LerpTexel(top, bottom, fracV);
+}
+
+static inline int BlendFactor(int factor, int sc, int sa, int dc, int da, int fix, bool isSrc) {
+	switch (factor) {
+	case GE_SRCBLEND_DSTCOLOR: return isSrc ? dc : sc;  // GE_DSTBLEND_SRCCOLOR for the destination
+	case GE_SRCBLEND_INVDSTCOLOR: return isSrc ? 255 - dc : 255 - sc;
+	case GE_SRCBLEND_SRCALPHA: return sa;
+	case GE_SRCBLEND_INVSRCALPHA: return 255 - sa;
+	case GE_SRCBLEND_DSTALPHA: return da;
+	case GE_SRCBLEND_INVDSTALPHA: return 255 - da;
+	case GE_SRCBLEND_DOUBLESRCALPHA: return 2 * sa;
+	case GE_SRCBLEND_DOUBLEINVSRCALPHA: return 2 * (255 - sa);
+	case GE_SRCBLEND_DOUBLEDSTALPHA: return 2 * da;
+	case GE_SRCBLEND_DOUBLEINVDSTALPHA: return 2 * (255 - da);
+	default: return fix;
+	}
+}
+
+static inline int BlendChannel(const RasterState &st, int shift, int sc, int sa, int dc, int da) {
+	int fixA = (st.fixA >> shift) & 0xFF;
+	int fixB = (st.fixB >> shift) & 0xFF;
+	int s = sc * BlendFactor(st.blendSrc, sc, sa, dc, da, fixA, true) / 255;
+	int d = dc * BlendFactor(st.blendDst, sc, sa, dc, da, fixB, false) / 255;
+	switch (st.blendEq) {
+	case GE_BLENDMODE_MUL_AND_ADD: return Clamp255(s + d);
+	case GE_BLENDMODE_MUL_AND_SUBTRACT: return Clamp255(s - d);
+	case GE_BLENDMODE_MUL_AND_SUBTRACT_REVERSE: return Clamp255(d - s);
+	// These ignore the factors.
+	case GE_BLENDMODE_MIN: return std::min(sc, dc);
+	case GE_BLENDMODE_MAX: return std::max(sc, dc);
+	case GE_BLENDMODE_ABSDIFF: return abs(sc - dc);
+	}
+	return sc;
+}
+
+void BinnedRasterizer::DrawTriangle(const Triangle &tri, int x1, int y1, int x2, int y2) {
+	const RasterState &st = states_[tri.state];
+	const Texture *tex = st.texture >= 0 ? &textures_[st.texture] : 0;
+
+	for (int y = y1; y <= y2; y++) {
+		const float py = y + 0.5f;
+		for (int x = x1; x <= x2; x++) {
+			const float px = x + 0.5f;
+
+			bool inside = true;
+			for (int i = 0; i < 3; i++) {
+				float e = tri.edge[i][0] * px + tri.edge[i][1] * py + tri.edge[i][2];
+				if (e < 0.0f || (e == 0.0f && !tri.inclusive[i])) {
+					inside = false;
+					break;
+				}
+			}
+			if (!inside)
+				continue;
+
+			float v[NUM_ATTRS];
+			for (int a = 0; a < NUM_ATTRS; a++)
+				v[a] = tri.attr[a][0] + tri.attr[a][1] * px + tri.attr[a][2] * py;
+			const float invW = v[ATTR_W] != 0.0f ? 1.0f / v[ATTR_W] : 0.0f;
+
+			int z = (int)v[ATTR_Z];
+			z = z < 0 ? 0 : (z > 65535 ? 65535 : z);
+			u16 *zptr = st.zb ? &st.zb[y * st.zbStride + x] : 0;
+
+			int r = ToInt255(v[ATTR_R] * invW);
+			int g = ToInt255(v[ATTR_G] * invW);
+			int b = ToInt255(v[ATTR_B] * invW);
+			int a = ToInt255(v[ATTR_A] * invW);
+
+			if (st.clearMode) {
+				u32 old = ReadPixel(st, x, y);
+				u32 keep = (st.clearColor ? 0 : 0x00FFFFFF) | (st.clearAlpha ? 0 : 0xFF000000);
+				u32 c = r | (g << 8) | (b << 16) | (a << 24);
+				WritePixel(st, x, y, (c & ~keep) | (old & keep));
+				if (zptr && st.clearDepth)
+					*zptr = z;
+				continue;
+			}
+
+			if (tex) {
+				u32 t = SampleTexture(tex->texels, tex->width, tex->height, st, v[ATTR_U] * invW, v[ATTR_V] * invW);
+				int tr = t & 0xFF, tg = (t >> 8) & 0xFF, tb = (t >> 16) & 0xFF;
+				int ta = st.texAlpha ? (t >> 24) : 255;
+				int er = st.texEnvColor & 0xFF, eg = (st.texEnvColor >> 8) & 0xFF, eb = (st.texEnvColor >> 16) & 0xFF;
+				switch (st.texFunc) {
+				case GE_TEXFUNC_MODULATE:
+					r = r * tr / 255; g = g * tg / 255; b = b * tb / 255; a = a * ta / 255;
+					break;
+				case GE_TEXFUNC_DECAL:
+					r = (r * (255 - ta) + tr * ta) / 255;
+					g = (g * (255 - ta) + tg * ta) / 255;
+					b = (b * (255 - ta) + tb * ta) / 255;
+					break;
+				case GE_TEXFUNC_BLEND:
+					r = (r * (255 - tr) + er * tr) / 255;
+					g = (g * (255 - tg) + eg * tg) / 255;
+					b = (b * (255 - tb) + eb * tb) / 255;
+					a = a * ta / 255;
+					break;
+				case GE_TEXFUNC_REPLACE:
+					r = tr; g = tg; b = tb;
+					if (st.texAlpha)
+						a = ta;
+					break;
+				case GE_TEXFUNC_ADD:
+					r = Clamp255(r + tr); g = Clamp255(g + tg); b = Clamp255(b + tb); a = a * ta / 255;
+					break;
+				}
+			}
+
+			if (st.secondaryColor) {
+				r = Clamp255(r + ToInt255(v[ATTR_SR] * invW));
+				g = Clamp255(g + ToInt255(v[ATTR_SG] * invW));
+				b = Clamp255(b + ToInt255(v[ATTR_SB] * invW));
+			}
+			if (st.colorDouble) {
+				r = Clamp255(r * 2); g = Clamp255(g * 2); b = Clamp255(b * 2);
+			}
+
+			if (st.alphaTest && !Compare(st.alphaFunc, a & st.alphaMask, st.alphaRef & st.alphaMask))
+				continue;
+
+			if (st.fog) {
+				float f = v[ATTR_FOG] * invW;
+				int fog = (int)((f < 0.0f ? 0.0f : (f > 1.0f ? 1.0f : f)) * 256.0f);
+				r = (r * fog + (st.fogColor & 0xFF) * (256 - fog)) >> 8;
+				g = (g * fog + ((st.fogColor >> 8) & 0xFF) * (256 - fog)) >> 8;
+				b = (b * fog + ((st.fogColor >> 16) & 0xFF) * (256 - fog)) >> 8;
+			}
+
+			if (zptr && st.depthTest && !Compare(st.depthFunc, z, *zptr))
+				continue;
+
+			u32 old = ReadPixel(st, x, y);
+			if (st.blend) {
+				int dr = old & 0xFF, dg = (old >> 8) & 0xFF, db = (old >> 16) & 0xFF, da = old >> 24;
+				r = BlendChannel(st, 0, r, a, dr, da);
+				g = BlendChannel(st, 8, g, a, dg, da);
+				b = BlendChannel(st, 16, b, a, db, da);
+			}
+
+			u32 c = r | (g << 8) | (b << 16) | (a << 24);
+			WritePixel(st, x, y, (c & ~st.writeMask) | (old & st.writeMask));
+			if (zptr && st.depthWrite)
+				*zptr = z;
+		}
+	}
+}
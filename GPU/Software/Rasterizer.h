@@ -0,0 +1,170 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include <vector>
+
+#include "../../Globals.h"
+#include "../../Common/Thread.h"
+
+// Everything the pixel pipeline needs to know about a draw. Captured when the draw is
+// submitted, so that any number of draws can be queued up and rendered later in one go.
+struct RasterState {
+	u8 *fb;
+	int fbStride;  // In pixels
+	int fbFormat;  // GEBufferFormat
+	u16 *zb;       // NULL when depth is neither tested nor written
+	int zbStride;
+
+	// Inclusive.
+	int scissorX1, scissorY1, scissorX2, scissorY2;
+
+	bool clearMode;
+	bool clearColor, clearAlpha, clearDepth;
+
+	bool depthTest;
+	int depthFunc;
+	bool depthWrite;
+
+	bool alphaTest;
+	int alphaFunc;
+	u8 alphaRef;
+	u8 alphaMask;
+
+	bool blend;
+	int blendSrc, blendDst, blendEq;
+	u32 fixA, fixB;
+
+	bool fog;
+	u32 fogColor;
+	bool secondaryColor;
+
+	int texture;  // Index returned by AddTexture, or -1
+	bool texClampS, texClampT;
+	bool texLinear;
+	int texFunc;
+	bool texAlpha;
+	bool colorDouble;
+	u32 texEnvColor;
+
+	u32 writeMask;  // Bits of the destination (in 8888) that are kept, from pmskc and pmska.
+};
+
+// A vertex in screen space. x and y are in pixels, z is 0-65535. w is 1/clip w, used for
+// perspective correct interpolation; 1 in through mode.
+struct RasterVertex {
+	float x, y, z, w;
+	float u, v;
+	float color0[4];
+	float color1[3];
+	float fog;
+};
+
+// Converts a 565, 5551 or 4444 framebuffer pixel to 8888, red in the low byte.
+u32 RGBA16To8888(u16 c, int format);
+
+// Splits the screen into tiles, bins the queued triangles into the tiles they touch and
+// then renders the tiles in parallel. Each tile is only ever touched by one thread and
+// sees its triangles in submission order, so the results are exactly the same as
+// drawing everything in order on one thread.
+class BinnedRasterizer {
+public:
+	// threads = 0 picks one per core.
+	BinnedRasterizer(int threads = 0);
+	~BinnedRasterizer();
+
+	// Copies the texels, which must stay valid only for the duration of the call.
+	int AddTexture(const u32 *texels, int width, int height);
+	int AddState(const RasterState &state);
+	void AddTriangle(const RasterVertex &v0, const RasterVertex &v1, const RasterVertex &v2, int state);
+
+	// Renders everything that's queued. When this returns, memory is up to date.
+	void Flush();
+	bool Empty() const { return triangles_.empty(); }
+	// Increases each time the queue is flushed, which also forgets the states and textures.
+	int FlushCount() const { return flushCount_; }
+
+	enum {
+		TILE_SHIFT = 5,
+		TILE_SIZE = 1 << TILE_SHIFT,
+		TILES_X = 1024 >> TILE_SHIFT,
+		TILES_Y = 1024 >> TILE_SHIFT,
+		// Not much point in waking up the workers for less than this.
+		MIN_PARALLEL_TRIANGLES = 16,
+		MAX_QUEUED_TRIANGLES = 65536,
+	};
+
+private:
+	enum {
+		ATTR_Z,
+		ATTR_W,
+		ATTR_U,
+		ATTR_V,
+		ATTR_R,
+		ATTR_G,
+		ATTR_B,
+		ATTR_A,
+		ATTR_SR,
+		ATTR_SG,
+		ATTR_SB,
+		ATTR_FOG,
+		NUM_ATTRS,
+	};
+
+	// Set up once, then shared by the tiles.
+	struct Triangle {
+		int state;
+		int minX, minY, maxX, maxY;
+		// Edge functions, a * x + b * y + c, >= 0 inside. Pixels exactly on an edge are only
+		// drawn for one of the two triangles sharing it, picked by the edge's direction.
+		float edge[3][3];
+		bool inclusive[3];
+		// Attribute planes, a + b * x + c * y at pixel centers. All but Z are pre-multiplied by w.
+		float attr[NUM_ATTRS][3];
+	};
+
+	struct Texture {
+		std::vector<u32> texels;
+		int width;
+		int height;
+	};
+
+	void DrawQueued();
+	void RunTiles();
+	void RasterizeTile(int tile);
+	void DrawTriangle(const Triangle &tri, int x1, int y1, int x2, int y2);
+
+	static void WorkerThreadFunc(BinnedRasterizer *rast);
+	void WorkerThread();
+
+	std::vector<Triangle> triangles_;
+	std::vector<RasterState> states_;
+	std::vector<Texture> textures_;
+	std::vector<int> bins_[TILES_X * TILES_Y];
+	std::vector<int> activeTiles_;
+	int flushCount_;
+
+	std::vector<std::thread *> workers_;
+	std::mutex mutex_;
+	std::condition_variable workCond_;
+	std::condition_variable doneCond_;
+	int generation_;
+	int busy_;
+	size_t nextTile_;
+	bool quit_;
+};
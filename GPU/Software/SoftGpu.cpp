@@ -0,0 +1,674 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include "ChunkFile.h"
+#include "../BlockTransfer.h"
+#include "../GPUState.h"
+#include "../ge_constants.h"
+#include "../GLES/SoftwareTransform.h"
+#include "../GLES/TextureCache.h"
+#include "../../Core/MemMap.h"
+#include "../../Core/System.h"
+#include "SoftGpu.h"
+
+// Vertices closer than this (in clip w) are clipped away, to stay clear of the division.
+static const float MIN_CLIP_W = 0.00001f;
+
+static u32 VRAMAddress(u32 ptr, u32 width) {
+	return 0x04000000 | (((ptr & 0xFFFFFF) | ((width & 0xFF0000) << 8)) & 0x001FFFFF);
+}
+
+static bool IsVRAMAddress(u32 addr) {
+	return (addr & 0x0F000000) == 0x04000000;
+}
+
+SoftGPU::SoftGPU()
+	: lastVType_(0xFFFFFFFF), textureWidth_(0), textureHeight_(0), textureIndex_(-1), textureFlushCount_(-1),
+	  displayFramebuf_(0), displayStride_(0), displayFormat_(GE_FORMAT_8888), framesDumped_(0) {
+	// The texture decoders share the temp buffers with the GLES texture cache.
+	TextureCache_Init();
+	gstate_c.textureChanged = true;
+}
+
+SoftGPU::~SoftGPU() {
+	rasterizer_.Flush();
+	TextureCache_Shutdown();
+}
+
+void SoftGPU::DrawSync(int mode) {
+	rasterizer_.Flush();
+	NullGPU::DrawSync(mode);
+}
+
+void SoftGPU::Flush() {
+	rasterizer_.Flush();
+}
+
+void SoftGPU::InvalidateCache(u32 addr, int size) {
+	// The decoded texture is a copy, so anything might have changed under it.
+	gstate_c.textureChanged = true;
+}
+
+void SoftGPU::ResolveMemory(u32 addr, int size) {
+	// Something is about to read or write memory directly, the workers may still be drawing there.
+	rasterizer_.Flush();
+}
+
+void SoftGPU::DoState(PointerWrap &p) {
+	rasterizer_.Flush();
+	NullGPU::DoState(p);
+	gstate_c.textureChanged = true;
+}
+
+void SoftGPU::ExecuteOp(u32 op, u32 diff) {
+	u32 cmd = op >> 24;
+	u32 data = op & 0xFFFFFF;
+
+	// Drawing, and the state cache the transform reads, are handled here. Everything else,
+	// like list control flow, interrupts and matrix uploads, is left to NullGPU.
+	switch (cmd) {
+	case GE_CMD_PRIM:
+		DrawPrim(data);
+		return;
+
+	case GE_CMD_BEZIER:
+		DrawPatch(patchCache_.GetBezier(data & 0xFF, (data >> 8) & 0xFF));
+		return;
+
+	case GE_CMD_SPLINE:
+		DrawPatch(patchCache_.GetSpline(data & 0xFF, (data >> 8) & 0xFF, (data >> 16) & 0x3, (data >> 18) & 0x3));
+		return;
+
+	case GE_CMD_FINISH:
+		// The finish interrupt may well look at what we drew.
+		rasterizer_.Flush();
+		break;
+
+	case GE_CMD_TRANSFERSTART:
+		rasterizer_.Flush();
+		DoBlockTransfer();
+		return;
+
+	case GE_CMD_TEXADDR0:
+	case GE_CMD_TEXBUFWIDTH0:
+	case GE_CMD_TEXSIZE0:
+	case GE_CMD_TEXFORMAT:
+	case GE_CMD_TEXMODE:
+	case GE_CMD_TEXFLUSH:
+	case GE_CMD_CLUTADDR:
+	case GE_CMD_CLUTADDRUPPER:
+	case GE_CMD_CLUTFORMAT:
+	case GE_CMD_LOADCLUT:
+		gstate_c.textureChanged = true;
+		break;
+
+	case GE_CMD_TEXSCALEU:
+		gstate_c.uScale = getFloat24(data);
+		break;
+
+	case GE_CMD_TEXSCALEV:
+		gstate_c.vScale = getFloat24(data);
+		break;
+
+	case GE_CMD_TEXOFFSETU:
+		gstate_c.uOff = getFloat24(data);
+		break;
+
+	case GE_CMD_TEXOFFSETV:
+		gstate_c.vOff = getFloat24(data);
+		break;
+
+	case GE_CMD_LX0:case GE_CMD_LY0:case GE_CMD_LZ0:
+	case GE_CMD_LX1:case GE_CMD_LY1:case GE_CMD_LZ1:
+	case GE_CMD_LX2:case GE_CMD_LY2:case GE_CMD_LZ2:
+	case GE_CMD_LX3:case GE_CMD_LY3:case GE_CMD_LZ3:
+		{
+			int n = cmd - GE_CMD_LX0;
+			gstate_c.lightpos[n / 3][n % 3] = getFloat24(data);
+		}
+		break;
+
+	case GE_CMD_LDX0:case GE_CMD_LDY0:case GE_CMD_LDZ0:
+	case GE_CMD_LDX1:case GE_CMD_LDY1:case GE_CMD_LDZ1:
+	case GE_CMD_LDX2:case GE_CMD_LDY2:case GE_CMD_LDZ2:
+	case GE_CMD_LDX3:case GE_CMD_LDY3:case GE_CMD_LDZ3:
+		{
+			int n = cmd - GE_CMD_LDX0;
+			gstate_c.lightdir[n / 3][n % 3] = getFloat24(data);
+		}
+		break;
+
+	case GE_CMD_LKA0:case GE_CMD_LKB0:case GE_CMD_LKC0:
+	case GE_CMD_LKA1:case GE_CMD_LKB1:case GE_CMD_LKC1:
+	case GE_CMD_LKA2:case GE_CMD_LKB2:case GE_CMD_LKC2:
+	case GE_CMD_LKA3:case GE_CMD_LKB3:case GE_CMD_LKC3:
+		{
+			int n = cmd - GE_CMD_LKA0;
+			gstate_c.lightatt[n / 3][n % 3] = getFloat24(data);
+		}
+		break;
+
+	case GE_CMD_LAC0:case GE_CMD_LAC1:case GE_CMD_LAC2:case GE_CMD_LAC3:
+	case GE_CMD_LDC0:case GE_CMD_LDC1:case GE_CMD_LDC2:case GE_CMD_LDC3:
+	case GE_CMD_LSC0:case GE_CMD_LSC1:case GE_CMD_LSC2:case GE_CMD_LSC3:
+		{
+			int l = (cmd - GE_CMD_LAC0) / 3;
+			int t = (cmd - GE_CMD_LAC0) % 3;
+			gstate_c.lightColor[t][l][0] = (float)(data & 0xff) / 255.0f;
+			gstate_c.lightColor[t][l][1] = (float)((data >> 8) & 0xff) / 255.0f;
+			gstate_c.lightColor[t][l][2] = (float)(data >> 16) / 255.0f;
+		}
+		break;
+
+	case GE_CMD_MINZ:
+		gstate_c.zMin = getFloat24(data) / 65535.f;
+		break;
+
+	case GE_CMD_MAXZ:
+		gstate_c.zMax = getFloat24(data) / 65535.f;
+		break;
+
+	case GE_CMD_VIEWPORTZ1:
+		gstate_c.zScale = getFloat24(data) / 65535.f;
+		break;
+
+	case GE_CMD_VIEWPORTZ2:
+		gstate_c.zOff = getFloat24(data) / 65535.f;
+		break;
+	}
+
+	NullGPU::ExecuteOp(op, diff);
+}
+
+void SoftGPU::DrawPrim(u32 data) {
+	u32 count = data & 0xFFFF;
+	int prim = data >> 16;
+	u32 vertType = gstate.vertType;
+
+	if (count == 0)
+		return;
+
+	if (!Memory::IsValidAddress(gstate_c.vertexAddr)) {
+		ERROR_LOG(G3D, "Bad vertex address %08x!", gstate_c.vertexAddr);
+		return;
+	}
+	const void *verts = Memory::GetPointer(gstate_c.vertexAddr);
+	const void *inds = 0;
+	int indexType = (vertType & GE_VTYPE_IDX_MASK);
+	if (indexType != GE_VTYPE_IDX_NONE) {
+		if (!Memory::IsValidAddress(gstate_c.indexAddr)) {
+			ERROR_LOG(G3D, "Bad index address %08x!", gstate_c.indexAddr);
+			return;
+		}
+		inds = Memory::GetPointer(gstate_c.indexAddr);
+	}
+
+	DrawVertices(verts, inds, prim, count, vertType);
+
+	// After drawing, we advance the vertexAddr (when non indexed) or indexAddr (when indexed),
+	// the same as the GLES backend does.
+	if (inds)
+		gstate_c.indexAddr += count * (indexType == GE_VTYPE_IDX_16BIT ? 2 : 1);
+	else
+		gstate_c.vertexAddr += count * dec_.VertexSize();
+}
+
+void SoftGPU::DrawPatch(const PatchMesh *mesh) {
+	if (!mesh || mesh->indices.empty())
+		return;
+	DrawVertices(&mesh->verts[0], &mesh->indices[0], mesh->prim, (u32)mesh->indices.size(), mesh->vertType);
+}
+
+void SoftGPU::DrawVertices(const void *verts, const void *inds, int prim, u32 count, u32 vertType) {
+	int indexType = (vertType & GE_VTYPE_IDX_MASK);
+	if (vertType != lastVType_) {
+		dec_.SetVertexType(vertType);
+		lastVType_ = vertType;
+	}
+
+	u16 lowerBound = 0;
+	u16 upperBound = count - 1;
+	if (inds)
+		GetIndexBounds((void *)inds, count, vertType, &lowerBound, &upperBound);
+	int numVerts = upperBound - lowerBound + 1;
+
+	const DecVtxFormat &decFmt = dec_.GetDecVtxFmt();
+	decoded_.resize(numVerts * decFmt.stride);
+	transformed_.resize(numVerts);
+	clipped_.resize(numVerts);
+	dec_.DecodeVerts(&decoded_[0], verts, inds, prim, count, lowerBound, upperBound);
+
+	SoftwareTransformer transformer(vertType, decFmt);
+	transformer.Transform(&transformed_[0], &decoded_[0], numVerts);
+
+	// Xscreen = -offsetX + vpXb + vpXa * Xview, and so on.
+	vpScale_[0] = getFloat24(gstate.viewportx1);
+	vpScale_[1] = getFloat24(gstate.viewporty1);
+	vpScale_[2] = getFloat24(gstate.viewportz1);
+	vpCenter_[0] = getFloat24(gstate.viewportx2) - (float)(gstate.offsetx & 0xFFFF) / 16.0f;
+	vpCenter_[1] = getFloat24(gstate.viewporty2) - (float)(gstate.offsety & 0xFFFF) / 16.0f;
+	vpCenter_[2] = getFloat24(gstate.viewportz2);
+	for (int i = 0; i < numVerts; i++)
+		ProjectVertex(clipped_[i], transformed_[i]);
+
+	gpuStats.numDrawCalls++;
+	gpuStats.numVertsTransformed += count;
+
+	int state = SetupState();
+	if (state >= 0) {
+		const u8 *inds8 = (const u8 *)inds;
+		const u16 *inds16 = (const u16 *)inds;
+		std::vector<int> &index = indices_;
+		index.resize(count);
+		for (u32 i = 0; i < count; i++) {
+			if (indexType == GE_VTYPE_IDX_8BIT)
+				index[i] = inds8[i] - lowerBound;
+			else if (indexType == GE_VTYPE_IDX_16BIT)
+				index[i] = inds16[i] - lowerBound;
+			else
+				index[i] = i;
+		}
+
+		const ClipVertex *v = &clipped_[0];
+		bool cull = !gstate.isModeThrough() && !gstate.isModeClear() && gstate.isCullEnabled();
+		switch (prim) {
+		case GE_PRIM_POINTS:
+			for (u32 i = 0; i < count; i++)
+				AddPoint(v[index[i]], state);
+			break;
+		case GE_PRIM_LINES:
+			for (u32 i = 1; i < count; i += 2)
+				AddLine(v[index[i - 1]], v[index[i]], state);
+			break;
+		case GE_PRIM_LINE_STRIP:
+			for (u32 i = 1; i < count; i++)
+				AddLine(v[index[i - 1]], v[index[i]], state);
+			break;
+		case GE_PRIM_TRIANGLES:
+			for (u32 i = 2; i < count; i += 3)
+				AddTriangle(v[index[i - 2]], v[index[i - 1]], v[index[i]], state, cull);
+			break;
+		case GE_PRIM_TRIANGLE_STRIP:
+			// Every other triangle is flipped to keep the winding the same for culling.
+			for (u32 i = 2; i < count; i++) {
+				if (i & 1)
+					AddTriangle(v[index[i - 1]], v[index[i - 2]], v[index[i]], state, cull);
+				else
+					AddTriangle(v[index[i - 2]], v[index[i - 1]], v[index[i]], state, cull);
+			}
+			break;
+		case GE_PRIM_TRIANGLE_FAN:
+			for (u32 i = 2; i < count; i++)
+				AddTriangle(v[index[0]], v[index[i - 1]], v[index[i]], state, cull);
+			break;
+		case GE_PRIM_RECTANGLES:
+			for (u32 i = 1; i < count; i += 2)
+				AddRectangle(v[index[i - 1]], v[index[i]], state);
+			break;
+		default:
+			ERROR_LOG(G3D, "Unknown primitive type %i", prim);
+			break;
+		}
+	}
+}
+
+int SoftGPU::SetupState() {
+	RasterState st;
+	memset(&st, 0, sizeof(st));
+
+	st.fbFormat = gstate.framebufpixformat & 3;
+	st.fbStride = gstate.fbwidth & 0x3C0;
+	int bpp = st.fbFormat == GE_FORMAT_8888 ? 4 : 2;
+
+	st.scissorX1 = gstate.scissor1 & 0x3FF;
+	st.scissorY1 = (gstate.scissor1 >> 10) & 0x3FF;
+	st.scissorX2 = std::min((int)(gstate.scissor2 & 0x3FF), st.fbStride - 1);
+	st.scissorY2 = (gstate.scissor2 >> 10) & 0x3FF;
+	if (st.fbStride == 0 || st.scissorX1 > st.scissorX2 || st.scissorY1 > st.scissorY2)
+		return -1;
+
+	u32 fbAddr = VRAMAddress(gstate.fbptr, gstate.fbwidth);
+	u32 fbEnd = fbAddr + ((st.scissorY2 + 1) * st.fbStride) * bpp - 1;
+	if (!Memory::IsValidAddress(fbAddr) || !Memory::IsValidAddress(fbEnd)) {
+		ERROR_LOG(G3D, "Bad framebuffer %08x, stride %i", fbAddr, st.fbStride);
+		return -1;
+	}
+	st.fb = Memory::GetPointer(fbAddr);
+
+	st.clearMode = gstate.isModeClear();
+	st.clearColor = (gstate.clearmode & 0x100) != 0;
+	st.clearAlpha = (gstate.clearmode & 0x200) != 0;
+	st.clearDepth = (gstate.clearmode & 0x400) != 0;
+
+	st.depthTest = !st.clearMode && gstate.isDepthTestEnabled();
+	st.depthFunc = gstate.getDepthTestFunc();
+	st.depthWrite = st.depthTest && gstate.isDepthWriteEnabled();
+	if (st.depthTest || (st.clearMode && st.clearDepth)) {
+		u32 zAddr = VRAMAddress(gstate.zbptr, gstate.zbwidth);
+		st.zbStride = gstate.zbwidth & 0x3C0;
+		u32 zEnd = zAddr + ((st.scissorY2 + 1) * st.zbStride) * 2 - 1;
+		if (st.zbStride >= st.scissorX2 + 1 && Memory::IsValidAddress(zAddr) && Memory::IsValidAddress(zEnd))
+			st.zb = (u16 *)Memory::GetPointer(zAddr);
+	}
+
+	st.alphaTest = !st.clearMode && (gstate.alphaTestEnable & 1);
+	st.alphaFunc = gstate.alphatest & 7;
+	st.alphaRef = (gstate.alphatest >> 8) & 0xFF;
+	st.alphaMask = (gstate.alphatest >> 16) & 0xFF;
+
+	st.blend = !st.clearMode && (gstate.alphaBlendEnable & 1);
+	st.blendSrc = gstate.getBlendFuncA();
+	st.blendDst = gstate.getBlendFuncB();
+	st.blendEq = gstate.getBlendEq();
+	st.fixA = gstate.getFixA();
+	st.fixB = gstate.getFixB();
+
+	bool throughmode = gstate.isModeThrough();
+	st.fog = !st.clearMode && !throughmode && gstate.isFogEnabled();
+	st.fogColor = gstate.fogcolor & 0xFFFFFF;
+	st.secondaryColor = !st.clearMode && !throughmode && (gstate.lmode & 1) && (gstate.lightingEnable & 1);
+
+	st.texture = -1;
+	if (!st.clearMode && (gstate.textureMapEnable & 1)) {
+		UpdateTexture();
+		st.texture = textureIndex_;
+	}
+	st.texClampS = (gstate.texwrap & 1) != 0;
+	st.texClampT = ((gstate.texwrap >> 8) & 1) != 0;
+	st.texLinear = ((gstate.texfilter >> 8) & 1) != 0;
+	st.texFunc = gstate.texfunc & 7;
+	st.texAlpha = (gstate.texfunc & 0x100) != 0;
+	st.colorDouble = (gstate.texfunc & 0x10000) != 0;
+	st.texEnvColor = gstate.texenvcolor & 0xFFFFFF;
+
+	st.writeMask = st.clearMode ? 0 : ((gstate.pmskc & 0xFFFFFF) | ((gstate.pmska & 0xFF) << 24));
+
+	return rasterizer_.AddState(st);
+}
+
+void SoftGPU::UpdateTexture() {
+	u32 texaddr = (gstate.texaddr[0] & 0xFFFFF0) | ((gstate.texbufwidth[0] << 8) & 0x0F000000);
+	// A texture in VRAM may be the target of something still queued, render to texture.
+	bool renderTarget = IsVRAMAddress(texaddr) && !rasterizer_.Empty();
+	if (gstate_c.textureChanged || renderTarget) {
+		gstate_c.textureChanged = false;
+		if (renderTarget)
+			rasterizer_.Flush();
+
+		int w, h;
+		const u32 *texels = TextureCache_DecodeTo8888(&w, &h);
+		if (texels) {
+			texture_.assign(texels, texels + w * h);
+			textureWidth_ = w;
+			textureHeight_ = h;
+		} else {
+			texture_.clear();
+		}
+		textureIndex_ = -1;
+	}
+
+	if (texture_.empty()) {
+		textureIndex_ = -1;
+	} else if (textureIndex_ < 0 || textureFlushCount_ != rasterizer_.FlushCount()) {
+		textureIndex_ = rasterizer_.AddTexture(&texture_[0], textureWidth_, textureHeight_);
+		textureFlushCount_ = rasterizer_.FlushCount();
+	}
+}
+
+void SoftGPU::ProjectVertex(ClipVertex &cv, const TransformedVertex &tv) {
+	if (gstate.isModeThrough()) {
+		cv.clip[0] = tv.x;
+		cv.clip[1] = tv.y;
+		cv.clip[2] = tv.z;
+		cv.clip[3] = 1.0f;
+	} else {
+		const float *m = gstate.projMatrix;
+		for (int i = 0; i < 4; i++)
+			cv.clip[i] = m[i] * tv.x + m[4 + i] * tv.y + m[8 + i] * tv.z + m[12 + i];
+	}
+
+	RasterVertex &v = cv.v;
+	v.u = tv.u;
+	v.v = tv.v;
+	memcpy(v.color0, tv.color0, sizeof(v.color0));
+	memcpy(v.color1, tv.color1, sizeof(v.color1));
+	v.fog = tv.fog;
+}
+
+void SoftGPU::ToScreen(RasterVertex &out, const ClipVertex &cv) {
+	out = cv.v;
+	if (gstate.isModeThrough()) {
+		out.x = cv.clip[0];
+		out.y = cv.clip[1];
+		out.z = cv.clip[2];
+		out.w = 1.0f;
+	} else {
+		float invW = 1.0f / cv.clip[3];
+		out.x = vpCenter_[0] + vpScale_[0] * cv.clip[0] * invW;
+		out.y = vpCenter_[1] + vpScale_[1] * cv.clip[1] * invW;
+		out.z = vpCenter_[2] + vpScale_[2] * cv.clip[2] * invW;
+		out.w = invW;
+	}
+}
+
+static void LerpClipVertex(SoftGPU::ClipVertex &out, const SoftGPU::ClipVertex &a, const SoftGPU::ClipVertex &b, float t) {
+	for (int i = 0; i < 4; i++)
+		out.clip[i] = a.clip[i] + (b.clip[i] - a.clip[i]) * t;
+	out.v.u = a.v.u + (b.v.u - a.v.u) * t;
+	out.v.v = a.v.v + (b.v.v - a.v.v) * t;
+	for (int i = 0; i < 4; i++)
+		out.v.color0[i] = a.v.color0[i] + (b.v.color0[i] - a.v.color0[i]) * t;
+	for (int i = 0; i < 3; i++)
+		out.v.color1[i] = a.v.color1[i] + (b.v.color1[i] - a.v.color1[i]) * t;
+	out.v.fog = a.v.fog + (b.v.fog - a.v.fog) * t;
+}
+
+// Clips a convex polygon against dot(plane, clip) >= minDist. Returns the new count.
+static int ClipPolygon(SoftGPU::ClipVertex *out, const SoftGPU::ClipVertex *in, int count, const float plane[4], float minDist) {
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		const SoftGPU::ClipVertex &a = in[i];
+		const SoftGPU::ClipVertex &b = in[(i + 1) % count];
+		float da = plane[0] * a.clip[0] + plane[1] * a.clip[1] + plane[2] * a.clip[2] + plane[3] * a.clip[3] - minDist;
+		float db = plane[0] * b.clip[0] + plane[1] * b.clip[1] + plane[2] * b.clip[2] + plane[3] * b.clip[3] - minDist;
+		if (da >= 0.0f)
+			out[n++] = a;
+		if ((da >= 0.0f) != (db >= 0.0f))
+			LerpClipVertex(out[n++], a, b, da / (da - db));
+	}
+	return n;
+}
+
+void SoftGPU::AddTriangle(const ClipVertex &v0, const ClipVertex &v1, const ClipVertex &v2, int state, bool cull) {
+	// Only the near plane needs real clipping, the rest is done by the scissor.
+	// Two planes can add two vertices.
+	ClipVertex poly[2][5];
+	int count = 3;
+	poly[0][0] = v0;
+	poly[0][1] = v1;
+	poly[0][2] = v2;
+	if (!gstate.isModeThrough()) {
+		static const float nearPlane[4] = {0.0f, 0.0f, 1.0f, 1.0f};
+		static const float wPlane[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+		float minW = std::min(v0.clip[3], std::min(v1.clip[3], v2.clip[3]));
+		float minZ = std::min(v0.clip[2] + v0.clip[3], std::min(v1.clip[2] + v1.clip[3], v2.clip[2] + v2.clip[3]));
+		if (minW < MIN_CLIP_W || minZ < 0.0f) {
+			count = ClipPolygon(poly[1], poly[0], count, nearPlane, 0.0f);
+			count = ClipPolygon(poly[0], poly[1], count, wPlane, MIN_CLIP_W);
+			if (count < 3)
+				return;
+		}
+	}
+
+	RasterVertex screen[5];
+	for (int i = 0; i < count; i++)
+		ToScreen(screen[i], poly[0][i]);
+
+	if (cull) {
+		// The screen has Y pointing down, so front facing (counter-clockwise) triangles have negative area.
+		float area = (screen[1].x - screen[0].x) * (screen[2].y - screen[0].y) - (screen[2].x - screen[0].x) * (screen[1].y - screen[0].y);
+		bool backFacing = area > 0.0f;
+		if (backFacing == (gstate.getCullMode() == 0))
+			return;
+	}
+
+	for (int i = 2; i < count; i++)
+		rasterizer_.AddTriangle(screen[0], screen[i - 1], screen[i], state);
+}
+
+void SoftGPU::AddRectangle(const ClipVertex &v0, const ClipVertex &v1, int state) {
+	if (!gstate.isModeThrough() && (v0.clip[3] < MIN_CLIP_W || v1.clip[3] < MIN_CLIP_W))
+		return;
+
+	RasterVertex tl, br;
+	ToScreen(tl, v0);
+	ToScreen(br, v1);
+	// Color, depth and fog all come from the second vertex. There's no perspective.
+	br.w = 1.0f;
+	RasterVertex corners[4] = {br, br, br, br};
+	corners[0].x = tl.x; corners[0].y = tl.y; corners[0].u = tl.u; corners[0].v = tl.v;
+	corners[1].y = tl.y; corners[1].v = tl.v;
+	corners[3].x = tl.x; corners[3].u = tl.u;
+
+	rasterizer_.AddTriangle(corners[0], corners[1], corners[2], state);
+	rasterizer_.AddTriangle(corners[0], corners[2], corners[3], state);
+}
+
+void SoftGPU::AddLine(const ClipVertex &v0, const ClipVertex &v1, int state) {
+	if (!gstate.isModeThrough() && (v0.clip[3] < MIN_CLIP_W || v1.clip[3] < MIN_CLIP_W))
+		return;
+
+	RasterVertex a, b;
+	ToScreen(a, v0);
+	ToScreen(b, v1);
+	float dx = b.x - a.x;
+	float dy = b.y - a.y;
+	float len = sqrtf(dx * dx + dy * dy);
+	if (len == 0.0f) {
+		AddPoint(v0, state);
+		return;
+	}
+
+	// A one pixel wide quad along the line.
+	float nx = -dy / len * 0.5f;
+	float ny = dx / len * 0.5f;
+	RasterVertex quad[4] = {a, a, b, b};
+	quad[0].x += nx; quad[0].y += ny;
+	quad[1].x -= nx; quad[1].y -= ny;
+	quad[2].x -= nx; quad[2].y -= ny;
+	quad[3].x += nx; quad[3].y += ny;
+	rasterizer_.AddTriangle(quad[0], quad[1], quad[2], state);
+	rasterizer_.AddTriangle(quad[0], quad[2], quad[3], state);
+}
+
+void SoftGPU::AddPoint(const ClipVertex &v0, int state) {
+	if (!gstate.isModeThrough() && v0.clip[3] < MIN_CLIP_W)
+		return;
+
+	RasterVertex p;
+	ToScreen(p, v0);
+	p.w = 1.0f;
+	RasterVertex quad[4] = {p, p, p, p};
+	quad[1].x += 1.0f;
+	quad[2].x += 1.0f; quad[2].y += 1.0f;
+	quad[3].y += 1.0f;
+	rasterizer_.AddTriangle(quad[0], quad[1], quad[2], state);
+	rasterizer_.AddTriangle(quad[0], quad[2], quad[3], state);
+}
+
+void SoftGPU::DoBlockTransfer() {
+	BlockTransfer transfer;
+	transfer.ReadGState();
+
+	DEBUG_LOG(G3D, "Block transfer: %08x to %08x, %i x %i", transfer.srcBasePtr, transfer.dstBasePtr, transfer.width, transfer.height);
+
+	if (transfer.Execute())
+		gstate_c.textureChanged = true;
+}
+
+void SoftGPU::SetDisplayFramebuffer(u32 framebuf, u32 stride, int format) {
+	// What's queued belongs on the framebuffer that was being shown.
+	if (framebuf != displayFramebuf_)
+		rasterizer_.Flush();
+	displayFramebuf_ = framebuf;
+	displayStride_ = stride;
+	displayFormat_ = format;
+}
+
+void SoftGPU::CopyDisplayToOutput() {
+	// Everything is already in VRAM, once we've drawn it.
+	rasterizer_.Flush();
+	if (!PSP_CoreParameter().frameDumpDirectory.empty())
+		DumpFrame();
+	patchCache_.Decimate();
+}
+
+static void PutLE32(u8 *p, u32 v) {
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = v >> 24;
+}
+
+void SoftGPU::DumpFrame() {
+	const int width = 480;
+	const int height = 272;
+	int bpp = displayFormat_ == GE_FORMAT_8888 ? 4 : 2;
+	u32 addr = displayFramebuf_;
+	u32 end = addr + (displayStride_ * (height - 1) + width) * bpp - 1;
+	if (displayStride_ < width || !Memory::IsValidAddress(addr) || !Memory::IsValidAddress(end))
+		return;
+
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s/frame%05d.bmp", PSP_CoreParameter().frameDumpDirectory.c_str(), framesDumped_++);
+	FILE *f = fopen(filename, "wb");
+	if (!f) {
+		ERROR_LOG(G3D, "Unable to write frame dump %s", filename);
+		return;
+	}
+
+	// 24-bit uncompressed BMP, rows bottom up. 480 * 3 is already a multiple of 4.
+	const u32 imageSize = width * height * 3;
+	u8 header[54] = {'B', 'M'};
+	PutLE32(header + 2, sizeof(header) + imageSize);
+	PutLE32(header + 10, sizeof(header));
+	PutLE32(header + 14, 40);
+	PutLE32(header + 18, width);
+	PutLE32(header + 22, height);
+	header[26] = 1;
+	header[28] = 24;
+	PutLE32(header + 34, imageSize);
+	fwrite(header, sizeof(header), 1, f);
+
+	const u8 *fb = Memory::GetPointer(addr);
+	std::vector<u8> row(width * 3);
+	for (int y = height - 1; y >= 0; y--) {
+		for (int x = 0; x < width; x++) {
+			int index = y * displayStride_ + x;
+			u32 c = displayFormat_ == GE_FORMAT_8888 ? ((const u32 *)fb)[index] : RGBA16To8888(((const u16 *)fb)[index], displayFormat_);
+			row[x * 3 + 0] = (c >> 16) & 0xFF;
+			row[x * 3 + 1] = (c >> 8) & 0xFF;
+			row[x * 3 + 2] = c & 0xFF;
+		}
+		fwrite(&row[0], row.size(), 1, f);
+	}
+	fclose(f);
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2013- PPSSPP Project.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 2.0 or later versions.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License 2.0 for more details.
+
+// A copy of the GPL 2.0 should have been included with the program.
+// If not, see http://www.gnu.org/licenses/
+
+// Official git repository and contact information can be found at
+// https://github.com/hrydgard/ppsspp and http://www.ppsspp.org/.
+
+#pragma once
+
+#include <vector>
+
+#include "../Null/NullGpu.h"
+#include "../GLES/Spline.h"
+#include "../GLES/VertexDecoder.h"
+#include "Rasterizer.h"
+
+// Renders straight into emulated VRAM on the CPU, so it works without GL and gives
+// reference images to compare the hardware renderer against. Display list handling is
+// inherited from NullGPU, this only adds the drawing.
+//
+// Vertices go through the same decoder and software transform as the GLES backend, then
+// get clipped, projected and handed to the binned rasterizer. Draws are queued until
+// something needs to see VRAM: a block transfer, the end of a list, the display, or a
+// texture that lives in VRAM.
+class SoftGPU : public NullGPU
+{
+public:
+	SoftGPU();
+	~SoftGPU();
+	virtual void ExecuteOp(u32 op, u32 diff);
+	virtual void DrawSync(int mode);
+
+	virtual void SetDisplayFramebuffer(u32 framebuf, u32 stride, int format);
+	virtual void CopyDisplayToOutput();
+	virtual void InvalidateCache(u32 addr, int size);
+	virtual void ResolveMemory(u32 addr, int size);
+	virtual void Flush();
+	virtual void DoState(PointerWrap &p);
+
+	// A vertex after projection, before clipping and the viewport.
+	struct ClipVertex {
+		float clip[4];
+		RasterVertex v;
+	};
+
+private:
+	void DrawPrim(u32 data);
+	void DrawPatch(const PatchMesh *mesh);
+	void DrawVertices(const void *verts, const void *inds, int prim, u32 count, u32 vertType);
+	int SetupState();
+	void UpdateTexture();
+	void ProjectVertex(ClipVertex &cv, const TransformedVertex &tv);
+	void ToScreen(RasterVertex &out, const ClipVertex &cv);
+	void AddTriangle(const ClipVertex &v0, const ClipVertex &v1, const ClipVertex &v2, int state, bool cull);
+	void AddRectangle(const ClipVertex &v0, const ClipVertex &v1, int state);
+	void AddLine(const ClipVertex &v0, const ClipVertex &v1, int state);
+	void AddPoint(const ClipVertex &v0, int state);
+	void DoBlockTransfer();
+	void DumpFrame();
+
+	BinnedRasterizer rasterizer_;
+
+	PatchCache patchCache_;
+	VertexDecoder dec_;
+	u32 lastVType_;
+	std::vector<u8> decoded_;
+	std::vector<TransformedVertex> transformed_;
+	std::vector<ClipVertex> clipped_;
+	std::vector<int> indices_;
+
+	// Decoded texture, kept so it can be handed to the rasterizer again after a flush.
+	std::vector<u32> texture_;
+	int textureWidth_;
+	int textureHeight_;
+	int textureIndex_;
+	int textureFlushCount_;
+
+	// Viewport, from the GE registers, per draw.
+	float vpScale_[3];
+	float vpCenter_[3];
+
+	u32 displayFramebuf_;
+	u32 displayStride_;
+	int displayFormat_;
+	int framesDumped_;
+};
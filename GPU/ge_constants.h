@@ -461,6 +461,13 @@ enum GEPrimitiveType
 	GE_PRIM_RECTANGLES=6,
 };
 
+enum GEPatchPrimType
+{
+	GE_PATCHPRIM_TRIANGLES=0,
+	GE_PATCHPRIM_LINES=1,
+	GE_PATCHPRIM_POINTS=2,
+};
+
 enum GELogicOp
 {
 	GE_LOGIC_AND = 1,
@@ -57,9 +57,12 @@ SOURCES +=	../Core/CPU.cpp \ # Core
 	../Core/ELF/PrxDecrypter.cpp \
 	../Core/ELF/ParamSFO.cpp \
 	../Core/FileSystems/BlockDevices.cpp \
+	../Core/FileSystems/ImageCompressor.cpp \
+	../Core/FileSystems/BlockCache.cpp \
 	../Core/FileSystems/DirectoryFileSystem.cpp \
 	../Core/FileSystems/ISOFileSystem.cpp \
 	../Core/FileSystems/MetaFileSystem.cpp \
+	../Core/FileSystems/AsyncIOManager.cpp \
 	../Core/HLE/HLE.cpp \
 	../Core/HLE/HLETables.cpp \
 	../Core/HLE/__sceAudio.cpp \
@@ -131,7 +134,10 @@ SOURCES +=	../Core/CPU.cpp \ # Core
 	../GPU/GLES/FragmentShaderGenerator.cpp \
 	../GPU/GLES/Framebuffer.cpp \
 	../GPU/GLES/IndexGenerator.cpp \
+	../GPU/GLES/PixelConvert.cpp \
 	../GPU/GLES/ShaderManager.cpp \
+	../GPU/GLES/SoftwareTransform.cpp \
+	../GPU/GLES/Spline.cpp \
 	../GPU/GLES/StateMapping.cpp \
 	../GPU/GLES/TextureCache.cpp \
 	../GPU/GLES/TransformPipeline.cpp \
@@ -139,9 +145,15 @@ SOURCES +=	../Core/CPU.cpp \ # Core
 	../GPU/GLES/VertexShaderGenerator.cpp \
 	../GPU/GeDisasm.cpp \
 	../GPU/GPUCommon.cpp \
+	../GPU/GETrace.cpp \
+	../GPU/GPUStatsLog.cpp \
+	../GPU/PageGenerations.cpp \
+	../GPU/BlockTransfer.cpp \
 	../GPU/GPUState.cpp \
 	../GPU/Math3D.cpp \
 	../GPU/Null/NullGpu.cpp \ # Kirk
+	../GPU/Software/SoftGpu.cpp \ # Kirk
+	../GPU/Software/Rasterizer.cpp \ # Kirk
 	../ext/libkirk/AES.c \
 	../ext/libkirk/SHA1.c \
 	../ext/libkirk/bn.c \
@@ -167,10 +179,13 @@ HEADERS +=	../Core/CPU.h \
 	../Core/ELF/PrxDecrypter.h \
 	../Core/ELF/ParamSFO.h \
 	../Core/FileSystems/BlockDevices.h \
+	../Core/FileSystems/ImageCompressor.h \
+	../Core/FileSystems/BlockCache.h \
 	../Core/FileSystems/DirectoryFileSystem.h \
 	../Core/FileSystems/FileSystem.h \
 	../Core/FileSystems/ISOFileSystem.h \
 	../Core/FileSystems/MetaFileSystem.h \
+	../Core/FileSystems/AsyncIOManager.h \
 	../Core/HLE/FunctionWrappers.h \
 	../Core/HLE/HLE.h \
 	../Core/HLE/HLETables.h \
@@ -241,18 +256,28 @@ HEADERS +=	../Core/CPU.h \
 	../GPU/GLES/FragmentShaderGenerator.h \
 	../GPU/GLES/Framebuffer.h \
 	../GPU/GLES/IndexGenerator.h \
+	../GPU/GLES/PixelConvert.h \
 	../GPU/GLES/ShaderManager.h \
+	../GPU/GLES/SoftwareTransform.h \
+	../GPU/GLES/Spline.h \
 	../GPU/GLES/StateMapping.h \
 	../GPU/GLES/TextureCache.h \
 	../GPU/GLES/TransformPipeline.h \
+	../GPU/GLES/Vec4f.h \
 	../GPU/GLES/VertexDecoder.h \
 	../GPU/GLES/VertexShaderGenerator.h \
 	../GPU/GPUInterface.h \
 	../GPU/GeDisasm.h \
 	../GPU/GPUCommon.h \
+	../GPU/GETrace.h \
+	../GPU/GPUStatsLog.h \
+	../GPU/PageGenerations.h \
+	../GPU/BlockTransfer.h \
 	../GPU/GPUState.h \
 	../GPU/Math3D.h \
 	../GPU/Null/NullGpu.h \
+	../GPU/Software/SoftGpu.h \
+	../GPU/Software/Rasterizer.h \
 	../GPU/ge_constants.h \
 	../ext/libkirk/AES.h \
 	../ext/libkirk/SHA1.h \
@@ -206,7 +206,7 @@ void MainWindow::SetNextState(CoreState state)
 
 void MainWindow::BrowseAndBoot(void)
 {
-	QString filename = QFileDialog::getOpenFileName(NULL, "Load File", g_Config.currentDirectory.c_str(), "PSP ROMs (*.pbp *.elf *.iso *.cso *.prx)");
+	QString filename = QFileDialog::getOpenFileName(NULL, "Load File", g_Config.currentDirectory.c_str(), "PSP ROMs (*.pbp *.elf *.iso *.cso *.sso *.prx)");
 	if (QFile::exists(filename))
 		EmuThread_Start(filename, w);
 }
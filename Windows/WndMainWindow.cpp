@@ -185,7 +185,7 @@ namespace MainWindow
 
 		filter += "PSP";
 		filter += "|";
-		filter += "*.pbp;*.elf;*.iso;*.cso;*.prx";
+		filter += "*.pbp;*.elf;*.iso;*.cso;*.sso;*.prx";
 		filter += "|";
 		filter += "|";
 		for (int i=0; i<(int)filter.length(); i++)
@@ -194,7 +194,7 @@ namespace MainWindow
 				filter[i] = '\0';
 		}
 
-		if (W32Util::BrowseForFileName(true, GetHWND(), "Load File",0,filter.c_str(),"*.pbp;*.elf;*.iso;*.cso;",fn))
+		if (W32Util::BrowseForFileName(true, GetHWND(), "Load File",0,filter.c_str(),"*.pbp;*.elf;*.iso;*.cso;*.sso;",fn))
 		{
 			// decode the filename with fullpath
 			std::string fullpath = fn;
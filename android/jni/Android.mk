@@ -73,19 +73,28 @@ LOCAL_SRC_FILES := \
   $(SRC)/Common/MathUtil.cpp \
   $(SRC)/GPU/Math3D.cpp \
   $(SRC)/GPU/GPUCommon.cpp \
+  $(SRC)/GPU/GETrace.cpp \
+  $(SRC)/GPU/GPUStatsLog.cpp \
+  $(SRC)/GPU/PageGenerations.cpp \
+  $(SRC)/GPU/BlockTransfer.cpp \
   $(SRC)/GPU/GPUState.cpp \
   $(SRC)/GPU/GeDisasm.cpp \
   $(SRC)/GPU/GLES/Framebuffer.cpp \
   $(SRC)/GPU/GLES/DisplayListInterpreter.cpp \
   $(SRC)/GPU/GLES/TextureCache.cpp \
   $(SRC)/GPU/GLES/IndexGenerator.cpp \
+  $(SRC)/GPU/GLES/PixelConvert.cpp \
   $(SRC)/GPU/GLES/TransformPipeline.cpp \
   $(SRC)/GPU/GLES/StateMapping.cpp \
   $(SRC)/GPU/GLES/VertexDecoder.cpp \
   $(SRC)/GPU/GLES/ShaderManager.cpp \
+  $(SRC)/GPU/GLES/SoftwareTransform.cpp \
+  $(SRC)/GPU/GLES/Spline.cpp \
   $(SRC)/GPU/GLES/VertexShaderGenerator.cpp \
   $(SRC)/GPU/GLES/FragmentShaderGenerator.cpp \
   $(SRC)/GPU/Null/NullGpu.cpp \
+  $(SRC)/GPU/Software/SoftGpu.cpp \
+  $(SRC)/GPU/Software/Rasterizer.cpp \
   $(SRC)/Core/ELF/ElfReader.cpp \
   $(SRC)/Core/ELF/PrxDecrypter.cpp \
   $(SRC)/Core/ELF/ParamSFO.cpp \
@@ -154,8 +163,11 @@ LOCAL_SRC_FILES := \
   $(SRC)/Core/HLE/sceUtility.cpp \
   $(SRC)/Core/HLE/sceVaudio.cpp \
   $(SRC)/Core/FileSystems/BlockDevices.cpp \
+  $(SRC)/Core/FileSystems/ImageCompressor.cpp \
+  $(SRC)/Core/FileSystems/BlockCache.cpp \
   $(SRC)/Core/FileSystems/ISOFileSystem.cpp \
   $(SRC)/Core/FileSystems/MetaFileSystem.cpp \
+  $(SRC)/Core/FileSystems/AsyncIOManager.cpp \
   $(SRC)/Core/FileSystems/DirectoryFileSystem.cpp \
   $(SRC)/Core/MIPS/MIPS.cpp.arm \
   $(SRC)/Core/MIPS/MIPSAnalyst.cpp \
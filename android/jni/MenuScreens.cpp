@@ -170,7 +170,7 @@ void MenuScreen::render() {
 
 	if (UIButton(GEN_ID, vlinear, w, "Load...", ALIGN_RIGHT)) {
 #if defined(USING_QT_UI) && defined(__SYMBIAN32__)
-		QString fileName = QFileDialog::getOpenFileName(NULL, "Load ROM", g_Config.currentDirectory.c_str(), "PSP ROMs (*.iso *.cso *.pbp *.elf)");
+		QString fileName = QFileDialog::getOpenFileName(NULL, "Load ROM", g_Config.currentDirectory.c_str(), "PSP ROMs (*.iso *.cso *.sso *.pbp *.elf)");
 		if (QFile::exists(fileName)) {
 			QDir newPath;
 			g_Config.currentDirectory = newPath.filePath(fileName).toStdString();
@@ -180,10 +180,11 @@ void MenuScreen::render() {
 #else
 		FileSelectScreenOptions options;
 		options.allowChooseDirectory = true;
-		options.filter = "iso:cso:pbp:elf:prx:";
+		options.filter = "iso:cso:sso:pbp:elf:prx:";
 		options.folderIcon = I_ICON_FOLDER;
 		options.iconMapping["iso"] = I_ICON_UMD;
 		options.iconMapping["cso"] = I_ICON_UMD;
+		options.iconMapping["sso"] = I_ICON_UMD;
 		options.iconMapping["pbp"] = I_ICON_EXE;
 		options.iconMapping["elf"] = I_ICON_EXE;
 		screenManager()->switchScreen(new FileSelectScreen(options));
@@ -307,6 +308,7 @@ void SettingsScreen::render() {
 	UICheckBox(GEN_ID, x, y += stride, "Hardware Transform", ALIGN_TOPLEFT, &g_Config.bHardwareTransform);
 	UICheckBox(GEN_ID, x, y += stride, "Draw using Stream VBO", ALIGN_TOPLEFT, &g_Config.bUseVBO);
 	UICheckBox(GEN_ID, x, y += 50, "Vertex Cache", ALIGN_TOPLEFT, &g_Config.bVertexCache);
+	UICheckBox(GEN_ID, x, y += stride, "Auto Frameskip", ALIGN_TOPLEFT, &g_Config.bAutoFrameSkip);
 
 	bool useJit = g_Config.iCpuCore == CPU_JIT;
 	UICheckBox(GEN_ID, x, y += stride, "JIT (Dynarec)", ALIGN_TOPLEFT, &useJit);
@@ -10,8 +10,19 @@
 #include "../Core/System.h"
 #include "../Core/MIPS/MIPS.h"
 #include "../Core/Host.h"
+#include "../Core/MemMap.h"
+#include "../Core/PSPLoaders.h"
+#include "../Core/FileSystems/BlockDevices.h"
+#include "../Core/FileSystems/ImageCompressor.h"
+#include "../GPU/GPUState.h"
+#include "../GPU/GPUInterface.h"
+#include "../GPU/GETrace.h"
+#include "../GPU/GPUStatsLog.h"
+#include "../GPU/GeDisasm.h"
 #include "Log.h"
 #include "LogManager.h"
+#include "CPUDetect.h"
+#include "base/timeutil.h"
 
 #include "StubHost.h"
 #ifdef _WIN32
@@ -60,13 +71,85 @@ void printUsage(const char *progname, const char *reason)
 	HeadlessHost h2;
 	if (typeid(h1) != typeid(h2))
 		fprintf(stderr, "  --graphics            use the full gpu backend (slower)\n");
+	fprintf(stderr, "  -s, --software        render with the software gpu, no GL needed\n");
+	fprintf(stderr, "  -d, --dump dir        with -s, write every displayed frame to dir as a BMP\n");
 
 	fprintf(stderr, "  -f                    use the fast interpreter\n");
 	fprintf(stderr, "  -j                    use jit (overrides -f)\n");
 	fprintf(stderr, "  -c, --compare         compare with output in file.expected\n");
+	fprintf(stderr, "  --stats file          write gpu stats for every frame to file (CSV, or JSON lines\n");
+	fprintf(stderr, "                        if it ends in .json), and print percentiles at the end\n");
+	fprintf(stderr, "  --trace file          record a GE trace of the run to file\n");
+	fprintf(stderr, "  --replay file         replay a GE trace instead of running, and time each command\n");
+	fprintf(stderr, "  --compress out.sso    compress the iso or cso given instead of file.elf to out.sso\n");
+	fprintf(stderr, "                        instead of running it\n");
+	fprintf(stderr, "  --block-size bytes    block size for --compress, default 32768\n");
 	fprintf(stderr, "\nSee headless.txt for details.\n");
 }
 
+// Runs a GE trace through the gpu selected in coreParameter, without booting anything.
+int replayTrace(CoreParameter &coreParameter, const char *filename)
+{
+	PSP_CoreParameter() = coreParameter;
+	Memory::Init();
+	InitGfxState();
+
+	GETraceStats stats;
+	bool success = GETrace_Replay(filename, gpu, stats);
+	if (success)
+	{
+		double total = stats.frameSeconds;
+		for (int cmd = 0; cmd < 256; cmd++)
+			total += stats.seconds[cmd];
+
+		printf("%d frames, %d bytes of memory, %0.2f ms total\n", stats.frames, stats.memoryBytes, total * 1000.0);
+		printf(" cmd     count   total ms    avg us  sample\n");
+		for (int cmd = 0; cmd < 256; cmd++)
+		{
+			if (stats.count[cmd] == 0)
+				continue;
+			char disasm[256];
+			GeDisassembleOp(0, stats.sampleOp[cmd], 0, disasm);
+			printf("  %02x %9d %10.3f %9.3f  %s\n", cmd, stats.count[cmd], stats.seconds[cmd] * 1000.0,
+				stats.seconds[cmd] * 1000000.0 / stats.count[cmd], disasm);
+		}
+		if (stats.frames > 0)
+			printf("flip %9d %10.3f %9.3f\n", stats.frames, stats.frameSeconds * 1000.0, stats.frameSeconds * 1000000.0 / stats.frames);
+	}
+	else
+		fprintf(stderr, "Failed to replay %s\n", filename);
+
+	ShutdownGfxState();
+	Memory::Shutdown();
+	return success ? 0 : 1;
+}
+
+// Converts an ISO or CSO to SSO, using all the cores.
+int compressImage(const char *input, const char *output, u32 blockSize)
+{
+	BlockDevice *device = constructBlockDevice(input);
+	if (!device)
+	{
+		fprintf(stderr, "Failed to open %s\n", input);
+		return 1;
+	}
+	int numThreads = cpu_info.num_cores > 0 ? cpu_info.num_cores : 1;
+
+	double start = time_now_d();
+	std::string error_string;
+	bool success = CompressImageToSSO(device, output, blockSize, numThreads, &error_string);
+	double seconds = time_now_d() - start;
+	delete device;
+
+	if (!success)
+	{
+		fprintf(stderr, "Failed to compress %s: %s\n", input, error_string.c_str());
+		return 1;
+	}
+	printf("Compressed %s to %s on %d threads in %0.2f s\n", input, output, numThreads, seconds);
+	return 0;
+}
+
 int main(int argc, const char* argv[])
 {
 	bool fullLog = false;
@@ -74,10 +157,23 @@ int main(int argc, const char* argv[])
 	bool fastInterpreter = false;
 	bool autoCompare = false;
 	bool useGraphics = false;
+	bool useSoftware = false;
 	
 	const char *bootFilename = 0;
 	const char *mountIso = 0;
+	const char *dumpDirectory = 0;
+	const char *statsFilename = 0;
+	const char *traceFilename = 0;
+	const char *replayFilename = 0;
+	const char *compressFilename = 0;
+	u32 compressBlockSize = 32768;
 	bool readMount = false;
+	bool readDump = false;
+	bool readStats = false;
+	bool readTrace = false;
+	bool readReplay = false;
+	bool readCompress = false;
+	bool readBlockSize = false;
 
 	for (int i = 1; i < argc; i++)
 	{
@@ -87,6 +183,42 @@ int main(int argc, const char* argv[])
 			readMount = false;
 			continue;
 		}
+		if (readDump)
+		{
+			dumpDirectory = argv[i];
+			readDump = false;
+			continue;
+		}
+		if (readStats)
+		{
+			statsFilename = argv[i];
+			readStats = false;
+			continue;
+		}
+		if (readTrace)
+		{
+			traceFilename = argv[i];
+			readTrace = false;
+			continue;
+		}
+		if (readReplay)
+		{
+			replayFilename = argv[i];
+			readReplay = false;
+			continue;
+		}
+		if (readCompress)
+		{
+			compressFilename = argv[i];
+			readCompress = false;
+			continue;
+		}
+		if (readBlockSize)
+		{
+			compressBlockSize = (u32)atoi(argv[i]);
+			readBlockSize = false;
+			continue;
+		}
 		if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--mount"))
 			readMount = true;
 		else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--log"))
@@ -99,6 +231,20 @@ int main(int argc, const char* argv[])
 			autoCompare = true;
 		else if (!strcmp(argv[i], "--graphics"))
 			useGraphics = true;
+		else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--software"))
+			useSoftware = true;
+		else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--dump"))
+			readDump = true;
+		else if (!strcmp(argv[i], "--stats"))
+			readStats = true;
+		else if (!strcmp(argv[i], "--trace"))
+			readTrace = true;
+		else if (!strcmp(argv[i], "--replay"))
+			readReplay = true;
+		else if (!strcmp(argv[i], "--compress"))
+			readCompress = true;
+		else if (!strcmp(argv[i], "--block-size"))
+			readBlockSize = true;
 		else if (bootFilename == 0)
 			bootFilename = argv[i];
 		else
@@ -119,7 +265,27 @@ int main(int argc, const char* argv[])
 		printUsage(argv[0], "Missing argument after -m");
 		return 1;
 	}
-	if (!bootFilename)
+	if (readDump)
+	{
+		printUsage(argv[0], "Missing argument after -d");
+		return 1;
+	}
+	if (readStats)
+	{
+		printUsage(argv[0], "Missing argument after --stats");
+		return 1;
+	}
+	if (readTrace || readReplay)
+	{
+		printUsage(argv[0], readTrace ? "Missing argument after --trace" : "Missing argument after --replay");
+		return 1;
+	}
+	if (readCompress || readBlockSize)
+	{
+		printUsage(argv[0], readCompress ? "Missing argument after --compress" : "Missing argument after --block-size");
+		return 1;
+	}
+	if (!bootFilename && !replayFilename)
 	{
 		printUsage(argv[0], argc <= 1 ? NULL : "No executable specified");
 		return 1;
@@ -143,11 +309,15 @@ int main(int argc, const char* argv[])
 	}
 
 	CoreParameter coreParameter;
-	coreParameter.fileToStart = bootFilename;
+	coreParameter.fileToStart = bootFilename ? bootFilename : "";
 	coreParameter.mountIso = mountIso ? mountIso : "";
 	coreParameter.startPaused = false;
 	coreParameter.cpuCore = useJit ? CPU_JIT : (fastInterpreter ? CPU_FASTINTERPRETER : CPU_INTERPRETER);
-	coreParameter.gpuCore = headlessHost->isGLWorking() ? GPU_GLES : GPU_NULL;
+	if (useSoftware)
+		coreParameter.gpuCore = GPU_SOFTWARE;
+	else
+		coreParameter.gpuCore = headlessHost->isGLWorking() ? GPU_GLES : GPU_NULL;
+	coreParameter.frameDumpDirectory = dumpDirectory ? dumpDirectory : "";
 	coreParameter.enableSound = false;
 	coreParameter.headLess = true;
 	coreParameter.printfEmuLog = true;
@@ -164,6 +334,29 @@ int main(int argc, const char* argv[])
 	g_Config.flashDirectory = g_Config.memCardDirectory+"/flash/";
 #endif
 
+	if (compressFilename)
+	{
+		if (!bootFilename)
+		{
+			printUsage(argv[0], "No image to compress specified");
+			return 1;
+		}
+		int result = compressImage(bootFilename, compressFilename, compressBlockSize);
+		host->ShutdownGL();
+		delete host;
+		host = NULL;
+		return result;
+	}
+
+	if (replayFilename)
+	{
+		int result = replayTrace(coreParameter, replayFilename);
+		host->ShutdownGL();
+		delete host;
+		host = NULL;
+		return result;
+	}
+
 	std::string error_string;
 
 	if (!PSP_Init(coreParameter, &error_string)) {
@@ -174,6 +367,11 @@ int main(int argc, const char* argv[])
 
 	host->BootDone();
 
+	if (traceFilename)
+		GETrace_BeginRecording(traceFilename);
+	if (statsFilename)
+		GPUStatsLog_Begin(statsFilename);
+
 	coreState = CORE_RUNNING;
 	while (coreState == CORE_RUNNING)
 	{
@@ -187,6 +385,8 @@ int main(int argc, const char* argv[])
 			coreState = CORE_RUNNING;
 	}
 
+	GETrace_EndRecording();
+	GPUStatsLog_End(stderr);
 	host->ShutdownGL();
 	PSP_Shutdown();
 
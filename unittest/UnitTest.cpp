@@ -25,12 +25,31 @@
 // Or just integrate with an existing testing framework.
 
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <string>
 
 #include "Common/ArmEmitter.h"
+#include "Core/Config.h"
+#include "Core/MemMap.h"
+#include "Core/FileSystems/BlockCache.h"
+#include "Core/FileSystems/MetaFileSystem.h"
+#include "GPU/BlockTransfer.h"
+#include "GPU/GPUStatsLog.h"
+#include "GPU/PageGenerations.h"
 #include "ext/disarm.h"
+#include "base/timeutil.h"
+#include "GPU/ge_constants.h"
+#include "GPU/GLES/Framebuffer.h"
+#include "GPU/GLES/IndexGenerator.h"
+#include "GPU/GLES/PixelConvert.h"
+#include "GPU/GLES/ShaderManager.h"
+#include "GPU/GLES/SoftwareTransform.h"
+#include "GPU/GLES/Spline.h"
+#include "GPU/GLES/VertexDecoder.h"
+#include "GPU/Software/Rasterizer.h"
 
 #define EXPECT_EQ_STR(a, b) if ((a) != (b)) { printf(__FUNCTION__ ": Test Fail\n%s\nvs\n%s\n", a.c_str(), b.c_str()); return false; }
 
@@ -51,8 +70,771 @@ bool TestArmEmitter() {
 	return true;
 }
 
+// Decodes the same random vertex data with the step functions and the jit,
+// for every combination of formats, and checks that the outputs match.
+bool TestVertexDecoderJit() {
+	const int count = 64;
+	static u8 verts[count * 256];
+	static u8 expected[count * 256];
+	static u8 decoded[count * 256];
+
+	srand(1234);
+	for (size_t i = 0; i < sizeof(verts); i++) {
+		verts[i] = rand() & 0xFF;
+		// Keep floats away from NaN/Inf, their bits aren't preserved by all the step functions.
+		if ((i & 3) == 3)
+			verts[i] &= 0xBF;
+	}
+
+	const u32 weightTypes[] = {0, GE_VTYPE_WEIGHT_8BIT, GE_VTYPE_WEIGHT_16BIT, GE_VTYPE_WEIGHT_FLOAT};
+	const u32 colTypes[] = {0, GE_VTYPE_COL_565, GE_VTYPE_COL_5551, GE_VTYPE_COL_4444, GE_VTYPE_COL_8888};
+
+	VertexDecoderJitCache jitCache;
+	int numJitted = 0;
+	for (int through = 0; through < 2; through++)
+	for (int wt = 0; wt < 4; wt++)
+	for (int nw = 0; nw < 8; nw += 3)
+	for (int tc = 0; tc < 4; tc++)
+	for (int col = 0; col < 5; col++)
+	for (int nrm = 0; nrm < 4; nrm++)
+	for (int pos = 1; pos < 4; pos++) {
+		u32 vtype = weightTypes[wt] | (nw << GE_VTYPE_WEIGHTCOUNT_SHIFT) | (tc << GE_VTYPE_TC_SHIFT) | colTypes[col] |
+			(nrm << GE_VTYPE_NRM_SHIFT) | (pos << GE_VTYPE_POS_SHIFT) | (through ? GE_VTYPE_THROUGH : 0);
+		VertexDecoder dec;
+		dec.SetVertexType(vtype, &jitCache);
+		if (!dec.IsJitted())
+			continue;
+		numJitted++;
+
+		int size = dec.GetDecVtxFmt().stride * count;
+		memset(expected, 0, size);
+		memset(decoded, 0, size);
+		dec.DecodeVertsNoJit(expected, verts, 0, count - 1);
+		dec.DecodeVerts(decoded, verts, 0, GE_PRIM_TRIANGLES, count, 0, count - 1);
+		if (memcmp(expected, decoded, size) != 0) {
+			printf("TestVertexDecoderJit: Mismatch for vtype %06x\n", vtype);
+			return false;
+		}
+	}
+
+	if (numJitted == 0) {
+		printf("TestVertexDecoderJit: Nothing was jitted\n");
+		return false;
+	}
+
+	printf("TestVertexDecoderJit: Success (%i formats)\n", numJitted);
+	return true;
+}
+
+// Checks the vectorized index bounds and strip translation against plain loops,
+// for lengths that exercise both the vector body and the scalar tail.
+bool TestIndexBounds() {
+	static u16 inds16[300];
+	static u8 inds8[300];
+	static u16 out[1024];
+	for (int i = 0; i < 300; i++) {
+		inds16[i] = (u16)(rand() * 7);
+		inds8[i] = (u8)rand();
+	}
+	// Make sure values with the top bit set and clear are both present.
+	inds16[17] = 0xFFFE;
+	inds16[33] = 0x0001;
+
+	for (int count = 1; count < 300; count += 13) {
+		int lo16 = 0xFFFF, hi16 = 0, lo8 = 0xFF, hi8 = 0;
+		for (int i = 0; i < count; i++) {
+			lo16 = std::min(lo16, (int)inds16[i]);
+			hi16 = std::max(hi16, (int)inds16[i]);
+			lo8 = std::min(lo8, (int)inds8[i]);
+			hi8 = std::max(hi8, (int)inds8[i]);
+		}
+		u16 lower, upper;
+		GetIndexBounds(inds16, count, GE_VTYPE_IDX_16BIT, &lower, &upper);
+		if (lower != lo16 || upper != hi16) {
+			printf("TestIndexBounds: 16-bit mismatch at count %i\n", count);
+			return false;
+		}
+		GetIndexBounds(inds8, count, GE_VTYPE_IDX_8BIT, &lower, &upper);
+		if (lower != lo8 || upper != hi8) {
+			printf("TestIndexBounds: 8-bit mismatch at count %i\n", count);
+			return false;
+		}
+
+		if (count < 3)
+			continue;
+		IndexGenerator gen;
+		gen.Setup(out);
+		gen.TranslateStrip(count, inds16, 5);
+		bool wind = false;
+		for (int i = 0; i < count - 2; i++) {
+			u16 expected[3] = {
+				(u16)(5 + inds16[i]),
+				(u16)(5 + inds16[i + (wind ? 2 : 1)]),
+				(u16)(5 + inds16[i + (wind ? 1 : 2)]),
+			};
+			if (memcmp(expected, out + i * 3, sizeof(expected)) != 0) {
+				printf("TestIndexBounds: Strip mismatch at count %i\n", count);
+				return false;
+			}
+			wind = !wind;
+		}
+	}
+
+	printf("TestIndexBounds: Success\n");
+	return true;
+}
+
+// Lights random vertices with a single directional diffuse light, where the
+// expected result is easy to compute, with a count that leaves a partial batch.
+bool TestSoftwareTransform() {
+	const int count = SoftwareTransformer::BATCH_SIZE + 37;
+	static float verts[count][6];
+	static u8 decoded[count * 64];
+	static TransformedVertex transformed[count];
+
+	for (int i = 0; i < count; i++) {
+		for (int j = 0; j < 6; j++)
+			verts[i][j] = (rand() % 2001 - 1000) / 500.0f;
+	}
+
+	memset(&gstate, 0, sizeof(gstate));
+	memset(&gstate_c, 0, sizeof(gstate_c));
+	const float world[12] = {1, 0, 0, 0, 1, 0, 0, 0, 1, 1, 2, 3};
+	const float view[12] = {1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0};
+	memcpy(gstate.worldMatrix, world, sizeof(world));
+	memcpy(gstate.viewMatrix, view, sizeof(view));
+	gstate.lightingEnable = 1;
+	gstate.lightEnable[0] = 1;
+	gstate.ltype[0] = (GE_LIGHTTYPE_DIRECTIONAL << 8) | GE_LIGHTCOMP_ONLYDIFFUSE;
+	gstate.materialdiffuse = 0xFFFFFF;
+	gstate_c.lightpos[0][2] = 1.0f;
+	gstate_c.lightColor[1][0][0] = 1.0f;
+	gstate_c.lightColor[1][0][1] = 0.5f;
+	gstate_c.lightColor[1][0][2] = 0.25f;
+
+	// Normal first, then position, as the PSP stores them.
+	u32 vtype = GE_VTYPE_NRM_FLOAT | GE_VTYPE_POS_FLOAT;
+	VertexDecoder dec;
+	dec.SetVertexType(vtype);
+	dec.DecodeVerts(decoded, verts, 0, GE_PRIM_TRIANGLES, count, 0, count - 1);
+
+	SoftwareTransformer transformer(vtype, dec.GetDecVtxFmt());
+	transformer.Transform(transformed, decoded, count);
+
+	for (int i = 0; i < count; i++) {
+		const float *n = verts[i];
+		const float *p = verts[i] + 3;
+		float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		float dot = len > 0.0f ? std::max(n[2] / len, 0.0f) : 0.0f;
+		float expected[10] = {
+			p[0] + 1.0f, p[1] + 2.0f, p[2] + 3.0f,
+			dot * 1.0f, dot * 0.5f, dot * 0.25f, 1.0f,
+			0.0f, 0.0f, 0.0f,
+		};
+		const TransformedVertex &t = transformed[i];
+		float actual[10] = {
+			t.x, t.y, t.z,
+			t.color0[0], t.color0[1], t.color0[2], t.color0[3],
+			t.color1[0], t.color1[1], t.color1[2],
+		};
+		for (int j = 0; j < 10; j++) {
+			if (fabsf(expected[j] - actual[j]) > 0.0001f) {
+				printf("TestSoftwareTransform: Vertex %i component %i: %f vs %f\n", i, j, actual[j], expected[j]);
+				return false;
+			}
+		}
+	}
+
+	// Batched draws carry their own uniforms, which must win over gstate.
+	TransformUniforms uniforms;
+	uniforms.FromGState();
+	uniforms.worldMatrix[9] = -1.0f;
+	gstate.lightingEnable = 0;
+	SoftwareTransformer baked(vtype, dec.GetDecVtxFmt(), uniforms);
+	baked.Transform(transformed, decoded, count);
+	for (int i = 0; i < count; i++) {
+		if (fabsf(transformed[i].x - (verts[i][3] - 1.0f)) > 0.0001f) {
+			printf("TestSoftwareTransform: Baked world matrix not used for vertex %i\n", i);
+			return false;
+		}
+	}
+
+	u32 throughType = GE_VTYPE_POS_FLOAT | GE_VTYPE_THROUGH;
+	dec.SetVertexType(throughType);
+	dec.DecodeVerts(decoded, verts, 0, GE_PRIM_RECTANGLES, 2, 0, 1);
+	uniforms.materialAmbient = 0x0000FF;
+	uniforms.materialAlpha = 0x80;
+	SoftwareTransformer tinted(throughType, dec.GetDecVtxFmt(), uniforms);
+	tinted.Transform(transformed, decoded, 2);
+	if (transformed[1].color0[0] != 1.0f || transformed[1].color0[1] != 0.0f || fabsf(transformed[1].color0[3] - 128.0f / 255.0f) > 0.0001f) {
+		printf("TestSoftwareTransform: Baked material color not used\n");
+		return false;
+	}
+
+	printf("TestSoftwareTransform: Success\n");
+	return true;
+}
+
+bool TestSoftwareRasterizer() {
+	const int stride = 512;
+	static u32 fb[272 * stride];
+	memset(fb, 0, sizeof(fb));
+
+	RasterState st;
+	memset(&st, 0, sizeof(st));
+	st.fb = (u8 *)fb;
+	st.fbStride = stride;
+	st.fbFormat = GE_FORMAT_8888;
+	st.scissorX1 = 0;
+	st.scissorY1 = 0;
+	st.scissorX2 = 479;
+	st.scissorY2 = 271;
+	st.texture = -1;
+	// Adds onto the destination, so a pixel covered twice ends up brighter.
+	st.blend = true;
+	st.blendSrc = GE_SRCBLEND_FIXA;
+	st.blendDst = GE_DSTBLEND_FIXB;
+	st.blendEq = GE_BLENDMODE_MUL_AND_ADD;
+	st.fixA = 0xFFFFFF;
+	st.fixB = 0xFFFFFF;
+
+	// A grid of quads split into triangles, crossing tile edges, enough to go wide.
+	BinnedRasterizer rast(4);
+	int state = rast.AddState(st);
+	const int quads = 12, size = 20;
+	for (int qy = 0; qy < quads; qy++) {
+		for (int qx = 0; qx < quads; qx++) {
+			RasterVertex v[4];
+			memset(v, 0, sizeof(v));
+			for (int i = 0; i < 4; i++) {
+				v[i].x = (float)(7 + qx * size + (i & 1) * size);
+				v[i].y = (float)(3 + qy * size + (i >> 1) * size);
+				v[i].w = 1.0f;
+				v[i].color0[0] = v[i].color0[1] = v[i].color0[2] = 100.0f / 255.0f;
+				v[i].color0[3] = 1.0f;
+			}
+			rast.AddTriangle(v[0], v[1], v[2], state);
+			rast.AddTriangle(v[2], v[1], v[3], state);
+		}
+	}
+	rast.Flush();
+
+	for (int y = 0; y < 272; y++) {
+		for (int x = 0; x < 480; x++) {
+			bool inside = x >= 7 && x < 7 + quads * size && y >= 3 && y < 3 + quads * size;
+			u32 expected = inside ? 100 : 0;
+			if ((fb[y * stride + x] & 0xFF) != expected) {
+				printf("TestSoftwareRasterizer: Pixel %i,%i: %i vs %i\n", x, y, fb[y * stride + x] & 0xFF, expected);
+				return false;
+			}
+		}
+	}
+
+	printf("TestSoftwareRasterizer: Success\n");
+	return true;
+}
+
+bool TestPatchTessellation() {
+	// A 7x4 grid of control points on a plane, two bezier patches wide. Bezier surfaces
+	// reproduce linear functions exactly. Splines with open ends pass through the corners,
+	// and their basis functions always sum to one.
+	const int ucount = 7, vcount = 4;
+	float points[vcount][ucount][3];
+	for (int v = 0; v < vcount; v++) {
+		for (int u = 0; u < ucount; u++) {
+			points[v][u][0] = (float)u;
+			points[v][u][1] = (float)v * 2.0f;
+			points[v][u][2] = 1.0f;
+		}
+	}
+
+	memset(&gstate, 0, sizeof(gstate));
+	memset(&gstate_c, 0, sizeof(gstate_c));
+	const int udiv = 5, vdiv = 3;
+	gstate.patchdivision = udiv | (vdiv << 8);
+
+	u32 vtype = GE_VTYPE_POS_FLOAT;
+	VertexDecoder dec;
+	dec.SetVertexType(vtype);
+	static u8 decoded[ucount * vcount * 64];
+	dec.DecodeVerts(decoded, points, 0, GE_PRIM_TRIANGLES, ucount * vcount, 0, ucount * vcount - 1);
+
+	for (int spline = 0; spline < 2; spline++) {
+		PatchMesh mesh;
+		int upatches, vpatches;
+		if (spline) {
+			TessellateSpline(mesh, decoded, dec.GetDecVtxFmt(), vtype, ucount, vcount, 3, 3);
+			upatches = ucount - 3;
+			vpatches = vcount - 3;
+		} else {
+			TessellateBezier(mesh, decoded, dec.GetDecVtxFmt(), vtype, ucount, vcount);
+			upatches = (ucount - 1) / 3;
+			vpatches = (vcount - 1) / 3;
+		}
+
+		const int cols = upatches * udiv + 1, rows = vpatches * vdiv + 1;
+		if (mesh.prim != GE_PRIM_TRIANGLES || (int)mesh.indices.size() != (cols - 1) * (rows - 1) * 6) {
+			printf("TestPatchTessellation: Wrong number of indices %i\n", (int)mesh.indices.size());
+			return false;
+		}
+		// Texture coordinates are generated, position is float: u, v, x, y, z.
+		if (mesh.vertType != (GE_VTYPE_TC_FLOAT | GE_VTYPE_POS_FLOAT | GE_VTYPE_IDX_16BIT) || (int)mesh.verts.size() != cols * rows * 20) {
+			printf("TestPatchTessellation: Wrong vertex format %08x\n", mesh.vertType);
+			return false;
+		}
+
+		const float *vert = (const float *)&mesh.verts[0];
+		for (int r = 0; r < rows; r++) {
+			for (int c = 0; c < cols; c++, vert += 5) {
+				float expected[5] = {
+					(float)c / udiv, (float)r / vdiv,
+					(float)(ucount - 1) * c / (cols - 1), (float)(vcount - 1) * 2.0f * r / (rows - 1), 1.0f,
+				};
+				bool corner = (c == 0 || c == cols - 1) && (r == 0 || r == rows - 1);
+				for (int j = 0; j < 5; j++) {
+					if (spline && !corner && (j == 2 || j == 3))
+						continue;
+					if (fabsf(vert[j] - expected[j]) > 0.0001f) {
+						printf("TestPatchTessellation: %s vertex %i,%i component %i: %f vs %f\n", spline ? "Spline" : "Bezier", c, r, j, vert[j], expected[j]);
+						return false;
+					}
+				}
+			}
+		}
+	}
+
+	printf("TestPatchTessellation: Success\n");
+	return true;
+}
+
+bool TestShaderIDs() {
+	// Color doubling and the secondary color used to share a bit of the fragment shader ID.
+	memset(&gstate, 0, sizeof(gstate));
+	gstate.textureMapEnable = 1;
+	gstate.lightingEnable = 1;
+	gstate.lmode = 1;
+	FragmentShaderID secondary;
+	ComputeFragmentShaderID(&secondary);
+	gstate.lmode = 0;
+	gstate.texfunc = 0x10000;
+	FragmentShaderID doubled;
+	ComputeFragmentShaderID(&doubled);
+	if (secondary == doubled) {
+		printf("TestShaderIDs: Color doubling and secondary color have the same ID %08x\n", doubled.d[0]);
+		return false;
+	}
+
+	// The generators only look at the ID, so a saved ID gives back the same source.
+	static char buffer[16384];
+	GenerateFragmentShader(doubled, buffer);
+	std::string fs = buffer;
+	memset(&gstate, 0, sizeof(gstate));
+	GenerateFragmentShader(doubled, buffer);
+	if (fs != buffer || fs.find("2.0, 2.0, 2.0, 2.0") == std::string::npos || fs.find("v_color1") != std::string::npos) {
+		printf("TestShaderIDs: Bad fragment shader\n%s\n", fs.c_str());
+		return false;
+	}
+
+	g_Config.bHardwareTransform = true;
+	gstate.vertType = GE_VTYPE_POS_FLOAT | GE_VTYPE_NRM_FLOAT | GE_VTYPE_WEIGHT_FLOAT | (2 << GE_VTYPE_WEIGHTCOUNT_SHIFT);
+	gstate.lightingEnable = 1;
+	gstate.lightEnable[2] = 1;
+	VertexShaderID vsid;
+	ComputeVertexShaderID(&vsid, GE_PRIM_TRIANGLES);
+	GenerateVertexShader(vsid, buffer);
+	std::string vs = buffer;
+	memset(&gstate, 0, sizeof(gstate));
+	GenerateVertexShader(vsid, buffer);
+	if (vs != buffer || vs.find("u_bone2") == std::string::npos || vs.find("u_bone3") != std::string::npos || vs.find("u_lightdiffuse2") == std::string::npos) {
+		printf("TestShaderIDs: Bad vertex shader\n%s\n", vs.c_str());
+		return false;
+	}
+
+	// The packed ID index has to survive growing.
+	ShaderIDMap<LinkedShaderID, int> map;
+	for (int i = 0; i < 1000; i++) {
+		vsid.d[0] = i * 7;
+		vsid.d[1] = i & 3;
+		FragmentShaderID fsid;
+		fsid.d[0] = i >> 2;
+		map.Insert(LinkedShaderID(vsid, fsid), i + 1);
+	}
+	for (int i = 0; i < 1000; i++) {
+		vsid.d[0] = i * 7;
+		vsid.d[1] = i & 3;
+		FragmentShaderID fsid;
+		fsid.d[0] = i >> 2;
+		LinkedShaderID id(vsid, fsid);
+		if (map.Get(id) != i + 1 || !(id.VSID() == vsid) || !(id.FSID() == fsid)) {
+			printf("TestShaderIDs: Lost ID %i in the index\n", i);
+			return false;
+		}
+	}
+	vsid.d[0] = 1;
+	if (map.size() != 1000 || map.Get(LinkedShaderID(vsid, FragmentShaderID())) != 0) {
+		printf("TestShaderIDs: Found a missing ID\n");
+		return false;
+	}
+
+	printf("TestShaderIDs: Success\n");
+	return true;
+}
+
+bool TestDisplayConvert() {
+	// Odd sizes and strides so that both the vector loops and the leftovers run.
+	const int width = 29, height = 3, srcStride = 37, dstStride = 31;
+	static u16 src[srcStride * height * 2];
+	static u16 dst[dstStride * height * 2];
+	for (int i = 0; i < srcStride * height * 2; i++) {
+		src[i] = (u16)(i * 0x9E37 + (i >> 3));
+	}
+
+	const char *names[] = {"565", "5551", "4444", "8888"};
+	for (int format = 0; format < 4; format++) {
+		memset(dst, 0, sizeof(dst));
+		ConvertDisplayPixels((u8 *)dst, dstStride, (const u8 *)src, srcStride, format, width, height);
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				u32 got, expected;
+				if (format == PSP_DISPLAY_PIXEL_FORMAT_8888) {
+					got = ((u32 *)dst)[y * dstStride + x];
+					expected = ((u32 *)src)[y * srcStride + x];
+				} else {
+					// Same channels, GL has the first one in the high bits.
+					u16 c = src[y * srcStride + x];
+					got = dst[y * dstStride + x];
+					switch (format) {
+					case PSP_DISPLAY_PIXEL_FORMAT_565:
+						expected = ((c & 0x1F) << 11) | (((c >> 5) & 0x3F) << 5) | (c >> 11);
+						break;
+					case PSP_DISPLAY_PIXEL_FORMAT_5551:
+						expected = ((c & 0x1F) << 11) | (((c >> 5) & 0x1F) << 6) | (((c >> 10) & 0x1F) << 1) | (c >> 15);
+						break;
+					default:
+						expected = ((c & 0xF) << 12) | (((c >> 4) & 0xF) << 8) | (((c >> 8) & 0xF) << 4) | (c >> 12);
+						break;
+					}
+				}
+				if (got != expected) {
+					printf("TestDisplayConvert: %s pixel %i,%i: %08x vs %08x\n", names[format], x, y, got, expected);
+					return false;
+				}
+			}
+		}
+	}
+
+	printf("TestDisplayConvert: Success\n");
+	return true;
+}
+
+bool TestReadbackConvert() {
+	// GL colors made from PSP ones by shifting each channel up, so they should come back
+	// exactly, and in the opposite row order.
+	const int width = 13, height = 4, srcStride = 16, dstStride = 15;
+	static u8 src[srcStride * height * 4];
+	static u16 pixels[dstStride * height * 2];
+	static u16 dst[dstStride * height * 2];
+
+	const char *names[] = {"565", "5551", "4444", "8888"};
+	for (int format = 0; format < 4; format++) {
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				u32 i = y * dstStride + x;
+				u32 c = i * 0x9E3779B1;
+				u8 *gl = src + ((height - 1 - y) * srcStride + x) * 4;
+				switch (format) {
+				case PSP_DISPLAY_PIXEL_FORMAT_565:
+					c &= 0xFFFF;
+					gl[0] = (c & 0x1F) << 3; gl[1] = ((c >> 5) & 0x3F) << 2; gl[2] = (c >> 11) << 3; gl[3] = 0xFF;
+					break;
+				case PSP_DISPLAY_PIXEL_FORMAT_5551:
+					c &= 0xFFFF;
+					gl[0] = (c & 0x1F) << 3; gl[1] = ((c >> 5) & 0x1F) << 3; gl[2] = ((c >> 10) & 0x1F) << 3; gl[3] = (c >> 15) ? 0xFF : 0;
+					break;
+				case PSP_DISPLAY_PIXEL_FORMAT_4444:
+					c &= 0xFFFF;
+					gl[0] = (c & 0xF) << 4; gl[1] = ((c >> 4) & 0xF) << 4; gl[2] = ((c >> 8) & 0xF) << 4; gl[3] = (c >> 12) << 4;
+					break;
+				default:
+					memcpy(gl, &c, 4);
+					break;
+				}
+				if (format == PSP_DISPLAY_PIXEL_FORMAT_8888)
+					((u32 *)pixels)[i] = c;
+				else
+					pixels[i] = (u16)c;
+			}
+		}
+
+		memset(dst, 0, sizeof(dst));
+		ConvertReadbackPixels((u8 *)dst, dstStride, src, srcStride, format, width, height);
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				u32 i = y * dstStride + x;
+				u32 got = format == PSP_DISPLAY_PIXEL_FORMAT_8888 ? ((u32 *)dst)[i] : dst[i];
+				u32 expected = format == PSP_DISPLAY_PIXEL_FORMAT_8888 ? ((u32 *)pixels)[i] : pixels[i];
+				if (got != expected) {
+					printf("TestReadbackConvert: %s pixel %i,%i: %08x vs %08x\n", names[format], x, y, got, expected);
+					return false;
+				}
+			}
+		}
+	}
+
+	printf("TestReadbackConvert: Success\n");
+	return true;
+}
+
+// Needs PSP memory to be set up.
+static bool TestBlockTransferMemory() {
+	// Scroll a 16-bit buffer down and to the right within itself, then copy it whole.
+	const u32 base = 0x08800000;
+	const int stride = 8;
+	u16 *mem = (u16 *)Memory::GetPointer(base);
+	u16 before[stride * stride];
+	for (int i = 0; i < stride * stride; i++) {
+		mem[i] = before[i] = (u16)i;
+	}
+	BlockTransfer transfer = {base, stride, 0, 0, base, stride, 1, 2, 6, 5, 2};
+	if (!transfer.Execute()) {
+		printf("TestBlockTransfer: Transfer failed\n");
+		return false;
+	}
+	for (int y = 0; y < stride; y++) {
+		for (int x = 0; x < stride; x++) {
+			bool inside = x >= 1 && x < 7 && y >= 2 && y < 7;
+			u16 expected = inside ? before[(y - 2) * stride + x - 1] : before[y * stride + x];
+			if (mem[y * stride + x] != expected) {
+				printf("TestBlockTransfer: Overlapping copy wrong at %i,%i: %i vs %i\n", x, y, mem[y * stride + x], expected);
+				return false;
+			}
+		}
+	}
+
+	BlockTransfer whole = {base, stride, 0, 0, base + 0x1000, stride, 0, 0, stride, stride, 2};
+	if (!whole.Execute() || memcmp(mem, Memory::GetPointer(base + 0x1000), stride * stride * 2) != 0) {
+		printf("TestBlockTransfer: Whole buffer copy wrong\n");
+		return false;
+	}
+	BlockTransfer bad = whole;
+	bad.dstBasePtr = 0x10000000;
+	if (bad.Execute()) {
+		printf("TestBlockTransfer: Transfer to bad memory succeeded\n");
+		return false;
+	}
+	return true;
+}
+
+bool TestBlockTransfer() {
+	// Rows 2 to 4 of a 64 byte stride buffer, bytes 8 to 23 of each.
+	TransferRect rect = {0x1000, 64, 8, 24, 2, 5};
+	const u32 row2 = 0x1000 + 2 * 64;
+	const struct {
+		u32 start, end;
+		bool overlaps;
+	} ranges[] = {
+		{row2 + 8, row2 + 9, true},
+		{0x1000, row2 + 8, false},
+		{row2 + 24, row2 + 64 + 8, false},
+		{row2 + 23, row2 + 24, true},
+		{row2 + 64 + 7, row2 + 64 + 9, true},
+		{row2 + 2 * 64 + 24, 0x2000, false},
+		{0, 0x2000, true},
+	};
+	for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+		if (rect.Overlaps(ranges[i].start, ranges[i].end) != ranges[i].overlaps) {
+			printf("TestBlockTransfer: Range %08x-%08x overlap wrong\n", ranges[i].start, ranges[i].end);
+			return false;
+		}
+	}
+
+	TransferTracker tracker;
+	TransferRect strip1 = {0x1000, 64, 0, 32, 0, 4};
+	TransferRect strip2 = {0x1000, 64, 0, 32, 4, 8};
+	TransferRect other = {0x4000, 64, 0, 32, 0, 4};
+	tracker.Add(strip1);
+	tracker.Add(other);
+	tracker.Add(strip2);
+	if (tracker.Rects().size() != 2 || tracker.Rects()[0].top != 0 || tracker.Rects()[0].bottom != 8) {
+		printf("TestBlockTransfer: Strips weren't merged\n");
+		return false;
+	}
+
+	Memory::Init();
+	bool success = TestBlockTransferMemory();
+	Memory::Shutdown();
+	if (success)
+		printf("TestBlockTransfer: Success\n");
+	return success;
+}
+
+
+bool TestStatsPercentile() {
+	std::vector<float> sorted;
+	if (GPUStatsLog_Percentile(sorted, 50) != 0.0f) {
+		printf("TestStatsPercentile: Empty wasn't 0\n");
+		return false;
+	}
+	for (int i = 1; i <= 200; i++)
+		sorted.push_back((float)i);
+	const float expected[][2] = {
+		{0, 1}, {50, 100}, {90, 180}, {99, 198}, {99.9f, 200}, {100, 200},
+	};
+	for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+		float p = GPUStatsLog_Percentile(sorted, expected[i][0]);
+		if (p != expected[i][1]) {
+			printf("TestStatsPercentile: p%g was %g, expected %g\n", expected[i][0], p, expected[i][1]);
+			return false;
+		}
+	}
+
+	printf("TestStatsPercentile: Success\n");
+	return true;
+}
+
+// Needs PSP memory to be set up, the generations are kept for RAM and VRAM pages.
+static bool TestPageGenerationsMemory() {
+	PageGenerations gens;
+	const u32 base = 0x08800000;
+	const u8 *ptr = Memory::GetPointer(base);
+	const u32 page = 1 << PageGenerations::PAGE_SHIFT;
+
+	u32 before = gens.Get(ptr + page, 16);
+	gens.Written(base + 3 * page, 64);
+	if (gens.Get(ptr + page, 16) != before || gens.Get(ptr + page, 2 * page + 1) == before) {
+		printf("TestPageGenerations: Write to the wrong page\n");
+		return false;
+	}
+	u32 written = gens.Get(ptr + 3 * page, 4);
+	gens.Written(base + 3 * page - 1, 2);
+	if (gens.Get(ptr + 2 * page, 4) <= before || gens.Get(ptr + 3 * page, 4) <= written) {
+		printf("TestPageGenerations: Write across pages missed\n");
+		return false;
+	}
+	u32 all = gens.Get(ptr, 16);
+	gens.AllWritten();
+	if (gens.Get(ptr, 16) <= all) {
+		printf("TestPageGenerations: Write to all memory missed\n");
+		return false;
+	}
+	u8 outside[16];
+	if (gens.Get(outside, sizeof(outside)) != PageGenerations::UNTRACKED) {
+		printf("TestPageGenerations: Untracked memory has a generation\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool TestPageGenerations() {
+	Memory::Init();
+	bool success = TestPageGenerationsMemory();
+	Memory::Shutdown();
+	if (success)
+		printf("TestPageGenerations: Success\n");
+	return success;
+}
+
+bool TestBlockCache() {
+	// Two shards of two blocks each: even and odd block numbers.
+	BlockCache cache(16, 4, 2);
+	u8 block[16], out[16];
+	for (u32 i = 0; i < 6; i += 2) {
+		memset(block, i, sizeof(block));
+		cache.Insert(i, block);
+		if (i == 2 && !cache.Lookup(0, out)) {
+			printf("TestBlockCache: Block 0 missing\n");
+			return false;
+		}
+	}
+	// Block 0 was used after 2, so 2 was evicted when 4 went in.
+	if (cache.Lookup(2, out) || !cache.Lookup(0, out) || out[15] != 0 || !cache.Lookup(4, out) || out[0] != 4) {
+		printf("TestBlockCache: Evicted the wrong block\n");
+		return false;
+	}
+	// The odd shard is untouched by that.
+	memset(block, 7, sizeof(block));
+	cache.Insert(7, block);
+	if (!cache.Lookup(7, out) || out[3] != 7 || cache.Size() != 3) {
+		printf("TestBlockCache: Shards interfere\n");
+		return false;
+	}
+	cache.Clear();
+	if (cache.Lookup(0, out) || cache.Size() != 0) {
+		printf("TestBlockCache: Clear failed\n");
+		return false;
+	}
+
+	printf("TestBlockCache: Success\n");
+	return true;
+}
+
+bool TestMapFilePath() {
+	MetaFileSystem fs;
+	// Only the mount points matter here, never opened.
+	IFileSystem *umd = (IFileSystem *)1, *ms = (IFileSystem *)2, *umdAlias = (IFileSystem *)3;
+	fs.Mount("umd0:", umd);
+	fs.Mount("ms0:", ms);
+	fs.Mount("fatms0:", ms);
+	fs.Mount("umd:", umdAlias);
+	fs.Mount("umd0:", umdAlias);
+	fs.SetStartingDirectory("umd0:/PSP_GAME/USRDIR");
+
+	struct {
+		const char *in;
+		IFileSystem *system;
+		const char *out;
+	} cases[] = {
+		{"ms0:/PSP/SAVEDATA/DATA.BIN", ms, "/PSP/SAVEDATA/DATA.BIN"},
+		{"MS0:/PSP//SAVEDATA/./x/../DATA.BIN", ms, "/PSP/SAVEDATA/DATA.BIN"},
+		{"fatms0:/a/", ms, "/a"},
+		{"UMD0:/sce_lbn0x10_size0x20", umd, "/sce_lbn0x10_size0x20"},
+		{"umd:/x", umdAlias, "/x"},
+		{"data/file.pak", umd, "/PSP_GAME/USRDIR/data/file.pak"},
+		{"host0:../file.pak", umd, "/PSP_GAME/file.pak"},
+	};
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		std::string out;
+		IFileSystem *system = 0;
+		if (!fs.MapFilePath(cases[i].in, out, &system) || system != cases[i].system || out != cases[i].out) {
+			printf("TestMapFilePath: %s mapped to %s\n", cases[i].in, out.c_str());
+			return false;
+		}
+	}
+	std::string out;
+	IFileSystem *system = 0;
+	if (fs.MapFilePath("flash0:/kd/x.prx", out, &system)) {
+		printf("TestMapFilePath: Mapped an unmounted device\n");
+		return false;
+	}
+
+	// Throughput, for comparing changes to path mapping.
+	const int iterations = 200000;
+	double start = time_now_d();
+	for (int i = 0; i < iterations; i++) {
+		fs.MapFilePath(cases[i % 4].in, out, &system);
+	}
+	double seconds = time_now_d() - start;
+	printf("TestMapFilePath: Success (%0.0f paths/s)\n", seconds > 0.0 ? iterations / seconds : 0.0);
+	return true;
+}
+
 int main(int argc, const char *argv[])
 {
 	TestArmEmitter();
+	TestVertexDecoderJit();
+	TestIndexBounds();
+	TestSoftwareTransform();
+	TestSoftwareRasterizer();
+	TestPatchTessellation();
+	TestShaderIDs();
+	TestDisplayConvert();
+	TestReadbackConvert();
+	TestBlockTransfer();
+	TestStatsPercentile();
+	TestPageGenerations();
+	TestBlockCache();
+	TestMapFilePath();
 	return 0;
 }
\ No newline at end of file